@@ -0,0 +1,745 @@
+// BinLog.cpp : Compact binary form of the records LogToFile writes.
+// See BinLog.h for the file layout.
+
+#include "BinLog.h"
+#include "Timestamp.h"
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define fseek64 _fseeki64
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define fseek64 fseeko
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NAL_HAVE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int CountTrailingZeros(unsigned mask)
+{
+    unsigned long iBit;
+    _BitScanForward(&iBit, mask);
+    return (int)iBit;
+}
+#else
+static inline int CountTrailingZeros(unsigned mask)
+{
+    return __builtin_ctz(mask);
+}
+#endif
+#endif
+
+#define MS_PER_DAY  (86400 * (int64_t)1000)
+
+static bool IsDigits(const char* p, size_t cb)
+{
+    for (size_t j = 0; j < cb; j++) {
+        if (p[j] < '0' || p[j] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int ParseDigits(const char* p, size_t cb)
+{
+    int n = 0;
+    for (size_t j = 0; j < cb; j++) {
+        n = n * 10 + (p[j] - '0');
+    }
+    return n;
+}
+
+// Convert a broken-down local time to ms since 1970 UTC.
+static int64_t LocalToEpochMs(int year, int month, int day, int hour, int minute, int second)
+{
+    tm mytm;
+    memset(&mytm, 0, sizeof(mytm));
+    mytm.tm_year = year - 1900;
+    mytm.tm_mon = month - 1;
+    mytm.tm_mday = day;
+    mytm.tm_hour = hour;
+    mytm.tm_min = minute;
+    mytm.tm_sec = second;
+    mytm.tm_isdst = -1;
+    time_t t = mktime(&mytm);
+    if (t == (time_t)-1) {
+        return -1;
+    }
+    return (int64_t)t * 1000;
+}
+
+// Note a comma found by SplitCsvLine.
+static inline void AddComma(StructCsvSplit& split, const char* p)
+{
+    if (split.nCommas < CSV_SPLIT_COMMAS) {
+        split.aryCommas[split.nCommas++] = p;
+    }
+}
+
+// Finish a split at the newline (or buffer end) pEol.
+static inline void EndCsvLine(StructCsvSplit& split, const char* pEol, const char* pBufEnd)
+{
+    split.pNext = pEol < pBufEnd ? pEol + 1 : pBufEnd;
+    while (pEol > split.pLine && (pEol[-1] == '\r' || pEol[-1] == '\n')) {
+        pEol--;
+    }
+    split.pEnd = pEol;
+    while (split.nCommas > 0 && split.aryCommas[split.nCommas - 1] >= pEol) {
+        split.nCommas--;
+    }
+}
+
+void SplitCsvLine(const char* p, const char* pBufEnd, StructCsvSplit& split)
+{
+    split.pLine = p;
+    split.nCommas = 0;
+#ifdef NAL_HAVE_SSE2
+    // Compare 16 bytes at a time with '\n' and ','.  Commas after the
+    // newline belong to the next line; once the commas we want are
+    // found, only newlines matter.
+    const __m128i vectComma = _mm_set1_epi8(',');
+    const __m128i vectNewline = _mm_set1_epi8('\n');
+    for (; pBufEnd - p >= 16; p += 16) {
+        __m128i vectBytes = _mm_loadu_si128((const __m128i*)p);
+        unsigned maskNewline = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(vectBytes, vectNewline));
+        if (split.nCommas < CSV_SPLIT_COMMAS) {
+            unsigned maskComma = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(vectBytes, vectComma));
+            if (maskNewline != 0) {
+                maskComma &= (maskNewline & (0u - maskNewline)) - 1;
+            }
+            for (; maskComma != 0; maskComma &= maskComma - 1) {
+                AddComma(split, p + CountTrailingZeros(maskComma));
+            }
+        }
+        if (maskNewline != 0) {
+            EndCsvLine(split, p + CountTrailingZeros(maskNewline), pBufEnd);
+            return;
+        }
+    }
+    if (p < pBufEnd && pBufEnd - split.pLine >= 16) {
+        // Finish with one more load of the last 16 bytes of the buffer,
+        // ignoring the ones already looked at, rather than byte by byte.
+        const char* pLast = pBufEnd - 16;
+        unsigned maskSeen = (1u << (p - pLast)) - 1;
+        __m128i vectBytes = _mm_loadu_si128((const __m128i*)pLast);
+        unsigned maskNewline = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(vectBytes, vectNewline)) & ~maskSeen;
+        if (split.nCommas < CSV_SPLIT_COMMAS) {
+            unsigned maskComma = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(vectBytes, vectComma)) & ~maskSeen;
+            if (maskNewline != 0) {
+                maskComma &= (maskNewline & (0u - maskNewline)) - 1;
+            }
+            for (; maskComma != 0; maskComma &= maskComma - 1) {
+                AddComma(split, pLast + CountTrailingZeros(maskComma));
+            }
+        }
+        EndCsvLine(split, maskNewline != 0 ? pLast + CountTrailingZeros(maskNewline) : pBufEnd, pBufEnd);
+        return;
+    }
+#endif
+    for (; p < pBufEnd; p++) {
+        if (*p == '\n') {
+            EndCsvLine(split, p, pBufEnd);
+            return;
+        }
+        if (*p == ',') {
+            AddComma(split, p);
+        }
+    }
+    EndCsvLine(split, pBufEnd, pBufEnd);
+}
+
+bool ParseCsvLogLine(const char* pLine, size_t cbLine, StructTimeCache& cache, StructLogLine& line)
+{
+    StructCsvSplit split;
+    SplitCsvLine(pLine, pLine + cbLine, split);
+    return ParseCsvLogSplit(split, cache, line);
+}
+
+bool ParseCsvLogSplit(const StructCsvSplit& split, StructTimeCache& cache, StructLogLine& line)
+{
+    const char* pLine = split.pLine;
+    const char* pEnd = split.pEnd;
+    if (split.nCommas < 4) {
+        return false;
+    }
+
+    // Timestamp: "YYYY-MM-DD HH:MM:SS", optionally followed by ".fff",
+    // or the same with a 'T' and perhaps a UTC offset.
+    const char* pComma = split.aryCommas[0];
+    size_t cbStamp = pComma - pLine;
+    if (cbStamp < 19 || pLine[4] != '-' || pLine[7] != '-' || (pLine[10] != ' ' && pLine[10] != 'T') ||
+        pLine[13] != ':' || pLine[16] != ':' ||
+        !IsDigits(pLine, 4) || !IsDigits(pLine + 5, 2) || !IsDigits(pLine + 8, 2) ||
+        !IsDigits(pLine + 11, 2) || !IsDigits(pLine + 14, 2) || !IsDigits(pLine + 17, 2)) {
+        return false;
+    }
+    const char* pFracEnd = pLine + 19;
+    if (pFracEnd < pComma && *pFracEnd == '.') {
+        for (pFracEnd++; pFracEnd < pComma && *pFracEnd >= '0' && *pFracEnd <= '9'; pFracEnd++) {
+        }
+    }
+    int64_t msOffset = 0;
+    bool bOffset = false;
+    if (pFracEnd < pComma) {
+        // UTC offset: "Z", "+HH:MM" or "+HHMM".
+        size_t cbOffset = pComma - pFracEnd;
+        if (cbOffset == 1 && *pFracEnd == 'Z') {
+            bOffset = true;
+        } else if ((*pFracEnd == '+' || *pFracEnd == '-') && IsDigits(pFracEnd + 1, 2) &&
+                ((cbOffset == 6 && pFracEnd[3] == ':' && IsDigits(pFracEnd + 4, 2)) ||
+                 (cbOffset == 5 && IsDigits(pFracEnd + 3, 2)))) {
+            int minutes = ParseDigits(pFracEnd + 1, 2) * 60 + ParseDigits(pFracEnd + cbOffset - 2, 2);
+            msOffset = (int64_t)(*pFracEnd == '-' ? -minutes : minutes) * 60000;
+            bOffset = true;
+        } else {
+            return false;
+        }
+    }
+    if (bOffset) {
+        int64_t days = DaysFromCivil(ParseDigits(pLine, 4), ParseDigits(pLine + 5, 2), ParseDigits(pLine + 8, 2));
+        line.msTime = (days * 86400 + ParseDigits(pLine + 11, 2) * 3600) * 1000 - msOffset;
+    } else {
+        if (memcmp(cache.szHour, pLine, 13) != 0) {
+            int64_t msHour = LocalToEpochMs(ParseDigits(pLine, 4), ParseDigits(pLine + 5, 2),
+                ParseDigits(pLine + 8, 2), ParseDigits(pLine + 11, 2), 0, 0);
+            if (msHour < 0) {
+                return false;
+            }
+            memcpy(cache.szHour, pLine, 13);
+            cache.szHour[13] = '\0';
+            cache.msHour = msHour;
+        }
+        line.msTime = cache.msHour;
+    }
+    line.msTime += (ParseDigits(pLine + 14, 2) * 60 + ParseDigits(pLine + 17, 2)) * 1000;
+    if (pFracEnd > pLine + 20) {
+        // Fractional seconds; keep milliseconds.
+        int ms = 0;
+        int nDigits = 0;
+        for (const char* p = pLine + 20; p < pFracEnd; p++, nDigits++) {
+            if (nDigits < 3) {
+                ms = ms * 10 + (*p - '0');
+            }
+        }
+        for (; nDigits < 3; nDigits++) {
+            ms *= 10;
+        }
+        line.msTime += ms;
+    }
+
+    StructField* aFields[4] = { &line.action, &line.host, &line.localIP, &line.remoteIP };
+    for (int j = 0; j < 4; j++) {
+        const char* p = split.aryCommas[j] + 1;
+        const char* pFieldEnd = j + 1 < split.nCommas ? split.aryCommas[j + 1] : pEnd;
+        aFields[j]->p = p;
+        aFields[j]->cb = pFieldEnd - p;
+    }
+    // Details is the rest of the line; error text can contain commas.
+    if (split.nCommas < 5) {
+        line.details.p = pEnd;
+        line.details.cb = 0;
+    } else {
+        line.details.p = split.aryCommas[4] + 1;
+        line.details.cb = pEnd - (split.aryCommas[4] + 1);
+    }
+    return true;
+}
+
+int64_t ParseRoundTripMicros(const char* p, size_t cb)
+{
+    const char* pSpace = (const char*)memchr(p, ' ', cb);
+    const char* pEnd = pSpace ? pSpace : p + cb;
+    const char* pDot = (const char*)memchr(p, '.', pEnd - p);
+    const char* pIntEnd = pDot ? pDot : pEnd;
+    if (pIntEnd == p || pIntEnd - p > 9 || !IsDigits(p, pIntEnd - p)) {
+        return -1;
+    }
+    int64_t us = (int64_t)ParseDigits(p, pIntEnd - p) * 1000;
+    if (pDot) {
+        size_t cbFrac = pEnd - (pDot + 1);
+        if (cbFrac == 0 || !IsDigits(pDot + 1, cbFrac)) {
+            return -1;
+        }
+        int scale = 100;
+        for (size_t j = 0; j < cbFrac && j < 3; j++, scale /= 10) {
+            us += (pDot[1 + j] - '0') * scale;
+        }
+    }
+    return us;
+}
+
+int64_t ParseLocalTime(const char* psz)
+{
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    int n = sscanf(psz, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second);
+    if (n != 3 && n != 5 && n != 6) {
+        return -1;
+    }
+    return LocalToEpochMs(year, month, day, hour, minute, second);
+}
+
+//=== CBinLogWriter ========================================================
+
+CBinLogWriter::CBinLogWriter()
+{
+    m_strPrefix = "netavailw";
+    m_fp = NULL;
+    m_dayOpen = 0;
+    m_offFile = 0;
+    m_bInBlock = false;
+    memset(&m_entry, 0, sizeof(m_entry));
+    m_nRecords = 0;
+}
+
+CBinLogWriter::~CBinLogWriter()
+{
+    Close();
+}
+
+static int64_t FloorDiv(int64_t a, int64_t b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+bool CBinLogWriter::OpenSegment(int64_t msTime)
+{
+    time_t t = (time_t)FloorDiv(msTime, 1000);
+    tm mytm;
+#ifdef _WIN32
+    gmtime_s(&mytm, &t);
+#else
+    gmtime_r(&t, &mytm);
+#endif
+    char szStamp[32];
+    strftime(szStamp, sizeof(szStamp), "-%Y%m%d-%H%M%S", &mytm);
+
+    // Never append to an existing segment; its dictionary would have to
+    // be reloaded.  Pick an unused name instead.
+    std::string strPath = m_strPrefix + szStamp + BINLOG_EXT;
+    for (int j = 1; j < 100; j++) {
+        FILE* fpExisting = fopen(strPath.c_str(), "rb");
+        if (fpExisting == NULL) {
+            break;
+        }
+        fclose(fpExisting);
+        strPath = m_strPrefix + szStamp + "-" + std::to_string(j) + BINLOG_EXT;
+    }
+    m_fp = fopen(strPath.c_str(), "wb");
+    if (m_fp == NULL) {
+        return false;
+    }
+
+    StructBinFileHdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BINLOG_MAGIC, sizeof(hdr.magic));
+    hdr.msFirst = msTime;
+    hdr.version = 1;
+    fwrite(&hdr, sizeof(hdr), 1, m_fp);
+    m_offFile = sizeof(hdr);
+    m_dayOpen = FloorDiv(msTime, MS_PER_DAY);
+
+    // Id 0 is always the empty string.
+    m_mapDict.clear();
+    m_vectDict.clear();
+    m_vectDict.push_back(std::string());
+    m_mapDict[std::string()] = 0;
+    m_vectIndex.clear();
+    m_bInBlock = false;
+    return true;
+}
+
+void CBinLogWriter::WriteBlockHdr(uint32_t type, uint32_t cb)
+{
+    StructBinBlockHdr hdr;
+    hdr.type = type;
+    hdr.cb = cb;
+    fwrite(&hdr, sizeof(hdr), 1, m_fp);
+    m_offFile += sizeof(hdr);
+}
+
+// Look up a string in the segment dictionary, adding it (and writing a
+// DICT block for it) if it is new.
+uint16_t CBinLogWriter::Intern(const StructField& field)
+{
+    std::string str = field.ToString();
+    std::unordered_map<std::string, uint16_t>::iterator iter = m_mapDict.find(str);
+    if (iter != m_mapDict.end()) {
+        return iter->second;
+    }
+    // DICT blocks can't go in the middle of a RECS block.
+    FinishRecsBlock();
+    uint16_t id = (uint16_t)m_vectDict.size();
+    uint16_t cbStr = (uint16_t)(str.size() > 0xffff ? 0xffff : str.size());
+    WriteBlockHdr(BINLOG_BLOCK_DICT, (uint32_t)(sizeof(id) + cbStr));
+    fwrite(&id, sizeof(id), 1, m_fp);
+    fwrite(str.data(), 1, cbStr, m_fp);
+    m_offFile += sizeof(id) + cbStr;
+    m_vectDict.push_back(str);
+    m_mapDict[str] = id;
+    return id;
+}
+
+void CBinLogWriter::StartRecsBlock(int64_t msBase)
+{
+    memset(&m_entry, 0, sizeof(m_entry));
+    m_entry.msFirst = msBase;
+    m_entry.msLast = msBase;
+    m_entry.offBlock = m_offFile;
+    // Size 0 marks the block as still growing; FinishRecsBlock fills it in.
+    WriteBlockHdr(BINLOG_BLOCK_RECS, 0);
+    StructBinRecsHdr recsHdr;
+    recsHdr.msBase = msBase;
+    fwrite(&recsHdr, sizeof(recsHdr), 1, m_fp);
+    m_offFile += sizeof(recsHdr);
+    m_bInBlock = true;
+}
+
+void CBinLogWriter::FinishRecsBlock()
+{
+    if (!m_bInBlock) {
+        return;
+    }
+    uint32_t cb = (uint32_t)(sizeof(StructBinRecsHdr) + m_entry.nRecords * sizeof(StructBinRecord));
+    fseek64(m_fp, m_entry.offBlock + offsetof(StructBinBlockHdr, cb), SEEK_SET);
+    fwrite(&cb, sizeof(cb), 1, m_fp);
+    fseek64(m_fp, 0, SEEK_END);
+    m_vectIndex.push_back(m_entry);
+    m_bInBlock = false;
+}
+
+bool CBinLogWriter::Append(const StructLogLine& line)
+{
+    // One segment per UTC day, and at most 64K dictionary strings.
+    if (m_fp && (FloorDiv(line.msTime, MS_PER_DAY) != m_dayOpen || m_vectDict.size() > 0xff00)) {
+        Close();
+    }
+    if (m_fp == NULL && !OpenSegment(line.msTime)) {
+        return false;
+    }
+
+    StructBinRecord rec;
+    rec.idAction = Intern(line.action);
+    rec.idHost = Intern(line.host);
+    rec.idLocalIP = Intern(line.localIP);
+    rec.idRemoteIP = Intern(line.remoteIP);
+    int64_t usRoundTrip = ParseRoundTripMicros(line.details.p, line.details.cb);
+    if (usRoundTrip >= 0 && usRoundTrip < (int64_t)BINLOG_VALUE_DICT) {
+        rec.value = (uint32_t)usRoundTrip;
+    } else {
+        rec.value = BINLOG_VALUE_DICT | Intern(line.details);
+    }
+
+    // Deltas are unsigned 32-bit ms, so a new block is started if the
+    // clock went backwards.
+    if (m_bInBlock && (m_entry.nRecords >= BINLOG_BLOCK_RECORDS || line.msTime < m_entry.msFirst ||
+        line.msTime - m_entry.msFirst > 0xffffffffLL)) {
+        FinishRecsBlock();
+    }
+    if (!m_bInBlock) {
+        StartRecsBlock(line.msTime);
+    }
+    rec.msDelta = (uint32_t)(line.msTime - m_entry.msFirst);
+    fwrite(&rec, sizeof(rec), 1, m_fp);
+    m_offFile += sizeof(rec);
+    m_entry.nRecords++;
+    if (line.msTime > m_entry.msLast) {
+        m_entry.msLast = line.msTime;
+    }
+    m_nRecords++;
+    return true;
+}
+
+void CBinLogWriter::Flush()
+{
+    if (m_fp) {
+        fflush(m_fp);
+    }
+}
+
+void CBinLogWriter::Sync()
+{
+    if (m_fp) {
+        fflush(m_fp);
+#ifdef _WIN32
+        _commit(_fileno(m_fp));
+#else
+        fsync(fileno(m_fp));
+#endif
+    }
+}
+
+void CBinLogWriter::Close()
+{
+    if (m_fp == NULL) {
+        return;
+    }
+    FinishRecsBlock();
+
+    StructBinTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    memcpy(trailer.magic, BINLOG_TRAILER_MAGIC, sizeof(trailer.magic));
+
+    // DICTALL: (id, length, bytes) for every string.
+    trailer.offDictAll = m_offFile;
+    uint32_t cbDict = 0;
+    for (size_t j = 0; j < m_vectDict.size(); j++) {
+        cbDict += (uint32_t)(2 * sizeof(uint16_t) + m_vectDict[j].size());
+    }
+    WriteBlockHdr(BINLOG_BLOCK_DICTALL, cbDict);
+    for (size_t j = 0; j < m_vectDict.size(); j++) {
+        uint16_t id = (uint16_t)j;
+        uint16_t cbStr = (uint16_t)m_vectDict[j].size();
+        fwrite(&id, sizeof(id), 1, m_fp);
+        fwrite(&cbStr, sizeof(cbStr), 1, m_fp);
+        fwrite(m_vectDict[j].data(), 1, cbStr, m_fp);
+    }
+    m_offFile += cbDict;
+
+    trailer.offIndex = m_offFile;
+    uint32_t cbIndex = (uint32_t)(m_vectIndex.size() * sizeof(StructBinIndexEntry));
+    WriteBlockHdr(BINLOG_BLOCK_INDEX, cbIndex);
+    if (cbIndex) {
+        fwrite(&m_vectIndex[0], 1, cbIndex, m_fp);
+    }
+    m_offFile += cbIndex;
+
+    fwrite(&trailer, sizeof(trailer), 1, m_fp);
+    fclose(m_fp);
+    m_fp = NULL;
+}
+
+//=== CBinLogSegment =======================================================
+
+CBinLogSegment::CBinLogSegment()
+{
+    m_pBase = NULL;
+    m_cbFile = 0;
+#ifdef _WIN32
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hMapping = NULL;
+#endif
+    m_msFirst = 0;
+    m_msLast = 0;
+}
+
+CBinLogSegment::~CBinLogSegment()
+{
+    Close();
+}
+
+bool CBinLogSegment::Open(const std::string& strPath, std::string& strError)
+{
+    Close();
+#ifdef _WIN32
+    m_hFile = CreateFileA(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE) {
+        strError = "Cannot open " + strPath;
+        return false;
+    }
+    LARGE_INTEGER liSize;
+    GetFileSizeEx(m_hFile, &liSize);
+    m_cbFile = (uint64_t)liSize.QuadPart;
+    if (m_cbFile >= sizeof(StructBinFileHdr)) {
+        m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_hMapping) {
+            m_pBase = (const unsigned char*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+        }
+    }
+#else
+    int fd = open(strPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        strError = "Cannot open " + strPath;
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    m_cbFile = (uint64_t)st.st_size;
+    if (m_cbFile >= sizeof(StructBinFileHdr)) {
+        void* p = mmap(NULL, m_cbFile, PROT_READ, MAP_SHARED, fd, 0);
+        m_pBase = p == MAP_FAILED ? NULL : (const unsigned char*)p;
+    }
+    close(fd);
+#endif
+    if (m_pBase == NULL) {
+        strError = "Cannot map " + strPath;
+        Close();
+        return false;
+    }
+    const StructBinFileHdr* pHdr = (const StructBinFileHdr*)m_pBase;
+    if (memcmp(pHdr->magic, BINLOG_MAGIC, sizeof(pHdr->magic)) != 0) {
+        strError = strPath + " is not a netavailw binary log";
+        Close();
+        return false;
+    }
+    m_msFirst = pHdr->msFirst;
+    m_msLast = pHdr->msFirst;
+    if (!LoadFromTrailer()) {
+        LoadByScanning();
+    }
+    for (size_t j = 0; j < m_vectIndex.size(); j++) {
+        if (m_vectIndex[j].msLast > m_msLast) {
+            m_msLast = m_vectIndex[j].msLast;
+        }
+    }
+    return true;
+}
+
+void CBinLogSegment::Close()
+{
+#ifdef _WIN32
+    if (m_pBase) {
+        UnmapViewOfFile(m_pBase);
+    }
+    if (m_hMapping) {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_pBase) {
+        munmap((void*)m_pBase, m_cbFile);
+    }
+#endif
+    m_pBase = NULL;
+    m_cbFile = 0;
+    m_vectDict.clear();
+    m_vectIndex.clear();
+}
+
+void CBinLogSegment::AddString(uint16_t id, const char* p, size_t cb)
+{
+    if (id >= m_vectDict.size()) {
+        m_vectDict.resize((size_t)id + 1);
+    }
+    m_vectDict[id].assign(p, cb);
+}
+
+// Read the dictionary and index of a closed segment from the blocks the
+// trailer points at.
+bool CBinLogSegment::LoadFromTrailer()
+{
+    if (m_cbFile < sizeof(StructBinFileHdr) + sizeof(StructBinTrailer)) {
+        return false;
+    }
+    const StructBinTrailer* pTrailer = (const StructBinTrailer*)(m_pBase + m_cbFile - sizeof(StructBinTrailer));
+    if (memcmp(pTrailer->magic, BINLOG_TRAILER_MAGIC, sizeof(pTrailer->magic)) != 0 ||
+        pTrailer->offDictAll + sizeof(StructBinBlockHdr) > m_cbFile ||
+        pTrailer->offIndex + sizeof(StructBinBlockHdr) > m_cbFile) {
+        return false;
+    }
+
+    const StructBinBlockHdr* pDictHdr = (const StructBinBlockHdr*)(m_pBase + pTrailer->offDictAll);
+    const unsigned char* p = (const unsigned char*)(pDictHdr + 1);
+    const unsigned char* pEnd = p + pDictHdr->cb;
+    if (pDictHdr->type != BINLOG_BLOCK_DICTALL || pEnd > m_pBase + m_cbFile) {
+        return false;
+    }
+    while (p + 2 * sizeof(uint16_t) <= pEnd) {
+        uint16_t id, cbStr;
+        memcpy(&id, p, sizeof(id));
+        memcpy(&cbStr, p + sizeof(id), sizeof(cbStr));
+        p += 2 * sizeof(uint16_t);
+        if (p + cbStr > pEnd) {
+            break;
+        }
+        AddString(id, (const char*)p, cbStr);
+        p += cbStr;
+    }
+
+    const StructBinBlockHdr* pIndexHdr = (const StructBinBlockHdr*)(m_pBase + pTrailer->offIndex);
+    if (pIndexHdr->type != BINLOG_BLOCK_INDEX ||
+        pTrailer->offIndex + sizeof(StructBinBlockHdr) + pIndexHdr->cb > m_cbFile) {
+        return false;
+    }
+    size_t nEntries = pIndexHdr->cb / sizeof(StructBinIndexEntry);
+    m_vectIndex.resize(nEntries);
+    if (nEntries) {
+        memcpy(&m_vectIndex[0], pIndexHdr + 1, nEntries * sizeof(StructBinIndexEntry));
+    }
+    return true;
+}
+
+// Build the dictionary and index of a segment that is still being
+// written, or was not closed cleanly, by walking its blocks.
+bool CBinLogSegment::LoadByScanning()
+{
+    m_vectDict.clear();
+    m_vectIndex.clear();
+    uint64_t off = sizeof(StructBinFileHdr);
+    while (off + sizeof(StructBinBlockHdr) <= m_cbFile) {
+        const StructBinBlockHdr* pHdr = (const StructBinBlockHdr*)(m_pBase + off);
+        uint64_t cb = pHdr->cb;
+        uint64_t cbAvail = m_cbFile - off - sizeof(StructBinBlockHdr);
+        if (pHdr->type == BINLOG_BLOCK_RECS) {
+            if (cb == 0 || cb > cbAvail) {
+                // The block being appended to: it runs to the end of file.
+                cb = cbAvail < sizeof(StructBinRecsHdr) ? 0 :
+                    sizeof(StructBinRecsHdr) + (cbAvail - sizeof(StructBinRecsHdr)) / sizeof(StructBinRecord) * sizeof(StructBinRecord);
+            }
+            if (cb < sizeof(StructBinRecsHdr)) {
+                break;
+            }
+            const StructBinRecsHdr* pRecsHdr = (const StructBinRecsHdr*)(pHdr + 1);
+            const StructBinRecord* pRecs = (const StructBinRecord*)(pRecsHdr + 1);
+            StructBinIndexEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.offBlock = off;
+            entry.nRecords = (uint32_t)((cb - sizeof(StructBinRecsHdr)) / sizeof(StructBinRecord));
+            entry.msFirst = pRecsHdr->msBase;
+            entry.msLast = pRecsHdr->msBase;
+            for (uint32_t j = 0; j < entry.nRecords; j++) {
+                if (pRecsHdr->msBase + pRecs[j].msDelta > entry.msLast) {
+                    entry.msLast = pRecsHdr->msBase + pRecs[j].msDelta;
+                }
+            }
+            if (entry.nRecords) {
+                m_vectIndex.push_back(entry);
+            }
+        } else if (cb > cbAvail) {
+            break;
+        } else if (pHdr->type == BINLOG_BLOCK_DICT && cb >= sizeof(uint16_t)) {
+            uint16_t id;
+            memcpy(&id, pHdr + 1, sizeof(id));
+            AddString(id, (const char*)(pHdr + 1) + sizeof(id), (size_t)cb - sizeof(id));
+        }
+        off += sizeof(StructBinBlockHdr) + cb;
+    }
+    return true;
+}
+
+const std::string& CBinLogSegment::GetString(uint16_t id) const
+{
+    static const std::string strEmpty;
+    return id < m_vectDict.size() ? m_vectDict[id] : strEmpty;
+}
+
+int CBinLogSegment::FindString(const std::string& str) const
+{
+    for (size_t j = 0; j < m_vectDict.size(); j++) {
+        if (m_vectDict[j] == str) {
+            return (int)j;
+        }
+    }
+    return -1;
+}
+
+const StructBinRecord* CBinLogSegment::GetRecords(const StructBinIndexEntry& entry, int64_t& msBase) const
+{
+    const StructBinRecsHdr* pRecsHdr = (const StructBinRecsHdr*)(m_pBase + entry.offBlock + sizeof(StructBinBlockHdr));
+    msBase = pRecsHdr->msBase;
+    return (const StructBinRecord*)(pRecsHdr + 1);
+}
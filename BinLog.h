@@ -0,0 +1,235 @@
+// BinLog.h : Compact binary form of the records LogToFile writes.
+//
+// A log is a series of segment files, one per UTC day at most, named
+// <prefix>-YYYYMMDD-HHMMSS.nab after the time of their first record.
+// A segment is a 32-byte header followed by blocks.  Each block starts
+// with a StructBinBlockHdr giving its type and size:
+//
+//   DICT    one dictionary string (hostname, IP address, action or error
+//           text) and the id records use for it.  Written before the
+//           first record that uses it.
+//   RECS    a run of up to BINLOG_BLOCK_RECORDS fixed-width 16-byte
+//           records, with the absolute time of the block; each record
+//           holds its time as a delta from it.
+//   DICTALL all the dictionary strings of the segment, and
+//   INDEX   the sparse time index: one entry per RECS block.  These two
+//           are written when the segment is closed, followed by a
+//           StructBinTrailer pointing at them.
+//
+// A reader of a closed segment reads the header, trailer, dictionary and
+// index, and then only the RECS blocks that overlap the time range it
+// wants.  A segment that is still open (or was not closed cleanly) has no
+// trailer; it is read by walking the block headers instead.
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define BINLOG_MAGIC            "NAVBLOG1"
+#define BINLOG_TRAILER_MAGIC    "NAVBIDX1"
+#define BINLOG_EXT              ".nab"
+#define BINLOG_BLOCK_RECORDS    512
+
+#define BINLOG_BLOCK_DICT       1
+#define BINLOG_BLOCK_RECS       2
+#define BINLOG_BLOCK_DICTALL    3
+#define BINLOG_BLOCK_INDEX      4
+
+// If set in StructBinRecord::value, the low bits are the dictionary id of
+// the details text; otherwise value is a round trip time in microseconds.
+#define BINLOG_VALUE_DICT       0x80000000u
+
+#pragma pack(push, 1)
+struct StructBinFileHdr {
+    char     magic[8];          // BINLOG_MAGIC
+    int64_t  msFirst;           // time of the first record, ms since 1970 UTC
+    uint32_t version;           // 1
+    uint8_t  reserved[12];
+};
+
+struct StructBinBlockHdr {
+    uint32_t type;              // BINLOG_BLOCK_xxx
+    uint32_t cb;                // size of the payload that follows; 0 while
+                                // a RECS block is still being appended to
+};
+
+struct StructBinRecsHdr {       // payload prefix of a RECS block
+    int64_t  msBase;            // time of the block's first record
+};
+
+struct StructBinRecord {
+    uint32_t msDelta;           // time since the block's msBase
+    uint16_t idAction;          // dictionary ids; 0 is the empty string
+    uint16_t idHost;
+    uint16_t idLocalIP;
+    uint16_t idRemoteIP;
+    uint32_t value;             // RTT in us, or BINLOG_VALUE_DICT | id
+};
+
+struct StructBinIndexEntry {
+    int64_t  msFirst;
+    int64_t  msLast;
+    uint64_t offBlock;          // file offset of the RECS block header
+    uint32_t nRecords;
+    uint32_t reserved;
+};
+
+struct StructBinTrailer {
+    uint64_t offDictAll;        // file offset of the DICTALL block header
+    uint64_t offIndex;          // file offset of the INDEX block header
+    char     magic[8];          // BINLOG_TRAILER_MAGIC
+};
+#pragma pack(pop)
+
+// A field of a parsed CSV line; points into the line.
+struct StructField {
+    const char* p;
+    size_t      cb;
+    std::string ToString() const { return std::string(p, cb); }
+};
+
+// One parsed netavailw.csv line:
+// timestamp,action,hostname,localIP,remoteIP,details
+struct StructLogLine {
+    int64_t     msTime;         // ms since 1970 UTC
+    StructField action;
+    StructField host;
+    StructField localIP;
+    StructField remoteIP;
+    StructField details;
+};
+
+// Caches the local-time conversion of the timestamp's hour, since mktime
+// is slow and consecutive lines share it.  Daylight saving changes fall
+// on the hour in all but a handful of zones.
+struct StructTimeCache {
+    char    szHour[14];         // "YYYY-MM-DD HH"
+    int64_t msHour;
+    StructTimeCache() { szHour[0] = '\0'; msHour = 0; }
+};
+
+// Where the line breaks and field separators of a netavailw.csv line are.
+// Only the first CSV_SPLIT_COMMAS commas count: the details field, which
+// is last, can contain commas.
+#define CSV_SPLIT_COMMAS    5
+struct StructCsvSplit {
+    const char* pLine;
+    const char* pEnd;           // end of the line, without its \r\n
+    const char* pNext;          // start of the next line, or the end of the buffer
+    int         nCommas;
+    const char* aryCommas[CSV_SPLIT_COMMAS];
+};
+
+// Find the end of the line starting at p, and its commas, in one pass
+// that looks at 16 bytes at a time where SSE2 is available.
+void SplitCsvLine(const char* p, const char* pBufEnd, StructCsvSplit& split);
+
+// Parse a netavailw.csv line.  The timestamp is local time, optionally
+// with fractional seconds, or ISO 8601 with a 'T' and, optionally, a UTC
+// offset ("+01:00", "-0500" or "Z"), which then fixes the time without
+// reference to the local time zone.
+// Exit:   Returns false if the line is malformed.
+bool ParseCsvLogLine(const char* pLine, size_t cbLine, StructTimeCache& cache, StructLogLine& line);
+
+// Parse a line already split by SplitCsvLine.
+// Exit:   Returns false if the line is malformed.
+bool ParseCsvLogSplit(const StructCsvSplit& split, StructTimeCache& cache, StructLogLine& line);
+
+// Parse the details of a ping record ("12.345" or, in older logs, "12")
+// into microseconds.  Anything after a space, such as the address a
+// target given by name was pinged at, is ignored.
+// Exit:   Returns -1 if it is not a number.
+int64_t ParseRoundTripMicros(const char* p, size_t cb);
+
+// Parse a local time given as "YYYY-MM-DD", "YYYY-MM-DD HH:MM" or
+// "YYYY-MM-DD HH:MM:SS".
+// Exit:   Returns ms since 1970 UTC, or -1 if it can't be parsed.
+int64_t ParseLocalTime(const char* psz);
+
+class CBinLogWriter
+{
+public:
+    CBinLogWriter();
+    ~CBinLogWriter();
+
+    // Segments are written as <strPrefix>-YYYYMMDD-HHMMSS.nab.
+    void SetPrefix(const std::string& strPrefix) { m_strPrefix = strPrefix; }
+
+    // Append one record, starting a new segment when needed.
+    bool Append(const StructLogLine& line);
+
+    // Make everything appended so far visible to readers.
+    void Flush();
+
+    // Flush, and force what was written to disk.
+    void Sync();
+
+    // Finish the current segment with its dictionary, index and trailer.
+    void Close();
+
+    uint64_t GetRecordCount() const { return m_nRecords; }
+
+private:
+    bool OpenSegment(int64_t msTime);
+    uint16_t Intern(const StructField& field);
+    void WriteBlockHdr(uint32_t type, uint32_t cb);
+    void StartRecsBlock(int64_t msBase);
+    void FinishRecsBlock();
+
+    std::string m_strPrefix;
+    FILE*    m_fp;
+    int64_t  m_dayOpen;         // UTC day number of the open segment
+    uint64_t m_offFile;         // current end of file
+
+    std::unordered_map<std::string, uint16_t> m_mapDict;
+    std::vector<std::string> m_vectDict;    // index = id
+
+    // The RECS block being appended to.
+    bool     m_bInBlock;
+    StructBinIndexEntry m_entry;
+    std::vector<StructBinIndexEntry> m_vectIndex;
+    uint64_t m_nRecords;
+};
+
+// Read-only view of one segment, mapped into memory.
+class CBinLogSegment
+{
+public:
+    CBinLogSegment();
+    ~CBinLogSegment();
+
+    bool Open(const std::string& strPath, std::string& strError);
+    void Close();
+
+    int64_t GetFirstTime() const { return m_msFirst; }
+    int64_t GetLastTime() const { return m_msLast; }
+    const std::vector<StructBinIndexEntry>& GetIndex() const { return m_vectIndex; }
+
+    const std::string& GetString(uint16_t id) const;
+
+    // Exit:   Returns the id of the string, or -1 if the segment doesn't
+    //         contain it.
+    int FindString(const std::string& str) const;
+
+    // Records of one RECS block.  Only touches that block's pages.
+    const StructBinRecord* GetRecords(const StructBinIndexEntry& entry, int64_t& msBase) const;
+
+private:
+    bool LoadFromTrailer();
+    bool LoadByScanning();
+    void AddString(uint16_t id, const char* p, size_t cb);
+
+    const unsigned char* m_pBase;
+    uint64_t m_cbFile;
+#ifdef _WIN32
+    void*    m_hFile;
+    void*    m_hMapping;
+#endif
+    int64_t  m_msFirst;
+    int64_t  m_msLast;
+    std::vector<std::string> m_vectDict;
+    std::vector<StructBinIndexEntry> m_vectIndex;
+};
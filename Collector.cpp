@@ -0,0 +1,659 @@
+// Collector.cpp : The receiving side of result streaming.  See Collector.h.
+
+#include "Collector.h"
+#include "Timestamp.h"
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#define poll WSAPoll
+#define SocketWouldBlock() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#define closesocket close
+#define INVALID_SOCKET (-1)
+#define SocketWouldBlock() (errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+
+#define COLLECTOR_WAKE_MS       200     // receive threads notice Stop this often
+#define COLLECTOR_RCVBUF        (4 * 1024 * 1024)
+#define COLLECTOR_RECV_BATCH    32      // datagrams per recvmmsg
+#define COLLECTOR_MAX_CONNS     4096    // TCP connections at once
+
+CCollector::CCollector()
+{
+    m_pfnOutage = NULL;
+    m_pContext = NULL;
+    m_aryShards = NULL;
+    m_sockListen = (intptr_t)INVALID_SOCKET;
+    m_bStop = false;
+    m_nBatches = 0;
+    m_nResults = 0;
+    m_nBadBatches = 0;
+    m_nLostBatches = 0;
+    m_nConnections = 0;
+    m_nOutages = 0;
+    m_nPairs = 0;
+    m_nTargets = 0;
+    m_nSenders = 0;
+    m_nOutagesNow = 0;
+}
+
+CCollector::~CCollector()
+{
+    Stop();
+    delete[] m_aryShards;
+}
+
+// Open a UDP socket on the configured port, sharing it with the other
+// receive threads' sockets if bShare.
+// Exit:   Returns the socket, or INVALID_SOCKET.
+static intptr_t OpenUdpSocket(const sockaddr_in& addr, bool bShare)
+{
+    auto sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+        return (intptr_t)INVALID_SOCKET;
+    }
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if (bShare && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on)) != 0) {
+        closesocket(sock);
+        return (intptr_t)INVALID_SOCKET;
+    }
+#endif
+    int cbRcvBuf = COLLECTOR_RCVBUF;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&cbRcvBuf, sizeof(cbRcvBuf));
+#ifdef _WIN32
+    DWORD msTimeout = COLLECTOR_WAKE_MS;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&msTimeout, sizeof(msTimeout));
+#else
+    timeval tv = { 0, COLLECTOR_WAKE_MS * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+    if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+        closesocket(sock);
+        return (intptr_t)INVALID_SOCKET;
+    }
+    return (intptr_t)sock;
+}
+
+bool CCollector::Start(const StructCollectorConfig& config, PFN_OUTAGE_EVENT pfnOutage, void* pContext,
+    std::string& strError)
+{
+    if (!m_vectThreads.empty()) {
+        return true;
+    }
+    m_config = config;
+    if (m_config.nShards < 1) {
+        m_config.nShards = 1;
+    }
+    if (m_config.nReceivers < 1) {
+        m_config.nReceivers = 1;
+    }
+    if (m_config.nDownAfter < 1) {
+        m_config.nDownAfter = 1;
+    }
+    m_pfnOutage = pfnOutage;
+    m_pContext = pContext;
+    delete[] m_aryShards;
+    m_aryShards = new StructShard[m_config.nShards];
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)m_config.port);
+    if (inet_pton(AF_INET, m_config.strBindAddress.c_str(), &addr.sin_addr) != 1) {
+        strError = "Bad collector bind address: " + m_config.strBindAddress;
+        return false;
+    }
+    std::string strWhere = m_config.strBindAddress + ":" + std::to_string(m_config.port);
+
+    // Each receive thread has its own socket where the kernel can spread
+    // datagrams over them; elsewhere they share one.
+#ifdef SO_REUSEPORT
+    for (int j = 0; j < m_config.nReceivers; j++) {
+        intptr_t sock = OpenUdpSocket(addr, true);
+        if (sock == (intptr_t)INVALID_SOCKET) {
+            break;
+        }
+        m_vectUdpSockets.push_back(sock);
+    }
+#endif
+    if (m_vectUdpSockets.empty()) {
+        intptr_t sock = OpenUdpSocket(addr, false);
+        if (sock == (intptr_t)INVALID_SOCKET) {
+            strError = "Cannot receive results on UDP " + strWhere;
+            return false;
+        }
+        m_vectUdpSockets.push_back(sock);
+    }
+
+    if (m_config.bTcp) {
+        auto sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        int on = 1;
+        if (sock != INVALID_SOCKET) {
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+        }
+        if (sock == INVALID_SOCKET || bind(sock, (const sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, SOMAXCONN) != 0) {
+            if (sock != INVALID_SOCKET) {
+                closesocket(sock);
+            }
+            for (size_t j = 0; j < m_vectUdpSockets.size(); j++) {
+                closesocket(m_vectUdpSockets[j]);
+            }
+            m_vectUdpSockets.clear();
+            strError = "Cannot listen for results on TCP " + strWhere;
+            return false;
+        }
+        // Non-blocking, so each wake can accept every connection waiting.
+#ifdef _WIN32
+        u_long ulOn = 1;
+        ioctlsocket(sock, FIONBIO, &ulOn);
+#else
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+        m_sockListen = (intptr_t)sock;
+    }
+
+    m_bStop = false;
+    for (int j = 0; j < m_config.nReceivers; j++) {
+        intptr_t sock = m_vectUdpSockets[j % m_vectUdpSockets.size()];
+        m_vectThreads.push_back(std::thread(&CCollector::ReceiveUdp, this, sock));
+    }
+    if (m_sockListen != (intptr_t)INVALID_SOCKET) {
+        m_vectThreads.push_back(std::thread(&CCollector::ReceiveTcp, this));
+    }
+    return true;
+}
+
+void CCollector::Stop()
+{
+    if (m_vectThreads.empty()) {
+        return;
+    }
+    m_bStop = true;
+    for (size_t j = 0; j < m_vectThreads.size(); j++) {
+        m_vectThreads[j].join();
+    }
+    m_vectThreads.clear();
+    for (size_t j = 0; j < m_vectUdpSockets.size(); j++) {
+        closesocket(m_vectUdpSockets[j]);
+    }
+    m_vectUdpSockets.clear();
+    if (m_sockListen != (intptr_t)INVALID_SOCKET) {
+        closesocket(m_sockListen);
+        m_sockListen = (intptr_t)INVALID_SOCKET;
+    }
+}
+
+CCollector::StructShard& CCollector::GetShard(const std::string& strKey) const
+{
+    return m_aryShards[std::hash<std::string>()(strKey) % (size_t)m_config.nShards];
+}
+
+bool CCollector::Ingest(const char* p, size_t cb, int64_t msNow)
+{
+    // Reused from batch to batch, so a thread that has warmed up only
+    // allocates for pairs it hasn't seen.
+    static thread_local std::vector<StructStreamResult> vectResults;
+    static thread_local std::vector<StructTargetDelta> vectDeltas;
+    static thread_local std::string strKey;
+
+    StructStreamBatch batch;
+    if (!DecodeStreamBatch(p, cb, batch, vectResults)) {
+        m_nBadBatches.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    m_nBatches.fetch_add(1, std::memory_order_relaxed);
+    m_nResults.fetch_add(vectResults.size(), std::memory_order_relaxed);
+
+    // Count the batches missing from the sender's numbering.  A sender
+    // with a new id has restarted, and starts a new numbering.
+    strKey.assign(batch.host.p, batch.host.cb);
+    {
+        StructShard& shard = GetShard(strKey);
+        CCritSecInScope lock(shard.crit);
+        std::unordered_map<std::string, StructSender>::iterator it = shard.mapSenders.find(strKey);
+        if (it == shard.mapSenders.end()) {
+            StructSender sender;
+            sender.idSender = batch.idSender;
+            sender.seqNext = batch.seq;
+            it = shard.mapSenders.emplace(strKey, sender).first;
+            m_nSenders.fetch_add(1, std::memory_order_relaxed);
+        }
+        StructSender& sender = it->second;
+        if (sender.idSender != batch.idSender) {
+            sender.idSender = batch.idSender;
+            sender.seqNext = batch.seq;
+        }
+        int32_t nAhead = (int32_t)(batch.seq - sender.seqNext);
+        if (nAhead >= 0) {
+            m_nLostBatches.fetch_add(nAhead, std::memory_order_relaxed);
+            sender.seqNext = batch.seq + 1;
+        }
+        sender.msSeen = msNow;
+        if (sender.strLocalIP.size() != batch.localIP.cb ||
+                memcmp(sender.strLocalIP.data(), batch.localIP.p, batch.localIP.cb) != 0) {
+            sender.strLocalIP = batch.localIP.ToString();
+        }
+    }
+
+    vectDeltas.clear();
+    for (size_t j = 0; j < vectResults.size(); j++) {
+        const StructStreamResult& result = vectResults[j];
+        strKey.assign(batch.host.p, batch.host.cb);
+        strKey += '\t';
+        strKey.append(result.target.p, result.target.cb);
+        StructShard& shard = GetShard(strKey);
+        StructTargetDelta delta;
+        delta.dHosts = 0;
+        delta.dDown = 0;
+        {
+            CCritSecInScope lock(shard.crit);
+            std::unordered_map<std::string, StructPair>::iterator it = shard.mapPairs.find(strKey);
+            if (it == shard.mapPairs.end()) {
+                StructPair pairNew = {};
+                it = shard.mapPairs.emplace(strKey, pairNew).first;
+                m_nPairs.fetch_add(1, std::memory_order_relaxed);
+                delta.dHosts = 1;
+            }
+            StructPair& pair = it->second;
+            pair.nProbes++;
+            pair.msSeen = msNow;
+            if (result.usRtt < 0) {
+                pair.nLost++;
+                if (pair.nFailures++ == 0) {
+                    pair.msFailStart = result.msTime;
+                }
+                if (!pair.bDown && pair.nFailures >= m_config.nDownAfter) {
+                    pair.bDown = true;
+                    delta.dDown = 1;
+                }
+            } else {
+                pair.usSum += result.usRtt;
+                pair.nFailures = 0;
+                if (pair.bDown) {
+                    pair.bDown = false;
+                    delta.dDown = -1;
+                }
+            }
+            delta.msFailStart = pair.msFailStart;
+        }
+        if (delta.dHosts != 0 || delta.dDown != 0) {
+            delta.strTarget = result.target.ToString();
+            vectDeltas.push_back(delta);
+        }
+    }
+    if (!vectDeltas.empty()) {
+        ApplyDeltas(vectDeltas, msNow);
+    }
+    return true;
+}
+
+// Apply pairs' changes to their targets, and report the outages that
+// start or end, after letting go of the locks.
+void CCollector::ApplyDeltas(const std::vector<StructTargetDelta>& vectDeltas, int64_t msNow)
+{
+    static thread_local std::vector<StructOutageEvent> vectEvents;
+    vectEvents.clear();
+    for (size_t j = 0; j < vectDeltas.size(); j++) {
+        const StructTargetDelta& delta = vectDeltas[j];
+        StructShard& shard = GetShard(delta.strTarget);
+        CCritSecInScope lock(shard.crit);
+        std::unordered_map<std::string, StructTarget>::iterator it = shard.mapTargets.find(delta.strTarget);
+        if (it == shard.mapTargets.end()) {
+            StructTarget targetNew = {};
+            it = shard.mapTargets.emplace(delta.strTarget, targetNew).first;
+            m_nTargets.fetch_add(1, std::memory_order_relaxed);
+        }
+        StructTarget& target = it->second;
+        target.nHosts += delta.dHosts;
+        if (delta.dDown > 0 && (target.nDown == 0 || delta.msFailStart < target.msFirstFailure)) {
+            target.msFirstFailure = delta.msFailStart;
+        }
+        target.nDown += delta.dDown;
+
+        bool bOutage = target.nDown >= m_config.nOutageHosts &&
+            target.nDown * 100 >= m_config.pctOutageHosts * target.nHosts;
+        if (bOutage != target.bOutage) {
+            target.bOutage = bOutage;
+            StructOutageEvent event;
+            event.bStart = bOutage;
+            event.strTarget = delta.strTarget;
+            event.nDown = target.nDown;
+            event.nHosts = target.nHosts;
+            event.msFirstFailure = target.msFirstFailure;
+            event.msDetected = msNow;
+            vectEvents.push_back(event);
+            m_nOutagesNow.fetch_add(bOutage ? 1 : -1, std::memory_order_relaxed);
+            if (bOutage) {
+                m_nOutages.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        if (target.nHosts <= 0) {
+            shard.mapTargets.erase(it);
+            m_nTargets.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    for (size_t j = 0; j < vectEvents.size() && m_pfnOutage; j++) {
+        m_pfnOutage(vectEvents[j], m_pContext);
+    }
+}
+
+void CCollector::Expire(int64_t msNow)
+{
+    if (m_aryShards == NULL) {
+        return;
+    }
+    int64_t msOldest = msNow - (int64_t)m_config.secsStale * 1000;
+    std::vector<StructTargetDelta> vectDeltas;
+    for (int iShard = 0; iShard < m_config.nShards; iShard++) {
+        StructShard& shard = m_aryShards[iShard];
+        CCritSecInScope lock(shard.crit);
+        for (std::unordered_map<std::string, StructPair>::iterator it = shard.mapPairs.begin();
+                it != shard.mapPairs.end();) {
+            if (it->second.msSeen >= msOldest) {
+                ++it;
+                continue;
+            }
+            StructTargetDelta delta;
+            delta.strTarget = it->first.substr(it->first.find('\t') + 1);
+            delta.dHosts = -1;
+            delta.dDown = it->second.bDown ? -1 : 0;
+            delta.msFailStart = it->second.msFailStart;
+            vectDeltas.push_back(delta);
+            it = shard.mapPairs.erase(it);
+            m_nPairs.fetch_sub(1, std::memory_order_relaxed);
+        }
+        for (std::unordered_map<std::string, StructSender>::iterator it = shard.mapSenders.begin();
+                it != shard.mapSenders.end();) {
+            if (it->second.msSeen >= msOldest) {
+                ++it;
+                continue;
+            }
+            it = shard.mapSenders.erase(it);
+            m_nSenders.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    ApplyDeltas(vectDeltas, msNow);
+}
+
+StructCollectorStats CCollector::GetStats() const
+{
+    StructCollectorStats stats;
+    stats.nBatches = m_nBatches.load(std::memory_order_relaxed);
+    stats.nResults = m_nResults.load(std::memory_order_relaxed);
+    stats.nBadBatches = m_nBadBatches.load(std::memory_order_relaxed);
+    stats.nLostBatches = m_nLostBatches.load(std::memory_order_relaxed);
+    stats.nConnections = m_nConnections.load(std::memory_order_relaxed);
+    stats.nOutages = m_nOutages.load(std::memory_order_relaxed);
+    stats.nPairs = m_nPairs.load(std::memory_order_relaxed);
+    stats.nTargets = m_nTargets.load(std::memory_order_relaxed);
+    stats.nSenders = m_nSenders.load(std::memory_order_relaxed);
+    stats.nOutagesNow = m_nOutagesNow.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void CCollector::GetTargets(std::vector<StructFleetTarget>& vectTargets) const
+{
+    vectTargets.clear();
+    if (m_aryShards == NULL) {
+        return;
+    }
+    std::unordered_map<std::string, size_t> mapIndex;
+    for (int iShard = 0; iShard < m_config.nShards; iShard++) {
+        const StructShard& shard = m_aryShards[iShard];
+        CCritSecInScope lock(shard.crit);
+        for (std::unordered_map<std::string, StructTarget>::const_iterator it = shard.mapTargets.begin();
+                it != shard.mapTargets.end(); ++it) {
+            StructFleetTarget target;
+            target.strTarget = it->first;
+            target.nHosts = it->second.nHosts;
+            target.nDown = it->second.nDown;
+            target.bOutage = it->second.bOutage;
+            target.nProbes = 0;
+            target.nLost = 0;
+            target.usSum = 0;
+            mapIndex[it->first] = vectTargets.size();
+            vectTargets.push_back(target);
+        }
+    }
+    for (int iShard = 0; iShard < m_config.nShards; iShard++) {
+        const StructShard& shard = m_aryShards[iShard];
+        CCritSecInScope lock(shard.crit);
+        for (std::unordered_map<std::string, StructPair>::const_iterator it = shard.mapPairs.begin();
+                it != shard.mapPairs.end(); ++it) {
+            std::unordered_map<std::string, size_t>::const_iterator itIndex =
+                mapIndex.find(it->first.substr(it->first.find('\t') + 1));
+            if (itIndex == mapIndex.end()) {
+                continue;
+            }
+            StructFleetTarget& target = vectTargets[itIndex->second];
+            target.nProbes += it->second.nProbes;
+            target.nLost += it->second.nLost;
+            target.usSum += it->second.usSum;
+        }
+    }
+    std::sort(vectTargets.begin(), vectTargets.end(), [](const StructFleetTarget& a, const StructFleetTarget& b) {
+        if (a.nDown != b.nDown) {
+            return a.nDown > b.nDown;
+        }
+        return a.strTarget < b.strTarget;
+    });
+}
+
+void CCollector::RenderMetrics(CTextBuffer& buf) const
+{
+    StructCollectorStats stats = GetStats();
+    AppendHelp(buf, "netavail_collector_batches_total", "counter", "Result batches taken in.");
+    buf.Printf("netavail_collector_batches_total %llu\n", (unsigned long long)stats.nBatches);
+    AppendHelp(buf, "netavail_collector_results_total", "counter", "Results taken in.");
+    buf.Printf("netavail_collector_results_total %llu\n", (unsigned long long)stats.nResults);
+    AppendHelp(buf, "netavail_collector_bad_batches_total", "counter", "Datagrams and TCP data that were not well-formed batches.");
+    buf.Printf("netavail_collector_bad_batches_total %llu\n", (unsigned long long)stats.nBadBatches);
+    AppendHelp(buf, "netavail_collector_lost_batches_total", "counter", "Batches missing from senders' numbering.");
+    buf.Printf("netavail_collector_lost_batches_total %llu\n", (unsigned long long)stats.nLostBatches);
+    AppendHelp(buf, "netavail_collector_connections_total", "counter", "TCP connections accepted.");
+    buf.Printf("netavail_collector_connections_total %llu\n", (unsigned long long)stats.nConnections);
+    AppendHelp(buf, "netavail_collector_outages_total", "counter", "Correlated outages detected.");
+    buf.Printf("netavail_collector_outages_total %llu\n", (unsigned long long)stats.nOutages);
+    AppendHelp(buf, "netavail_collector_pairs", "gauge", "Host and target pairs kept.");
+    buf.Printf("netavail_collector_pairs %d\n", stats.nPairs);
+    AppendHelp(buf, "netavail_collector_senders", "gauge", "Hosts sending results.");
+    buf.Printf("netavail_collector_senders %d\n", stats.nSenders);
+
+    std::vector<StructFleetTarget> vectTargets;
+    GetTargets(vectTargets);
+    AppendHelp(buf, "netavail_collector_target_hosts", "gauge", "Hosts reporting each target.");
+    for (size_t j = 0; j < vectTargets.size(); j++) {
+        buf.Append("netavail_collector_target_hosts{target=\"");
+        AppendLabelValue(buf, vectTargets[j].strTarget.c_str());
+        buf.Printf("\"} %d\n", vectTargets[j].nHosts);
+    }
+    AppendHelp(buf, "netavail_collector_target_hosts_down", "gauge", "Hosts with each target down.");
+    for (size_t j = 0; j < vectTargets.size(); j++) {
+        buf.Append("netavail_collector_target_hosts_down{target=\"");
+        AppendLabelValue(buf, vectTargets[j].strTarget.c_str());
+        buf.Printf("\"} %d\n", vectTargets[j].nDown);
+    }
+    AppendHelp(buf, "netavail_collector_target_outage", "gauge", "1 while a target is in a correlated outage.");
+    for (size_t j = 0; j < vectTargets.size(); j++) {
+        buf.Append("netavail_collector_target_outage{target=\"");
+        AppendLabelValue(buf, vectTargets[j].strTarget.c_str());
+        buf.Printf("\"} %d\n", vectTargets[j].bOutage ? 1 : 0);
+    }
+}
+
+void CCollector::ReceiveUdp(intptr_t sock)
+{
+#ifdef __linux__
+    // Take datagrams in runs, one system call for up to
+    // COLLECTOR_RECV_BATCH.  Each buffer has a byte to spare, so an
+    // oversized datagram shows up as malformed rather than cut to fit.
+    std::vector<char> vectBuf(COLLECTOR_RECV_BATCH * (STREAM_BATCH_MAX + 1));
+    mmsghdr aryMsgs[COLLECTOR_RECV_BATCH];
+    iovec aryIov[COLLECTOR_RECV_BATCH];
+    for (int j = 0; j < COLLECTOR_RECV_BATCH; j++) {
+        aryIov[j].iov_base = &vectBuf[j * (STREAM_BATCH_MAX + 1)];
+        aryIov[j].iov_len = STREAM_BATCH_MAX + 1;
+        memset(&aryMsgs[j], 0, sizeof(aryMsgs[j]));
+        aryMsgs[j].msg_hdr.msg_iov = &aryIov[j];
+        aryMsgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    while (!m_bStop) {
+        int nMsgs = recvmmsg((int)sock, aryMsgs, COLLECTOR_RECV_BATCH, MSG_WAITFORONE, NULL);
+        if (nMsgs <= 0) {
+            continue;
+        }
+        int64_t msNow = GetWallMicros() / 1000;
+        for (int j = 0; j < nMsgs; j++) {
+            Ingest((const char*)aryIov[j].iov_base, aryMsgs[j].msg_len, msNow);
+        }
+    }
+#else
+    char buf[STREAM_BATCH_MAX + 1];
+    while (!m_bStop) {
+        int cb = recvfrom(sock, buf, sizeof(buf), 0, NULL, NULL);
+        if (cb <= 0) {
+            continue;
+        }
+        Ingest(buf, cb, GetWallMicros() / 1000);
+    }
+#endif
+}
+
+void CCollector::ReceiveTcp()
+{
+    // Each connection keeps what it has read of a batch until the rest
+    // comes.
+    struct StructConn {
+        std::vector<char> vectBuf;
+        size_t cb;
+    };
+    std::unordered_map<intptr_t, StructConn> mapConns;
+    std::vector<intptr_t> vectReady;
+#ifdef __linux__
+    // With thousands of senders, epoll costs only the connections with
+    // something to read; poll would go through all of them every time.
+    int fdEpoll = epoll_create1(0);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)m_sockListen;
+    epoll_ctl(fdEpoll, EPOLL_CTL_ADD, (int)m_sockListen, &ev);
+    std::vector<epoll_event> vectEvents(256);
+#else
+    std::vector<pollfd> vectPoll;
+#endif
+    while (!m_bStop) {
+        vectReady.clear();
+#ifdef __linux__
+        int nEvents = epoll_wait(fdEpoll, &vectEvents[0], (int)vectEvents.size(), COLLECTOR_WAKE_MS);
+        for (int j = 0; j < nEvents; j++) {
+            vectReady.push_back((intptr_t)vectEvents[j].data.u64);
+        }
+#else
+        vectPoll.resize(mapConns.size() + 1);
+        vectPoll[0].fd = m_sockListen;
+        vectPoll[0].events = POLLIN;
+        vectPoll[0].revents = 0;
+        size_t iPoll = 1;
+        for (auto it = mapConns.begin(); it != mapConns.end(); ++it, iPoll++) {
+            vectPoll[iPoll].fd = it->first;
+            vectPoll[iPoll].events = POLLIN;
+            vectPoll[iPoll].revents = 0;
+        }
+        if (poll(&vectPoll[0], (int)vectPoll.size(), COLLECTOR_WAKE_MS) > 0) {
+            for (size_t j = 0; j < vectPoll.size(); j++) {
+                if (vectPoll[j].revents != 0) {
+                    vectReady.push_back((intptr_t)vectPoll[j].fd);
+                }
+            }
+        }
+#endif
+        int64_t msNow = GetWallMicros() / 1000;
+        for (size_t j = 0; j < vectReady.size(); j++) {
+            intptr_t sockReady = vectReady[j];
+            if (sockReady == m_sockListen) {
+                for (;;) {
+                    auto sock = accept(m_sockListen, NULL, NULL);
+                    if (sock == INVALID_SOCKET) {
+                        break;
+                    }
+                    if (mapConns.size() >= COLLECTOR_MAX_CONNS) {
+                        closesocket(sock);
+                        continue;
+                    }
+                    StructConn& conn = mapConns[(intptr_t)sock];
+                    conn.vectBuf.resize(2 * STREAM_BATCH_MAX);
+                    conn.cb = 0;
+#ifdef __linux__
+                    ev.events = EPOLLIN;
+                    ev.data.u64 = (uint64_t)sock;
+                    epoll_ctl(fdEpoll, EPOLL_CTL_ADD, (int)sock, &ev);
+#endif
+                    m_nConnections.fetch_add(1, std::memory_order_relaxed);
+                }
+                continue;
+            }
+
+            auto it = mapConns.find(sockReady);
+            if (it == mapConns.end()) {
+                continue;
+            }
+            StructConn& conn = it->second;
+            // Accepted sockets may inherit the listener's non-blocking
+            // mode, so a read with nothing to take isn't an error.
+            bool bKeep = true;
+            int cb = recv(sockReady, &conn.vectBuf[conn.cb], (int)(conn.vectBuf.size() - conn.cb), 0);
+            if (cb == 0 || (cb < 0 && !SocketWouldBlock())) {
+                bKeep = false;
+            } else if (cb > 0) {
+                conn.cb += cb;
+            }
+            // Take every whole batch; anything that isn't a batch means the
+            // stream can't be followed, so drop it.
+            size_t off = 0;
+            while (bKeep && conn.cb - off >= sizeof(StructStreamHdr)) {
+                size_t cbBatch = GetStreamBatchSize(&conn.vectBuf[off], conn.cb - off);
+                if (cbBatch == 0) {
+                    m_nBadBatches.fetch_add(1, std::memory_order_relaxed);
+                    bKeep = false;
+                } else if (cbBatch <= conn.cb - off) {
+                    Ingest(&conn.vectBuf[off], cbBatch, msNow);
+                    off += cbBatch;
+                } else {
+                    break;
+                }
+            }
+            if (!bKeep) {
+                // Closing takes it out of the epoll set too.
+                closesocket(sockReady);
+                mapConns.erase(it);
+            } else if (off > 0) {
+                memmove(&conn.vectBuf[0], &conn.vectBuf[off], conn.cb - off);
+                conn.cb -= off;
+            }
+        }
+    }
+    for (auto it = mapConns.begin(); it != mapConns.end(); ++it) {
+        closesocket(it->first);
+    }
+#ifdef __linux__
+    close(fdEpoll);
+#endif
+}
@@ -0,0 +1,175 @@
+// Collector.h : The receiving side of result streaming (see
+// ResultStream.h): takes in batches of results from many netavailw and
+// netavaild instances, keeps figures per (host, target) pair, and spots
+// outages that many hosts see at once.
+//
+// Batches come in over UDP on a pool of receive threads (on Linux each
+// has its own SO_REUSEPORT socket, so the kernel spreads senders over
+// them, and takes datagrams in runs with recvmmsg), and over TCP on one
+// thread that waits on every connection at once (with epoll on Linux).
+// Any number of threads may call Ingest at once: the pairs, targets and
+// senders are kept in nShards shards by the hash of their key, each shard
+// under its own lock, so threads seldom meet.
+//
+// A pair is down once nDownAfter results in a row have failed, and up
+// again at its next reply.  A target is in an outage while at least
+// nOutageHosts of the hosts reporting it, and at least pctOutageHosts
+// percent of them, have it down.  Outages are reported the moment a
+// result tips the balance, through the callback given to Start, so
+// detection takes a sender's flush time and a round trip, not a polling
+// interval.  A pair not heard from in secsStale seconds is dropped, and
+// stops counting toward its target; Expire does that, and should be
+// called about once a second.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "CritSec.h"
+#include "MetricsServer.h"
+#include "ResultStream.h"
+
+struct StructCollectorConfig {
+    int     port = STREAM_PORT_DEFAULT;     // UDP and TCP
+    std::string strBindAddress = "0.0.0.0";
+    bool    bTcp = true;                    // take TCP connections as well as UDP
+    int     nReceivers = 4;                 // UDP receive threads
+    int     nShards = 64;
+    int     secsStale = 60;
+    int     nDownAfter = 2;
+    int     nOutageHosts = 3;
+    int     pctOutageHosts = 50;
+};
+
+// An outage starting or ending.
+struct StructOutageEvent {
+    bool        bStart;
+    std::string strTarget;
+    int         nDown;          // hosts with the target down
+    int         nHosts;         // hosts reporting the target
+    int64_t     msFirstFailure; // sender's time of the first failure of the hosts down, ms since 1970 UTC
+    int64_t     msDetected;     // collector's time the outage started or ended
+};
+
+typedef void (*PFN_OUTAGE_EVENT)(const StructOutageEvent& event, void* pContext);
+
+// The state of one target across the fleet, for display.
+struct StructFleetTarget {
+    std::string strTarget;
+    int         nHosts;
+    int         nDown;
+    bool        bOutage;
+    uint64_t    nProbes;        // of the pairs of the target now kept
+    uint64_t    nLost;
+    int64_t     usSum;          // of the replies
+};
+
+struct StructCollectorStats {
+    uint64_t nBatches;          // batches taken in
+    uint64_t nResults;
+    uint64_t nBadBatches;       // malformed, or not batches at all
+    uint64_t nLostBatches;      // gaps in senders' batch numbers
+    uint64_t nConnections;      // TCP connections accepted
+    uint64_t nOutages;          // outages started
+    int      nPairs;
+    int      nTargets;
+    int      nSenders;
+    int      nOutagesNow;
+};
+
+class CCollector
+{
+public:
+    CCollector();
+    ~CCollector();
+
+    // Open the sockets and start the receive threads.  pfnOutage is
+    // called from them, and from Expire, with no lock held.
+    bool Start(const StructCollectorConfig& config, PFN_OUTAGE_EVENT pfnOutage, void* pContext,
+        std::string& strError);
+    void Stop();
+
+    // Take in one batch, received at msNow (ms since 1970 UTC).  Safe
+    // from any number of threads.
+    // Exit:   Returns false if the batch was malformed.
+    bool Ingest(const char* p, size_t cb, int64_t msNow);
+
+    // Drop the pairs and senders not heard from in secsStale.
+    void Expire(int64_t msNow);
+
+    StructCollectorStats GetStats() const;
+
+    // The targets, by the number of hosts with them down, most first.
+    void GetTargets(std::vector<StructFleetTarget>& vectTargets) const;
+
+    // Render the figures in Prometheus text format.
+    void RenderMetrics(CTextBuffer& buf) const;
+
+private:
+    struct StructPair {
+        uint64_t nProbes;
+        uint64_t nLost;
+        int64_t  usSum;
+        int64_t  msSeen;            // collector's time of the latest result
+        int64_t  msFailStart;       // sender's time of the first failure of the run
+        int      nFailures;         // in a row
+        bool     bDown;
+    };
+
+    struct StructTarget {
+        int      nHosts;
+        int      nDown;
+        bool     bOutage;
+        int64_t  msFirstFailure;    // of the hosts down since none was
+    };
+
+    struct StructSender {
+        uint32_t idSender;
+        uint32_t seqNext;
+        int64_t  msSeen;
+        std::string strLocalIP;
+    };
+
+    // A change to a target that a pair's result or expiry brings.
+    struct StructTargetDelta {
+        std::string strTarget;
+        int      dHosts;
+        int      dDown;
+        int64_t  msFailStart;
+    };
+
+    struct StructShard {
+        mutable CCritSec crit{"Collector.Shard"};
+        std::unordered_map<std::string, StructPair> mapPairs;      // "host\ttarget"
+        std::unordered_map<std::string, StructTarget> mapTargets;
+        std::unordered_map<std::string, StructSender> mapSenders;  // by host
+    };
+
+    StructShard& GetShard(const std::string& strKey) const;
+    void ApplyDeltas(const std::vector<StructTargetDelta>& vectDeltas, int64_t msNow);
+    void ReceiveUdp(intptr_t sock);
+    void ReceiveTcp();
+
+    StructCollectorConfig m_config;
+    PFN_OUTAGE_EVENT m_pfnOutage;
+    void*   m_pContext;
+    StructShard* m_aryShards;
+    std::vector<intptr_t> m_vectUdpSockets;
+    intptr_t m_sockListen;
+    std::vector<std::thread> m_vectThreads;
+    std::atomic<bool> m_bStop;
+
+    std::atomic<uint64_t> m_nBatches;
+    std::atomic<uint64_t> m_nResults;
+    std::atomic<uint64_t> m_nBadBatches;
+    std::atomic<uint64_t> m_nLostBatches;
+    std::atomic<uint64_t> m_nConnections;
+    std::atomic<uint64_t> m_nOutages;
+    std::atomic<int> m_nPairs;
+    std::atomic<int> m_nTargets;
+    std::atomic<int> m_nSenders;
+    std::atomic<int> m_nOutagesNow;
+};
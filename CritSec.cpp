@@ -1,17 +1,190 @@
+// CritSec.cpp : Portable lock, with optional instrumentation.  See CritSec.h.
+
 #include "CritSec.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+static std::atomic<bool> bLockStatsEnabled(false);
 
+// The figures of every lock name.  Entries are filled in once, under
+// the registry's own uninstrumented lock, and never move or go away.
+static StructLockStats AryLockStats[LOCK_STATS_MAX];
+static std::atomic<int> nLockStats(0);
 
-CCritSec::CCritSec()
+static int64_t LockNowMicros()
 {
-    InitializeCriticalSection(&m_crit);
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Exit:   Returns the histogram bucket for a time in us.
+static int GetLockBucket(int64_t us)
+{
+    int iBucket = 0;
+    while (iBucket < LOCK_HIST_BUCKETS - 1 && us >= ((int64_t)1 << iBucket)) {
+        iBucket++;
+    }
+    return iBucket;
+}
+
+// Exit:   Returns the figures for a lock name, adding them if the name
+//         is new, or NULL if there is no name or no room.
+static StructLockStats* FindLockStats(const char* pszName)
+{
+    if (pszName == NULL) {
+        return NULL;
+    }
+    static CCritSec critRegistry;
+    CCritSecInScope lock(critRegistry);
+    int nStats = nLockStats.load(std::memory_order_relaxed);
+    for (int j = 0; j < nStats; j++) {
+        if (strcmp(AryLockStats[j].pszName, pszName) == 0) {
+            return &AryLockStats[j];
+        }
+    }
+    if (nStats == LOCK_STATS_MAX) {
+        return NULL;
+    }
+    AryLockStats[nStats].pszName = pszName;
+    nLockStats.store(nStats + 1, std::memory_order_release);
+    return &AryLockStats[nStats];
+}
+
+CCritSec::CCritSec(const char* pszName)
+{
+#ifdef _WIN32
+    InitializeSRWLock(&m_lock);
+#endif
+    m_pStats = FindLockStats(pszName);
+    m_usAcquired = -1;
 }
 
 CCritSec::~CCritSec()
 {
-    DeleteCriticalSection(&m_crit);
 }
 
-CRITICAL_SECTION* CCritSec::GetCritSecPtr()
+#ifdef _WIN32
+bool CCritSec::TryLock()
+{
+    return TryAcquireSRWLockExclusive(&m_lock) != 0;
+}
+
+void CCritSec::Lock()
+{
+    AcquireSRWLockExclusive(&m_lock);
+}
+
+void CCritSec::Unlock()
 {
-    return &m_crit;
-};
+    ReleaseSRWLockExclusive(&m_lock);
+}
+#else
+bool CCritSec::TryLock()
+{
+    return m_mutex.try_lock();
+}
+
+void CCritSec::Lock()
+{
+    m_mutex.lock();
+}
+
+void CCritSec::Unlock()
+{
+    m_mutex.unlock();
+}
+#endif
+
+void CCritSec::Enter()
+{
+    if (m_pStats == NULL || !bLockStatsEnabled.load(std::memory_order_relaxed)) {
+        Lock();
+        m_usAcquired = -1;
+        return;
+    }
+    int64_t usWait = 0;
+    bool bContended = !TryLock();
+    if (bContended) {
+        int64_t usStart = LockNowMicros();
+        Lock();
+        usWait = LockNowMicros() - usStart;
+    }
+    m_usAcquired = LockNowMicros();
+
+    // We hold the lock, so only readers race with these updates.
+    m_pStats->nAcquired.fetch_add(1, std::memory_order_relaxed);
+    m_pStats->aryWait[GetLockBucket(usWait)].fetch_add(1, std::memory_order_relaxed);
+    if (bContended) {
+        m_pStats->nContended.fetch_add(1, std::memory_order_relaxed);
+        m_pStats->usWaitTotal.fetch_add(usWait, std::memory_order_relaxed);
+    }
+}
+
+void CCritSec::Leave()
+{
+    if (m_usAcquired >= 0) {
+        int64_t usHold = LockNowMicros() - m_usAcquired;
+        m_usAcquired = -1;
+        m_pStats->usHoldTotal.fetch_add(usHold, std::memory_order_relaxed);
+        m_pStats->aryHold[GetLockBucket(usHold)].fetch_add(1, std::memory_order_relaxed);
+    }
+    Unlock();
+}
+
+void CCritSec::EnableStats(bool bEnable)
+{
+    bLockStatsEnabled.store(bEnable, std::memory_order_relaxed);
+}
+
+bool CCritSec::IsStatsEnabled()
+{
+    return bLockStatsEnabled.load(std::memory_order_relaxed);
+}
+
+int CCritSec::GetStatsCount()
+{
+    return nLockStats.load(std::memory_order_acquire);
+}
+
+const StructLockStats& CCritSec::GetStats(int iStats)
+{
+    return AryLockStats[iStats];
+}
+
+// Format the upper bound of the highest non-empty bucket, in ms.
+static void FormatLockMax(const std::atomic<uint64_t>* aryBuckets, char* szBuf, size_t cbBuf)
+{
+    int iTop = LOCK_HIST_BUCKETS - 1;
+    while (iTop > 0 && aryBuckets[iTop].load(std::memory_order_relaxed) == 0) {
+        iTop--;
+    }
+    int64_t usLimit = CCritSec::GetBucketLimit(iTop);
+    if (usLimit < 0) {
+        snprintf(szBuf, cbBuf, ">=%.3f", (double)((int64_t)1 << (LOCK_HIST_BUCKETS - 2)) / 1000);
+    } else {
+        snprintf(szBuf, cbBuf, "<%.3f", (double)usLimit / 1000);
+    }
+}
+
+std::string CCritSec::FormatStats()
+{
+    std::string strOut;
+    int nStats = GetStatsCount();
+    for (int j = 0; j < nStats; j++) {
+        const StructLockStats& stats = AryLockStats[j];
+        uint64_t nAcquired = stats.nAcquired.load(std::memory_order_relaxed);
+        uint64_t nContended = stats.nContended.load(std::memory_order_relaxed);
+        double msWaitAvg = nAcquired > 0 ? stats.usWaitTotal.load(std::memory_order_relaxed) / 1000.0 / nAcquired : 0;
+        double msHoldAvg = nAcquired > 0 ? stats.usHoldTotal.load(std::memory_order_relaxed) / 1000.0 / nAcquired : 0;
+        char szWaitMax[32], szHoldMax[32];
+        FormatLockMax(stats.aryWait, szWaitMax, sizeof(szWaitMax));
+        FormatLockMax(stats.aryHold, szHoldMax, sizeof(szHoldMax));
+        char szLine[300];
+        snprintf(szLine, sizeof(szLine), "%s n=%llu contended=%llu wait_avg=%.3f wait_max%s hold_avg=%.3f hold_max%s\n",
+            stats.pszName, (unsigned long long)nAcquired, (unsigned long long)nContended, msWaitAvg, szWaitMax,
+            msHoldAvg, szHoldMax);
+        strOut += szLine;
+    }
+    return strOut;
+}
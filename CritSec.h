@@ -1,32 +1,97 @@
+// CritSec.h : Portable lock, with optional instrumentation.
+// CCritSec is an SRWLOCK on Windows and a std::mutex elsewhere, and
+// CCritSecInScope holds one for the life of a scope.
+//
+// Locks given a name can be instrumented: with CCritSec::EnableStats on
+// (the LockStats setting), each name counts acquisitions and contended
+// acquisitions, and keeps histograms of how long threads waited for the
+// lock and how long they held it.  Locks of the same name share figures.
+// CCritSec::FormatStats dumps them, and the metrics endpoint reports
+// them.  With instrumentation off, taking a lock costs one relaxed load
+// more than the bare lock.
 #pragma once
 
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#ifdef _WIN32
+#include <winsock2.h>     // before Windows.h, which would otherwise bring in winsock.h
 #include <Windows.h>
+#else
+#include <mutex>
+#endif
+
+#define LOCK_STATS_MAX      64      // distinct lock names
+#define LOCK_HIST_BUCKETS   24      // bucket k: under 2^k us; the last takes the rest
+
+// The figures for one lock name.  Times are in microseconds.
+struct StructLockStats {
+    const char* pszName;
+    std::atomic<uint64_t> nAcquired{0};
+    std::atomic<uint64_t> nContended{0};    // acquisitions that had to wait
+    std::atomic<uint64_t> usWaitTotal{0};
+    std::atomic<uint64_t> usHoldTotal{0};
+    std::atomic<uint64_t> aryWait[LOCK_HIST_BUCKETS] = {};
+    std::atomic<uint64_t> aryHold[LOCK_HIST_BUCKETS] = {};
+};
 
-// Class that represents a Windows critical section.
 class CCritSec
 {
-    CRITICAL_SECTION m_crit;
-
 public:
-    CCritSec();
+    // A lock with no name is never instrumented.  pszName must outlive
+    // the process; a string literal will do.
+    explicit CCritSec(const char* pszName = NULL);
     ~CCritSec();
 
-    CRITICAL_SECTION* GetCritSecPtr();
-};
+    void Enter();
+    void Leave();
+
+    // Turn instrumentation on or off for every named lock.  Acquisitions
+    // already under way finish as they started.
+    static void EnableStats(bool bEnable);
+    static bool IsStatsEnabled();
 
-// Class that automatically acquires a critical section at creation,
-// and releases it upon deletion.
+    // The figures of each lock name, in the order the names were first
+    // used.  Safe from any thread; the figures are read without locking.
+    static int GetStatsCount();
+    static const StructLockStats& GetStats(int iStats);
+
+    // Exit:   Returns one line per lock name, e.g. "ProblemStore.Add
+    //         n=5120 contended=3 wait_avg=0.004 wait_max<0.016 hold_avg=0.001
+    //         hold_max<0.004", times in ms, max as the histogram bucket.
+    static std::string FormatStats();
+
+    // Exit:   Returns the upper bound of a histogram bucket, in us, or
+    //         -1 for the last.
+    static int64_t GetBucketLimit(int iBucket) { return iBucket < LOCK_HIST_BUCKETS - 1 ? (int64_t)1 << iBucket : -1; }
+
+private:
+    CCritSec(const CCritSec&) = delete;
+    CCritSec& operator=(const CCritSec&) = delete;
+
+    bool TryLock();
+    void Lock();
+    void Unlock();
+
+#ifdef _WIN32
+    SRWLOCK     m_lock;
+#else
+    std::mutex  m_mutex;
+#endif
+    StructLockStats* m_pStats;      // NULL if the lock has no name
+    int64_t     m_usAcquired;       // when the holder took the lock, if instrumented; else -1
+};
 
+// Holds a lock from creation until deletion.
 class CCritSecInScope
 {
-    CRITICAL_SECTION* m_pCrit;
+    CCritSec& m_crit;
 public:
-    CCritSecInScope(CRITICAL_SECTION *pCrit) {
-        m_pCrit = pCrit;
-        EnterCriticalSection(m_pCrit);
+    CCritSecInScope(CCritSec& crit) : m_crit(crit) {
+        m_crit.Enter();
     }
 
     ~CCritSecInScope() {
-        LeaveCriticalSection(m_pCrit);
+        m_crit.Leave();
     }
 };
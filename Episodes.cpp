@@ -0,0 +1,156 @@
+// Episodes.cpp : Outage episodes and roll-ups.
+
+#include "Episodes.h"
+#include "ErrorCodes.h"
+#include <stdio.h>
+#include <string.h>
+
+// Format a time in microseconds as milliseconds with three decimals.
+static int FormatMs(int64_t us, char* szBuf, size_t cbBuf)
+{
+    return snprintf(szBuf, cbBuf, "%lld.%03lld", (long long)(us / 1000), (long long)(us % 1000));
+}
+
+CEpisodeTracker::CEpisodeTracker(int nDownAfter, int nUpAfter)
+    : m_nDownAfter(nDownAfter > 0 ? nDownAfter : 1), m_nUpAfter(nUpAfter > 0 ? nUpAfter : 1),
+      m_state(LINK_UP), m_nFailRun(0), m_nOkRun(0)
+{
+    memset(&m_episode, 0, sizeof(m_episode));
+    m_episode.usWorstRtt = -1;
+}
+
+bool CEpisodeTracker::Update(int64_t msNow, int64_t usRtt, bool bSlow, uint32_t errorCode)
+{
+    EnumLinkState stateOld = m_state;
+    bool bFailed = usRtt < 0;
+    if (bFailed) {
+        m_nFailRun++;
+        m_nOkRun = 0;
+    } else if (bSlow) {
+        m_nFailRun = 0;
+        m_nOkRun = 0;
+    } else {
+        m_nFailRun = 0;
+        m_nOkRun++;
+    }
+
+    if (m_state == LINK_UP) {
+        if (!bFailed && !bSlow) {
+            return false;
+        }
+        memset(&m_episode, 0, sizeof(m_episode));
+        m_episode.msStart = msNow;
+        m_episode.usWorstRtt = -1;
+        m_state = LINK_DEGRADED;
+    }
+
+    m_episode.nProbes++;
+    if (bFailed) {
+        m_episode.nLost++;
+        int j = 0;
+        while (j < m_episode.nCodes && m_episode.aryCodes[j] != errorCode) {
+            j++;
+        }
+        if (j == m_episode.nCodes && j < EPISODE_MAX_CODES) {
+            m_episode.aryCodes[m_episode.nCodes++] = errorCode;
+        }
+    } else {
+        if (bSlow) {
+            m_episode.nSlow++;
+        }
+        if (usRtt > m_episode.usWorstRtt) {
+            m_episode.usWorstRtt = usRtt;
+        }
+    }
+
+    if (m_nFailRun >= m_nDownAfter) {
+        m_state = LINK_DOWN;
+    } else if (m_nOkRun >= m_nUpAfter) {
+        m_state = LINK_UP;
+    } else if (!bFailed) {
+        // An answer means the target is reachable again, if not yet healthy.
+        m_state = LINK_DEGRADED;
+    }
+    if (m_nOkRun == 1) {
+        m_episode.msEnd = msNow;
+    }
+    if (m_state > m_episode.worst) {
+        m_episode.worst = m_state;
+    }
+    return m_state != stateOld;
+}
+
+const char* CEpisodeTracker::GetStateName(EnumLinkState state)
+{
+    switch (state) {
+    case LINK_UP:       return "up";
+    case LINK_DEGRADED: return "degraded";
+    case LINK_DOWN:     return "down";
+    }
+    return "?";
+}
+
+void CEpisodeTracker::FormatEpisode(const StructEpisode& episode, char* szBuf, size_t cbBuf)
+{
+    int64_t msDuration = episode.msEnd - episode.msStart;
+    int cb = snprintf(szBuf, cbBuf, "end worst=%s secs=%lld.%01lld n=%llu lost=%llu slow=%llu maxrtt=",
+        GetStateName(episode.worst), (long long)(msDuration / 1000), (long long)(msDuration % 1000 / 100),
+        (unsigned long long)episode.nProbes, (unsigned long long)episode.nLost,
+        (unsigned long long)episode.nSlow);
+    if (cb < 0 || (size_t)cb >= cbBuf) {
+        return;
+    }
+    if (episode.usWorstRtt >= 0) {
+        cb += FormatMs(episode.usWorstRtt, szBuf + cb, cbBuf - cb);
+    } else {
+        cb += snprintf(szBuf + cb, cbBuf - cb, "none");
+    }
+    // Codes are separated by ; since the log is CSV.
+    const char* pszSep = " codes=";
+    for (int j = 0; j < episode.nCodes && (size_t)cb < cbBuf; j++) {
+        char szCode[32];
+        FormatErrorCode(episode.aryCodes[j], szCode, sizeof(szCode));
+        cb += snprintf(szBuf + cb, cbBuf - cb, "%s%s", pszSep, szCode);
+        pszSep = ";";
+    }
+}
+
+void StructRollup::Clear(int64_t msNow)
+{
+    msStart = msNow;
+    nProbes = 0;
+    nLost = 0;
+    usMin = -1;
+    usMax = -1;
+    usSum = 0;
+}
+
+void StructRollup::Add(int64_t usRtt)
+{
+    nProbes++;
+    if (usRtt < 0) {
+        nLost++;
+        return;
+    }
+    if (usMin < 0 || usRtt < usMin) {
+        usMin = usRtt;
+    }
+    if (usRtt > usMax) {
+        usMax = usRtt;
+    }
+    usSum += usRtt;
+}
+
+void StructRollup::Format(int64_t msNow, char* szBuf, size_t cbBuf) const
+{
+    char szMin[32] = "none", szAvg[32] = "none", szMax[32] = "none";
+    uint64_t nAnswered = nProbes - nLost;
+    if (nAnswered > 0) {
+        FormatMs(usMin, szMin, sizeof(szMin));
+        FormatMs(usSum / (int64_t)nAnswered, szAvg, sizeof(szAvg));
+        FormatMs(usMax, szMax, sizeof(szMax));
+    }
+    snprintf(szBuf, cbBuf, "%llds n=%llu lost=%llu min=%s avg=%s max=%s",
+        (long long)((msNow - msStart + 500) / 1000), (unsigned long long)nProbes,
+        (unsigned long long)nLost, szMin, szAvg, szMax);
+}
@@ -0,0 +1,87 @@
+// Episodes.h : Outage episodes and roll-ups, for logging transitions and
+// summaries instead of every ping.
+//
+// CEpisodeTracker runs a small state machine over the outcome of each ping
+// of one target:
+//   up        healthy
+//   degraded  a ping failed or was slow, but not enough failed in a row to
+//             call the target down
+//   down      nDownAfter pings in a row failed
+// An episode starts when the target leaves up and ends when nUpAfter
+// healthy pings in a row bring it back.  While an episode lasts, the
+// tracker gathers its worst state, worst round trip, loss and the error
+// codes seen.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum EnumLinkState {
+    LINK_UP,
+    LINK_DEGRADED,
+    LINK_DOWN
+};
+
+// Distinct error codes remembered per episode; later ones are counted
+// but not listed.
+#define EPISODE_MAX_CODES   8
+
+struct StructEpisode {
+    int64_t  msStart;           // first bad ping
+    int64_t  msEnd;             // first ping of the healthy run that ended it
+    EnumLinkState worst;
+    uint64_t nProbes;
+    uint64_t nLost;
+    uint64_t nSlow;
+    int64_t  usWorstRtt;        // -1 if no ping was answered
+    int      nCodes;
+    uint32_t aryCodes[EPISODE_MAX_CODES];
+};
+
+class CEpisodeTracker
+{
+public:
+    CEpisodeTracker(int nDownAfter = 3, int nUpAfter = 3);
+
+    // Account for one ping; usRtt is -1 if it failed.  msNow is the time
+    // it finished, in ms on any clock.
+    // Exit:   Returns true if the state changed.
+    bool Update(int64_t msNow, int64_t usRtt, bool bSlow, uint32_t errorCode);
+
+    EnumLinkState GetState() const { return m_state; }
+    bool InEpisode() const { return m_state != LINK_UP; }
+
+    // The episode in progress, or the last one if the state is up.
+    const StructEpisode& GetEpisode() const { return m_episode; }
+
+    static const char* GetStateName(EnumLinkState state);
+
+    // Format an episode as logged in "episode" end records, e.g.
+    // "end worst=down secs=42.0 n=9 lost=7 slow=0 maxrtt=812.204 codes=IP_REQ_TIMED_OUT;IP_DEST_HOST_UNREACHABLE".
+    static void FormatEpisode(const StructEpisode& episode, char* szBuf, size_t cbBuf);
+
+private:
+    int     m_nDownAfter;
+    int     m_nUpAfter;
+    EnumLinkState m_state;
+    int     m_nFailRun;         // failures in a row
+    int     m_nOkRun;           // healthy pings in a row
+    StructEpisode m_episode;
+};
+
+// Round trip times and loss over one roll-up interval.
+struct StructRollup {
+    int64_t  msStart;
+    uint64_t nProbes;
+    uint64_t nLost;
+    int64_t  usMin;
+    int64_t  usMax;
+    int64_t  usSum;
+
+    void Clear(int64_t msNow);
+    void Add(int64_t usRtt);
+
+    // Format as logged in "rollup" records, e.g.
+    // "300s n=30 lost=0 min=9.812 avg=11.390 max=14.080".
+    void Format(int64_t msNow, char* szBuf, size_t cbBuf) const;
+};
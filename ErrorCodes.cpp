@@ -0,0 +1,130 @@
+// ErrorCodes.cpp : Descriptions of the IP_xxx status codes a probe can end with.
+
+#include "ErrorCodes.h"
+#include "CritSec.h"
+#include <stdio.h>
+#include <unordered_map>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+constexpr StructErrorCodes AryErrorCodes[] = {
+#include "IcmpErrors.inc"
+    {0, "IP_SUCCESS", "No error."}
+};
+
+// AryErrorCodes by code: 1 + the index of the entry for
+// ICMP_ERROR_BASE + j, or 0 if there is none.  Built by the compiler.
+struct StructErrorIndex {
+    uint8_t ary[ICMP_ERROR_SPAN];
+};
+
+constexpr bool ErrorCodesInRange()
+{
+    for (int j = 0; AryErrorCodes[j].ec_num > 0; j++) {
+        if (AryErrorCodes[j].ec_num < ICMP_ERROR_BASE || AryErrorCodes[j].ec_num >= ICMP_ERROR_BASE + ICMP_ERROR_SPAN) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(ErrorCodesInRange(), "icmp-errors.txt has a code outside ICMP_ERROR_BASE..+ICMP_ERROR_SPAN");
+static_assert(sizeof(AryErrorCodes) / sizeof(AryErrorCodes[0]) < 256, "too many codes for StructErrorIndex");
+
+constexpr StructErrorIndex MakeErrorIndex()
+{
+    StructErrorIndex index = {};
+    for (int j = 0; AryErrorCodes[j].ec_num > 0; j++) {
+        index.ary[AryErrorCodes[j].ec_num - ICMP_ERROR_BASE] = (uint8_t)(j + 1);
+    }
+    return index;
+}
+static constexpr StructErrorIndex ErrorIndex = MakeErrorIndex();
+
+const StructErrorCodes* FindErrorCode(uint32_t errorCode)
+{
+    uint32_t j = errorCode - ICMP_ERROR_BASE;
+    if (j >= ICMP_ERROR_SPAN || ErrorIndex.ary[j] == 0) {
+        return NULL;
+    }
+    return &AryErrorCodes[ErrorIndex.ary[j] - 1];
+}
+
+const char* ErrorCodeToIdent(uint32_t errorCode)
+{
+    const StructErrorCodes* pEntry = FindErrorCode(errorCode);
+    return pEntry ? pEntry->ec_ident : NULL;
+}
+
+void FormatErrorCode(uint32_t errorCode, char* szBuf, size_t cbBuf)
+{
+    const char* pszIdent = ErrorCodeToIdent(errorCode);
+    if (pszIdent) {
+        snprintf(szBuf, cbBuf, "%s", pszIdent);
+    } else {
+        snprintf(szBuf, cbBuf, "%u", errorCode);
+    }
+}
+
+std::string ErrorCodeToTextSpecial(uint32_t errorCode)
+{
+    const StructErrorCodes* pEntry = FindErrorCode(errorCode);
+    return pEntry ? pEntry->ec_text : "";
+}
+
+// Ask the OS to describe a code that isn't in the table.
+static std::string GetSystemErrorText(uint32_t errorCode)
+{
+    char szMsg[256];
+    szMsg[0] = '\0';
+#ifdef _WIN32
+    // It's not an ICMP error code, so use the general Windows function
+    // to translate the error code.
+    DWORD nChars = FormatMessage(
+        FORMAT_MESSAGE_FROM_SYSTEM |
+        FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL,
+        errorCode,
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+        szMsg,
+        sizeof(szMsg), NULL);
+    // Messages end with a line break.
+    while (nChars > 0 && (szMsg[nChars - 1] == '\n' || szMsg[nChars - 1] == '\r')) {
+        szMsg[--nChars] = '\0';
+    }
+#else
+    // The Linux engine only produces codes from the table.
+    int nChars = 0;
+#endif
+
+    if (0 == nChars) {
+        snprintf(szMsg, sizeof(szMsg), "Cannot convert error code %u (%x)", errorCode, errorCode);
+    }
+    return szMsg;
+}
+
+const char* ErrorCodeDescription(uint32_t errorCode)
+{
+    const StructErrorCodes* pEntry = FindErrorCode(errorCode);
+    if (pEntry) {
+        return pEntry->ec_text;
+    }
+
+    // Elements of an unordered_map don't move, so the text can be handed
+    // out after the lock is dropped.
+    static CCritSec critCache("ErrorCodes.Cache");
+    static std::unordered_map<uint32_t, std::string> mapCache;
+    CCritSecInScope lock(critCache);
+    std::unordered_map<uint32_t, std::string>::iterator iter = mapCache.find(errorCode);
+    if (iter == mapCache.end()) {
+        iter = mapCache.emplace(errorCode, GetSystemErrorText(errorCode)).first;
+    }
+    return iter->second.c_str();
+}
+
+std::string ErrorCodeToText(uint32_t errorCode)
+{
+    char szBuf[320];
+    snprintf(szBuf, sizeof(szBuf), "Error %u: %s", errorCode, ErrorCodeDescription(errorCode));
+    return szBuf;
+}
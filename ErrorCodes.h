@@ -0,0 +1,55 @@
+// ErrorCodes.h : Descriptions of the IP_xxx status codes a probe can end with.
+// The Linux probe engine maps ICMP errors and errno values onto the same
+// Windows codes, so the table and the log text are the same everywhere.
+//
+// The table is generated at build time from misc/icmp-errors.txt (see
+// misc/icmp-errors.cmake).  Log records carry the short IP_xxx name of a
+// code; the sentence describing it is only looked up for display.
+//
+// Besides the Windows IP_xxx codes, the table has DNS_xxx codes for DNS
+// probes (see SocketProbe.h), in the range Windows leaves unused between
+// IP_GENERAL_FAILURE and ICMP_ERROR_BASE + ICMP_ERROR_SPAN.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// IP_xxx codes lie in [ICMP_ERROR_BASE, ICMP_ERROR_BASE + ICMP_ERROR_SPAN),
+// which lets FindErrorCode index straight into the table.
+#define ICMP_ERROR_BASE     11000
+#define ICMP_ERROR_SPAN     64
+
+// Struct used to store the descriptions of certain error codes that
+// are not handled properly by FormatMessage.
+struct StructErrorCodes {
+    uint32_t ec_num;
+    const char* ec_ident;
+    const char* ec_text;
+};
+
+// Terminated by an entry with ec_num == 0.
+extern const StructErrorCodes AryErrorCodes[];
+
+// Exit:   Returns the table entry for an IP_xxx code, or NULL if it
+//         isn't one.
+const StructErrorCodes* FindErrorCode(uint32_t errorCode);
+
+// Exit:   Returns the name of an IP_xxx code, e.g. "IP_REQ_TIMED_OUT", or
+//         NULL if it isn't one.
+const char* ErrorCodeToIdent(uint32_t errorCode);
+
+// Format an error code as written in log records: its IP_xxx name if it
+// has one, else the number.
+void FormatErrorCode(uint32_t errorCode, char* szBuf, size_t cbBuf);
+
+// Map an ICMP error code to a textual description.
+// Exit:   Returns the description, or "" if the code wasn't recognized.
+std::string ErrorCodeToTextSpecial(uint32_t errorCode);
+
+// Exit:   Returns a description of any error code: from the table, or
+//         else from the OS, which is asked only once per code.  The
+//         string lives as long as the program.
+const char* ErrorCodeDescription(uint32_t errorCode);
+
+// Exit:   Returns "Error <code>: <description>", for display.
+std::string ErrorCodeToText(uint32_t errorCode);
@@ -0,0 +1,178 @@
+// LatencyGraph.cpp : The latency graph of netavailw's main window.  See
+// LatencyGraph.h.
+
+#include "LatencyGraph.h"
+#include "Prober.h"
+
+// Time shown by each range, in ms, indexed by EnumGraphRange.
+static const int64_t AryRangeMs[GRAPH_NUM_RANGES] = {
+    3600 * 1000LL,
+    86400 * 1000LL,
+    30 * 86400 * 1000LL
+};
+
+static const char* AryRangeNames[GRAPH_NUM_RANGES] = { "Last hour", "Last day", "Last 30 days" };
+
+CLatencyGraph::CLatencyGraph()
+{
+    m_hwnd = NULL;
+    m_hdcMem = NULL;
+    m_hbm = NULL;
+    m_hbmOld = NULL;
+    m_cx = 0;
+    m_cy = 0;
+    m_hbrBack = CreateSolidBrush(RGB(255, 255, 255));
+    m_hbrLoss = CreateSolidBrush(RGB(230, 40, 40));
+    m_penRange = CreatePen(PS_SOLID, 1, RGB(150, 190, 235));
+    m_penSlow = CreatePen(PS_DOT, 1, RGB(230, 150, 150));
+    m_crMean = RGB(20, 60, 160);
+    m_range = GRAPH_RANGE_HOUR;
+    m_iSeries = -1;
+    m_usScale = 1000000;
+    m_usSlow = 500000;
+    m_msPerColumn = 0;
+    m_msRight = -1;
+}
+
+CLatencyGraph::~CLatencyGraph()
+{
+    Detach();
+    DeleteObject(m_hbrBack);
+    DeleteObject(m_hbrLoss);
+    DeleteObject(m_penRange);
+    DeleteObject(m_penSlow);
+}
+
+void CLatencyGraph::Attach(HWND hwndCtrl)
+{
+    Detach();
+    m_hwnd = hwndCtrl;
+    RECT rc;
+    GetClientRect(hwndCtrl, &rc);
+    m_cx = rc.right - rc.left;
+    m_cy = rc.bottom - rc.top;
+    HDC hdc = GetDC(hwndCtrl);
+    m_hdcMem = CreateCompatibleDC(hdc);
+    m_hbm = CreateCompatibleBitmap(hdc, m_cx > 0 ? m_cx : 1, m_cy > 0 ? m_cy : 1);
+    ReleaseDC(hwndCtrl, hdc);
+    m_hbmOld = SelectObject(m_hdcMem, m_hbm);
+    RECT rcAll = { 0, 0, m_cx, m_cy };
+    FillRect(m_hdcMem, &rcAll, m_hbrBack);
+    m_msRight = -1;
+}
+
+void CLatencyGraph::Detach()
+{
+    if (m_hdcMem) {
+        SelectObject(m_hdcMem, m_hbmOld);
+        DeleteObject(m_hbm);
+        DeleteDC(m_hdcMem);
+    }
+    m_hdcMem = NULL;
+    m_hbm = NULL;
+    m_hwnd = NULL;
+}
+
+void CLatencyGraph::SetRange(EnumGraphRange range)
+{
+    if (range != m_range) {
+        m_range = range;
+        m_msRight = -1;
+    }
+}
+
+void CLatencyGraph::SetTarget(int iSeries, int msBadPing)
+{
+    int64_t usSlow = (int64_t)(msBadPing > 0 ? msBadPing : 1) * 1000;
+    if (iSeries != m_iSeries || usSlow != m_usSlow) {
+        m_iSeries = iSeries;
+        m_usSlow = usSlow;
+        m_usScale = 2 * usSlow;
+        m_msRight = -1;
+    }
+}
+
+const char* CLatencyGraph::GetRangeName(EnumGraphRange range)
+{
+    return AryRangeNames[range];
+}
+
+// Exit:   Returns the row of an RTT, clipped to the top of the graph.
+int CLatencyGraph::GetY(int64_t us) const
+{
+    if (us > m_usScale) {
+        us = m_usScale;
+    }
+    return m_cy - 1 - (int)(us * (m_cy - 1) / m_usScale);
+}
+
+// Render nColumns columns from x = xFirst, the first starting at msFirst.
+void CLatencyGraph::RenderColumns(int xFirst, int64_t msFirst, int nColumns)
+{
+    RttSeries.GetColumns(m_iSeries, msFirst, m_msPerColumn, nColumns, m_vectColumns);
+    RECT rc = { xFirst, 0, xFirst + nColumns, m_cy };
+    FillRect(m_hdcMem, &rc, m_hbrBack);
+    HGDIOBJ penOld = SelectObject(m_hdcMem, m_penSlow);
+    int ySlow = GetY(m_usSlow);
+    MoveToEx(m_hdcMem, xFirst, ySlow, NULL);
+    LineTo(m_hdcMem, xFirst + nColumns, ySlow);
+
+    SelectObject(m_hdcMem, m_penRange);
+    for (int j = 0; j < nColumns; j++) {
+        const StructRttBucket& column = m_vectColumns[j];
+        if (column.nProbes == 0) {
+            continue;
+        }
+        int x = xFirst + j;
+        if (column.nLost > 0) {
+            RECT rcLoss = { x, 0, x + 1, (int)((int64_t)m_cy * column.nLost / column.nProbes) };
+            if (rcLoss.bottom < 2) {
+                rcLoss.bottom = 2;
+            }
+            FillRect(m_hdcMem, &rcLoss, m_hbrLoss);
+        }
+        int64_t usMean = column.GetMean();
+        if (usMean >= 0) {
+            MoveToEx(m_hdcMem, x, GetY(column.usMax), NULL);
+            LineTo(m_hdcMem, x, GetY(column.usMin) + 1);
+            SetPixel(m_hdcMem, x, GetY(usMean), m_crMean);
+        }
+    }
+    SelectObject(m_hdcMem, penOld);
+}
+
+void CLatencyGraph::Update(int64_t msNow)
+{
+    if (m_hdcMem == NULL || m_cx <= 0 || m_cy <= 0) {
+        return;
+    }
+    // Rounded down, so the graph never reaches back past what the tier
+    // chosen for the range keeps.
+    int64_t msPerColumn = AryRangeMs[m_range] / m_cx;
+    if (msPerColumn != m_msPerColumn) {
+        m_msPerColumn = msPerColumn;
+        m_msRight = -1;
+    }
+    int64_t msRight = msNow / m_msPerColumn * m_msPerColumn;
+    int64_t nShift = m_msRight < 0 ? m_cx : (msRight - m_msRight) / m_msPerColumn;
+    if (nShift < 0 || nShift >= m_cx) {
+        RenderColumns(0, msRight - (m_cx - 1) * m_msPerColumn, m_cx);
+    } else {
+        // Move what's drawn left, and render the columns that came into
+        // view, with the one that was rightmost, which is now complete.
+        if (nShift > 0) {
+            BitBlt(m_hdcMem, 0, 0, m_cx - (int)nShift, m_cy, m_hdcMem, (int)nShift, 0, SRCCOPY);
+        }
+        int nRender = (int)nShift + 1;
+        RenderColumns(m_cx - nRender, msRight - (nRender - 1) * m_msPerColumn, nRender);
+    }
+    m_msRight = msRight;
+    InvalidateRect(m_hwnd, NULL, FALSE);
+}
+
+void CLatencyGraph::Paint(HDC hdc, const RECT& rc)
+{
+    if (m_hdcMem) {
+        BitBlt(hdc, rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top, m_hdcMem, 0, 0, SRCCOPY);
+    }
+}
@@ -0,0 +1,71 @@
+// LatencyGraph.h : The latency graph of netavailw's main window.
+// Each pixel column is a period of time, newest on the right: a light
+// bar from the least to the greatest RTT of the period, a dark dot at the
+// mean, and a red band from the top for the share of pings lost.  The
+// scale runs to twice the too-slow time, which is marked.  Columns come
+// from RttSeries (see RttSeries.h).
+//
+// The graph is kept in an offscreen bitmap.  As time moves on, Update
+// scrolls the bitmap left by the columns that have passed, and renders
+// only those and the current one, still filling in; the whole graph is
+// only rendered again when the range, target or scale changes.
+#pragma once
+
+#include "framework.h"
+#include <stdint.h>
+#include <vector>
+#include "RttSeries.h"
+
+enum EnumGraphRange {
+    GRAPH_RANGE_HOUR,
+    GRAPH_RANGE_DAY,
+    GRAPH_RANGE_MONTH,
+    GRAPH_NUM_RANGES
+};
+
+class CLatencyGraph
+{
+public:
+    CLatencyGraph();
+    ~CLatencyGraph();
+
+    // Draw in an owner-drawn static control, sized as it is now.
+    void Attach(HWND hwndCtrl);
+    void Detach();
+
+    void SetRange(EnumGraphRange range);
+    void SetTarget(int iSeries, int msBadPing);
+
+    // Bring the graph up to msNow (ms since 1970 UTC), and invalidate
+    // the control if anything changed.  Call on the UI thread.
+    void Update(int64_t msNow);
+
+    // Copy the graph to the control; for WM_DRAWITEM.
+    void Paint(HDC hdc, const RECT& rc);
+
+    static const char* GetRangeName(EnumGraphRange range);
+
+private:
+    void RenderColumns(int xFirst, int64_t msFirst, int nColumns);
+    int GetY(int64_t us) const;
+
+    HWND    m_hwnd;
+    HDC     m_hdcMem;
+    HBITMAP m_hbm;
+    HGDIOBJ m_hbmOld;
+    int     m_cx;
+    int     m_cy;
+    HBRUSH  m_hbrBack;
+    HBRUSH  m_hbrLoss;
+    HPEN    m_penRange;
+    HPEN    m_penSlow;
+    COLORREF m_crMean;
+
+    EnumGraphRange m_range;
+    int     m_iSeries;
+    int64_t m_usScale;          // RTT at the top of the graph
+    int64_t m_usSlow;
+    int64_t m_msPerColumn;
+    int64_t m_msRight;          // start of the rightmost column as last rendered, or -1 to render all
+    std::vector<StructRttBucket> m_vectColumns;
+};
@@ -0,0 +1,357 @@
+// LatencyStats.cpp : Streaming latency statistics per target.
+
+#include "LatencyStats.h"
+#include <string.h>
+
+// Window lengths, in ms, indexed by EnumStatsWindow.
+static const int64_t AryWindowMs[STATS_NUM_WINDOWS] = {
+    60 * 1000LL,
+    3600 * 1000LL,
+    86400 * 1000LL
+};
+
+static const char* AryWindowNames[STATS_NUM_WINDOWS] = { "1m", "1h", "1d" };
+
+const int64_t AryStatsTotalBoundsUs[STATS_TOTAL_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000, 2500000, 5000000
+};
+
+// Increment a counter that only one thread writes.
+static inline void Bump(std::atomic<uint64_t>& n, uint64_t nAdd = 1)
+{
+    n.store(n.load(std::memory_order_relaxed) + nAdd, std::memory_order_relaxed);
+}
+
+// Position of the highest set bit of v, which must be nonzero.
+static int HighBit(uint64_t v)
+{
+    int n = 0;
+    while (v >>= 1) {
+        n++;
+    }
+    return n;
+}
+
+// Values below STATS_SUB_BUCKETS have a bucket each.  Above that, each
+// power of 2 [2^k, 2^(k+1)) is split into STATS_SUB_BUCKETS equal buckets.
+int StatsBucketOf(int64_t usRtt)
+{
+    if (usRtt < STATS_SUB_BUCKETS) {
+        return usRtt < 0 ? 0 : (int)usRtt;
+    }
+    int k = HighBit((uint64_t)usRtt);       // >= 4
+    int iBucket = STATS_SUB_BUCKETS * (k - 3) + (int)(usRtt >> (k - 4)) - STATS_SUB_BUCKETS;
+    return iBucket < STATS_NUM_BUCKETS ? iBucket : STATS_NUM_BUCKETS - 1;
+}
+
+int64_t StatsBucketValue(int iBucket)
+{
+    if (iBucket < STATS_SUB_BUCKETS) {
+        return iBucket;
+    }
+    int k = iBucket / STATS_SUB_BUCKETS + 3;
+    int64_t width = 1LL << (k - 4);
+    int64_t low = (int64_t)(STATS_SUB_BUCKETS + iBucket % STATS_SUB_BUCKETS) << (k - 4);
+    return low + width / 2;
+}
+
+void StructLatencyHistogram::Clear()
+{
+    memset(counts, 0, sizeof(counts));
+    nReplies = 0;
+    nLost = 0;
+    usSum = 0;
+    usMin = INT64_MAX;
+    usMax = 0;
+}
+
+void StructLatencyHistogram::Add(int64_t usRtt)
+{
+    if (usRtt < 0) {
+        nLost++;
+        return;
+    }
+    counts[StatsBucketOf(usRtt)]++;
+    nReplies++;
+    usSum += usRtt;
+    if (usRtt < usMin) {
+        usMin = usRtt;
+    }
+    if (usRtt > usMax) {
+        usMax = usRtt;
+    }
+}
+
+void StructLatencyHistogram::Merge(const StructLatencyHistogram& other)
+{
+    for (int j = 0; j < STATS_NUM_BUCKETS; j++) {
+        counts[j] += other.counts[j];
+    }
+    nReplies += other.nReplies;
+    nLost += other.nLost;
+    usSum += other.usSum;
+    if (other.usMin < usMin) {
+        usMin = other.usMin;
+    }
+    if (other.usMax > usMax) {
+        usMax = other.usMax;
+    }
+}
+
+int64_t StructLatencyHistogram::Quantile(double q) const
+{
+    if (nReplies == 0) {
+        return 0;
+    }
+    // Rank of the wanted value, 1-based.
+    uint64_t nRank = (uint64_t)(q * nReplies + 0.5);
+    if (nRank < 1) {
+        nRank = 1;
+    }
+    uint64_t nSeen = 0;
+    for (int j = 0; j < STATS_NUM_BUCKETS; j++) {
+        nSeen += counts[j];
+        if (nSeen >= nRank) {
+            // The bucket midpoint, but never outside what was observed.
+            int64_t us = StatsBucketValue(j);
+            return us < usMin ? usMin : us > usMax ? usMax : us;
+        }
+    }
+    return usMax;
+}
+
+void StructLatencyHistogram::Summarize(StructLatencySummary& summary) const
+{
+    summary.nProbes = nReplies + nLost;
+    summary.nLost = nLost;
+    summary.usMin = nReplies ? usMin : 0;
+    summary.usMean = nReplies ? (int64_t)(usSum / nReplies) : 0;
+    summary.usP50 = Quantile(0.50);
+    summary.usP90 = Quantile(0.90);
+    summary.usP95 = Quantile(0.95);
+    summary.usP99 = Quantile(0.99);
+    summary.usMax = usMax;
+}
+
+CLatencyStats::CLatencyStats()
+    : m_critAdd("LatencyStats.GetTarget")
+{
+}
+
+CLatencyStats::~CLatencyStats()
+{
+    int nTargets = m_tableTargets.GetCount();
+    for (int j = 0; j < nTargets; j++) {
+        delete m_tableTargets.Get(j);
+    }
+}
+
+int CLatencyStats::GetTarget(const std::string& strName)
+{
+    CCritSecInScope lock(m_critAdd);
+    std::unordered_map<std::string, int>::const_iterator it = m_mapTargets.find(strName);
+    if (it != m_mapTargets.end()) {
+        return it->second;
+    }
+    StructTargetStats* pTarget = new StructTargetStats;
+    pTarget->strName = strName;
+    pTarget->nTotalProbes.store(0, std::memory_order_relaxed);
+    pTarget->nTotalLost.store(0, std::memory_order_relaxed);
+    pTarget->usTotalSum.store(0, std::memory_order_relaxed);
+    for (int j = 0; j < STATS_TOTAL_BUCKETS; j++) {
+        pTarget->aryTotalBuckets[j].store(0, std::memory_order_relaxed);
+    }
+    for (int j = 0; j < STATS_ERROR_CODES; j++) {
+        pTarget->aryLostByCode[j].store(0, std::memory_order_relaxed);
+    }
+    pTarget->usLagSum.store(0, std::memory_order_relaxed);
+    pTarget->usLagMax.store(0, std::memory_order_relaxed);
+    pTarget->usLagLast.store(0, std::memory_order_relaxed);
+    pTarget->bInBurst.store(false, std::memory_order_relaxed);
+    for (int w = 0; w < STATS_NUM_WINDOWS; w++) {
+        for (int j = 0; j < STATS_SLICES; j++) {
+            ResetSlice(pTarget->slices[w][j], -1);
+        }
+    }
+    int iTarget = m_tableTargets.Add(pTarget);
+    if (iTarget < 0) {
+        delete pTarget;
+        return -1;
+    }
+    m_mapTargets[strName] = iTarget;
+    return iTarget;
+}
+
+void CLatencyStats::ResetSlice(StructSlice& slice, int64_t msStart)
+{
+    // Mark the slice as belonging to no period while it's cleared, so a
+    // reader skips it rather than merging half-cleared counts.
+    slice.msStart.store(-1, std::memory_order_release);
+    for (int j = 0; j < STATS_NUM_BUCKETS; j++) {
+        slice.counts[j].store(0, std::memory_order_relaxed);
+    }
+    slice.nLost.store(0, std::memory_order_relaxed);
+    slice.usSum.store(0, std::memory_order_relaxed);
+    slice.usMin.store(INT64_MAX, std::memory_order_relaxed);
+    slice.usMax.store(0, std::memory_order_relaxed);
+    slice.msStart.store(msStart, std::memory_order_release);
+}
+
+void CLatencyStats::Record(int iTarget, int64_t usRtt, int64_t msNow, uint32_t errorCode)
+{
+    if (iTarget < 0 || iTarget >= m_tableTargets.GetCount()) {
+        return;
+    }
+    StructTargetStats& target = *m_tableTargets.Get(iTarget);
+    int iBucket = usRtt >= 0 ? StatsBucketOf(usRtt) : -1;
+
+    Bump(target.nTotalProbes);
+    if (usRtt < 0) {
+        Bump(target.nTotalLost);
+        uint32_t iCode = errorCode - STATS_ERROR_CODE_BASE;
+        Bump(target.aryLostByCode[iCode < STATS_ERROR_CODES ? iCode : 0]);
+    } else {
+        int iTotal = 0;
+        while (iTotal < STATS_TOTAL_BUCKETS - 1 && usRtt > AryStatsTotalBoundsUs[iTotal]) {
+            iTotal++;
+        }
+        Bump(target.aryTotalBuckets[iTotal]);
+        Bump(target.usTotalSum, (uint64_t)usRtt);
+    }
+
+    for (int w = 0; w < STATS_NUM_WINDOWS; w++) {
+        int64_t msSlice = AryWindowMs[w] / STATS_SLICES;
+        int64_t period = msNow / msSlice;
+        StructSlice& slice = target.slices[w][period % STATS_SLICES];
+        int64_t msStart = period * msSlice;
+        if (slice.msStart.load(std::memory_order_relaxed) != msStart) {
+            ResetSlice(slice, msStart);
+        }
+        // Only this thread writes the slice, so plain load/store suffices
+        // for everything but keeps readers free of torn values.
+        if (iBucket < 0) {
+            slice.nLost.store(slice.nLost.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            continue;
+        }
+        std::atomic<uint32_t>& count = slice.counts[iBucket];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        slice.usSum.store(slice.usSum.load(std::memory_order_relaxed) + usRtt, std::memory_order_relaxed);
+        if (usRtt < slice.usMin.load(std::memory_order_relaxed)) {
+            slice.usMin.store(usRtt, std::memory_order_relaxed);
+        }
+        if (usRtt > slice.usMax.load(std::memory_order_relaxed)) {
+            slice.usMax.store(usRtt, std::memory_order_relaxed);
+        }
+    }
+}
+
+void CLatencyStats::RecordLag(int iTarget, int64_t usLag)
+{
+    if (iTarget < 0 || iTarget >= m_tableTargets.GetCount()) {
+        return;
+    }
+    StructTargetStats& target = *m_tableTargets.Get(iTarget);
+    if (usLag > 0) {
+        Bump(target.usLagSum, (uint64_t)usLag);
+    }
+    if (usLag > target.usLagMax.load(std::memory_order_relaxed)) {
+        target.usLagMax.store(usLag, std::memory_order_relaxed);
+    }
+    target.usLagLast.store(usLag, std::memory_order_relaxed);
+}
+
+void CLatencyStats::SetBurst(int iTarget, bool bInBurst)
+{
+    if (iTarget < 0 || iTarget >= m_tableTargets.GetCount()) {
+        return;
+    }
+    m_tableTargets.Get(iTarget)->bInBurst.store(bInBurst, std::memory_order_relaxed);
+}
+
+void CLatencyStats::MergeTarget(const StructTargetStats& target, EnumStatsWindow window, int64_t msNow,
+    StructLatencyHistogram& hist) const
+{
+    int64_t msSlice = AryWindowMs[window] / STATS_SLICES;
+    int64_t msOldest = (msNow / msSlice - (STATS_SLICES - 1)) * msSlice;
+    for (int j = 0; j < STATS_SLICES; j++) {
+        const StructSlice& slice = target.slices[window][j];
+        int64_t msStart = slice.msStart.load(std::memory_order_acquire);
+        if (msStart < msOldest || msStart > msNow) {
+            continue;
+        }
+        uint64_t nReplies = 0;
+        for (int b = 0; b < STATS_NUM_BUCKETS; b++) {
+            uint32_t n = slice.counts[b].load(std::memory_order_relaxed);
+            hist.counts[b] += n;
+            nReplies += n;
+        }
+        hist.nReplies += nReplies;
+        hist.nLost += slice.nLost.load(std::memory_order_relaxed);
+        hist.usSum += slice.usSum.load(std::memory_order_relaxed);
+        int64_t usMin = slice.usMin.load(std::memory_order_relaxed);
+        int64_t usMax = slice.usMax.load(std::memory_order_relaxed);
+        if (nReplies && usMin < hist.usMin) {
+            hist.usMin = usMin;
+        }
+        if (usMax > hist.usMax) {
+            hist.usMax = usMax;
+        }
+    }
+}
+
+void CLatencyStats::GetHistogram(int iTarget, EnumStatsWindow window, int64_t msNow, StructLatencyHistogram& hist) const
+{
+    hist.Clear();
+    int nTargets = m_tableTargets.GetCount();
+    if (iTarget >= 0) {
+        if (iTarget < nTargets) {
+            MergeTarget(*m_tableTargets.Get(iTarget), window, msNow, hist);
+        }
+        return;
+    }
+    for (int j = 0; j < nTargets; j++) {
+        MergeTarget(*m_tableTargets.Get(j), window, msNow, hist);
+    }
+}
+
+void CLatencyStats::GetSummary(int iTarget, EnumStatsWindow window, int64_t msNow, StructLatencySummary& summary) const
+{
+    // The merge buffer is about 3 KB; keep one per reading thread rather
+    // than putting it on the stack.
+    static thread_local StructLatencyHistogram hist;
+    GetHistogram(iTarget, window, msNow, hist);
+    hist.Summarize(summary);
+}
+
+void CLatencyStats::GetTotals(int iTarget, StructLatencyTotals& totals) const
+{
+    memset(&totals, 0, sizeof(totals));
+    if (iTarget < 0 || iTarget >= m_tableTargets.GetCount()) {
+        return;
+    }
+    const StructTargetStats& target = *m_tableTargets.Get(iTarget);
+    totals.nProbes = target.nTotalProbes.load(std::memory_order_relaxed);
+    totals.nLost = target.nTotalLost.load(std::memory_order_relaxed);
+    totals.usSum = target.usTotalSum.load(std::memory_order_relaxed);
+    for (int j = 0; j < STATS_TOTAL_BUCKETS; j++) {
+        totals.aryBuckets[j] = target.aryTotalBuckets[j].load(std::memory_order_relaxed);
+    }
+    for (int j = 0; j < STATS_ERROR_CODES; j++) {
+        totals.aryLostByCode[j] = target.aryLostByCode[j].load(std::memory_order_relaxed);
+    }
+    totals.usLagSum = target.usLagSum.load(std::memory_order_relaxed);
+    totals.usLagMax = target.usLagMax.load(std::memory_order_relaxed);
+    totals.usLagLast = target.usLagLast.load(std::memory_order_relaxed);
+    totals.bInBurst = target.bInBurst.load(std::memory_order_relaxed);
+}
+
+const char* CLatencyStats::GetWindowName(EnumStatsWindow window)
+{
+    return AryWindowNames[window];
+}
+
+int64_t CLatencyStats::GetWindowMs(EnumStatsWindow window)
+{
+    return AryWindowMs[window];
+}
@@ -0,0 +1,168 @@
+// LatencyStats.h : Streaming latency statistics per target.
+// Every probe result is recorded into fixed-memory, mergeable log-linear
+// histograms (in the style of HDR Histogram, with 16 sub-buckets per
+// power of 2, so quantiles are within about 3%) kept for three rolling
+// windows: 1 minute, 1 hour and 1 day.  Each window is a ring of
+// STATS_SLICES time slices; a window's figures are the merge of its
+// slices that are still current, so the window rolls forward a quarter
+// at a time and covers between 3/4 and all of its nominal length.
+// Memory is about 20 KB per target.
+//
+// Lifetime totals are also kept per target: probe and loss counts,
+// losses by IP_xxx error code, and a coarse RTT histogram, for exporters
+// that want counters rather than windows.  So is how the target keeps to
+// its schedule: how late its pings start, and whether it is in burst
+// mode.
+//
+// Recording is O(1) and allocation-free, so it runs on the probe thread.
+// Each target must be recorded by one thread at a time.
+// Readers (the dialog, log summaries, exports) take summaries from any
+// thread without locking; a summary taken while a slice is being recycled
+// may be off by the probes in that slice.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "CritSec.h"
+#include "TargetTable.h"
+
+enum EnumStatsWindow {
+    STATS_WINDOW_1MIN,
+    STATS_WINDOW_1HOUR,
+    STATS_WINDOW_1DAY,
+    STATS_NUM_WINDOWS
+};
+
+#define STATS_SLICES            4
+#define STATS_SUB_BUCKETS       16      // linear buckets per power of 2
+#define STATS_MAX_EXPONENT      24      // covers up to 2^28 us, about 4.5 minutes
+#define STATS_NUM_BUCKETS       (STATS_SUB_BUCKETS * (STATS_MAX_EXPONENT + 1))
+
+// Lifetime totals: the coarse histogram has a bucket per bound in
+// AryStatsTotalBoundsUs plus one for anything slower.  Losses are counted
+// by error code - STATS_ERROR_CODE_BASE; other codes are counted in [0].
+#define STATS_TOTAL_BUCKETS     16
+#define STATS_ERROR_CODE_BASE   11000
+#define STATS_ERROR_CODES       64
+
+extern const int64_t AryStatsTotalBoundsUs[STATS_TOTAL_BUCKETS - 1];
+
+struct StructLatencyTotals {
+    uint64_t nProbes;
+    uint64_t nLost;
+    uint64_t usSum;                             // of replies
+    uint64_t aryBuckets[STATS_TOTAL_BUCKETS];   // replies per bucket, not cumulative
+    uint64_t aryLostByCode[STATS_ERROR_CODES];
+    uint64_t usLagSum;      // time by which pings started after their deadlines
+    int64_t  usLagMax;
+    int64_t  usLagLast;
+    bool     bInBurst;      // pinging at the burst interval
+};
+
+// Figures for one target and window.  Times are in microseconds.
+struct StructLatencySummary {
+    uint64_t nProbes;       // replies plus losses
+    uint64_t nLost;
+    int64_t  usMin;
+    int64_t  usMean;
+    int64_t  usP50;
+    int64_t  usP90;
+    int64_t  usP95;
+    int64_t  usP99;
+    int64_t  usMax;
+};
+
+// A histogram that can be summed across slices, windows or targets.
+// Plain (non-atomic) counts; used for merging and by readers.
+struct StructLatencyHistogram {
+    uint64_t counts[STATS_NUM_BUCKETS];
+    uint64_t nReplies;
+    uint64_t nLost;
+    uint64_t usSum;
+    int64_t  usMin;
+    int64_t  usMax;
+
+    void Clear();
+    void Add(int64_t usRtt);
+    void Merge(const StructLatencyHistogram& other);
+
+    // Exit:   Returns the value at quantile q (0..1), or 0 if empty.
+    int64_t Quantile(double q) const;
+    void Summarize(StructLatencySummary& summary) const;
+};
+
+// Map a round trip time to its bucket, and a bucket to a representative
+// value (its midpoint).
+int StatsBucketOf(int64_t usRtt);
+int64_t StatsBucketValue(int iBucket);
+
+class CLatencyStats
+{
+public:
+    // The table of targets grows without moving (see TargetTable.h), so
+    // adding a target never moves data a reader may be looking at.
+    CLatencyStats();
+    ~CLatencyStats();
+
+    // Find a target by name, adding it if it's new.  Allocates; call it
+    // when targets are configured, not per probe.
+    // Exit:   Returns the target index, or -1 if the table is full, at
+    //         about a million targets.
+    int GetTarget(const std::string& strName);
+    int GetTargetCount() const { return m_tableTargets.GetCount(); }
+    const std::string& GetTargetName(int iTarget) const { return m_tableTargets.Get(iTarget)->strName; }
+
+    // Record a probe result.  usRtt < 0 means the probe was lost, and
+    // errorCode says why.  msNow is any monotonic millisecond clock, used
+    // consistently.
+    void Record(int iTarget, int64_t usRtt, int64_t msNow, uint32_t errorCode = 0);
+
+    // Record how late a ping to the target started after its deadline,
+    // and whether the target went into or out of burst mode.  By the
+    // thread that records the target.
+    void RecordLag(int iTarget, int64_t usLag);
+    void SetBurst(int iTarget, bool bInBurst);
+
+    // Merge the current slices of a target's window into hist.  Pass
+    // iTarget = -1 to merge all targets.
+    void GetHistogram(int iTarget, EnumStatsWindow window, int64_t msNow, StructLatencyHistogram& hist) const;
+    void GetSummary(int iTarget, EnumStatsWindow window, int64_t msNow, StructLatencySummary& summary) const;
+    void GetTotals(int iTarget, StructLatencyTotals& totals) const;
+
+    static const char* GetWindowName(EnumStatsWindow window);
+    static int64_t GetWindowMs(EnumStatsWindow window);
+
+private:
+    struct StructSlice {
+        std::atomic<int64_t>  msStart;      // start of the period the slice holds
+        std::atomic<uint32_t> counts[STATS_NUM_BUCKETS];
+        std::atomic<uint64_t> nLost;
+        std::atomic<uint64_t> usSum;
+        std::atomic<int64_t>  usMin;
+        std::atomic<int64_t>  usMax;
+    };
+
+    struct StructTargetStats {
+        std::string strName;
+        StructSlice slices[STATS_NUM_WINDOWS][STATS_SLICES];
+        std::atomic<uint64_t> nTotalProbes;
+        std::atomic<uint64_t> nTotalLost;
+        std::atomic<uint64_t> usTotalSum;
+        std::atomic<uint64_t> aryTotalBuckets[STATS_TOTAL_BUCKETS];
+        std::atomic<uint64_t> aryLostByCode[STATS_ERROR_CODES];
+        std::atomic<uint64_t> usLagSum;
+        std::atomic<int64_t>  usLagMax;
+        std::atomic<int64_t>  usLagLast;
+        std::atomic<bool>     bInBurst;
+    };
+
+    static void ResetSlice(StructSlice& slice, int64_t msStart);
+    void MergeTarget(const StructTargetStats& target, EnumStatsWindow window, int64_t msNow,
+        StructLatencyHistogram& hist) const;
+
+    CTargetTable<StructTargetStats> m_tableTargets;
+    std::unordered_map<std::string, int> m_mapTargets;  // guarded by m_critAdd
+    CCritSec   m_critAdd;           // serializes GetTarget; Record and readers never take it
+};
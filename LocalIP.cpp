@@ -0,0 +1,314 @@
+// LocalIP.cpp : Cached snapshot of the machine's local IP addresses.
+// See LocalIP.h.
+
+#include "LocalIP.h"
+#include <string.h>
+
+#ifdef _WIN32
+#pragma comment(lib, "iphlpapi.lib")
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+// Fill in a StructLocalAddr from a socket address.
+// Exit:   Returns false if the address is not IPv4 or IPv6.
+static bool MakeLocalAddr(const char* szAdapter, const sockaddr* pAddr, StructLocalAddr& addr)
+{
+    char szAddr[INET6_ADDRSTRLEN];
+    addr.strAdapter = szAdapter;
+    addr.family = pAddr->sa_family;
+    if (pAddr->sa_family == AF_INET) {
+        const in_addr* pIn = &((const sockaddr_in*)pAddr)->sin_addr;
+        const unsigned char* pb = (const unsigned char*)pIn;
+        inet_ntop(AF_INET, (void*)pIn, szAddr, sizeof(szAddr));
+        addr.bLoopback = pb[0] == 127;
+        addr.bLinkLocal = pb[0] == 169 && pb[1] == 254;
+    } else if (pAddr->sa_family == AF_INET6) {
+        const in6_addr* pIn6 = &((const sockaddr_in6*)pAddr)->sin6_addr;
+        const unsigned char* pb = (const unsigned char*)pIn6;
+        inet_ntop(AF_INET6, (void*)pIn6, szAddr, sizeof(szAddr));
+        static const unsigned char abLoopback[16] = { 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,1 };
+        addr.bLoopback = memcmp(pb, abLoopback, 16) == 0;
+        addr.bLinkLocal = pb[0] == 0xfe && (pb[1] & 0xc0) == 0x80;
+    } else {
+        return false;
+    }
+    addr.strAddress = szAddr;
+    return true;
+}
+
+#ifdef _WIN32
+
+TypVectLocalAddrs EnumerateLocalAddrs()
+{
+    TypVectLocalAddrs vectAddrs;
+
+    // The buffer is sized by the call itself, so any number of adapters
+    // is handled.  Start with the 15 KB that Microsoft recommends.
+    std::vector<char> buf(15 * 1024);
+    ULONG cbBuf = (ULONG)buf.size();
+    ULONG flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER;
+    ULONG dwStatus;
+    for (int j = 0; j < 3; j++) {
+        dwStatus = GetAdaptersAddresses(AF_UNSPEC, flags, NULL,
+            (PIP_ADAPTER_ADDRESSES)&buf[0], &cbBuf);
+        if (dwStatus != ERROR_BUFFER_OVERFLOW) {
+            break;
+        }
+        buf.resize(cbBuf);
+    }
+    if (dwStatus != ERROR_SUCCESS) {
+        return vectAddrs;
+    }
+
+    for (PIP_ADAPTER_ADDRESSES pAdapter = (PIP_ADAPTER_ADDRESSES)&buf[0]; pAdapter; pAdapter = pAdapter->Next) {
+        for (PIP_ADAPTER_UNICAST_ADDRESS pUnicast = pAdapter->FirstUnicastAddress; pUnicast; pUnicast = pUnicast->Next) {
+            StructLocalAddr addr;
+            if (MakeLocalAddr(pAdapter->AdapterName, pUnicast->Address.lpSockaddr, addr)) {
+                vectAddrs.push_back(addr);
+            }
+        }
+    }
+    return vectAddrs;
+}
+
+#else
+
+TypVectLocalAddrs EnumerateLocalAddrs()
+{
+    TypVectLocalAddrs vectAddrs;
+    ifaddrs* pIfAddrs = NULL;
+    if (getifaddrs(&pIfAddrs) != 0) {
+        return vectAddrs;
+    }
+    for (ifaddrs* pIf = pIfAddrs; pIf; pIf = pIf->ifa_next) {
+        StructLocalAddr addr;
+        if (pIf->ifa_addr && MakeLocalAddr(pIf->ifa_name, pIf->ifa_addr, addr)) {
+            vectAddrs.push_back(addr);
+        }
+    }
+    freeifaddrs(pIfAddrs);
+    return vectAddrs;
+}
+
+#endif
+
+std::string SelectLocalIPClassic(const TypVectLocalAddrs& vectAddrs)
+{
+    std::string strIP;
+    for (TypVectLocalAddrs::const_iterator iter = vectAddrs.begin(); iter != vectAddrs.end(); iter++) {
+        if (iter->family != AF_INET) {
+            continue;
+        }
+        unsigned char ab[4];
+        if (inet_pton(AF_INET, iter->strAddress.c_str(), ab) != 1) {
+            continue;
+        }
+        // Check the octets to look for a pattern that is likely NOT one
+        // of the weird IP addresses assigned by software like VMware.
+        if (ab[0] == 192 && ab[1] == 168) {
+            if (strIP.length() == 0) {
+                strIP = iter->strAddress;
+            } else if (ab[3] != 1) {
+                strIP = iter->strAddress;
+            }
+        }
+    }
+    return strIP;
+}
+
+std::string SelectLocalIPFirstGlobal(const TypVectLocalAddrs& vectAddrs)
+{
+    std::string strIPv6;
+    for (TypVectLocalAddrs::const_iterator iter = vectAddrs.begin(); iter != vectAddrs.end(); iter++) {
+        if (iter->bLoopback || iter->bLinkLocal) {
+            continue;
+        }
+        if (iter->family == AF_INET) {
+            return iter->strAddress;
+        }
+        if (strIPv6.empty()) {
+            strIPv6 = iter->strAddress;
+        }
+    }
+    return strIPv6;
+}
+
+CLocalIPCache::CLocalIPCache()
+    : m_pSnapshot(std::make_shared<StructLocalIPSnapshot>()), m_versionLatest(0), m_critRefresh("LocalIP.Refresh")
+{
+    m_pfnSelect = SelectLocalIPClassic;
+    m_version = 0;
+#ifdef _WIN32
+    m_hNotifyInterface = NULL;
+    m_hNotifyAddress = NULL;
+#else
+    m_sockNetlink = -1;
+    m_bStop = false;
+#endif
+}
+
+CLocalIPCache::~CLocalIPCache()
+{
+    Stop();
+}
+
+void CLocalIPCache::SetSelector(PFN_SELECT_LOCAL_IP pfnSelect)
+{
+    m_pfnSelect = pfnSelect;
+    Refresh();
+}
+
+std::shared_ptr<const StructLocalIPSnapshot> CLocalIPCache::GetSnapshot() const
+{
+    return std::atomic_load_explicit(&m_pSnapshot, std::memory_order_acquire);
+}
+
+const char* CLocalIPCache::GetLikelyIP() const
+{
+    // Every log record asks, so the shared pointer is only taken again
+    // when the version has moved on.
+    static thread_local std::shared_ptr<const StructLocalIPSnapshot> pSnapshot;
+    if (!pSnapshot || pSnapshot->version != GetVersion()) {
+        pSnapshot = GetSnapshot();
+    }
+    return pSnapshot->strLikelyIP.c_str();
+}
+
+void CLocalIPCache::Refresh()
+{
+    // Enumerating under the lock too means a refresh that started earlier,
+    // and so may have seen older addresses, can't publish after this one.
+    CCritSecInScope lock(m_critRefresh);
+    std::shared_ptr<StructLocalIPSnapshot> pNew = std::make_shared<StructLocalIPSnapshot>();
+    pNew->vectAddrs = EnumerateLocalAddrs();
+    PFN_SELECT_LOCAL_IP pfnSelect = m_pfnSelect;
+    pNew->strLikelyIP = pfnSelect(pNew->vectAddrs);
+    pNew->version = ++m_version;
+    std::atomic_store_explicit(&m_pSnapshot, std::shared_ptr<const StructLocalIPSnapshot>(pNew),
+        std::memory_order_release);
+    // After the snapshot, so whoever sees the version gets it or a later one.
+    m_versionLatest.store(pNew->version, std::memory_order_release);
+}
+
+#ifdef _WIN32
+
+void WINAPI CLocalIPCache::OnInterfaceChange(PVOID pContext, PMIB_IPINTERFACE_ROW pRow, MIB_NOTIFICATION_TYPE type)
+{
+    UNREFERENCED_PARAMETER(pRow);
+    UNREFERENCED_PARAMETER(type);
+    ((CLocalIPCache*)pContext)->Refresh();
+}
+
+void WINAPI CLocalIPCache::OnAddressChange(PVOID pContext, PMIB_UNICASTIPADDRESS_ROW pRow, MIB_NOTIFICATION_TYPE type)
+{
+    UNREFERENCED_PARAMETER(pRow);
+    UNREFERENCED_PARAMETER(type);
+    ((CLocalIPCache*)pContext)->Refresh();
+}
+
+bool CLocalIPCache::Start()
+{
+    Refresh();
+    // Interface notifications cover adapters coming and going; address
+    // notifications cover DHCP and roaming between networks.
+    bool bOK = NotifyIpInterfaceChange(AF_UNSPEC, OnInterfaceChange, this, FALSE,
+        &m_hNotifyInterface) == NO_ERROR;
+    bOK = NotifyUnicastIpAddressChange(AF_UNSPEC, OnAddressChange, this, FALSE,
+        &m_hNotifyAddress) == NO_ERROR && bOK;
+    return bOK;
+}
+
+void CLocalIPCache::Stop()
+{
+    // CancelMibChangeNotify2 waits for callbacks in progress to finish.
+    if (m_hNotifyInterface) {
+        CancelMibChangeNotify2(m_hNotifyInterface);
+        m_hNotifyInterface = NULL;
+    }
+    if (m_hNotifyAddress) {
+        CancelMibChangeNotify2(m_hNotifyAddress);
+        m_hNotifyAddress = NULL;
+    }
+}
+
+#else
+
+bool CLocalIPCache::Start()
+{
+    // Subscribe before taking the first snapshot, so no change is missed.
+    m_sockNetlink = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (m_sockNetlink >= 0) {
+        sockaddr_nl addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+        if (bind(m_sockNetlink, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(m_sockNetlink);
+            m_sockNetlink = -1;
+        }
+    }
+    Refresh();
+    if (m_sockNetlink < 0) {
+        return false;
+    }
+    m_bStop = false;
+    m_thread = std::thread(&CLocalIPCache::NetlinkThread, this);
+    return true;
+}
+
+void CLocalIPCache::Stop()
+{
+    if (m_thread.joinable()) {
+        m_bStop = true;
+        m_thread.join();
+    }
+    if (m_sockNetlink >= 0) {
+        close(m_sockNetlink);
+        m_sockNetlink = -1;
+    }
+}
+
+void CLocalIPCache::NetlinkThread()
+{
+    char buf[8192];
+    while (!m_bStop) {
+        pollfd pfd;
+        pfd.fd = m_sockNetlink;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+
+        // Drain everything pending; one refresh covers a burst of changes.
+        bool bChanged = false;
+        ssize_t cb;
+        while ((cb = recv(m_sockNetlink, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            for (nlmsghdr* pHdr = (nlmsghdr*)buf; NLMSG_OK(pHdr, (unsigned)cb); pHdr = NLMSG_NEXT(pHdr, cb)) {
+                if (pHdr->nlmsg_type == RTM_NEWADDR || pHdr->nlmsg_type == RTM_DELADDR) {
+                    bChanged = true;
+                }
+            }
+        }
+        if (cb < 0 && errno == ENOBUFS) {
+            // We missed notifications; the snapshot may be stale.
+            bChanged = true;
+        }
+        if (bChanged) {
+            Refresh();
+        }
+    }
+}
+
+#endif
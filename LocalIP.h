@@ -0,0 +1,108 @@
+// LocalIP.h : Cached snapshot of the machine's local IP addresses.
+// Enumerating adapters is by far the most expensive part of writing a log
+// record, so the addresses and the address chosen for the log are kept in
+// an immutable snapshot.  The snapshot is rebuilt only when the OS reports
+// an address change (NotifyUnicastIpAddressChange/NotifyIpInterfaceChange
+// on Windows, an RTMGRP_IPV4_IFADDR/RTMGRP_IPV6_IFADDR netlink listener on
+// Linux).  Readers look at its version, a single atomic load, and take the
+// snapshot itself, a shared pointer, only when it has changed; a snapshot
+// is freed once the last reader lets go of it.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#endif
+#include "CritSec.h"
+
+struct StructLocalAddr {
+    std::string strAdapter;     // adapter or interface name
+    std::string strAddress;     // numeric address, e.g. "192.168.1.20" or "fe80::1"
+    int         family;         // AF_INET or AF_INET6
+    bool        bLoopback;
+    bool        bLinkLocal;     // 169.254.x.x or fe80::/10
+};
+
+typedef std::vector<StructLocalAddr> TypVectLocalAddrs;
+
+// Chooses the address to record in the log from the enumerated addresses.
+// Exit:   Returns the chosen numeric address, or "" if none is suitable.
+typedef std::string (*PFN_SELECT_LOCAL_IP)(const TypVectLocalAddrs& vectAddrs);
+
+// The program's original heuristic: the last 192.168.x.x address, preferring
+// one that doesn't end in .1.  Avoids the odd addresses assigned by
+// software like VMware.
+std::string SelectLocalIPClassic(const TypVectLocalAddrs& vectAddrs);
+
+// The first address that is not loopback or link-local, preferring IPv4.
+// Suits servers, which often have no 192.168.x.x address.
+std::string SelectLocalIPFirstGlobal(const TypVectLocalAddrs& vectAddrs);
+
+// Immutable once published.
+struct StructLocalIPSnapshot {
+    uint64_t          version;
+    TypVectLocalAddrs vectAddrs;
+    std::string       strLikelyIP;
+};
+
+// Enumerate all unicast addresses of all adapters, IPv4 and IPv6.
+TypVectLocalAddrs EnumerateLocalAddrs();
+
+class CLocalIPCache
+{
+public:
+    CLocalIPCache();
+    ~CLocalIPCache();
+
+    // Take the first snapshot and start listening for address changes.
+    bool Start();
+    void Stop();
+
+    // Change the selection heuristic.  Takes effect immediately.
+    void SetSelector(PFN_SELECT_LOCAL_IP pfnSelect);
+
+    // Rebuild the snapshot now.  Called on address change notifications.
+    // Refreshes run one at a time, from enumerating to publishing, so the
+    // last to start is the one that stays.
+    void Refresh();
+
+    // Exit:   Returns the latest snapshot, which stays valid while held.
+    //         May wait briefly on the lock that guards the shared pointer.
+    std::shared_ptr<const StructLocalIPSnapshot> GetSnapshot() const;
+
+    // Exit:   Returns the version of the latest snapshot.  Never blocks.
+    uint64_t GetVersion() const { return m_versionLatest.load(std::memory_order_acquire); }
+
+    // Exit:   Returns the address chosen for the log, e.g. "192.168.1.20".
+    //         The calling thread holds on to the snapshot it comes from
+    //         until a newer one is published, so the string stays valid on
+    //         that thread until its next call.
+    const char* GetLikelyIP() const;
+
+private:
+    std::shared_ptr<const StructLocalIPSnapshot> m_pSnapshot;   // through atomic_load and atomic_store only
+    std::atomic<uint64_t> m_versionLatest;
+    std::atomic<PFN_SELECT_LOCAL_IP> m_pfnSelect;
+    CCritSec   m_critRefresh;       // serializes refreshes; readers never take it
+    uint64_t m_version;
+
+#ifdef _WIN32
+    static void WINAPI OnInterfaceChange(PVOID pContext, PMIB_IPINTERFACE_ROW pRow, MIB_NOTIFICATION_TYPE type);
+    static void WINAPI OnAddressChange(PVOID pContext, PMIB_UNICASTIPADDRESS_ROW pRow, MIB_NOTIFICATION_TYPE type);
+    HANDLE m_hNotifyInterface;
+    HANDLE m_hNotifyAddress;
+#else
+    void NetlinkThread();
+    int m_sockNetlink;
+    std::atomic<bool> m_bStop;
+    std::thread m_thread;
+#endif
+};
@@ -0,0 +1,291 @@
+// LogWriter.cpp : Background group-commit writer for netavailw.csv.
+// See LogWriter.h.
+
+#include "LogWriter.h"
+#include "StageTimer.h"
+#include <string.h>
+#include <time.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+static int64_t LogNowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CLogWriter::CLogWriter()
+{
+    m_pQueue = NULL;
+    m_bStop = false;
+    m_fp = NULL;
+    m_cbFile = 0;
+    m_usOpened = 0;
+    m_usLastFsync = 0;
+    m_bDirty = false;
+    m_cbBuf = 0;
+    m_nInBuf = 0;
+    m_nQueued = 0;
+    m_nWritten = 0;
+    m_nDropped = 0;
+    m_nBackpressure = 0;
+    m_nWrites = 0;
+    m_nFsyncs = 0;
+    m_nRotations = 0;
+    m_nDepthMax = 0;
+}
+
+CLogWriter::~CLogWriter()
+{
+    Stop();
+    delete m_pQueue;
+}
+
+bool CLogWriter::Start(const StructLogWriterConfig& config)
+{
+    if (m_thread.joinable()) {
+        return true;
+    }
+    m_config = config;
+    if (m_config.cbWriteBuf < 2 * LOG_RECORD_MAX) {
+        m_config.cbWriteBuf = 2 * LOG_RECORD_MAX;
+    }
+    m_buf.resize(m_config.cbWriteBuf);
+    m_cbBuf = 0;
+    m_nInBuf = 0;
+    delete m_pQueue;
+    m_pQueue = new CMpscQueue<StructRecord>(m_config.nQueueCapacity);
+    m_binWriter.SetPrefix(m_config.strBinPrefix);
+    m_bStop = false;
+    m_thread = std::thread(&CLogWriter::ThreadMain, this);
+    return true;
+}
+
+void CLogWriter::Stop()
+{
+    if (m_thread.joinable()) {
+        m_bStop = true;
+        m_thread.join();
+    }
+}
+
+bool CLogWriter::Write(const char* pText, size_t cbText)
+{
+    if (m_pQueue == NULL) {
+        m_nDropped++;
+        return false;
+    }
+    size_t pos;
+    StructRecord* pRecord = m_pQueue->BeginPush(pos);
+    if (pRecord == NULL) {
+        m_nDropped++;
+        return false;
+    }
+    if (cbText > LOG_RECORD_MAX - 1) {
+        cbText = LOG_RECORD_MAX - 1;
+    }
+    memcpy(pRecord->text, pText, cbText);
+    pRecord->text[cbText] = '\n';
+    pRecord->cb = (uint16_t)(cbText + 1);
+    m_pQueue->EndPush(pos);
+
+    m_nQueued++;
+    size_t nDepth = m_pQueue->GetDepth();
+    if (nDepth * 4 >= m_pQueue->GetCapacity() * 3) {
+        m_nBackpressure++;
+    }
+    size_t nDepthMax = m_nDepthMax.load(std::memory_order_relaxed);
+    while (nDepth > nDepthMax && !m_nDepthMax.compare_exchange_weak(nDepthMax, nDepth)) {
+    }
+    return true;
+}
+
+StructLogWriterStats CLogWriter::GetStats() const
+{
+    StructLogWriterStats stats;
+    stats.nQueued = m_nQueued;
+    stats.nWritten = m_nWritten;
+    stats.nDropped = m_nDropped;
+    stats.nBackpressure = m_nBackpressure;
+    stats.nWrites = m_nWrites;
+    stats.nFsyncs = m_nFsyncs;
+    stats.nRotations = m_nRotations;
+    stats.nDepth = m_pQueue ? m_pQueue->GetDepth() : 0;
+    stats.nDepthMax = m_nDepthMax;
+    return stats;
+}
+
+bool CLogWriter::OpenFile()
+{
+    m_fp = fopen(m_config.strPath.c_str(), "ab");
+    if (m_fp == NULL) {
+        return false;
+    }
+    // We do our own buffering.
+    setvbuf(m_fp, NULL, _IONBF, 0);
+    fseek(m_fp, 0, SEEK_END);
+#ifdef _WIN32
+    m_cbFile = _ftelli64(m_fp);
+#else
+    m_cbFile = ftello(m_fp);
+#endif
+    m_usOpened = LogNowMicros();
+    return true;
+}
+
+void CLogWriter::CloseFile()
+{
+    if (m_fp) {
+        Fsync();
+        fclose(m_fp);
+        m_fp = NULL;
+    }
+}
+
+// Write out the gathered records with a single write call.
+void CLogWriter::FlushBuffer()
+{
+    if (m_cbBuf == 0) {
+        return;
+    }
+    if (m_fp == NULL && !OpenFile()) {
+        // Can't open the log (e.g. the directory is read-only); the
+        // records are lost, but count them so it shows up in the stats.
+        m_nDropped += m_nInBuf;
+        m_cbBuf = 0;
+        m_nInBuf = 0;
+        return;
+    }
+    {
+        STAGE_SCOPE(STAGE_LOG_WRITE);
+        fwrite(&m_buf[0], 1, m_cbBuf, m_fp);
+    }
+    m_cbFile += m_cbBuf;
+    m_nWritten += m_nInBuf;
+    m_cbBuf = 0;
+    m_nInBuf = 0;
+    m_bDirty = true;
+    m_nWrites++;
+}
+
+void CLogWriter::Fsync()
+{
+    if (!m_bDirty) {
+        return;
+    }
+    STAGE_SCOPE(STAGE_LOG_FSYNC);
+    if (m_config.bBinary) {
+        m_binWriter.Sync();
+    }
+    if (m_fp) {
+#ifdef _WIN32
+        _commit(_fileno(m_fp));
+#else
+        fsync(fileno(m_fp));
+#endif
+    }
+    m_bDirty = false;
+    m_nFsyncs++;
+}
+
+// Rename the current file aside, as e.g. netavailw-20240514-093000.csv,
+// once it has reached the configured size or age.  The next write
+// starts a new file.
+void CLogWriter::RotateIfDue(int64_t usNow)
+{
+    if (m_fp == NULL) {
+        return;
+    }
+    bool bBySize = m_config.cbRotate > 0 && m_cbFile >= m_config.cbRotate;
+    bool byAge = m_config.secsRotate > 0 &&
+        usNow - m_usOpened >= (int64_t)m_config.secsRotate * 1000000;
+    if (!bBySize && !byAge) {
+        return;
+    }
+    CloseFile();
+
+    time_t now = time(NULL);
+    tm mytm;
+#ifdef _WIN32
+    localtime_s(&mytm, &now);
+#else
+    localtime_r(&now, &mytm);
+#endif
+    char szStamp[32];
+    strftime(szStamp, sizeof(szStamp), "-%Y%m%d-%H%M%S", &mytm);
+
+    std::string strBase = m_config.strPath;
+    std::string strExt;
+    size_t iDot = strBase.rfind('.');
+    if (iDot != std::string::npos && strBase.find_first_of("/\\", iDot) == std::string::npos) {
+        strExt = strBase.substr(iDot);
+        strBase.resize(iDot);
+    }
+    std::string strRotated = strBase + szStamp + strExt;
+    for (int j = 1; rename(m_config.strPath.c_str(), strRotated.c_str()) != 0 && j < 10; j++) {
+        // Name already taken (two rotations in one second); try another.
+        strRotated = strBase + szStamp + "-" + std::to_string(j) + strExt;
+    }
+    m_nRotations++;
+}
+
+void CLogWriter::ThreadMain()
+{
+    SetStageThreadName("log writer");
+    m_usLastFsync = LogNowMicros();
+    for (;;) {
+        // Stop is checked before draining so that records queued before
+        // the request are all written.
+        bool bStopping = m_bStop;
+
+        // Gather as many records as fit into the write buffer.
+        size_t nGathered = 0;
+        StructRecord* pRecord;
+        while ((pRecord = m_pQueue->Front()) != NULL) {
+            if (m_config.bBinary) {
+                StructLogLine line;
+                if (ParseCsvLogLine(pRecord->text, pRecord->cb, m_timeCache, line)) {
+                    m_binWriter.Append(line);
+                }
+            }
+            if (m_config.bCsv) {
+                if (m_cbBuf + pRecord->cb > m_buf.size()) {
+                    FlushBuffer();
+                }
+                memcpy(&m_buf[m_cbBuf], pRecord->text, pRecord->cb);
+                m_cbBuf += pRecord->cb;
+                m_nInBuf++;
+            } else {
+                m_nWritten++;
+            }
+            m_pQueue->Pop();
+            nGathered++;
+        }
+        FlushBuffer();
+        if (m_config.bBinary && nGathered) {
+            m_binWriter.Flush();
+            m_bDirty = true;
+        }
+
+        int64_t usNow = LogNowMicros();
+        if (m_config.msFsync > 0 && usNow - m_usLastFsync >= (int64_t)m_config.msFsync * 1000) {
+            Fsync();
+            m_usLastFsync = usNow;
+        }
+        RotateIfDue(usNow);
+
+        if (bStopping) {
+            break;
+        }
+        if (nGathered == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(m_config.msFlush));
+        }
+    }
+    CloseFile();
+    m_binWriter.Close();
+}
@@ -0,0 +1,105 @@
+// LogWriter.h : Background group-commit writer for netavailw.csv.
+// Any thread can queue a record without blocking: records go into a
+// bounded lock-free queue and are dropped (and counted) if it is full.
+// One writer thread keeps the log file open, gathers queued records into
+// large writes, fsyncs on a configurable cadence, and rotates the file by
+// size and by age.  Records can also (or instead) be written in the
+// compact binary format of BinLog.h.
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MpscQueue.h"
+#include "BinLog.h"
+
+// Longest record, including the newline.  Longer records are truncated.
+#define LOG_RECORD_MAX  500
+
+struct StructLogWriterConfig {
+    std::string strPath = "netavailw.csv";
+    bool    bCsv = true;            // write strPath
+    bool    bBinary = false;        // write binary segments <strBinPrefix>-*.nab
+    std::string strBinPrefix = "netavailw";
+    size_t  nQueueCapacity = 4096;  // records
+    size_t  cbWriteBuf = 64 * 1024; // bytes gathered before a write
+    int     msFlush = 50;           // max time a record waits in the queue
+    int     msFsync = 1000;         // fsync cadence; 0 to never fsync
+    int64_t cbRotate = 0;           // rotate when this size is reached; 0 to disable
+    int     secsRotate = 0;         // rotate when the file is this old; 0 to disable
+};
+
+struct StructLogWriterStats {
+    uint64_t nQueued;           // records accepted
+    uint64_t nWritten;          // records written to the file
+    uint64_t nDropped;          // records dropped because the queue was full
+    uint64_t nBackpressure;     // records queued while the queue was 3/4 full
+    uint64_t nWrites;           // write calls issued
+    uint64_t nFsyncs;
+    uint64_t nRotations;
+    size_t   nDepth;            // records currently queued
+    size_t   nDepthMax;         // high-water mark of the queue
+};
+
+class CLogWriter
+{
+public:
+    CLogWriter();
+    ~CLogWriter();
+
+    // Create the queue and start the writer thread.  Records written
+    // before Start are dropped.
+    bool Start(const StructLogWriterConfig& config);
+
+    // Write out everything queued, then stop the writer thread.
+    void Stop();
+
+    // Queue one record; a newline is appended.  Never blocks.
+    // Exit:   Returns false if the record was dropped.
+    bool Write(const char* pText, size_t cbText);
+    bool Write(const std::string& strText) { return Write(strText.c_str(), strText.size()); }
+
+    StructLogWriterStats GetStats() const;
+
+private:
+    struct StructRecord {
+        uint16_t cb;
+        char     text[LOG_RECORD_MAX];
+    };
+
+    void ThreadMain();
+    bool OpenFile();
+    void CloseFile();
+    void FlushBuffer();
+    void Fsync();
+    void RotateIfDue(int64_t usNow);
+
+    StructLogWriterConfig m_config;
+    CMpscQueue<StructRecord>* m_pQueue;
+    std::thread m_thread;
+    std::atomic<bool> m_bStop;
+
+    // Used only by the writer thread.
+    FILE*   m_fp;
+    int64_t m_cbFile;
+    int64_t m_usOpened;
+    int64_t m_usLastFsync;
+    bool    m_bDirty;           // written since the last fsync
+    CBinLogWriter m_binWriter;
+    StructTimeCache m_timeCache;
+    std::vector<char> m_buf;
+    size_t  m_cbBuf;
+    uint64_t m_nInBuf;          // records in m_buf
+
+    std::atomic<uint64_t> m_nQueued;
+    std::atomic<uint64_t> m_nWritten;
+    std::atomic<uint64_t> m_nDropped;
+    std::atomic<uint64_t> m_nBackpressure;
+    std::atomic<uint64_t> m_nWrites;
+    std::atomic<uint64_t> m_nFsyncs;
+    std::atomic<uint64_t> m_nRotations;
+    std::atomic<size_t>   m_nDepthMax;
+};
@@ -0,0 +1,85 @@
+// MappedFile.cpp : Read-only mapping of a whole file.  See MappedFile.h.
+
+#include "MappedFile.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+CMappedFile::CMappedFile()
+    : m_p(NULL), m_cb(0)
+#ifdef _WIN32
+    , m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL)
+#endif
+{
+}
+
+CMappedFile::~CMappedFile()
+{
+    Close();
+}
+
+bool CMappedFile::Open(const std::string& strPath)
+{
+    Close();
+#ifdef _WIN32
+    m_hFile = CreateFileA(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER liSize;
+    GetFileSizeEx(m_hFile, &liSize);
+    m_cb = (size_t)liSize.QuadPart;
+    if (m_cb > 0) {
+        m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_hMapping) {
+            m_p = (const char*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+        }
+    }
+#else
+    int fd = open(strPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    m_cb = (size_t)st.st_size;
+    if (m_cb > 0) {
+        void* p = mmap(NULL, m_cb, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, m_cb, MADV_SEQUENTIAL);
+            m_p = (const char*)p;
+        }
+    }
+    close(fd);
+#endif
+    return m_p != NULL || m_cb == 0;
+}
+
+void CMappedFile::Close()
+{
+#ifdef _WIN32
+    if (m_p) {
+        UnmapViewOfFile(m_p);
+    }
+    if (m_hMapping) {
+        CloseHandle(m_hMapping);
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_hFile);
+    }
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hMapping = NULL;
+#else
+    if (m_p) {
+        munmap((void*)m_p, m_cb);
+    }
+#endif
+    m_p = NULL;
+    m_cb = 0;
+}
@@ -0,0 +1,33 @@
+// MappedFile.h : Read-only mapping of a whole file, for scanning logs
+// without copying them.
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+class CMappedFile
+{
+public:
+    CMappedFile();
+    ~CMappedFile();
+
+    // Map a file, read sequentially from start to end.  An empty file
+    // opens with no data.
+    // Exit:   Returns false if the file can't be opened or mapped.
+    bool Open(const std::string& strPath);
+    void Close();
+
+    const char* GetData() const { return m_p; }
+    size_t GetSize() const { return m_cb; }
+
+private:
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile& operator=(const CMappedFile&) = delete;
+
+    const char* m_p;
+    size_t      m_cb;
+#ifdef _WIN32
+    void*       m_hFile;
+    void*       m_hMapping;
+#endif
+};
@@ -0,0 +1,551 @@
+// MetricsServer.cpp : Minimal HTTP endpoint serving Prometheus metrics.
+
+#include "MetricsServer.h"
+#include "Prober.h"
+#include "ShardedProber.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define poll WSAPoll
+#define SEND_FLAGS 0
+#else
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#define closesocket close
+#define INVALID_SOCKET (-1)
+#define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+#define METRICS_REQUEST_MAX     2048
+#define METRICS_RECV_TIMEOUT_MS 1000
+
+void CTextBuffer::Reserve(size_t cbMore)
+{
+    if (m_cb + cbMore > m_vect.size()) {
+        m_vect.resize((m_cb + cbMore) * 2);
+    }
+}
+
+void CTextBuffer::Append(const char* p, size_t cb)
+{
+    Reserve(cb);
+    memcpy(&m_vect[m_cb], p, cb);
+    m_cb += cb;
+}
+
+void CTextBuffer::Append(const char* psz)
+{
+    Append(psz, strlen(psz));
+}
+
+void CTextBuffer::Printf(const char* pszFormat, ...)
+{
+    for (int iTry = 0; iTry < 2; iTry++) {
+        size_t cbFree = m_vect.size() - m_cb;
+        va_list args;
+        va_start(args, pszFormat);
+        int cb = vsnprintf(&m_vect[m_cb], cbFree, pszFormat, args);
+        va_end(args);
+        if (cb < 0) {
+            return;
+        }
+        if ((size_t)cb < cbFree) {
+            m_cb += cb;
+            return;
+        }
+        Reserve(cb + 1);
+    }
+}
+
+void AppendLabelValue(CTextBuffer& buf, const char* psz)
+{
+    for (const char* p = psz; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            buf.Append("\\", 1);
+        } else if (*p == '\n') {
+            buf.Append("\\n", 2);
+            continue;
+        }
+        buf.Append(p, 1);
+    }
+}
+
+void AppendHelp(CTextBuffer& buf, const char* pszName, const char* pszType, const char* pszHelp)
+{
+    buf.Printf("# HELP %s %s\n# TYPE %s %s\n", pszName, pszHelp, pszName, pszType);
+}
+
+// Start a sample line: name{target="..." and any extra labels.  The
+// caller finishes the labels and adds the value.
+static void AppendTargetSample(CTextBuffer& buf, const char* pszName, int iTarget)
+{
+    buf.Append(pszName);
+    buf.Append("{target=\"", 9);
+    AppendLabelValue(buf, LatencyStats.GetTargetName(iTarget).c_str());
+    buf.Append("\"", 1);
+}
+
+// Render one lock histogram as a Prometheus histogram in seconds.
+static void AppendLockHistogram(CTextBuffer& buf, const char* pszName, const StructLockStats& stats,
+    const std::atomic<uint64_t>* aryBuckets, uint64_t usTotal)
+{
+    uint64_t nCumulative = 0;
+    for (int k = 0; k < LOCK_HIST_BUCKETS; k++) {
+        nCumulative += aryBuckets[k].load(std::memory_order_relaxed);
+        buf.Printf("%s_bucket{lock=\"", pszName);
+        AppendLabelValue(buf, stats.pszName);
+        int64_t usLimit = CCritSec::GetBucketLimit(k);
+        if (usLimit < 0) {
+            buf.Printf("\",le=\"+Inf\"} %llu\n", (unsigned long long)nCumulative);
+        } else {
+            buf.Printf("\",le=\"%g\"} %llu\n", usLimit / 1e6, (unsigned long long)nCumulative);
+        }
+    }
+    buf.Printf("%s_sum{lock=\"", pszName);
+    AppendLabelValue(buf, stats.pszName);
+    buf.Printf("\"} %.6f\n", usTotal / 1e6);
+    buf.Printf("%s_count{lock=\"", pszName);
+    AppendLabelValue(buf, stats.pszName);
+    buf.Printf("\"} %llu\n", (unsigned long long)nCumulative);
+}
+
+// Render the figures of the instrumented locks; see CritSec.h.
+static void RenderLockStats(CTextBuffer& buf)
+{
+    int nStats = CCritSec::GetStatsCount();
+    AppendHelp(buf, "netavail_lock_acquisitions_total", "counter", "Acquisitions of each named lock while instrumented.");
+    for (int j = 0; j < nStats; j++) {
+        const StructLockStats& stats = CCritSec::GetStats(j);
+        buf.Append("netavail_lock_acquisitions_total{lock=\"");
+        AppendLabelValue(buf, stats.pszName);
+        buf.Printf("\"} %llu\n", (unsigned long long)stats.nAcquired.load(std::memory_order_relaxed));
+    }
+    AppendHelp(buf, "netavail_lock_contentions_total", "counter", "Acquisitions that found the lock held.");
+    for (int j = 0; j < nStats; j++) {
+        const StructLockStats& stats = CCritSec::GetStats(j);
+        buf.Append("netavail_lock_contentions_total{lock=\"");
+        AppendLabelValue(buf, stats.pszName);
+        buf.Printf("\"} %llu\n", (unsigned long long)stats.nContended.load(std::memory_order_relaxed));
+    }
+    AppendHelp(buf, "netavail_lock_wait_seconds", "histogram", "Time spent waiting for each named lock.");
+    for (int j = 0; j < nStats; j++) {
+        const StructLockStats& stats = CCritSec::GetStats(j);
+        AppendLockHistogram(buf, "netavail_lock_wait_seconds", stats, stats.aryWait,
+            stats.usWaitTotal.load(std::memory_order_relaxed));
+    }
+    AppendHelp(buf, "netavail_lock_hold_seconds", "histogram", "Time each named lock was held.");
+    for (int j = 0; j < nStats; j++) {
+        const StructLockStats& stats = CCritSec::GetStats(j);
+        AppendLockHistogram(buf, "netavail_lock_hold_seconds", stats, stats.aryHold,
+            stats.usHoldTotal.load(std::memory_order_relaxed));
+    }
+}
+
+#if NAL_STAGE_TIMERS
+// Render the duration histogram of each stage of the probe loop that
+// has run; see StageTimer.h.
+static void RenderStageStats(CTextBuffer& buf)
+{
+    AppendHelp(buf, "netavail_stage_seconds", "histogram", "Time spent in each stage of the probe loop.");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const StructStageStats& stats = GetStageStats(stage);
+        if (stats.nSpans.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        const char* pszStage = GetStageName(stage);
+        uint64_t nCumulative = 0;
+        for (int k = 0; k < STAGE_HIST_BUCKETS; k++) {
+            nCumulative += stats.aryBuckets[k].load(std::memory_order_relaxed);
+            int64_t usLimit = GetStageBucketLimit(k);
+            if (usLimit < 0) {
+                buf.Printf("netavail_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", pszStage,
+                    (unsigned long long)nCumulative);
+            } else {
+                buf.Printf("netavail_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", pszStage, usLimit / 1e6,
+                    (unsigned long long)nCumulative);
+            }
+        }
+        buf.Printf("netavail_stage_seconds_sum{stage=\"%s\"} %.6f\n", pszStage,
+            stats.usTotal.load(std::memory_order_relaxed) / 1e6);
+        buf.Printf("netavail_stage_seconds_count{stage=\"%s\"} %llu\n", pszStage, (unsigned long long)nCumulative);
+    }
+}
+#endif
+
+void CMetricsServer::Render(CTextBuffer& buf)
+{
+    static const double AryQuantiles[] = { 0.5, 0.9, 0.95, 0.99 };
+    int nTargets = LatencyStats.GetTargetCount();
+    StructLatencyTotals totals;
+    int64_t msNow = ProbeNowMicros() / 1000;
+
+    AppendHelp(buf, "netavail_probes_total", "counter", "Probes completed, by target.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        LatencyStats.GetTotals(iTarget, totals);
+        AppendTargetSample(buf, "netavail_probes_total", iTarget);
+        buf.Printf("} %llu\n", (unsigned long long)totals.nProbes);
+    }
+
+    AppendHelp(buf, "netavail_probe_failures_total", "counter", "Failed probes, by target and IP status code.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        LatencyStats.GetTotals(iTarget, totals);
+        for (int j = 0; j < STATS_ERROR_CODES; j++) {
+            if (totals.aryLostByCode[j] == 0) {
+                continue;
+            }
+            const char* pszIdent = j ? ErrorCodeToIdent(STATS_ERROR_CODE_BASE + j) : "other";
+            AppendTargetSample(buf, "netavail_probe_failures_total", iTarget);
+            if (pszIdent) {
+                buf.Printf(",code=\"%s\"} %llu\n", pszIdent, (unsigned long long)totals.aryLostByCode[j]);
+            } else {
+                buf.Printf(",code=\"%d\"} %llu\n", STATS_ERROR_CODE_BASE + j, (unsigned long long)totals.aryLostByCode[j]);
+            }
+        }
+    }
+
+    AppendHelp(buf, "netavail_rtt_seconds", "histogram", "Round trip times of successful probes.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        LatencyStats.GetTotals(iTarget, totals);
+        uint64_t nCumulative = 0;
+        for (int j = 0; j < STATS_TOTAL_BUCKETS; j++) {
+            nCumulative += totals.aryBuckets[j];
+            AppendTargetSample(buf, "netavail_rtt_seconds_bucket", iTarget);
+            if (j < STATS_TOTAL_BUCKETS - 1) {
+                buf.Printf(",le=\"%g\"} %llu\n", AryStatsTotalBoundsUs[j] / 1e6, (unsigned long long)nCumulative);
+            } else {
+                buf.Printf(",le=\"+Inf\"} %llu\n", (unsigned long long)nCumulative);
+            }
+        }
+        AppendTargetSample(buf, "netavail_rtt_seconds_sum", iTarget);
+        buf.Printf("} %.6f\n", totals.usSum / 1e6);
+        AppendTargetSample(buf, "netavail_rtt_seconds_count", iTarget);
+        buf.Printf("} %llu\n", (unsigned long long)nCumulative);
+    }
+
+    AppendHelp(buf, "netavail_target_lag_seconds_total", "counter", "Time by which pings started after their deadlines, by target.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        LatencyStats.GetTotals(iTarget, totals);
+        AppendTargetSample(buf, "netavail_target_lag_seconds_total", iTarget);
+        buf.Printf("} %.6f\n", totals.usLagSum / 1e6);
+    }
+    AppendHelp(buf, "netavail_target_lag_max_seconds", "gauge", "Largest lag of a single ping, by target.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        LatencyStats.GetTotals(iTarget, totals);
+        AppendTargetSample(buf, "netavail_target_lag_max_seconds", iTarget);
+        buf.Printf("} %.6f\n", totals.usLagMax / 1e6);
+    }
+    AppendHelp(buf, "netavail_target_lag_last_seconds", "gauge", "Lag of the latest ping, by target.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        LatencyStats.GetTotals(iTarget, totals);
+        AppendTargetSample(buf, "netavail_target_lag_last_seconds", iTarget);
+        buf.Printf("} %.6f\n", totals.usLagLast / 1e6);
+    }
+    AppendHelp(buf, "netavail_target_burst", "gauge", "1 while the target is pinged at the burst interval.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        LatencyStats.GetTotals(iTarget, totals);
+        AppendTargetSample(buf, "netavail_target_burst", iTarget);
+        buf.Printf("} %d\n", totals.bInBurst ? 1 : 0);
+    }
+
+    AppendHelp(buf, "netavail_rtt_window_seconds", "gauge", "RTT quantiles over rolling windows.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        for (int w = 0; w < STATS_NUM_WINDOWS; w++) {
+            StructLatencySummary summary;
+            LatencyStats.GetSummary(iTarget, (EnumStatsWindow)w, msNow, summary);
+            const int64_t AryValues[] = { summary.usP50, summary.usP90, summary.usP95, summary.usP99 };
+            for (int q = 0; q < 4; q++) {
+                AppendTargetSample(buf, "netavail_rtt_window_seconds", iTarget);
+                buf.Printf(",window=\"%s\",quantile=\"%g\"} %.6f\n", CLatencyStats::GetWindowName((EnumStatsWindow)w),
+                    AryQuantiles[q], AryValues[q] / 1e6);
+            }
+        }
+    }
+
+    AppendHelp(buf, "netavail_loss_window_ratio", "gauge", "Fraction of probes lost over rolling windows.");
+    for (int iTarget = 0; iTarget < nTargets; iTarget++) {
+        for (int w = 0; w < STATS_NUM_WINDOWS; w++) {
+            StructLatencySummary summary;
+            LatencyStats.GetSummary(iTarget, (EnumStatsWindow)w, msNow, summary);
+            AppendTargetSample(buf, "netavail_loss_window_ratio", iTarget);
+            buf.Printf(",window=\"%s\"} %g\n", CLatencyStats::GetWindowName((EnumStatsWindow)w),
+                summary.nProbes ? (double)summary.nLost / summary.nProbes : 0.0);
+        }
+    }
+
+    StructLogWriterStats logStats = LogWriter.GetStats();
+    AppendHelp(buf, "netavail_log_queue_depth", "gauge", "Log records waiting for the writer thread.");
+    buf.Printf("netavail_log_queue_depth %llu\n", (unsigned long long)logStats.nDepth);
+    AppendHelp(buf, "netavail_log_queue_depth_max", "gauge", "High-water mark of the log queue.");
+    buf.Printf("netavail_log_queue_depth_max %llu\n", (unsigned long long)logStats.nDepthMax);
+    AppendHelp(buf, "netavail_log_records_written_total", "counter", "Log records written.");
+    buf.Printf("netavail_log_records_written_total %llu\n", (unsigned long long)logStats.nWritten);
+    AppendHelp(buf, "netavail_log_records_dropped_total", "counter", "Log records dropped because the queue was full.");
+    buf.Printf("netavail_log_records_dropped_total %llu\n", (unsigned long long)logStats.nDropped);
+    AppendHelp(buf, "netavail_log_backpressure_total", "counter", "Log records queued while the queue was 3/4 full.");
+    buf.Printf("netavail_log_backpressure_total %llu\n", (unsigned long long)logStats.nBackpressure);
+    AppendHelp(buf, "netavail_log_fsyncs_total", "counter", "fsync calls on the log.");
+    buf.Printf("netavail_log_fsyncs_total %llu\n", (unsigned long long)logStats.nFsyncs);
+
+    if (ResultStream.IsRunning()) {
+        StructResultStreamStats streamStats = ResultStream.GetStats();
+        AppendHelp(buf, "netavail_stream_results_sent_total", "counter", "Results streamed to the collector.");
+        buf.Printf("netavail_stream_results_sent_total %llu\n", (unsigned long long)streamStats.nSent);
+        AppendHelp(buf, "netavail_stream_results_dropped_total", "counter",
+            "Results not streamed: the queue was full, a send failed, or there was no connection.");
+        buf.Printf("netavail_stream_results_dropped_total %llu\n", (unsigned long long)streamStats.nDropped);
+        AppendHelp(buf, "netavail_stream_connected", "gauge", "1 while results can be sent to the collector.");
+        buf.Printf("netavail_stream_connected %d\n", streamStats.bConnected ? 1 : 0);
+    }
+
+    StructResolverStats resolverStats = Resolver.GetStats();
+    AppendHelp(buf, "netavail_resolver_lookups_total", "counter", "Target names resolved in the background.");
+    buf.Printf("netavail_resolver_lookups_total %llu\n", (unsigned long long)resolverStats.nLookups);
+    AppendHelp(buf, "netavail_resolver_failures_total", "counter", "Target names that failed to resolve.");
+    buf.Printf("netavail_resolver_failures_total %llu\n", (unsigned long long)resolverStats.nFailures);
+    AppendHelp(buf, "netavail_resolver_address_changes_total", "counter",
+        "Target names that resolved to a different address from before.");
+    buf.Printf("netavail_resolver_address_changes_total %llu\n", (unsigned long long)resolverStats.nChanges);
+    AppendHelp(buf, "netavail_resolver_names", "gauge", "Target names in the resolver's cache.");
+    buf.Printf("netavail_resolver_names %d\n", resolverStats.nNames);
+    if (resolverStats.nNames > 0) {
+        std::shared_ptr<const StructSettingsSnapshot> pSnapshot = GetSettings();
+        AppendHelp(buf, "netavail_target_address", "gauge", "The address each target given by name is pinged at.");
+        for (size_t j = 0; j < pSnapshot->vectTargets.size(); j++) {
+            const std::string& strTarget = pSnapshot->vectTargets[j].strAddress;
+            std::string strAddress = Resolver.Peek(strTarget);
+            if (!strAddress.empty()) {
+                buf.Append("netavail_target_address{target=\"");
+                AppendLabelValue(buf, strTarget.c_str());
+                buf.Append("\",address=\"");
+                AppendLabelValue(buf, strAddress.c_str());
+                buf.Append("\"} 1\n");
+            }
+        }
+    }
+
+    AppendHelp(buf, "netavail_series_memory_bytes", "gauge", "Memory reserved for the RTT history of the latency graph.");
+    buf.Printf("netavail_series_memory_bytes %llu\n", (unsigned long long)RttSeries.GetMemoryUsed());
+    AppendHelp(buf, "netavail_series_targets", "gauge", "Targets with RTT history.");
+    buf.Printf("netavail_series_targets %d\n", RttSeries.GetTargetCount());
+
+    AppendHelp(buf, "netavail_probe_loop_iterations_total", "counter", "Pings done by the probe loop.");
+    buf.Printf("netavail_probe_loop_iterations_total %llu\n",
+        (unsigned long long)ProbeLoopStats.nPings.load(std::memory_order_relaxed));
+    AppendHelp(buf, "netavail_probe_loop_seconds_total", "counter", "Time spent in pings, including waiting for replies.");
+    buf.Printf("netavail_probe_loop_seconds_total %.6f\n",
+        ProbeLoopStats.usBusyTotal.load(std::memory_order_relaxed) / 1e6);
+    AppendHelp(buf, "netavail_probe_loop_overhead_seconds_total", "counter", "Time spent in pings beyond the measured round trips, or the waits of failed pings.");
+    buf.Printf("netavail_probe_loop_overhead_seconds_total %.6f\n",
+        ProbeLoopStats.usOverheadTotal.load(std::memory_order_relaxed) / 1e6);
+    AppendHelp(buf, "netavail_probe_loop_overhead_max_seconds", "gauge", "Largest overhead of a single ping.");
+    buf.Printf("netavail_probe_loop_overhead_max_seconds %.6f\n",
+        ProbeLoopStats.usOverheadMax.load(std::memory_order_relaxed) / 1e6);
+    AppendHelp(buf, "netavail_probe_lag_seconds_total", "counter", "Time by which pings started after their deadlines.");
+    buf.Printf("netavail_probe_lag_seconds_total %.6f\n",
+        ProbeLoopStats.usLagTotal.load(std::memory_order_relaxed) / 1e6);
+    AppendHelp(buf, "netavail_probe_lag_max_seconds", "gauge", "Largest lag of a single ping.");
+    buf.Printf("netavail_probe_lag_max_seconds %.6f\n",
+        ProbeLoopStats.usLagMax.load(std::memory_order_relaxed) / 1e6);
+    AppendHelp(buf, "netavail_probe_lag_last_seconds", "gauge", "Lag of the latest ping.");
+    buf.Printf("netavail_probe_lag_last_seconds %.6f\n",
+        ProbeLoopStats.usLagLast.load(std::memory_order_relaxed) / 1e6);
+    AppendHelp(buf, "netavail_probe_skipped_total", "counter", "Deadlines skipped because a ping overran.");
+    buf.Printf("netavail_probe_skipped_total %llu\n",
+        (unsigned long long)ProbeLoopStats.nSkipped.load(std::memory_order_relaxed));
+    AppendHelp(buf, "netavail_probe_bursts_total", "counter", "Times a target entered burst mode.");
+    buf.Printf("netavail_probe_bursts_total %llu\n",
+        (unsigned long long)ProbeLoopStats.nBursts.load(std::memory_order_relaxed));
+    AppendHelp(buf, "netavail_probe_burst_targets", "gauge", "Targets pinged at the burst interval.");
+    buf.Printf("netavail_probe_burst_targets %d\n", ProbeLoopStats.nInBurst.load(std::memory_order_relaxed));
+
+    int nShards = ShardCount.load();
+    if (nShards > 0) {
+        AppendHelp(buf, "netavail_shard_targets", "gauge", "Targets of each shard.");
+        for (int j = 0; j < nShards; j++) {
+            buf.Printf("netavail_shard_targets{shard=\"%d\"} %d\n", j,
+                ShardStats[j].nTargets.load(std::memory_order_relaxed));
+        }
+        AppendHelp(buf, "netavail_shard_pings_total", "counter", "Pings sent by each shard.");
+        for (int j = 0; j < nShards; j++) {
+            buf.Printf("netavail_shard_pings_total{shard=\"%d\"} %llu\n", j,
+                (unsigned long long)ShardStats[j].nPings.load(std::memory_order_relaxed));
+        }
+        AppendHelp(buf, "netavail_shard_in_flight", "gauge", "Pings each shard has out.");
+        for (int j = 0; j < nShards; j++) {
+            buf.Printf("netavail_shard_in_flight{shard=\"%d\"} %d\n", j,
+                ShardStats[j].nActive.load(std::memory_order_relaxed));
+        }
+        AppendHelp(buf, "netavail_shard_finishing", "gauge", "Pings of each shard waiting for or being finished by a worker.");
+        for (int j = 0; j < nShards; j++) {
+            buf.Printf("netavail_shard_finishing{shard=\"%d\"} %d\n", j,
+                ShardStats[j].nFinishing.load(std::memory_order_relaxed));
+        }
+        AppendHelp(buf, "netavail_shard_busy_seconds_total", "counter", "Time each shard spent other than waiting on its backend.");
+        for (int j = 0; j < nShards; j++) {
+            buf.Printf("netavail_shard_busy_seconds_total{shard=\"%d\"} %.6f\n", j,
+                ShardStats[j].usBusy.load(std::memory_order_relaxed) / 1e6);
+        }
+
+        int nWorkers = FinishPool.GetWorkerCount();
+        StructWorkerStats aryWorkers[WORKPOOL_MAX_WORKERS];
+        for (int j = 0; j < nWorkers; j++) {
+            aryWorkers[j] = FinishPool.GetStats(j);
+        }
+        AppendHelp(buf, "netavail_worker_tasks_total", "counter", "Pings finished by each worker.");
+        for (int j = 0; j < nWorkers; j++) {
+            buf.Printf("netavail_worker_tasks_total{worker=\"%d\"} %llu\n", j, (unsigned long long)aryWorkers[j].nTasks);
+        }
+        AppendHelp(buf, "netavail_worker_stolen_total", "counter", "Pings each worker took from another's queue.");
+        for (int j = 0; j < nWorkers; j++) {
+            buf.Printf("netavail_worker_stolen_total{worker=\"%d\"} %llu\n", j, (unsigned long long)aryWorkers[j].nStolen);
+        }
+        AppendHelp(buf, "netavail_worker_queued", "gauge", "Pings waiting in each worker's queue.");
+        for (int j = 0; j < nWorkers; j++) {
+            buf.Printf("netavail_worker_queued{worker=\"%d\"} %d\n", j, aryWorkers[j].nQueued);
+        }
+        AppendHelp(buf, "netavail_worker_busy_seconds_total", "counter", "Time each worker spent finishing pings.");
+        for (int j = 0; j < nWorkers; j++) {
+            buf.Printf("netavail_worker_busy_seconds_total{worker=\"%d\"} %.6f\n", j, aryWorkers[j].usBusy / 1e6);
+        }
+    }
+
+#if NAL_STAGE_TIMERS
+    RenderStageStats(buf);
+#endif
+    if (CCritSec::IsStatsEnabled()) {
+        RenderLockStats(buf);
+    }
+}
+
+CMetricsServer::CMetricsServer()
+    : m_sockListen((intptr_t)INVALID_SOCKET), m_bStop(false), m_pfnRender(Render), m_bufHeader(256)
+{
+}
+
+CMetricsServer::~CMetricsServer()
+{
+    Stop();
+}
+
+bool CMetricsServer::Start(int port, std::string& strError, PFN_RENDER_METRICS pfnRender)
+{
+    m_pfnRender = pfnRender ? pfnRender : Render;
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    auto sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) {
+        strError = "Cannot create metrics socket";
+        return false;
+    }
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 8) != 0) {
+        closesocket(sock);
+        strError = "Cannot listen for metrics on 127.0.0.1:" + std::to_string(port);
+        return false;
+    }
+    m_sockListen = (intptr_t)sock;
+    m_bStop = false;
+    m_thread = std::thread(&CMetricsServer::ThreadMain, this);
+    return true;
+}
+
+void CMetricsServer::Stop()
+{
+    if (!m_thread.joinable()) {
+        return;
+    }
+    m_bStop = true;
+    m_thread.join();
+    closesocket(m_sockListen);
+    m_sockListen = (intptr_t)INVALID_SOCKET;
+}
+
+void CMetricsServer::ThreadMain()
+{
+    while (!m_bStop) {
+        // Wake up twice a second to notice Stop.
+        pollfd pfd;
+        pfd.fd = m_sockListen;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+        auto sock = accept(m_sockListen, NULL, NULL);
+        if (sock == INVALID_SOCKET) {
+            continue;
+        }
+        HandleConnection((intptr_t)sock);
+        closesocket(sock);
+    }
+}
+
+// Read one request and answer it.  Only GET /metrics (or /) is served.
+void CMetricsServer::HandleConnection(intptr_t sock)
+{
+#ifdef _WIN32
+    DWORD msTimeout = METRICS_RECV_TIMEOUT_MS;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&msTimeout, sizeof(msTimeout));
+#else
+    timeval tv = { METRICS_RECV_TIMEOUT_MS / 1000, (METRICS_RECV_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+    char szRequest[METRICS_REQUEST_MAX];
+    size_t cbRequest = 0;
+    while (cbRequest < sizeof(szRequest) - 1) {
+        int cb = recv(sock, szRequest + cbRequest, (int)(sizeof(szRequest) - 1 - cbRequest), 0);
+        if (cb <= 0) {
+            break;
+        }
+        cbRequest += cb;
+        szRequest[cbRequest] = '\0';
+        if (strstr(szRequest, "\r\n\r\n") || strstr(szRequest, "\n\n")) {
+            break;
+        }
+    }
+    szRequest[cbRequest] = '\0';
+
+    bool bFound = strncmp(szRequest, "GET /metrics ", 13) == 0 || strncmp(szRequest, "GET / ", 6) == 0;
+    m_bufBody.Clear();
+    if (bFound) {
+        m_pfnRender(m_bufBody);
+    } else {
+        m_bufBody.Append("Not found\n");
+    }
+    m_bufHeader.Clear();
+    m_bufHeader.Printf("HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %llu\r\nConnection: close\r\n\r\n",
+        bFound ? "200 OK" : "404 Not Found",
+        bFound ? "text/plain; version=0.0.4; charset=utf-8" : "text/plain",
+        (unsigned long long)m_bufBody.GetSize());
+
+    const CTextBuffer* AryParts[] = { &m_bufHeader, &m_bufBody };
+    for (int j = 0; j < 2; j++) {
+        const char* p = AryParts[j]->GetData();
+        size_t cbLeft = AryParts[j]->GetSize();
+        while (cbLeft > 0) {
+            int cb = send(sock, p, (int)cbLeft, SEND_FLAGS);
+            if (cb <= 0) {
+                return;
+            }
+            p += cb;
+            cbLeft -= cb;
+        }
+    }
+}
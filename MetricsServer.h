@@ -0,0 +1,73 @@
+// MetricsServer.h : Minimal HTTP endpoint on localhost serving Prometheus
+// text-format metrics: probe counts, failures by error code, RTT
+// histograms and quantiles per target, log writer queue figures, and
+// probe loop timing.
+//
+// One thread accepts connections and answers them one at a time; that is
+// plenty for a scraper.  Everything it reports is read from atomics, so a
+// scrape never takes a lock the probe path holds, and the response is
+// rendered into buffers that are reused from one scrape to the next.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A text buffer that keeps its memory between uses, so rendering only
+// allocates when a response is bigger than any before it.
+class CTextBuffer
+{
+public:
+    CTextBuffer(size_t cbInitial = 16 * 1024) : m_vect(cbInitial), m_cb(0) {}
+
+    void Clear() { m_cb = 0; }
+    void Append(const char* p, size_t cb);
+    void Append(const char* psz);
+    void Printf(const char* pszFormat, ...);
+
+    const char* GetData() const { return &m_vect[0]; }
+    size_t GetSize() const { return m_cb; }
+
+private:
+    void Reserve(size_t cbMore);
+
+    std::vector<char> m_vect;
+    size_t m_cb;
+};
+
+// Helpers for renderers: the HELP and TYPE lines of a metric, and a label
+// value, escaped as the text format requires.
+void AppendHelp(CTextBuffer& buf, const char* pszName, const char* pszType, const char* pszHelp);
+void AppendLabelValue(CTextBuffer& buf, const char* psz);
+
+typedef void (*PFN_RENDER_METRICS)(CTextBuffer& buf);
+
+class CMetricsServer
+{
+public:
+    CMetricsServer();
+    ~CMetricsServer();
+
+    // Listen on 127.0.0.1:port and start the server thread.  Scrapes are
+    // answered by pfnRender, or by Render if it is NULL.
+    bool Start(int port, std::string& strError, PFN_RENDER_METRICS pfnRender = NULL);
+    void Stop();
+
+    // Render the metrics into buf.  Exposed for callers that want the
+    // text without HTTP.
+    static void Render(CTextBuffer& buf);
+
+private:
+    void ThreadMain();
+    void HandleConnection(intptr_t sock);
+
+    intptr_t    m_sockListen;
+    std::thread m_thread;
+    std::atomic<bool> m_bStop;
+    PFN_RENDER_METRICS m_pfnRender;
+    CTextBuffer m_bufBody;
+    CTextBuffer m_bufHeader;
+};
@@ -0,0 +1,118 @@
+// MpscQueue.h : Bounded lock-free multi-producer, single-consumer queue.
+// Based on Dmitry Vyukov's bounded queue: each cell carries a sequence
+// number that tells producers and the consumer whose turn it is, so
+// neither side ever takes a lock or blocks.  Push fails, rather than
+// waiting, when the queue is full.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+template <typename T>
+class CMpscQueue
+{
+public:
+    // nCapacity is rounded up to a power of 2.
+    CMpscQueue(size_t nCapacity)
+    {
+        size_t n = 2;
+        while (n < nCapacity) {
+            n <<= 1;
+        }
+        m_mask = n - 1;
+        m_cells = std::vector<Cell>(n);
+        for (size_t j = 0; j < n; j++) {
+            m_cells[j].seq.store(j, std::memory_order_relaxed);
+        }
+        m_posEnqueue.store(0, std::memory_order_relaxed);
+        m_posDequeue.store(0, std::memory_order_relaxed);
+    }
+
+    // Claim a cell for writing.  Callable from any thread.
+    // Exit:   Returns the cell's item to fill in, or NULL if the queue is
+    //         full.  The item must be published with EndPush.
+    T* BeginPush(size_t& pos)
+    {
+        pos = m_posEnqueue.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = m_cells[pos & m_mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (m_posEnqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    return &cell.item;
+                }
+            } else if (diff < 0) {
+                return NULL;
+            } else {
+                pos = m_posEnqueue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void EndPush(size_t pos)
+    {
+        m_cells[pos & m_mask].seq.store(pos + 1, std::memory_order_release);
+    }
+
+    bool Push(const T& item)
+    {
+        size_t pos;
+        T* pItem = BeginPush(pos);
+        if (pItem == NULL) {
+            return false;
+        }
+        *pItem = item;
+        EndPush(pos);
+        return true;
+    }
+
+    // Look at the oldest item.  Consumer thread only.
+    // Exit:   Returns the item, or NULL if the queue is empty (or the
+    //         oldest item is still being written).  Release it with Pop.
+    T* Front()
+    {
+        size_t pos = m_posDequeue.load(std::memory_order_relaxed);
+        Cell& cell = m_cells[pos & m_mask];
+        if (cell.seq.load(std::memory_order_acquire) != pos + 1) {
+            return NULL;
+        }
+        return &cell.item;
+    }
+
+    void Pop()
+    {
+        size_t pos = m_posDequeue.load(std::memory_order_relaxed);
+        m_cells[pos & m_mask].seq.store(pos + m_mask + 1, std::memory_order_release);
+        m_posDequeue.store(pos + 1, std::memory_order_relaxed);
+    }
+
+    // Approximate number of items queued; exact when no push is in progress.
+    size_t GetDepth() const
+    {
+        size_t posEnq = m_posEnqueue.load(std::memory_order_relaxed);
+        size_t posDeq = m_posDequeue.load(std::memory_order_relaxed);
+        return posEnq >= posDeq ? posEnq - posDeq : 0;
+    }
+
+    size_t GetCapacity() const { return m_mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T item;
+
+        Cell() : seq(0) {}
+        Cell(const Cell& other) : seq(other.seq.load()), item(other.item) {}
+    };
+
+    std::vector<Cell> m_cells;
+    size_t m_mask;
+
+    // Producers and the consumer update different counters; keep them on
+    // separate cache lines.
+    alignas(64) std::atomic<size_t> m_posEnqueue;
+    alignas(64) std::atomic<size_t> m_posDequeue;
+};
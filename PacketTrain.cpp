@@ -0,0 +1,176 @@
+// PacketTrain.cpp : Packet train to one target.  See PacketTrain.h.
+
+#include "PacketTrain.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+CPacketTrain::CPacketTrain(CProbeBackend& backend)
+    : m_backend(backend)
+{
+    m_iTarget = -1;
+    m_bRunning = false;
+    m_nPackets = 0;
+    m_msSpacing = 0;
+    m_msTimeout = 0;
+    m_usStart = 0;
+    m_nSent = 0;
+    m_nOutstanding = 0;
+    m_iHighest = -1;
+    m_usLastRtt = -1;
+    m_jitter = 0;
+    m_usTotal = 0;
+    StructTrainResult result = { 0, 0, 0, 0, 0, -1, -1, -1, 0 };
+    m_result = result;
+}
+
+CPacketTrain::~CPacketTrain()
+{
+    m_backend.RemoveTarget(m_iTarget);
+}
+
+bool CPacketTrain::Start(const std::string& strAddress, int nPackets, int msSpacing, int msTimeout,
+    std::string& strError)
+{
+    if (m_bRunning) {
+        strError = "a packet train is already running";
+        return false;
+    }
+    // Register the target afresh for each train.  Requests of the same
+    // index share a sink from train to train, and the backend reports no
+    // more duplicates of a removed target's requests, so a late duplicate
+    // of the last train's reply isn't counted against this train's.
+    m_backend.RemoveTarget(m_iTarget);
+    m_iTarget = m_backend.AddTarget(strAddress.c_str(), strError);
+    if (m_iTarget < 0) {
+        return false;
+    }
+    if (m_vectSinks.empty()) {
+        StructProbeSink sink = { OnProbeDone, this };
+        m_vectSinks.assign(TRAIN_MAX_PACKETS, sink);
+        m_backend.ReportDuplicates(true);
+    }
+
+    m_nPackets = nPackets < 1 ? 1 : nPackets > TRAIN_MAX_PACKETS ? TRAIN_MAX_PACKETS : nPackets;
+    m_msSpacing = msSpacing < 0 ? 0 : msSpacing;
+    m_msTimeout = msTimeout;
+    m_nSent = 0;
+    m_nOutstanding = 0;
+    m_iHighest = -1;
+    m_usLastRtt = -1;
+    m_jitter = 0;
+    m_usTotal = 0;
+    m_vectAnswered.assign(m_nPackets, false);
+    StructTrainResult result = { 0, 0, 0, 0, 0, -1, -1, -1, 0 };
+    m_result = result;
+    m_bRunning = true;
+    m_usStart = ProbeNowMicros();
+    SendDue();
+    return true;
+}
+
+void CPacketTrain::SendDue()
+{
+    if (!m_bRunning) {
+        return;
+    }
+    int64_t usNow = ProbeNowMicros();
+    int64_t usDue;
+    while (m_nSent < m_nPackets && usNow >= (usDue = m_usStart + (int64_t)m_nSent * m_msSpacing * 1000)) {
+        if (m_backend.Send(m_iTarget, m_msTimeout, &m_vectSinks[m_nSent])) {
+            m_nOutstanding++;
+        }
+        if (usNow - usDue > m_result.usLateMax) {
+            m_result.usLateMax = usNow - usDue;
+        }
+        m_nSent++;
+    }
+    if (m_nSent == m_nPackets && m_nOutstanding == 0) {
+        Finish();
+    }
+}
+
+int CPacketTrain::GetMsUntilNext() const
+{
+    if (!m_bRunning || m_nSent == m_nPackets) {
+        return INT32_MAX;
+    }
+    int64_t usUntil = m_usStart + (int64_t)m_nSent * m_msSpacing * 1000 - ProbeNowMicros();
+    return usUntil <= 0 ? 0 : (int)((usUntil + 999) / 1000);
+}
+
+void CPacketTrain::OnProbeDone(const StructProbeResult& result, void* pContext)
+{
+    CPacketTrain* pTrain = (CPacketTrain*)pContext;
+    int iPacket = (int)((const StructProbeSink*)result.pUser - &pTrain->m_vectSinks[0]);
+    if (!pTrain->m_bRunning || iPacket >= pTrain->m_nSent) {
+        return;
+    }
+    StructTrainResult& train = pTrain->m_result;
+    if (result.bDuplicate) {
+        if (pTrain->m_vectAnswered[iPacket]) {
+            train.nDuplicates++;
+        }
+        return;
+    }
+    pTrain->m_nOutstanding--;
+    if (result.errorCode == 0 && !pTrain->m_vectAnswered[iPacket]) {
+        pTrain->m_vectAnswered[iPacket] = true;
+        train.nReceived++;
+        if (iPacket < pTrain->m_iHighest) {
+            train.nReordered++;
+        } else {
+            pTrain->m_iHighest = iPacket;
+        }
+
+        // RFC 3550 6.4.1: J += (|D(i-1,i)| - J) / 16, where D is the change
+        // in transit time from the previous reply to arrive.
+        int64_t usRtt = result.usRoundTrip;
+        if (pTrain->m_usLastRtt >= 0) {
+            pTrain->m_jitter += (llabs(usRtt - pTrain->m_usLastRtt) - pTrain->m_jitter) / 16;
+        }
+        pTrain->m_usLastRtt = usRtt;
+        if (train.usMin < 0 || usRtt < train.usMin) {
+            train.usMin = usRtt;
+        }
+        if (usRtt > train.usMax) {
+            train.usMax = usRtt;
+        }
+        pTrain->m_usTotal += usRtt;
+    }
+    if (pTrain->m_nSent == pTrain->m_nPackets && pTrain->m_nOutstanding == 0) {
+        pTrain->Finish();
+    }
+}
+
+void CPacketTrain::Finish()
+{
+    m_bRunning = false;
+    m_result.nSent = m_nSent;
+    m_result.usJitter = (int64_t)m_jitter;
+    m_result.usMean = m_result.nReceived > 0 ? m_usTotal / m_result.nReceived : -1;
+}
+
+// Format a time in microseconds as milliseconds, or "-" if there is none.
+static void FormatTrainMs(int64_t us, char* szBuf, size_t cbBuf)
+{
+    if (us < 0) {
+        snprintf(szBuf, cbBuf, "-");
+    } else {
+        snprintf(szBuf, cbBuf, "%lld.%03lld", (long long)(us / 1000), (long long)(us % 1000));
+    }
+}
+
+std::string CPacketTrain::Format(const StructTrainResult& result)
+{
+    char szJitter[32], szMin[32], szMean[32], szMax[32], szLate[32];
+    FormatTrainMs(result.nReceived > 1 ? result.usJitter : -1, szJitter, sizeof(szJitter));
+    FormatTrainMs(result.usMin, szMin, sizeof(szMin));
+    FormatTrainMs(result.usMean, szMean, sizeof(szMean));
+    FormatTrainMs(result.usMax, szMax, sizeof(szMax));
+    FormatTrainMs(result.usLateMax, szLate, sizeof(szLate));
+    char szBuf[240];
+    snprintf(szBuf, sizeof(szBuf), "n=%d lost=%d loss=%.1f reordered=%d dup=%d jitter=%s min=%s avg=%s max=%s late=%s",
+        result.nSent, result.nSent - result.nReceived, result.GetLossPercent(), result.nReordered,
+        result.nDuplicates, szJitter, szMin, szMean, szMax, szLate);
+    return szBuf;
+}
@@ -0,0 +1,109 @@
+// PacketTrain.h : Packet train to one target, for loss percentage and
+// jitter.  A single ping can't tell one lost packet from an outage, and
+// says nothing about the variation in delay that breaks voice and video.
+// A train is nPackets echo requests sent msSpacing apart; its replies
+// give:
+//   loss        the share of requests with no reply within the timeout
+//   reordered   replies that arrived after a reply to a later request
+//   duplicates  further replies to a request already answered
+//   jitter      the RFC 3550 interarrival jitter: a running mean of the
+//               difference in transit time between replies, in the order
+//               they arrived, smoothed by 1/16.  Round trips stand in for
+//               one-way transit times; the difference is the same, so no
+//               clock synchronization is needed.
+//
+// The train sends through the prober's probe backend, which its CProberSet
+// may share with other probers, and turns on duplicate replies there.  Its
+// requests carry a StructProbeSink, so their replies reach the train
+// whenever the backend's owner polls it with DispatchProbeDone.  Requests
+// go out from SendDue as their time comes, which the prober's loop learns
+// from GetMsUntilNext, and replies are collected while later requests are
+// still to be sent, so a train of n requests takes about n * msSpacing
+// plus one round trip, not n round trips, and never holds up the loop.
+// The loop waits in whole milliseconds, so a request may go out up to a
+// millisecond after its time, or more while the loop is busy; each
+// train's result has the most any of its requests was late.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ProbeBackend.h"
+
+#define TRAIN_MAX_PACKETS   1000
+
+// The outcome of one train.  Round trips are in microseconds, and are
+// -1 if no reply came back.
+struct StructTrainResult {
+    int      nSent;
+    int      nReceived;     // requests answered, not counting duplicates
+    int      nReordered;
+    int      nDuplicates;
+    int64_t  usJitter;
+    int64_t  usMin;
+    int64_t  usMean;
+    int64_t  usMax;
+    int64_t  usLateMax;     // longest a request went out after its time
+
+    // Exit:   Returns the percentage of requests that got no reply.
+    double GetLossPercent() const { return nSent > 0 ? 100.0 * (nSent - nReceived) / nSent : 0; }
+};
+
+class CPacketTrain
+{
+public:
+    // Trains go through backend, which the caller opens and polls.
+    CPacketTrain(CProbeBackend& backend);
+    ~CPacketTrain();
+
+    // Start a train to a numeric IPv4 or IPv6 address, and send its first
+    // request.
+    // Exit:   Returns false with strError set if the backend refuses the
+    //         address, or a train is running.
+    bool Start(const std::string& strAddress, int nPackets, int msSpacing, int msTimeout, std::string& strError);
+
+    // Send the requests that are due.  A request the backend has no room
+    // for counts as lost.
+    void SendDue();
+
+    // Exit:   Returns how long until the next request is due, in ms rounded
+    //         up, or INT32_MAX if all have been sent.
+    int GetMsUntilNext() const;
+
+    // A train runs until every request it sent has been answered or has
+    // timed out.
+    bool IsRunning() const { return m_bRunning; }
+
+    // The outcome of the last train.
+    const StructTrainResult& GetResult() const { return m_result; }
+
+    // Exit:   Returns a train's outcome as logged in "train" records, e.g.
+    //         "n=20 lost=1 loss=5.0 reordered=0 dup=0 jitter=1.208
+    //         min=11.480 avg=13.902 max=19.775 late=0.412", times in ms.
+    static std::string Format(const StructTrainResult& result);
+
+private:
+    static void OnProbeDone(const StructProbeResult& result, void* pContext);
+    void Finish();
+
+    CProbeBackend& m_backend;
+    int         m_iTarget;      // added anew by each Start
+    bool        m_bRunning;
+    int         m_nPackets;
+    int         m_msSpacing;
+    int         m_msTimeout;
+    int64_t     m_usStart;      // when the first request was due
+    int         m_nSent;        // requests handed to the backend so far
+    int         m_nOutstanding;
+    int         m_iHighest;     // highest request index answered so far, or -1
+    int64_t     m_usLastRtt;    // round trip of the last reply to arrive, or -1
+    double      m_jitter;       // RFC 3550 J, in microseconds
+    int64_t     m_usTotal;
+    std::vector<bool> m_vectAnswered;
+    // The pUser of each request, by index.  Made TRAIN_MAX_PACKETS long by
+    // the first train and never moved, as a backend may still hold the
+    // requests of an earlier train; Start removes the target, so their
+    // replies don't reach this train.
+    std::vector<StructProbeSink> m_vectSinks;
+    StructTrainResult m_result;
+};
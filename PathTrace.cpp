@@ -0,0 +1,206 @@
+// PathTrace.cpp : Path trace to one target.  See PathTrace.h.
+
+#include "PathTrace.h"
+#include "ErrorCodes.h"
+#include <stdio.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+CPathTracer::CPathTracer()
+{
+    m_iTarget = -1;
+    m_bRunning = false;
+    m_nMaxHops = 0;
+    m_nRounds = 0;
+    m_msTimeout = 0;
+    m_iRound = 0;
+    m_nOutstanding = 0;
+    m_ttlEnd = 1;
+    m_errorEnd = 0;
+    m_usRoundStart = 0;
+}
+
+CPathTracer::~CPathTracer()
+{
+    if (m_pBackend) {
+        m_pBackend->Close();
+    }
+}
+
+bool CPathTracer::Start(const std::string& strBackend, const std::string& strAddress, int nMaxHops, int nRounds,
+    int msTimeout, std::string& strError)
+{
+    if (m_bRunning) {
+        strError = "a path trace is already running";
+        return false;
+    }
+    if (!m_pBackend || strBackend != m_strBackend) {
+        if (m_pBackend) {
+            m_pBackend->Close();
+            m_iTarget = -1;
+        }
+        m_strBackend = strBackend;
+        m_pBackend.reset(CreateProbeBackend(strBackend, strError));
+        if (!m_pBackend) {
+            return false;
+        }
+        if (!m_pBackend->Open(strError)) {
+            m_pBackend.reset();
+            return false;
+        }
+    }
+    if (m_iTarget < 0 || strAddress != m_strAddress) {
+        m_pBackend->RemoveTarget(m_iTarget);
+        m_strAddress = strAddress;
+        m_iTarget = m_pBackend->AddTarget(strAddress.c_str(), strError);
+        if (m_iTarget < 0) {
+            return false;
+        }
+    }
+
+    m_nMaxHops = nMaxHops < 1 ? 1 : nMaxHops > TRACE_MAX_HOPS ? TRACE_MAX_HOPS : nMaxHops;
+    m_nRounds = nRounds < 1 ? 1 : nRounds;
+    m_msTimeout = msTimeout;
+    m_iRound = 0;
+    m_nOutstanding = 0;
+    m_ttlEnd = m_nMaxHops + 1;
+    m_errorEnd = 0;
+    StructHopStats hop;
+    hop.addr.Clear();
+    hop.nSent = 0;
+    hop.nAnswered = 0;
+    hop.usMin = 0;
+    hop.usMax = 0;
+    hop.usTotal = 0;
+    m_vectHops.assign(m_nMaxHops, hop);
+
+    SendRound();
+    if (m_nOutstanding == 0) {
+        strError = "path traces need a probe backend that can limit the TTL";
+        return false;
+    }
+    m_bRunning = true;
+    return true;
+}
+
+// Send one request for each hop up to the target, or up to nMaxHops
+// while the target hasn't been seen.
+void CPathTracer::SendRound()
+{
+    m_usRoundStart = ProbeNowMicros();
+    m_iRound++;
+    int ttlLast = m_ttlEnd <= m_nMaxHops ? m_ttlEnd : m_nMaxHops;
+    for (int ttl = 1; ttl <= ttlLast; ttl++) {
+        if (m_pBackend->SendTtl(m_iTarget, ttl, m_msTimeout, (void*)(intptr_t)ttl)) {
+            m_vectHops[ttl - 1].nSent++;
+            m_nOutstanding++;
+        }
+    }
+}
+
+void CPathTracer::OnProbeDone(const StructProbeResult& result, void* pContext)
+{
+    CPathTracer* pTracer = (CPathTracer*)pContext;
+    int ttl = (int)(intptr_t)result.pUser;
+    pTracer->m_nOutstanding--;
+    if (result.errorCode == PROBE_ERR_TIMED_OUT) {
+        return;
+    }
+    StructHopStats& hop = pTracer->m_vectHops[ttl - 1];
+    if (result.errorCode != PROBE_ERR_TTL_EXPIRED && ttl < pTracer->m_ttlEnd) {
+        // An echo reply, or an error such as an unreachable that the
+        // request got no further than.
+        pTracer->m_ttlEnd = ttl;
+        pTracer->m_errorEnd = result.errorCode;
+    }
+    if (result.addrFrom.IsSet()) {
+        hop.addr = result.addrFrom;
+    }
+    if (hop.nAnswered == 0 || result.usRoundTrip < hop.usMin) {
+        hop.usMin = result.usRoundTrip;
+    }
+    if (result.usRoundTrip > hop.usMax) {
+        hop.usMax = result.usRoundTrip;
+    }
+    hop.usTotal += result.usRoundTrip;
+    hop.nAnswered++;
+}
+
+int CPathTracer::GetMsUntilNext() const
+{
+    if (!m_bRunning) {
+        return INT32_MAX;
+    }
+    int64_t usNow = ProbeNowMicros();
+    int64_t usNext = m_nOutstanding > 0 ? m_usRoundStart + (int64_t)m_msTimeout * 1000
+        : m_usRoundStart + (int64_t)TRACE_ROUND_MS * 1000;
+    return usNext <= usNow ? 0 : (int)((usNext - usNow + 999) / 1000);
+}
+
+bool CPathTracer::Poll(int msWait)
+{
+    if (!m_bRunning) {
+        return false;
+    }
+    if (m_nOutstanding == 0 && ProbeNowMicros() - m_usRoundStart >= (int64_t)TRACE_ROUND_MS * 1000) {
+        SendRound();
+    }
+    m_pBackend->Poll(m_nOutstanding > 0 ? msWait : 0, OnProbeDone, this);
+    if (m_nOutstanding == 0 && m_iRound >= m_nRounds) {
+        Finish();
+        return true;
+    }
+    return false;
+}
+
+// Drop the hops past the target, or past the first silent hop after
+// the last that answered.
+void CPathTracer::Finish()
+{
+    m_bRunning = false;
+    size_t nHops = m_vectHops.size();
+    if (m_ttlEnd <= m_nMaxHops) {
+        nHops = m_ttlEnd;
+    } else {
+        while (nHops > 0 && m_vectHops[nHops - 1].nAnswered == 0) {
+            nHops--;
+        }
+        if (nHops < m_vectHops.size()) {
+            nHops++;
+        }
+    }
+    m_vectHops.resize(nHops);
+}
+
+std::string CPathTracer::Format() const
+{
+    char szBuf[100];
+    if (m_ttlEnd > m_nMaxHops) {
+        snprintf(szBuf, sizeof(szBuf), "unreached hops=%d", (int)m_vectHops.size());
+    } else if (m_errorEnd != 0) {
+        char szCode[32];
+        FormatErrorCode(m_errorEnd, szCode, sizeof(szCode));
+        snprintf(szBuf, sizeof(szBuf), "stopped=%s hops=%d", szCode, (int)m_vectHops.size());
+    } else {
+        snprintf(szBuf, sizeof(szBuf), "reached hops=%d", (int)m_vectHops.size());
+    }
+    std::string strOut = szBuf;
+    for (size_t j = 0; j < m_vectHops.size(); j++) {
+        const StructHopStats& hop = m_vectHops[j];
+        std::string strAddr = FormatProbeAddr(hop.addr);
+        int pctLoss = hop.nSent > 0 ? 100 * (hop.nSent - hop.nAnswered) / hop.nSent : 100;
+        if (hop.nAnswered > 0) {
+            int64_t usMean = hop.usTotal / hop.nAnswered;
+            snprintf(szBuf, sizeof(szBuf), " %d=%s/%lld.%03lld/%d%%", (int)j + 1, strAddr.c_str(),
+                (long long)(usMean / 1000), (long long)(usMean % 1000), pctLoss);
+        } else {
+            snprintf(szBuf, sizeof(szBuf), " %d=%s/-/%d%%", (int)j + 1, strAddr.c_str(), pctLoss);
+        }
+        strOut += szBuf;
+    }
+    return strOut;
+}
@@ -0,0 +1,92 @@
+// PathTrace.h : Path trace to one target, in the manner of traceroute or
+// MTR, to tell whether trouble is on the LAN, at the ISP or at the far end.
+// Echo requests with TTLs 1 to nMaxHops go out together in each round,
+// rather than one hop after another; each router where the TTL runs out
+// answers with IP_TTL_EXPIRED_TRANSIT from its own address, and the
+// target answers the rest.  After the first round, rounds only go as far
+// as the target.  Rounds are at least TRACE_ROUND_MS apart, and the next
+// one starts only once the last has been answered or timed out, so a
+// trace adds at most one request per hop per second to the path.
+//
+// The tracer has its own probe backend, of the kind the prober uses, so
+// its requests and answers never mix with the prober's.  It is driven by
+// Poll from the prober's loop and never blocks it.
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ProbeBackend.h"
+
+#define TRACE_MAX_HOPS  64
+#define TRACE_ROUND_MS  1000
+
+// What one hop did over all rounds of a trace.
+struct StructHopStats {
+    StructProbeAddr addr;   // the last address that answered, if any
+    int      nSent;
+    int      nAnswered;
+    int64_t  usMin;         // round trips of the answers
+    int64_t  usMax;
+    int64_t  usTotal;
+};
+
+class CPathTracer
+{
+public:
+    CPathTracer();
+    ~CPathTracer();
+
+    // Start a trace to a numeric IPv4 or IPv6 address through a backend
+    // named as for CreateProbeBackend.  The backend is kept for later
+    // traces while strBackend stays the same.
+    // Exit:   Returns false with strError set if the backend can't be
+    //         opened, refuses the address, or can't limit TTLs.
+    bool Start(const std::string& strBackend, const std::string& strAddress, int nMaxHops, int nRounds,
+        int msTimeout, std::string& strError);
+
+    // Send the next round if it is due, and collect answers, waiting up
+    // to msWait milliseconds for them.
+    // Exit:   Returns true if the trace finished in this call.
+    bool Poll(int msWait);
+
+    bool IsRunning() const { return m_bRunning; }
+
+    // Exit:   Returns how long until the trace next needs Poll, in ms.
+    int GetMsUntilNext() const;
+
+    // The outcome of the last trace.  Hops run from TTL 1 to the target,
+    // or, if it never answered, to the first hop past the last that did.
+    const std::string& GetAddress() const { return m_strAddress; }
+    const std::vector<StructHopStats>& GetHops() const { return m_vectHops; }
+    bool IsReached() const { return m_ttlEnd <= m_nMaxHops && m_errorEnd == 0; }
+
+    // Exit:   Returns the outcome of the last trace as logged in "trace"
+    //         records, e.g. "reached hops=3 1=192.168.1.1/0.612/0%
+    //         2=*/-/100% 3=8.8.8.8/14.210/33%": each hop's address, mean
+    //         round trip in ms and loss.  The first word is "reached" if
+    //         the target answered, "stopped=CODE" if a hop answered with
+    //         an error such as IP_DEST_NET_UNREACHABLE, or "unreached".
+    std::string Format() const;
+
+private:
+    static void OnProbeDone(const StructProbeResult& result, void* pContext);
+    void SendRound();
+    void Finish();
+
+    std::string m_strBackend;
+    std::unique_ptr<CProbeBackend> m_pBackend;
+    int         m_iTarget;
+    std::string m_strAddress;
+    bool        m_bRunning;
+    int         m_nMaxHops;
+    int         m_nRounds;
+    int         m_msTimeout;
+    int         m_iRound;       // rounds sent so far
+    int         m_nOutstanding; // requests of the current round not yet answered
+    int         m_ttlEnd;       // lowest TTL the target (or a final error) answered; past nMaxHops if none
+    uint32_t    m_errorEnd;     // the error answered at m_ttlEnd, or 0 for an echo reply
+    int64_t     m_usRoundStart;
+    std::vector<StructHopStats> m_vectHops;  // by TTL - 1
+};
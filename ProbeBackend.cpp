@@ -0,0 +1,91 @@
+// ProbeBackend.cpp : Choosing a probe backend, and the addresses backends
+// share.  See ProbeBackend.h.
+
+#include "ProbeBackend.h"
+#include "ProbeEngine.h"
+#include "SimBackend.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#else
+#include <arpa/inet.h>
+#include <net/if.h>
+#endif
+
+void StructProbeAddr::SetV4(uint32_t addr)
+{
+    ver = addr != 0 ? 4 : 0;
+    memcpy(ab, &addr, 4);
+}
+
+void StructProbeAddr::SetV6(const void* pAddr)
+{
+    ver = 6;
+    memcpy(ab, pAddr, 16);
+}
+
+void DispatchProbeDone(const StructProbeResult& result, void* pContext)
+{
+    (void)pContext;
+    const StructProbeSink* pSink = (const StructProbeSink*)result.pUser;
+    if (pSink) {
+        pSink->pfnDone(result, pSink->pContext);
+    }
+}
+
+std::string FormatProbeAddr(const StructProbeAddr& addr)
+{
+    char szAddr[INET6_ADDRSTRLEN];
+    if (addr.ver == 0 || inet_ntop(addr.ver == 6 ? AF_INET6 : AF_INET, (void*)addr.ab, szAddr, sizeof(szAddr)) == NULL) {
+        return "*";
+    }
+    return szAddr;
+}
+
+bool ParseNumericAddress(const char* pszAddress, StructProbeAddr& addr, uint32_t& idScope)
+{
+    idScope = 0;
+    if (inet_pton(AF_INET, pszAddress, addr.ab) == 1) {
+        addr.ver = 4;
+        return true;
+    }
+    std::string strAddress = pszAddress;
+    size_t iZone = strAddress.find('%');
+    if (iZone != std::string::npos) {
+        std::string strZone = strAddress.substr(iZone + 1);
+        strAddress.erase(iZone);
+        char* pEnd;
+        idScope = (uint32_t)strtoul(strZone.c_str(), &pEnd, 10);
+        if (strZone.empty() || *pEnd != '\0') {
+            idScope = if_nametoindex(strZone.c_str());
+        }
+        if (idScope == 0) {
+            return false;
+        }
+    }
+    if (inet_pton(AF_INET6, strAddress.c_str(), addr.ab) == 1) {
+        addr.ver = 6;
+        return true;
+    }
+    return false;
+}
+
+CProbeBackend* CreateProbeBackend(const std::string& strSpec, std::string& strError)
+{
+    if (strSpec.empty() || strSpec == "icmp") {
+        return new CProbeEngine();
+    }
+    if (strSpec == "sim" || strSpec.compare(0, 4, "sim:") == 0) {
+        CSimProbeBackend* pSim = new CSimProbeBackend();
+        if (strSpec.size() > 4 && !pSim->Configure(strSpec.substr(4), strError)) {
+            delete pSim;
+            return NULL;
+        }
+        return pSim;
+    }
+    strError = "unknown probe backend: " + strSpec;
+    return NULL;
+}
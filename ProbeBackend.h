@@ -0,0 +1,126 @@
+// ProbeBackend.h : Interface between the probe loop and whatever carries
+// its probes.  CProbeEngine (ProbeEngine.h) sends real ICMP echo requests;
+// CSimProbeBackend (SimBackend.h) simulates a network, for load tests,
+// benchmarks and trying out failures on demand.  Either keeps many
+// requests in flight from one thread and hands back their outcomes from
+// Poll.  Round trip times are in microseconds.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// IP_NO_RESOURCES, IP_REQ_TIMED_OUT and IP_BAD_DESTINATION, for failures
+// a backend reports itself, and IP_TTL_EXPIRED_TRANSIT, the answer from a
+// router to a request sent with a TTL too small to reach the target.
+#define PROBE_ERR_NO_RESOURCES      11006
+#define PROBE_ERR_TIMED_OUT         11010
+#define PROBE_ERR_TTL_EXPIRED       11013
+#define PROBE_ERR_BAD_DESTINATION   11018
+
+// An IPv4 or IPv6 address, as answers come from.
+struct StructProbeAddr {
+    uint8_t  ver;           // 4 or 6, or 0 for none
+    uint8_t  ab[16];        // network order; IPv4 in the first 4 bytes
+
+    void Clear() { ver = 0; }
+    void SetV4(uint32_t addr);      // network order; 0 for none
+    void SetV6(const void* pAddr);  // 16 bytes
+    bool IsSet() const { return ver != 0; }
+};
+
+// Exit:   Returns the address in numeric form, e.g. "192.0.2.1" or
+//         "2001:db8::1", or "*" if it is not set.
+std::string FormatProbeAddr(const StructProbeAddr& addr);
+
+// Parse a numeric IPv4 or IPv6 address.  An IPv6 address may name its
+// zone, as link-local ones must: "fe80::1%eth0", or "fe80::1%2".
+// Exit:   Returns false if it is not a numeric address.
+bool ParseNumericAddress(const char* pszAddress, StructProbeAddr& addr, uint32_t& idScope);
+
+// Result of one request, as delivered to the completion callback.
+struct StructProbeResult {
+    int      iTarget;       // index returned by AddTarget
+    uint16_t seq;           // sequence number of the request
+    uint32_t errorCode;     // 0 (IP_SUCCESS) on success, else IP_xxx or OS error
+    int64_t  usRoundTrip;   // round trip time in microseconds; valid on success,
+                            // and for errors that came back from the network
+    StructProbeAddr addrFrom;   // the address the reply or error came from, if known
+    bool     bDuplicate;    // a further reply to a request already delivered; see ReportDuplicates
+    void*    pUser;         // cookie passed to Send
+};
+
+typedef void (*PFN_PROBE_DONE)(const StructProbeResult& result, void* pContext);
+
+// The pUser of a request on a backend that requests of different kinds
+// share, such as the pings of CProbeSession and the packets of
+// CPacketTrain.  DispatchProbeDone, as the completion callback, hands
+// each result to its sink's pfnDone, with the sink's pContext.
+struct StructProbeSink {
+    PFN_PROBE_DONE pfnDone;
+    void*    pContext;
+};
+
+void DispatchProbeDone(const StructProbeResult& result, void* pContext);
+
+class CProbeBackend
+{
+public:
+    virtual ~CProbeBackend() {}
+
+    virtual bool Open(std::string& strError) = 0;
+    virtual void Close() = 0;
+
+    // Register a target, given as a numeric IPv4 or IPv6 address; names
+    // are resolved beforehand (see Resolver.h).
+    // Exit:   Returns the target index, or -1 with strError set.
+    virtual int  AddTarget(const char* address, std::string& strError) = 0;
+
+    // Once a target is removed, further replies to its requests that were
+    // answered are no longer reported as duplicates, so whatever their
+    // pUser named may go away.
+    virtual void RemoveTarget(int iTarget) = 0;
+
+    // Start a request to a target.  It completes, with a reply, an error
+    // or IP_REQ_TIMED_OUT, through a later Poll.
+    // Exit:   Returns false if too many requests are outstanding.
+    virtual bool Send(int iTarget, int msTimeout, void* pUser) = 0;
+
+    // Start a request whose packet may cross at most ttl routers, for path
+    // traces.  A router where the TTL runs out answers IP_TTL_EXPIRED_TRANSIT
+    // from its own address.
+    // Exit:   Returns false if too many requests are outstanding, or if the
+    //         backend can't limit the TTL.
+    virtual bool SendTtl(int iTarget, int ttl, int msTimeout, void* pUser)
+    {
+        (void)iTarget; (void)ttl; (void)msTimeout; (void)pUser;
+        return false;
+    }
+
+    // Wait up to msWait milliseconds for activity, and deliver completed
+    // requests to pfnDone.
+    // Exit:   Returns the number of requests completed.
+    virtual int  Poll(int msWait, PFN_PROBE_DONE pfnDone, void* pContext) = 0;
+
+    // End the Poll under way on another thread early, or the next one if
+    // none is, e.g. when a worker hands back work the polling thread must
+    // pick up.  Safe from any thread.  Backends that can't be woken
+    // return from Poll when msWait is up, as usual.
+    virtual void Wake() {}
+
+    virtual int  GetInFlight() const = 0;
+
+    // Deliver a second and later reply to a request as a result of its
+    // own, with bDuplicate set, for as long as the request's slot has not
+    // been reused.  Off by default, so that callers that don't count
+    // duplicates never see them.  Backends that can't tell ignore this.
+    virtual void ReportDuplicates(bool bReport) { (void)bReport; }
+};
+
+// Create a backend from its spec: "icmp" (or "") for CProbeEngine, or
+// "sim" or "sim:RULES" for CSimProbeBackend; see SimBackend.h for RULES.
+// The backend is not yet open.
+// Exit:   Returns the backend, or NULL with strError set.
+CProbeBackend* CreateProbeBackend(const std::string& strSpec, std::string& strError);
+
+// Current value of the monotonic clock, in microseconds.
+int64_t ProbeNowMicros();
@@ -0,0 +1,1089 @@
+// ProbeEngine.cpp : Asynchronous ICMP echo engine.  See ProbeEngine.h.
+
+#include "ProbeEngine.h"
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+#include <iphlpapi.h>
+#include <icmpapi.h>
+
+#pragma comment(lib, "iphlpapi.lib")
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+
+// The Windows IP_xxx status codes (see AryErrorCodes in netavailw.cpp).
+// ICMP and ICMPv6 errors seen on Linux are mapped onto these so that the
+// rest of the program handles errors the same way on both platforms.
+// Windows gives some of them other names for IPv6, e.g. IP_DEST_NO_ROUTE
+// for IP_DEST_NET_UNREACHABLE and IP_DEST_PROHIBITED for
+// IP_DEST_PROT_UNREACHABLE.
+#define IP_SUCCESS                  0
+#define IP_DEST_NET_UNREACHABLE     11002
+#define IP_DEST_HOST_UNREACHABLE    11003
+#define IP_DEST_PROT_UNREACHABLE    11004
+#define IP_DEST_PORT_UNREACHABLE    11005
+#define IP_NO_RESOURCES             11006
+#define IP_PACKET_TOO_BIG           11009
+#define IP_REQ_TIMED_OUT            11010
+#define IP_BAD_ROUTE                11012
+#define IP_TTL_EXPIRED_TRANSIT      11013
+#define IP_TTL_EXPIRED_REASSEM      11014
+#define IP_PARAM_PROBLEM            11015
+#define IP_SOURCE_QUENCH            11016
+#define IP_BAD_DESTINATION          11018
+#define IP_GENERAL_FAILURE          11050
+
+// From <linux/icmp.h>, which clashes with <netinet/ip_icmp.h>.
+#ifndef ICMP_FILTER
+#define ICMP_FILTER 1
+#endif
+
+// Number of messages handed to one sendmmsg or recvmmsg call.
+#define PROBE_BATCH     64
+#define PROBE_RECV_SIZE 1500
+#define PROBE_CTL_SIZE  64
+#endif
+
+static const char SendData[PROBE_PAYLOAD_SIZE] = "Data Buffer";
+
+int64_t ProbeNowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CProbeEngine::CProbeEngine()
+{
+    m_seqNext = 1;
+    m_nInFlight = 0;
+    m_bReportDuplicates = false;
+#ifdef _WIN32
+    m_hIcmp = INVALID_HANDLE_VALUE;
+    m_hIcmp6 = INVALID_HANDLE_VALUE;
+    m_hWake = NULL;
+    m_pReplyBufs = NULL;
+    m_cbReplyBuf = 0;
+#else
+    m_sock = -1;
+    m_sock6 = -1;
+    m_epfd = -1;
+    m_fdWake = -1;
+    m_bRaw = false;
+    m_bRaw6 = false;
+    m_id = 0;
+    m_id6 = 0;
+#endif
+}
+
+CProbeEngine::~CProbeEngine()
+{
+    Close();
+}
+
+int CProbeEngine::AddTarget(const char* address, std::string& strError)
+{
+    StructTarget target;
+    memset(&target, 0, sizeof(target));
+    target.bInUse = true;
+    StructProbeAddr addr;
+    uint32_t idScope;
+    if (!ParseNumericAddress(address, addr, idScope)) {
+        strError = "not a numeric IPv4 or IPv6 address: ";
+        strError += address;
+        return -1;
+    }
+    if (addr.ver == 6) {
+        if (!m_strError6.empty()) {
+            strError = m_strError6;
+            return -1;
+        }
+        target.bV6 = true;
+        target.addr6.sin6_family = AF_INET6;
+        memcpy(&target.addr6.sin6_addr, addr.ab, 16);
+        target.addr6.sin6_scope_id = idScope;
+    } else {
+        target.addr.sin_family = AF_INET;
+        memcpy(&target.addr.sin_addr, addr.ab, 4);
+    }
+
+    // Reuse an index freed by RemoveTarget, if there is one.  A prober
+    // set shares one backend among all its targets, each added on its
+    // first ping and again after reloads and re-resolved addresses, so
+    // neither this nor RemoveTarget may search all of them.
+    if (!m_vectFreeTargets.empty()) {
+        int iTarget = m_vectFreeTargets.back();
+        m_vectFreeTargets.pop_back();
+        target.nGeneration = m_vectTargets[iTarget].nGeneration + 1;
+        m_vectTargets[iTarget] = target;
+        return iTarget;
+    }
+    m_vectTargets.push_back(target);
+    return (int)m_vectTargets.size() - 1;
+}
+
+void CProbeEngine::RemoveTarget(int iTarget)
+{
+    if (iTarget >= 0 && iTarget < (int)m_vectTargets.size() && m_vectTargets[iTarget].bInUse) {
+        m_vectTargets[iTarget].bInUse = false;
+        m_vectFreeTargets.push_back(iTarget);
+    }
+}
+
+// Find a free slot and assign it the next sequence number.
+// Exit:   Returns the slot, or NULL if all slots are busy.
+CProbeEngine::StructSlot* CProbeEngine::AllocSlot()
+{
+    if (m_nInFlight >= PROBE_MAX_IN_FLIGHT) {
+        return NULL;
+    }
+    for (int j = 0; j < PROBE_MAX_IN_FLIGHT; j++) {
+        uint16_t seq = m_seqNext++;
+        StructSlot* pSlot = &m_vectSlots[seq & (PROBE_MAX_IN_FLIGHT - 1)];
+        if (!pSlot->bInUse) {
+            pSlot->bInUse = true;
+            pSlot->bAnswered = false;
+            pSlot->bV6 = false;
+            pSlot->seq = seq;
+            m_nInFlight++;
+            return pSlot;
+        }
+    }
+    return NULL;
+}
+
+// Record the completion of a request and free its slot.  The result
+// is handed to the caller's callback by the next DispatchDone.
+void CProbeEngine::Complete(StructSlot* pSlot, uint32_t errorCode, int64_t usRoundTrip,
+    const StructProbeAddr& addrFrom)
+{
+    StructProbeResult result;
+    result.iTarget = pSlot->iTarget;
+    result.seq = pSlot->seq;
+    result.errorCode = errorCode;
+    result.usRoundTrip = usRoundTrip;
+    result.addrFrom = addrFrom;
+    result.bDuplicate = false;
+    result.pUser = pSlot->pUser;
+    m_vectDone.push_back(result);
+
+    pSlot->bInUse = false;
+    pSlot->bAnswered = errorCode == 0;
+    m_nInFlight--;
+}
+
+int CProbeEngine::DispatchDone(PFN_PROBE_DONE pfnDone, void* pContext)
+{
+    int nDone = (int)m_vectDone.size();
+    for (int j = 0; j < nDone; j++) {
+        pfnDone(m_vectDone[j], pContext);
+    }
+    m_vectDone.clear();
+    return nDone;
+}
+
+bool CProbeEngine::Send(int iTarget, int msTimeout, void* pUser)
+{
+    return SendTtl(iTarget, 0, msTimeout, pUser);
+}
+
+#ifdef _WIN32
+
+bool CProbeEngine::Open(std::string& strError)
+{
+    m_hIcmp = IcmpCreateFile();
+    if (m_hIcmp == INVALID_HANDLE_VALUE) {
+        strError = "Unable to open handle.";
+        return false;
+    }
+    m_hIcmp6 = Icmp6CreateFile();
+    m_strError6 = m_hIcmp6 == INVALID_HANDLE_VALUE ? "Unable to open ICMPv6 handle." : "";
+    m_hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (m_hWake == NULL) {
+        strError = "Unable to create event.";
+        Close();
+        return false;
+    }
+
+    // Each slot gets its own reply buffer, carved out of one allocation
+    // that lives as long as the engine, big enough for a reply of either
+    // family.  The extra 8 bytes are for the IO_STATUS_BLOCK that
+    // IcmpSendEcho2 stores when called asynchronously.
+    m_cbReplyBuf = (DWORD)(std::max(sizeof(ICMP_ECHO_REPLY), sizeof(ICMPV6_ECHO_REPLY)) + PROBE_PAYLOAD_SIZE + 8 + 32);
+    m_pReplyBufs = (char*)malloc((size_t)m_cbReplyBuf * PROBE_MAX_IN_FLIGHT);
+    if (m_pReplyBufs == NULL) {
+        strError = "Unable to allocate memory";
+        Close();
+        return false;
+    }
+
+    m_vectSlots.assign(PROBE_MAX_IN_FLIGHT, StructSlot());
+    for (int j = 0; j < PROBE_MAX_IN_FLIGHT; j++) {
+        m_vectSlots[j].bInUse = false;
+        m_vectSlots[j].bAnswered = false;
+        m_vectSlots[j].pEngine = this;
+        m_vectSlots[j].pReplyBuf = m_pReplyBufs + (size_t)j * m_cbReplyBuf;
+    }
+    m_vectDone.reserve(PROBE_MAX_IN_FLIGHT);
+    return true;
+}
+
+void CProbeEngine::Close()
+{
+    if (m_hIcmp != INVALID_HANDLE_VALUE) {
+        // Outstanding requests still reference their slots, so let them
+        // finish (each is bounded by its own timeout) before freeing.
+        while (m_nInFlight > 0) {
+            SleepEx(100, TRUE);
+        }
+        m_vectDone.clear();
+        IcmpCloseHandle(m_hIcmp);
+        m_hIcmp = INVALID_HANDLE_VALUE;
+    }
+    if (m_hIcmp6 != INVALID_HANDLE_VALUE) {
+        IcmpCloseHandle(m_hIcmp6);
+        m_hIcmp6 = INVALID_HANDLE_VALUE;
+    }
+    if (m_hWake != NULL) {
+        CloseHandle(m_hWake);
+        m_hWake = NULL;
+    }
+    if (m_pReplyBufs) {
+        free(m_pReplyBufs);
+        m_pReplyBufs = NULL;
+    }
+}
+
+// Called in the probe thread, during the alertable wait in Poll, when an
+// IcmpSendEcho2 request completes.
+void NTAPI CProbeEngine::ApcRoutine(PVOID pApcContext, PIO_STATUS_BLOCK pIoStatus, ULONG reserved)
+{
+    UNREFERENCED_PARAMETER(pIoStatus);
+    UNREFERENCED_PARAMETER(reserved);
+    StructSlot* pSlot = (StructSlot*)pApcContext;
+    CProbeEngine* pEngine = pSlot->pEngine;
+
+    StructProbeAddr addrFrom;
+    addrFrom.Clear();
+    DWORD nReplies = pSlot->bV6 ? Icmp6ParseReplies(pSlot->pReplyBuf, pEngine->m_cbReplyBuf)
+        : IcmpParseReplies(pSlot->pReplyBuf, pEngine->m_cbReplyBuf);
+    if (nReplies == 0) {
+        pEngine->Complete(pSlot, GetLastError(), 0, addrFrom);
+        return;
+    }
+    ULONG status;
+    ULONG msRoundTrip;
+    if (pSlot->bV6) {
+        PICMPV6_ECHO_REPLY pEchoReply = (PICMPV6_ECHO_REPLY)pSlot->pReplyBuf;
+        status = pEchoReply->Status;
+        msRoundTrip = pEchoReply->RoundTripTime;
+        addrFrom.SetV6(pEchoReply->Address.sin6_addr);
+    } else {
+        PICMP_ECHO_REPLY pEchoReply = (PICMP_ECHO_REPLY)pSlot->pReplyBuf;
+        status = pEchoReply->Status;
+        msRoundTrip = pEchoReply->RoundTripTime;
+        addrFrom.SetV4(pEchoReply->Address);
+    }
+    // RoundTripTime in the reply has only millisecond resolution, so
+    // measure the round trip on the monotonic clock instead.  The APC
+    // runs as soon as the probe thread's alertable wait wakes up.
+    // Path traces may not wait on the engine while their TTL-limited
+    // requests are out, so errors from routers keep RoundTripTime.
+    if (status != IP_SUCCESS) {
+        pEngine->Complete(pSlot, status, (int64_t)msRoundTrip * 1000, addrFrom);
+    } else {
+        pEngine->Complete(pSlot, IP_SUCCESS, ProbeNowMicros() - pSlot->usSent, addrFrom);
+    }
+}
+
+bool CProbeEngine::SendTtl(int iTarget, int ttl, int msTimeout, void* pUser)
+{
+    StructSlot* pSlot = AllocSlot();
+    if (pSlot == NULL) {
+        return false;
+    }
+    StructTarget& target = m_vectTargets[iTarget];
+    pSlot->iTarget = iTarget;
+    pSlot->nGeneration = target.nGeneration;
+    pSlot->bV6 = target.bV6;
+    pSlot->pUser = pUser;
+    pSlot->ttl = ttl;
+    pSlot->usSent = ProbeNowMicros();
+    pSlot->usDeadline = pSlot->usSent + (int64_t)msTimeout * 1000;
+
+    // The TTL is the hop limit for IPv6.
+    IP_OPTION_INFORMATION options;
+    memset(&options, 0, sizeof(options));
+    options.Ttl = (UCHAR)ttl;
+    DWORD dwRetVal;
+    if (target.bV6) {
+        sockaddr_in6 addrSource;
+        memset(&addrSource, 0, sizeof(addrSource));
+        addrSource.sin6_family = AF_INET6;
+        dwRetVal = Icmp6SendEcho2(m_hIcmp6, NULL, (PIO_APC_ROUTINE)ApcRoutine, pSlot, &addrSource, &target.addr6,
+            (LPVOID)SendData, sizeof(SendData), ttl > 0 ? &options : NULL, pSlot->pReplyBuf, m_cbReplyBuf, msTimeout);
+    } else {
+        dwRetVal = IcmpSendEcho2(m_hIcmp, NULL, (PIO_APC_ROUTINE)ApcRoutine, pSlot,
+            target.addr.sin_addr.S_un.S_addr, (LPVOID)SendData, sizeof(SendData),
+            ttl > 0 ? &options : NULL, pSlot->pReplyBuf, m_cbReplyBuf, msTimeout);
+    }
+    if (dwRetVal == 0) {
+        DWORD dwErr = GetLastError();
+        if (dwErr != ERROR_IO_PENDING) {
+            // The request failed immediately; no APC will be queued.
+            StructProbeAddr addrNone;
+            addrNone.Clear();
+            Complete(pSlot, dwErr, 0, addrNone);
+        }
+    }
+    return true;
+}
+
+int CProbeEngine::Poll(int msWait, PFN_PROBE_DONE pfnDone, void* pContext)
+{
+    if (m_vectDone.empty()) {
+        // Completion routines run during this alertable wait.
+        WaitForSingleObjectEx(m_hWake, msWait, TRUE);
+    }
+    return DispatchDone(pfnDone, pContext);
+}
+
+void CProbeEngine::Wake()
+{
+    SetEvent(m_hWake);
+}
+
+#else // Linux
+
+// Current value of the wall clock, in microseconds.  This is the clock
+// that SO_TIMESTAMPNS receive timestamps are taken on.
+static int64_t ProbeRealMicros()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ICMP checksum, as in RFC 1071.
+static uint16_t IcmpChecksum(const unsigned char* p, size_t cb)
+{
+    uint32_t sum = 0;
+    for (; cb > 1; cb -= 2, p += 2) {
+        sum += (uint32_t)((p[0] << 8) | p[1]);
+    }
+    if (cb) {
+        sum += (uint32_t)(p[0] << 8);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons((uint16_t)~sum);
+}
+
+// Map an ICMP type and code reported against one of our requests onto
+// the corresponding Windows IP_xxx status code.
+static uint32_t IcmpToErrorCode(int type, int code)
+{
+    switch (type) {
+    case ICMP_DEST_UNREACH:
+        switch (code) {
+        case ICMP_NET_UNREACH:   return IP_DEST_NET_UNREACHABLE;
+        case ICMP_HOST_UNREACH:  return IP_DEST_HOST_UNREACHABLE;
+        case ICMP_PROT_UNREACH:  return IP_DEST_PROT_UNREACHABLE;
+        case ICMP_PORT_UNREACH:  return IP_DEST_PORT_UNREACHABLE;
+        case ICMP_FRAG_NEEDED:   return IP_PACKET_TOO_BIG;
+        case ICMP_SR_FAILED:     return IP_BAD_ROUTE;
+        default:                 return IP_DEST_HOST_UNREACHABLE;
+        }
+    case ICMP_TIME_EXCEEDED:
+        return code == ICMP_EXC_FRAGTIME ? IP_TTL_EXPIRED_REASSEM : IP_TTL_EXPIRED_TRANSIT;
+    case ICMP_PARAMETERPROB:
+        return IP_PARAM_PROBLEM;
+    case ICMP_SOURCE_QUENCH:
+        return IP_SOURCE_QUENCH;
+    default:
+        return IP_GENERAL_FAILURE;
+    }
+}
+
+// Map an ICMPv6 type and code onto the IP_xxx status code that
+// Icmp6SendEcho2 reports for it.
+static uint32_t Icmp6ToErrorCode(int type, int code)
+{
+    switch (type) {
+    case ICMP6_DST_UNREACH:
+        switch (code) {
+        case ICMP6_DST_UNREACH_NOROUTE: return IP_DEST_NET_UNREACHABLE;
+        case ICMP6_DST_UNREACH_ADMIN:   return IP_DEST_PROT_UNREACHABLE;
+        case ICMP6_DST_UNREACH_NOPORT:  return IP_DEST_PORT_UNREACHABLE;
+        default:                        return IP_DEST_HOST_UNREACHABLE;
+        }
+    case ICMP6_PACKET_TOO_BIG:
+        return IP_PACKET_TOO_BIG;
+    case ICMP6_TIME_EXCEEDED:
+        return code == ICMP6_TIME_EXCEED_REASSEMBLY ? IP_TTL_EXPIRED_REASSEM : IP_TTL_EXPIRED_TRANSIT;
+    case ICMP6_PARAM_PROB:
+        return IP_PARAM_PROBLEM;
+    default:
+        return IP_GENERAL_FAILURE;
+    }
+}
+
+// Map an errno from a send or from the socket error queue onto an
+// IP_xxx code where one fits; otherwise pass the errno through.
+static uint32_t ErrnoToErrorCode(int err)
+{
+    switch (err) {
+    case ENETUNREACH:   return IP_DEST_NET_UNREACHABLE;
+    case EHOSTUNREACH:  return IP_DEST_HOST_UNREACHABLE;
+    case EMSGSIZE:      return IP_PACKET_TOO_BIG;
+    case ENOBUFS:       return IP_NO_RESOURCES;
+    case EINVAL:        return IP_BAD_DESTINATION;
+    default:            return (uint32_t)err;
+    }
+}
+
+// Identifier for a raw socket, where we must pick our own.  Engines are
+// opened from several threads, e.g. one per shard (see
+// ShardedProber.h).  Multiplying by an odd number is one-to-one modulo
+// 2^16, so no two of the next 65536 engines of the process share an
+// identifier.
+static uint16_t NextRawId()
+{
+    static std::atomic<uint16_t> s_instance(0);
+    return (uint16_t)(getpid() + s_instance.fetch_add(1, std::memory_order_relaxed) * 40503u);
+}
+
+// Have the kernel drop echo replies to other identifiers before they
+// reach a raw socket, which otherwise gets every reply to the host, so
+// that engines on other threads, or other processes, cost us nothing.
+// Errors still come through, to be matched by the request they quote.
+static void AttachIdFilter(int sock, uint16_t id, bool bV6)
+{
+    // IPv4 raw sockets deliver the IP header, so the ICMP header is found
+    // through its length; ICMPv6 ones start at the ICMPv6 header.
+    sock_filter aryV4[] = {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 2),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    sock_filter aryV6[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REPLY, 0, 2),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    sock_fprog prog;
+    prog.len = bV6 ? sizeof(aryV6) / sizeof(aryV6[0]) : sizeof(aryV4) / sizeof(aryV4[0]);
+    prog.filter = bV6 ? aryV6 : aryV4;
+    setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+// Set the options both families' sockets share and add the socket to
+// the epoll set.
+static void SetupSocket(int sock, int epfd)
+{
+    // Have the kernel timestamp each reply as it arrives, so that the
+    // time until we get around to reading it is not counted.
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+    // Thousands of replies can arrive between two polls.
+    int cbRcvBuf = 1 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &cbRcvBuf, sizeof(cbRcvBuf));
+
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+bool CProbeEngine::Open(std::string& strError)
+{
+    // Prefer an unprivileged ICMP datagram socket.  The kernel then assigns
+    // our identifier and delivers only our own replies to us.
+    m_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    if (m_sock >= 0) {
+        m_bRaw = false;
+        sockaddr_in addrLocal;
+        memset(&addrLocal, 0, sizeof(addrLocal));
+        addrLocal.sin_family = AF_INET;
+        socklen_t cbAddr = sizeof(addrLocal);
+        if (bind(m_sock, (sockaddr*)&addrLocal, sizeof(addrLocal)) != 0 ||
+            getsockname(m_sock, (sockaddr*)&addrLocal, &cbAddr) != 0) {
+            strError = "Unable to bind ICMP socket: ";
+            strError += strerror(errno);
+            Close();
+            return false;
+        }
+        m_id = ntohs(addrLocal.sin_port);
+
+        // ICMP errors for datagram sockets arrive on the error queue.
+        int onErr = 1;
+        setsockopt(m_sock, SOL_IP, IP_RECVERR, &onErr, sizeof(onErr));
+    } else {
+        // Not in net.ipv4.ping_group_range; a raw socket still works if
+        // we are privileged.  We must then pick and filter our own identifier.
+        int errDgram = errno;
+        m_sock = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+        if (m_sock < 0) {
+            strError = "Unable to open ICMP socket: ";
+            strError += strerror(errDgram);
+            return false;
+        }
+        m_bRaw = true;
+        m_id = NextRawId();
+
+        // Only wake up for replies and the errors we report.
+        uint32_t filter = ~((1U << ICMP_ECHOREPLY) | (1U << ICMP_DEST_UNREACH) |
+            (1U << ICMP_SOURCE_QUENCH) | (1U << ICMP_TIME_EXCEEDED) | (1U << ICMP_PARAMETERPROB));
+        setsockopt(m_sock, SOL_RAW, ICMP_FILTER, &filter, sizeof(filter));
+        AttachIdFilter(m_sock, m_id, false);
+    }
+
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0) {
+        strError = "epoll_create1 failed: ";
+        strError += strerror(errno);
+        Close();
+        return false;
+    }
+    SetupSocket(m_sock, m_epfd);
+    OpenIcmp6();
+
+    m_fdWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_fdWake < 0) {
+        strError = "eventfd failed: ";
+        strError += strerror(errno);
+        Close();
+        return false;
+    }
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = m_fdWake;
+    epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_fdWake, &ev);
+
+    m_vectSlots.assign(PROBE_MAX_IN_FLIGHT, StructSlot());
+    for (int j = 0; j < PROBE_MAX_IN_FLIGHT; j++) {
+        m_vectSlots[j].bInUse = false;
+        m_vectSlots[j].bAnswered = false;
+    }
+    m_vectSentReal.assign(PROBE_MAX_IN_FLIGHT, 0);
+    m_vectDone.reserve(PROBE_MAX_IN_FLIGHT);
+    m_vectPending.reserve(PROBE_MAX_IN_FLIGHT);
+    m_heapDeadlines.reserve(2 * PROBE_MAX_IN_FLIGHT);
+    m_packets.assign(PROBE_BATCH * (sizeof(icmphdr) + PROBE_PAYLOAD_SIZE), 0);
+    m_sendCtls.assign(PROBE_BATCH * CMSG_SPACE(sizeof(int)), 0);
+    m_recvBufs.assign(PROBE_BATCH * PROBE_RECV_SIZE, 0);
+    m_recvCtls.assign(PROBE_BATCH * PROBE_CTL_SIZE, 0);
+    m_recvAddrs.assign(PROBE_BATCH, sockaddr_in6());
+    return true;
+}
+
+// Open the ICMPv6 socket, in the same way as the IPv4 one.  Failure only
+// sets m_strError6, so that IPv4 targets still work on hosts without
+// IPv6 or where only IPv4 ping sockets are allowed.
+void CProbeEngine::OpenIcmp6()
+{
+    m_strError6.clear();
+    m_sock6 = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+    if (m_sock6 >= 0) {
+        m_bRaw6 = false;
+        sockaddr_in6 addrLocal;
+        memset(&addrLocal, 0, sizeof(addrLocal));
+        addrLocal.sin6_family = AF_INET6;
+        socklen_t cbAddr = sizeof(addrLocal);
+        if (bind(m_sock6, (sockaddr*)&addrLocal, sizeof(addrLocal)) != 0 ||
+            getsockname(m_sock6, (sockaddr*)&addrLocal, &cbAddr) != 0) {
+            m_strError6 = "Unable to bind ICMPv6 socket: ";
+            m_strError6 += strerror(errno);
+            close(m_sock6);
+            m_sock6 = -1;
+            return;
+        }
+        m_id6 = ntohs(addrLocal.sin6_port);
+        int onErr = 1;
+        setsockopt(m_sock6, SOL_IPV6, IPV6_RECVERR, &onErr, sizeof(onErr));
+    } else {
+        int errDgram = errno;
+        m_sock6 = socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+        if (m_sock6 < 0) {
+            m_strError6 = "Unable to open ICMPv6 socket: ";
+            m_strError6 += strerror(errDgram);
+            return;
+        }
+        m_bRaw6 = true;
+        m_id6 = NextRawId();
+
+        // The kernel fills in ICMPv6 checksums on raw sockets itself.
+        icmp6_filter filter;
+        ICMP6_FILTER_SETBLOCKALL(&filter);
+        ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+        ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filter);
+        ICMP6_FILTER_SETPASS(ICMP6_PACKET_TOO_BIG, &filter);
+        ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &filter);
+        ICMP6_FILTER_SETPASS(ICMP6_PARAM_PROB, &filter);
+        setsockopt(m_sock6, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+        AttachIdFilter(m_sock6, m_id6, true);
+    }
+    SetupSocket(m_sock6, m_epfd);
+}
+
+void CProbeEngine::Close()
+{
+    if (m_epfd >= 0) {
+        close(m_epfd);
+        m_epfd = -1;
+    }
+    if (m_fdWake >= 0) {
+        close(m_fdWake);
+        m_fdWake = -1;
+    }
+    if (m_sock >= 0) {
+        close(m_sock);
+        m_sock = -1;
+    }
+    if (m_sock6 >= 0) {
+        close(m_sock6);
+        m_sock6 = -1;
+    }
+    m_vectPending.clear();
+    m_heapDeadlines.clear();
+    m_vectDone.clear();
+    for (size_t j = 0; j < m_vectSlots.size(); j++) {
+        m_vectSlots[j].bInUse = false;
+        m_vectSlots[j].bAnswered = false;
+    }
+    m_nInFlight = 0;
+}
+
+bool CProbeEngine::SendTtl(int iTarget, int ttl, int msTimeout, void* pUser)
+{
+    StructSlot* pSlot = AllocSlot();
+    if (pSlot == NULL) {
+        return false;
+    }
+    pSlot->iTarget = iTarget;
+    pSlot->nGeneration = m_vectTargets[iTarget].nGeneration;
+    pSlot->bV6 = m_vectTargets[iTarget].bV6;
+    pSlot->pUser = pUser;
+    pSlot->ttl = ttl;
+    pSlot->usSent = ProbeNowMicros();
+    pSlot->usDeadline = pSlot->usSent + (int64_t)msTimeout * 1000;
+    m_heapDeadlines.push_back(std::make_pair(-pSlot->usDeadline, pSlot->seq));
+    std::push_heap(m_heapDeadlines.begin(), m_heapDeadlines.end());
+
+    // The request is transmitted with others in the next Flush.
+    m_vectPending.push_back(pSlot->seq);
+    if (m_vectPending.size() >= PROBE_BATCH) {
+        Flush();
+    }
+    return true;
+}
+
+// Transmit pending requests, up to PROBE_BATCH of one family per sendmmsg.
+void CProbeEngine::Flush()
+{
+    const size_t cbPacket = sizeof(icmphdr) + PROBE_PAYLOAD_SIZE;
+    mmsghdr msgs[PROBE_BATCH];
+    iovec iovs[PROBE_BATCH];
+    size_t iNext = 0;
+
+    while (iNext < m_vectPending.size()) {
+        bool bV6 = m_vectSlots[m_vectPending[iNext] & (PROBE_MAX_IN_FLIGHT - 1)].bV6;
+        int nBatch = 0;
+        while (nBatch < PROBE_BATCH && iNext + nBatch < m_vectPending.size()) {
+            StructSlot* pSlot = &m_vectSlots[m_vectPending[iNext + nBatch] & (PROBE_MAX_IN_FLIGHT - 1)];
+            if (pSlot->bV6 != bV6) {
+                break;
+            }
+            int j = nBatch++;
+            const StructTarget& target = m_vectTargets[pSlot->iTarget];
+            unsigned char* pPacket = &m_packets[j * cbPacket];
+            memcpy(pPacket + sizeof(icmphdr), SendData, PROBE_PAYLOAD_SIZE);
+            if (bV6) {
+                // The kernel computes ICMPv6 checksums, which cover the
+                // addresses of the IPv6 header.
+                icmp6_hdr* pHdr = (icmp6_hdr*)pPacket;
+                pHdr->icmp6_type = ICMP6_ECHO_REQUEST;
+                pHdr->icmp6_code = 0;
+                pHdr->icmp6_cksum = 0;
+                pHdr->icmp6_id = htons(m_id6);
+                pHdr->icmp6_seq = htons(pSlot->seq);
+            } else {
+                icmphdr* pHdr = (icmphdr*)pPacket;
+                pHdr->type = ICMP_ECHO;
+                pHdr->code = 0;
+                pHdr->checksum = 0;
+                pHdr->un.echo.id = htons(m_id);
+                pHdr->un.echo.sequence = htons(pSlot->seq);
+                pHdr->checksum = IcmpChecksum(pPacket, cbPacket);
+            }
+
+            iovs[j].iov_base = pPacket;
+            iovs[j].iov_len = cbPacket;
+            memset(&msgs[j], 0, sizeof(msgs[j]));
+            if (bV6) {
+                msgs[j].msg_hdr.msg_name = (void*)&target.addr6;
+                msgs[j].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+            } else {
+                msgs[j].msg_hdr.msg_name = (void*)&target.addr;
+                msgs[j].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            }
+            msgs[j].msg_hdr.msg_iov = &iovs[j];
+            msgs[j].msg_hdr.msg_iovlen = 1;
+            if (pSlot->ttl > 0) {
+                // The TTL (hop limit) goes with each message, so requests
+                // for every hop of a path trace can share one batch.
+                unsigned char* pCtl = &m_sendCtls[j * CMSG_SPACE(sizeof(int))];
+                msgs[j].msg_hdr.msg_control = pCtl;
+                msgs[j].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+                cmsghdr* pCmsg = CMSG_FIRSTHDR(&msgs[j].msg_hdr);
+                pCmsg->cmsg_level = bV6 ? IPPROTO_IPV6 : SOL_IP;
+                pCmsg->cmsg_type = bV6 ? IPV6_HOPLIMIT : IP_TTL;
+                pCmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(pCmsg), &pSlot->ttl, sizeof(int));
+            }
+        }
+
+        int64_t usNow = ProbeNowMicros();
+        int64_t usNowReal = ProbeRealMicros();
+        int nSent = sendmmsg(bV6 ? m_sock6 : m_sock, msgs, nBatch, 0);
+        if (nSent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                // Socket buffer is full; retry on the next poll.
+                break;
+            }
+            // The first message of the batch failed; fail it and go on.
+            StructSlot* pSlot = &m_vectSlots[m_vectPending[iNext] & (PROBE_MAX_IN_FLIGHT - 1)];
+            StructProbeAddr addrNone;
+            addrNone.Clear();
+            Complete(pSlot, ErrnoToErrorCode(errno), 0, addrNone);
+            iNext++;
+            continue;
+        }
+        for (int j = 0; j < nSent; j++) {
+            int iSlot = m_vectPending[iNext + j] & (PROBE_MAX_IN_FLIGHT - 1);
+            m_vectSlots[iSlot].usSent = usNow;
+            m_vectSentReal[iSlot] = usNowReal;
+        }
+        iNext += nSent;
+    }
+    m_vectPending.erase(m_vectPending.begin(), m_vectPending.begin() + iNext);
+}
+
+// Exit:   Returns the time from sending a request to the arrival of its
+//         answer: the kernel's receive timestamp usKernelRecv, or the time
+//         we read the answer, usNow, if there was none.
+int64_t CProbeEngine::GetRoundTrip(const StructSlot* pSlot, int64_t usNow, int64_t usKernelRecv) const
+{
+    int64_t usSentReal = m_vectSentReal[pSlot->seq & (PROBE_MAX_IN_FLIGHT - 1)];
+    if (usKernelRecv > 0 && usKernelRecv >= usSentReal) {
+        return usKernelRecv - usSentReal;
+    }
+    return usNow - pSlot->usSent;
+}
+
+// Handle one ICMP or ICMPv6 message from addrFrom: an echo reply, or (raw
+// sockets only) an error message quoting one of our echo requests.  The
+// echo header has the same layout in both families.
+void CProbeEngine::HandleIcmp(const unsigned char* pIcmp, size_t cb, int64_t usNow, int64_t usKernelRecv,
+    const StructProbeAddr& addrFrom, bool bV6)
+{
+    if (cb < sizeof(icmphdr)) {
+        return;
+    }
+    const icmphdr* pHdr = (const icmphdr*)pIcmp;
+    uint32_t errorCode = IP_SUCCESS;
+    if (pHdr->type != (bV6 ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY)) {
+        if (!(bV6 ? m_bRaw6 : m_bRaw)) {
+            return;
+        }
+        // Skip to the quoted IP header and the ICMP header of our request.
+        const unsigned char* pQuoted = pIcmp + sizeof(icmphdr);
+        size_t cbQuoted = cb - sizeof(icmphdr);
+        size_t cbIpHdr;
+        if (bV6) {
+            // Requests we send carry no extension headers.
+            if (cbQuoted < sizeof(ip6_hdr) || ((const ip6_hdr*)pQuoted)->ip6_nxt != IPPROTO_ICMPV6) {
+                return;
+            }
+            cbIpHdr = sizeof(ip6_hdr);
+        } else {
+            if (cbQuoted < sizeof(iphdr)) {
+                return;
+            }
+            cbIpHdr = ((const iphdr*)pQuoted)->ihl * 4;
+        }
+        if (cbQuoted < cbIpHdr + sizeof(icmphdr)) {
+            return;
+        }
+        errorCode = bV6 ? Icmp6ToErrorCode(pHdr->type, pHdr->code) : IcmpToErrorCode(pHdr->type, pHdr->code);
+        pHdr = (const icmphdr*)(pQuoted + cbIpHdr);
+        if (pHdr->type != (bV6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO)) {
+            return;
+        }
+    }
+    if (ntohs(pHdr->un.echo.id) != (bV6 ? m_id6 : m_id)) {
+        return;
+    }
+    uint16_t seq = ntohs(pHdr->un.echo.sequence);
+    StructSlot* pSlot = &m_vectSlots[seq & (PROBE_MAX_IN_FLIGHT - 1)];
+    if (!pSlot->bInUse || pSlot->seq != seq || pSlot->bV6 != bV6) {
+        // Late reply to a request that already timed out, or a duplicate:
+        // reported only while its target hasn't been removed.
+        if (m_bReportDuplicates && pSlot->bAnswered && pSlot->seq == seq && pSlot->bV6 == bV6 &&
+            errorCode == IP_SUCCESS && m_vectTargets[pSlot->iTarget].bInUse &&
+            m_vectTargets[pSlot->iTarget].nGeneration == pSlot->nGeneration) {
+            StructProbeResult result;
+            result.iTarget = pSlot->iTarget;
+            result.seq = seq;
+            result.errorCode = IP_SUCCESS;
+            result.usRoundTrip = GetRoundTrip(pSlot, usNow, usKernelRecv);
+            result.addrFrom = addrFrom;
+            result.bDuplicate = true;
+            result.pUser = pSlot->pUser;
+            m_vectDone.push_back(result);
+        }
+        return;
+    }
+    Complete(pSlot, errorCode, GetRoundTrip(pSlot, usNow, usKernelRecv), addrFrom);
+}
+
+void CProbeEngine::ReceiveReplies(bool bV6)
+{
+    int sock = bV6 ? m_sock6 : m_sock;
+    mmsghdr msgs[PROBE_BATCH];
+    iovec iovs[PROBE_BATCH];
+    for (;;) {
+        for (int j = 0; j < PROBE_BATCH; j++) {
+            iovs[j].iov_base = &m_recvBufs[j * PROBE_RECV_SIZE];
+            iovs[j].iov_len = PROBE_RECV_SIZE;
+            memset(&msgs[j], 0, sizeof(msgs[j]));
+            msgs[j].msg_hdr.msg_name = &m_recvAddrs[j];
+            msgs[j].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+            msgs[j].msg_hdr.msg_iov = &iovs[j];
+            msgs[j].msg_hdr.msg_iovlen = 1;
+            msgs[j].msg_hdr.msg_control = &m_recvCtls[j * PROBE_CTL_SIZE];
+            msgs[j].msg_hdr.msg_controllen = PROBE_CTL_SIZE;
+        }
+        int nRecv = recvmmsg(sock, msgs, PROBE_BATCH, MSG_DONTWAIT, NULL);
+        if (nRecv <= 0) {
+            break;
+        }
+        int64_t usNow = ProbeNowMicros();
+        for (int j = 0; j < nRecv; j++) {
+            const unsigned char* p = &m_recvBufs[j * PROBE_RECV_SIZE];
+            size_t cb = msgs[j].msg_len;
+            int64_t usKernelRecv = 0;
+            msghdr* pMsg = &msgs[j].msg_hdr;
+            for (cmsghdr* pCmsg = CMSG_FIRSTHDR(pMsg); pCmsg; pCmsg = CMSG_NXTHDR(pMsg, pCmsg)) {
+                if (pCmsg->cmsg_level == SOL_SOCKET && pCmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                    timespec ts;
+                    memcpy(&ts, CMSG_DATA(pCmsg), sizeof(ts));
+                    usKernelRecv = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+                }
+            }
+            StructProbeAddr addrFrom;
+            if (bV6) {
+                // Raw ICMPv6 sockets never deliver the IPv6 header.
+                addrFrom.SetV6(&m_recvAddrs[j].sin6_addr);
+            } else {
+                addrFrom.SetV4(((const sockaddr_in*)&m_recvAddrs[j])->sin_addr.s_addr);
+                if (m_bRaw) {
+                    // Raw IPv4 sockets deliver the IP header too.
+                    if (cb < sizeof(iphdr)) {
+                        continue;
+                    }
+                    size_t cbIpHdr = ((const iphdr*)p)->ihl * 4;
+                    if (cb < cbIpHdr) {
+                        continue;
+                    }
+                    addrFrom.SetV4(((const iphdr*)p)->saddr);
+                    p += cbIpHdr;
+                    cb -= cbIpHdr;
+                }
+            }
+            HandleIcmp(p, cb, usNow, usKernelRecv, addrFrom, bV6);
+        }
+        if (nRecv < PROBE_BATCH) {
+            break;
+        }
+    }
+}
+
+// Drain a socket error queue, where the kernel reports ICMP errors
+// (unreachable, TTL expired, ...) against datagram-socket requests.
+void CProbeEngine::ReceiveErrors(bool bV6)
+{
+    int sock = bV6 ? m_sock6 : m_sock;
+    for (;;) {
+        unsigned char data[128];
+        unsigned char control[512];
+        sockaddr_in6 addrFrom;
+        iovec iov;
+        iov.iov_base = data;
+        iov.iov_len = sizeof(data);
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addrFrom;
+        msg.msg_namelen = sizeof(addrFrom);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t cb = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (cb < (ssize_t)sizeof(icmphdr)) {
+            if (cb < 0) {
+                break;
+            }
+            continue;
+        }
+
+        uint32_t errorCode = IP_GENERAL_FAILURE;
+        StructProbeAddr addrOffender;
+        addrOffender.Clear();
+        int64_t usKernelRecv = 0;
+        for (cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg); pCmsg; pCmsg = CMSG_NXTHDR(&msg, pCmsg)) {
+            if ((pCmsg->cmsg_level == SOL_IP && pCmsg->cmsg_type == IP_RECVERR) ||
+                (pCmsg->cmsg_level == SOL_IPV6 && pCmsg->cmsg_type == IPV6_RECVERR)) {
+                const sock_extended_err* pErr = (const sock_extended_err*)CMSG_DATA(pCmsg);
+                if (pErr->ee_origin == SO_EE_ORIGIN_ICMP || pErr->ee_origin == SO_EE_ORIGIN_ICMP6) {
+                    errorCode = pErr->ee_origin == SO_EE_ORIGIN_ICMP6 ? Icmp6ToErrorCode(pErr->ee_type, pErr->ee_code)
+                        : IcmpToErrorCode(pErr->ee_type, pErr->ee_code);
+                    // The router or host that sent the ICMP error.
+                    const sockaddr* pOffender = SO_EE_OFFENDER(pErr);
+                    if (pOffender->sa_family == AF_INET) {
+                        addrOffender.SetV4(((const sockaddr_in*)pOffender)->sin_addr.s_addr);
+                    } else if (pOffender->sa_family == AF_INET6) {
+                        addrOffender.SetV6(&((const sockaddr_in6*)pOffender)->sin6_addr);
+                    }
+                } else {
+                    errorCode = ErrnoToErrorCode(pErr->ee_errno);
+                }
+            } else if (pCmsg->cmsg_level == SOL_SOCKET && pCmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec ts;
+                memcpy(&ts, CMSG_DATA(pCmsg), sizeof(ts));
+                usKernelRecv = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            }
+        }
+
+        // The payload is the echo request the error refers to.
+        const icmphdr* pHdr = (const icmphdr*)data;
+        uint16_t seq = ntohs(pHdr->un.echo.sequence);
+        StructSlot* pSlot = &m_vectSlots[seq & (PROBE_MAX_IN_FLIGHT - 1)];
+        if (pSlot->bInUse && pSlot->seq == seq && pSlot->bV6 == bV6) {
+            int64_t usRoundTrip = addrOffender.IsSet() ? GetRoundTrip(pSlot, ProbeNowMicros(), usKernelRecv) : 0;
+            Complete(pSlot, errorCode, usRoundTrip, addrOffender);
+        }
+    }
+}
+
+// Fail every request whose deadline has passed with IP_REQ_TIMED_OUT.
+void CProbeEngine::ExpireTimeouts(int64_t usNow)
+{
+    StructProbeAddr addrNone;
+    addrNone.Clear();
+    while (!m_heapDeadlines.empty() && -m_heapDeadlines.front().first <= usNow) {
+        int64_t usDeadline = -m_heapDeadlines.front().first;
+        uint16_t seq = m_heapDeadlines.front().second;
+        std::pop_heap(m_heapDeadlines.begin(), m_heapDeadlines.end());
+        m_heapDeadlines.pop_back();
+
+        StructSlot* pSlot = &m_vectSlots[seq & (PROBE_MAX_IN_FLIGHT - 1)];
+        if (pSlot->bInUse && pSlot->seq == seq && pSlot->usDeadline == usDeadline) {
+            // A request still waiting to be transmitted is dropped from the
+            // pending list as well, so that its slot cannot be sent twice.
+            std::vector<uint16_t>::iterator iter =
+                std::find(m_vectPending.begin(), m_vectPending.end(), seq);
+            if (iter != m_vectPending.end()) {
+                m_vectPending.erase(iter);
+            }
+            Complete(pSlot, IP_REQ_TIMED_OUT, 0, addrNone);
+        }
+    }
+}
+
+int CProbeEngine::Poll(int msWait, PFN_PROBE_DONE pfnDone, void* pContext)
+{
+    Flush();
+    int64_t usNow = ProbeNowMicros();
+    if (!m_heapDeadlines.empty() && -m_heapDeadlines.front().first <= usNow) {
+        // We may be polled late; don't time out requests whose answers
+        // are already waiting to be read.
+        ReceiveReplies(false);
+        ReceiveErrors(false);
+        if (m_sock6 >= 0) {
+            ReceiveReplies(true);
+            ReceiveErrors(true);
+        }
+    }
+    ExpireTimeouts(usNow);
+
+    if (m_vectDone.empty()) {
+        // Don't sleep past the earliest deadline.
+        int msTimeout = msWait;
+        if (!m_heapDeadlines.empty()) {
+            int64_t usUntil = -m_heapDeadlines.front().first - ProbeNowMicros();
+            int msUntil = usUntil <= 0 ? 0 : (int)((usUntil + 999) / 1000);
+            msTimeout = std::min(msTimeout, msUntil);
+        }
+        if (!m_vectPending.empty()) {
+            // Socket buffer was full; come back soon to retry.
+            msTimeout = std::min(msTimeout, 1);
+        }
+        epoll_event events[4];
+        int nEvents = epoll_wait(m_epfd, events, 4, msTimeout);
+        for (int j = 0; j < nEvents; j++) {
+            if (events[j].data.fd == m_fdWake) {
+                // Reading resets the counter; a failure means it was reset.
+                uint64_t nWakes;
+                ssize_t cbRead = read(m_fdWake, &nWakes, sizeof(nWakes));
+                (void)cbRead;
+                continue;
+            }
+            bool bV6 = events[j].data.fd == m_sock6;
+            if (events[j].events & EPOLLERR) {
+                ReceiveErrors(bV6);
+            }
+            if (events[j].events & EPOLLIN) {
+                ReceiveReplies(bV6);
+            }
+        }
+        ExpireTimeouts(ProbeNowMicros());
+    }
+    return DispatchDone(pfnDone, pContext);
+}
+
+void CProbeEngine::Wake()
+{
+    // Only fails if the counter would overflow, when a wake is pending.
+    uint64_t nWakes = 1;
+    ssize_t cbWritten = write(m_fdWake, &nWakes, sizeof(nWakes));
+    (void)cbWritten;
+}
+
+#endif
@@ -0,0 +1,166 @@
+// ProbeEngine.h : Asynchronous ICMP echo engine; the real probe backend
+// (see ProbeBackend.h).
+// Keeps many echo requests in flight at once from a single thread, and
+// matches each reply to its request by identifier and sequence number.
+// On Windows this uses overlapped IcmpSendEcho2 and Icmp6SendEcho2 with an
+// APC completion routine; on Linux it uses an unprivileged ICMP datagram
+// socket for each of IPv4 and IPv6 (falling back to a raw socket when
+// running privileged without ping_group_range access) with epoll and
+// batched sendmmsg/recvmmsg.  IPv4 and IPv6 requests share one sequence
+// space.  Round trip times are in microseconds; on Linux they come from
+// SO_TIMESTAMPNS kernel receive timestamps, so the delay before we read a
+// reply is not counted.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ProbeBackend.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <winternl.h>
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+// Maximum number of echo requests that can be outstanding at once.
+// Must be a power of 2 that divides 65536, so that sequence numbers
+// map onto slots without collisions.
+#define PROBE_MAX_IN_FLIGHT 8192
+
+// Size of the payload sent with each echo request.  This matches the
+// 32-byte "Data Buffer" payload the program has always sent.
+#define PROBE_PAYLOAD_SIZE  32
+
+class CProbeEngine : public CProbeBackend
+{
+public:
+    CProbeEngine();
+    ~CProbeEngine();
+
+    // Open the ICMP handles (Windows) or sockets and epoll instance
+    // (Linux).  If IPv6 can't be opened, IPv4 still works, and IPv6
+    // targets are refused with the reason.
+    bool Open(std::string& strError) override;
+    void Close() override;
+
+    // Register a target given as a numeric IPv4 or IPv6 address.
+    // Exit:   Returns the target index, or -1 with strError set.
+    int  AddTarget(const char* address, std::string& strError) override;
+    void RemoveTarget(int iTarget) override;
+
+    // Start an echo request to a target.  The request completes, with
+    // a reply, an ICMP error or IP_REQ_TIMED_OUT, through a later Poll.
+    // Exit:   Returns false if too many requests are outstanding.
+    bool Send(int iTarget, int msTimeout, void* pUser) override;
+
+    // As Send, with the TTL of the request set to ttl.  Routers where it
+    // runs out answer IP_TTL_EXPIRED_TRANSIT, with their address in
+    // addrFrom and the time until the answer arrived as the round trip.
+    bool SendTtl(int iTarget, int ttl, int msTimeout, void* pUser) override;
+
+    // Transmit any batched requests, wait up to msWait milliseconds for
+    // activity, and deliver completed requests to pfnDone.
+    // Exit:   Returns the number of requests completed.
+    int  Poll(int msWait, PFN_PROBE_DONE pfnDone, void* pContext) override;
+
+    // Sets an event (Windows) or eventfd (Linux) that Poll waits on too.
+    void Wake() override;
+
+    int  GetInFlight() const override { return m_nInFlight; }
+
+    // Duplicate replies are seen on Linux only; IcmpSendEcho2 hands back
+    // one reply per request.
+    void ReportDuplicates(bool bReport) override { m_bReportDuplicates = bReport; }
+
+private:
+    struct StructTarget {
+        bool        bInUse;
+        bool        bV6;
+        uint32_t    nGeneration;    // bumped each time the index is reused
+        sockaddr_in addr;
+        sockaddr_in6 addr6;
+    };
+
+    // One outstanding request.  Slots are indexed by seq modulo
+    // PROBE_MAX_IN_FLIGHT.
+    struct StructSlot {
+        bool      bInUse;
+        bool      bAnswered;    // completed with a reply; later replies are duplicates
+        bool      bV6;
+        uint16_t  seq;
+        int       iTarget;
+        uint32_t  nGeneration;  // of the target when sent
+        void*     pUser;
+        int       ttl;          // TTL to send with, or 0 for the default
+        int64_t   usSent;       // monotonic send time
+        int64_t   usDeadline;   // monotonic time at which the request times out
+#ifdef _WIN32
+        CProbeEngine* pEngine;
+        char*     pReplyBuf;    // points into m_pReplyBufs; allocated once in Open
+#endif
+    };
+
+    StructSlot* AllocSlot();
+    void Complete(StructSlot* pSlot, uint32_t errorCode, int64_t usRoundTrip, const StructProbeAddr& addrFrom);
+    int  DispatchDone(PFN_PROBE_DONE pfnDone, void* pContext);
+
+    std::vector<StructTarget> m_vectTargets;
+    std::vector<int>          m_vectFreeTargets;    // indexes freed by RemoveTarget
+    std::vector<StructSlot>   m_vectSlots;
+    std::vector<StructProbeResult> m_vectDone;  // completed, not yet dispatched
+    uint16_t m_seqNext;
+    int      m_nInFlight;
+    bool     m_bReportDuplicates;
+    std::string m_strError6;    // why IPv6 couldn't be opened, if it couldn't
+
+#ifdef _WIN32
+    static void NTAPI ApcRoutine(PVOID pApcContext, PIO_STATUS_BLOCK pIoStatus, ULONG reserved);
+    HANDLE   m_hIcmp;
+    HANDLE   m_hIcmp6;
+    HANDLE   m_hWake;       // auto-reset event set by Wake
+    char*    m_pReplyBufs;
+    DWORD    m_cbReplyBuf;
+#else
+    // Wall-clock send time.  Kernel receive timestamps (SO_TIMESTAMPNS)
+    // are CLOCK_REALTIME, so the round trip is measured on that clock.
+    std::vector<int64_t> m_vectSentReal;
+
+    void OpenIcmp6();
+    void Flush();
+    void ReceiveReplies(bool bV6);
+    void ReceiveErrors(bool bV6);
+    void HandleIcmp(const unsigned char* pIcmp, size_t cb, int64_t usNow, int64_t usKernelRecv,
+        const StructProbeAddr& addrFrom, bool bV6);
+    int64_t GetRoundTrip(const StructSlot* pSlot, int64_t usNow, int64_t usKernelRecv) const;
+    void ExpireTimeouts(int64_t usNow);
+
+    int      m_sock;
+    int      m_sock6;       // ICMPv6, or -1
+    int      m_epfd;
+    int      m_fdWake;      // eventfd written by Wake, in the epoll set
+    bool     m_bRaw;        // true if we had to fall back to SOCK_RAW
+    bool     m_bRaw6;
+    uint16_t m_id;          // ICMP identifier used by this engine
+    uint16_t m_id6;         // and ICMPv6
+
+    // Requests waiting for the next sendmmsg, and their packet and
+    // control (IP_TTL) buffers.
+    std::vector<uint16_t> m_vectPending;
+    std::vector<unsigned char> m_packets;
+    std::vector<unsigned char> m_sendCtls;
+
+    // Receive, control and source address buffers for one recvmmsg
+    // batch, allocated once in Open.
+    std::vector<unsigned char> m_recvBufs;
+    std::vector<unsigned char> m_recvCtls;
+    std::vector<sockaddr_in6> m_recvAddrs;     // big enough for either family
+
+    // Min-heap of (deadline, seq), used to time out requests.  Entries
+    // whose request already completed are discarded when they surface.
+    std::vector<std::pair<int64_t, uint16_t> > m_heapDeadlines;
+#endif
+};
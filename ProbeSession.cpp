@@ -0,0 +1,75 @@
+// ProbeSession.cpp : Long-lived probe session for one target.  See ProbeSession.h.
+
+#include "ProbeSession.h"
+
+CProbeSession::CProbeSession(CProbeBackend& engine)
+    : m_engine(engine)
+{
+    m_sink.pfnDone = OnProbeDone;
+    m_sink.pContext = this;
+    m_iTarget = -1;
+    m_bDone = false;
+    m_errorCode = 0;
+    m_usRoundTrip = 0;
+    m_usSent = 0;
+    m_usDone = 0;
+    m_msTimeout = 0;
+}
+
+CProbeSession::~CProbeSession()
+{
+    m_engine.RemoveTarget(m_iTarget);
+}
+
+bool CProbeSession::SetAddress(const std::string& strAddress, std::string& strError)
+{
+    if (m_iTarget >= 0 && strAddress == m_strAddress) {
+        return true;
+    }
+    m_engine.RemoveTarget(m_iTarget);
+    m_strAddress = strAddress;
+    m_iTarget = m_engine.AddTarget(strAddress.c_str(), strError);
+    return m_iTarget >= 0;
+}
+
+void CProbeSession::OnProbeDone(const StructProbeResult& result, void* pContext)
+{
+    CProbeSession* pSession = (CProbeSession*)pContext;
+    if (!result.bDuplicate) {
+        pSession->m_bDone = true;
+        pSession->m_usDone = ProbeNowMicros();
+        pSession->m_errorCode = result.errorCode;
+        pSession->m_usRoundTrip = result.usRoundTrip;
+    }
+}
+
+void CProbeSession::Send(int msTimeout)
+{
+    m_bDone = false;
+    m_usSent = ProbeNowMicros();
+    m_usDone = m_usSent;
+    m_msTimeout = msTimeout;
+    if (m_iTarget < 0) {
+        m_bDone = true;
+        m_errorCode = PROBE_ERR_BAD_DESTINATION;
+    } else if (!m_engine.Send(m_iTarget, msTimeout, &m_sink)) {
+        m_bDone = true;
+        m_errorCode = PROBE_ERR_NO_RESOURCES;
+    }
+}
+
+int64_t CProbeSession::GetWaited() const
+{
+    int64_t usWaited = m_usDone - m_usSent;
+    int64_t usTimeout = (int64_t)m_msTimeout * 1000;
+    return usWaited < usTimeout ? usWaited : usTimeout;
+}
+
+int64_t CProbeSession::Ping(int msTimeout)
+{
+    Send(msTimeout);
+    while (!m_bDone) {
+        Poll(msTimeout);
+    }
+    return GetResult();
+}
@@ -0,0 +1,63 @@
+// ProbeSession.h : Long-lived probe session for one target.
+// A session registers its target with a probe backend once and keeps it
+// registered, along with the engine's handle or socket and reply buffers,
+// for its whole life.  Its requests carry a StructProbeSink, so the engine
+// may be shared with sessions and packet trains alike and polled with
+// DispatchProbeDone.  Round trip times are in microseconds.
+#pragma once
+
+#include "ProbeBackend.h"
+
+class CProbeSession
+{
+public:
+    CProbeSession(CProbeBackend& engine);
+    ~CProbeSession();
+
+    // Point the session at a numeric IPv4 or IPv6 address.  Does nothing
+    // if the address is unchanged, so it is cheap to call before every
+    // probe.
+    bool SetAddress(const std::string& strAddress, std::string& strError);
+    const std::string& GetAddress() const { return m_strAddress; }
+
+    // Send one echo request and wait for its outcome.  Completions for
+    // other sessions sharing the engine are delivered to those sessions
+    // while we wait.
+    // Exit:   Returns the round trip time in microseconds, or -1 if the
+    //         request failed; GetErrorCode then gives the IP_xxx code.
+    int64_t Ping(int msTimeout);
+
+    // Ping in steps, for callers that wait on other things meanwhile:
+    // Send, then Poll until IsDone, then GetResult.  If Send fails, the
+    // session is done at once.
+    void    Send(int msTimeout);
+    void    Poll(int msWait) { m_engine.Poll(msWait, DispatchProbeDone, NULL); }
+    int64_t GetResult() const { return m_errorCode == 0 ? m_usRoundTrip : -1; }
+
+    bool     IsDone() const { return m_bDone; }
+    uint32_t GetErrorCode() const { return m_errorCode; }
+    int64_t  GetRoundTrip() const { return m_usRoundTrip; }
+
+    // Exit:   Returns how long the most recent request was out, in
+    //         microseconds: from Send until its outcome was delivered,
+    //         or until its timeout, if that came first.
+    int64_t  GetWaited() const;
+
+private:
+    // Completion of the session's request, through m_sink.  Duplicate
+    // replies, reported for the sake of packet trains, are ignored.
+    static void OnProbeDone(const StructProbeResult& result, void* pContext);
+
+    CProbeBackend& m_engine;
+    StructProbeSink m_sink;
+    int         m_iTarget;
+    std::string m_strAddress;
+
+    // Outcome of the most recent request.
+    bool        m_bDone;
+    uint32_t    m_errorCode;
+    int64_t     m_usRoundTrip;
+    int64_t     m_usSent;
+    int64_t     m_usDone;       // when the outcome was delivered
+    int         m_msTimeout;
+};
@@ -0,0 +1,1154 @@
+// Prober.cpp : The platform-neutral core shared by netavailw and netavaild.
+
+#include "Prober.h"
+#include "ProbeEngine.h"
+#include <stdio.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+std::string strHostname;
+CProblemStore ProblemStore;
+CLogWriter LogWriter;
+CLocalIPCache LocalIPCache;
+CLatencyStats LatencyStats;
+CRttSeries RttSeries;
+CMetricsServer MetricsServer;
+CResultStream ResultStream;
+CResolver Resolver;
+StructProbeLoopStats ProbeLoopStats;
+
+// Start the background log writer with the current settings.
+static void StartLogWriter()
+{
+    StructLogWriterConfig config;
+    config.msFsync = Settings.msLogFsync;
+    config.cbRotate = (int64_t)Settings.mbLogRotate * 1024 * 1024;
+    config.secsRotate = Settings.hoursLogRotate * 3600;
+    config.bCsv = (Settings.logFormat & LOG_FORMAT_CSV) != 0;
+    config.bBinary = (Settings.logFormat & LOG_FORMAT_BINARY) != 0;
+    LogWriter.Start(config);
+}
+
+// Add the targets of the settings to RttSeries, within the configured
+// budget, and fill in their history from the log.
+// Exit:   Returns the "history" record's details, e.g. "results=86400
+//         ms=41", or "" if there is no log to read.
+static std::string LoadRttSeries()
+{
+    RttSeries.SetBudget((size_t)(Settings.seriesMemoryMB > 0 ? Settings.seriesMemoryMB : 1) * 1024 * 1024);
+    std::shared_ptr<const StructSettingsSnapshot> pSnapshot = GetSettings();
+    for (size_t j = 0; j < pSnapshot->vectTargets.size(); j++) {
+        RttSeries.GetTarget(pSnapshot->vectTargets[j].strAddress, pSnapshot->vectTargets[j].secsSleep);
+    }
+    if (!(Settings.logFormat & LOG_FORMAT_CSV)) {
+        return "";
+    }
+    int64_t usStart = ProbeNowMicros();
+    int64_t nLoaded = RttSeries.LoadFromLog(StructLogWriterConfig().strPath, GetWallMicros() / 1000);
+    if (nLoaded < 0) {
+        return "";
+    }
+    char szBuf[64];
+    snprintf(szBuf, sizeof(szBuf), "results=%lld ms=%lld", (long long)nLoaded,
+        (long long)((ProbeNowMicros() - usStart) / 1000));
+    return szBuf;
+}
+
+// Exit:   Returns the local IP the log records carry, for result batches.
+static const char* GetLikelyLocalIP()
+{
+    return LocalIPCache.GetLikelyIP();
+}
+
+std::string GetComputerHostname()
+{
+    char szComputerName[256];
+#ifdef _WIN32
+    DWORD size = sizeof(szComputerName);
+    if (!GetComputerName(szComputerName, &size)) {
+        szComputerName[0] = '\0';
+    }
+#else
+    if (gethostname(szComputerName, sizeof(szComputerName)) != 0) {
+        szComputerName[0] = '\0';
+    }
+    szComputerName[sizeof(szComputerName) - 1] = '\0';
+#endif
+    return szComputerName;
+}
+
+void StartCore()
+{
+    // Record the local computer's name.  This will help log analysis.
+    strHostname = GetComputerHostname();
+
+    CCritSec::EnableStats(Settings.lockStats != 0);
+    LocalIPCache.Start();
+    Resolver.Start();
+    std::string strHistory = LoadRttSeries();
+    StartLogWriter();
+    LogToFile("start", "");
+    if (!strHistory.empty()) {
+        LogToFile("history", strHistory);
+    }
+
+    std::string strError;
+    if (Settings.portMetrics > 0 && !MetricsServer.Start(Settings.portMetrics, strError)) {
+        LogToFile("error", strError);
+    }
+    if (!Settings.strCollector.empty() && !ResultStream.Start(Settings.strCollector, strHostname, GetLikelyLocalIP,
+            strError)) {
+        LogToFile("error", strError);
+    }
+}
+
+void StopCore()
+{
+    ResultStream.Stop();
+    MetricsServer.Stop();
+    LogToFile("stop", "");
+    LogWriter.Stop();
+    Resolver.Stop();
+    LocalIPCache.Stop();
+}
+
+std::string GetTimeStr()
+{
+    return FormatTimestamp(GetWallMicros());
+}
+
+std::string GetTimeStr(int64_t usWall)
+{
+    return FormatTimestamp(usWall);
+}
+
+// Log a record to the log file.
+// Records look like:
+// timestamp,action,hostname,localIP,remoteIP,details
+// For "ping" records, details is the round trip time in milliseconds
+// with microsecond resolution, e.g. "12.345".  For "error" records it is
+// the IP_xxx name of the status, e.g. "IP_REQ_TIMED_OUT", or its number
+// if it has none; or, for errors with no status, a description.  Either
+// is followed by the address pinged, e.g. "12.345 address=192.0.2.7",
+// when the target was given by name.
+void LogToFile(std::string action, std::string details)
+{
+    // Queue the record for the writer thread; this never blocks on disk.
+    LogWriter.Write(FormatLogRecord(action, details));
+}
+
+std::string FormatLogRecord(const std::string& action, const std::string& details)
+{
+    return FormatLogRecord(action, GetSettings()->vectTargets[0].strAddress, details);
+}
+
+std::string FormatLogRecord(const std::string& action, const std::string& strRemote, const std::string& details)
+{
+    return FormatLogRecord(GetWallMicros(), action, strRemote, details);
+}
+
+std::string FormatLogRecord(int64_t usWall, const std::string& action, const std::string& strRemote,
+    const std::string& details)
+{
+    STAGE_SCOPE(STAGE_LOG_FORMAT);
+    char szTime[TIMESTAMP_MAX];
+    size_t cbTime = FormatTimestamp(usWall, szTime, sizeof(szTime));
+    std::string fullMsg;
+    fullMsg.reserve(cbTime + action.size() + strHostname.size() + strRemote.size() + details.size() + 40);
+    fullMsg.append(szTime, cbTime);
+    fullMsg += "," + action;
+    fullMsg += "," + strHostname;
+    // The local IP address can change during program execution (e.g. the
+    // user connects to a different network); the cache is refreshed when
+    // the OS reports an address change.
+    fullMsg += ",";
+    {
+        STAGE_SCOPE(STAGE_LOCAL_IP);
+        fullMsg += LocalIPCache.GetLikelyIP();
+    }
+    fullMsg += "," + strRemote;
+    fullMsg += "," + details;
+    return fullMsg;
+}
+
+// Format a time in microseconds as milliseconds with three decimals,
+// e.g. "0.213".  Sub-millisecond LAN latencies would otherwise show as 0.
+void FormatMicrosAsMs(int64_t us, char* szBuf, size_t cbBuf)
+{
+    snprintf(szBuf, cbBuf, "%lld.%03lld", (long long)(us / 1000), (long long)(us % 1000));
+}
+
+// Format the quantiles and loss of one window, e.g.
+// "1h n=360 lost=0 min=9.812 p50=11.204 p95=14.080 p99=21.504 max=23.117".
+std::string FormatLatencySummary(int iTarget, EnumStatsWindow window, int64_t msNow)
+{
+    StructLatencySummary summary;
+    LatencyStats.GetSummary(iTarget, window, msNow, summary);
+    char szMin[32], szP50[32], szP95[32], szP99[32], szMax[32];
+    FormatMicrosAsMs(summary.usMin, szMin, sizeof(szMin));
+    FormatMicrosAsMs(summary.usP50, szP50, sizeof(szP50));
+    FormatMicrosAsMs(summary.usP95, szP95, sizeof(szP95));
+    FormatMicrosAsMs(summary.usP99, szP99, sizeof(szP99));
+    FormatMicrosAsMs(summary.usMax, szMax, sizeof(szMax));
+    char szBuf[200];
+    snprintf(szBuf, sizeof(szBuf), "%s n=%llu lost=%llu min=%s p50=%s p95=%s p99=%s max=%s",
+        CLatencyStats::GetWindowName(window), (unsigned long long)summary.nProbes,
+        (unsigned long long)summary.nLost, szMin, szP50, szP95, szP99, szMax);
+    return szBuf;
+}
+
+int GetShardOfTarget(const std::string& strTarget, int nShards)
+{
+    if (nShards <= 1) {
+        return 0;
+    }
+    // FNV-1a, rather than std::hash, which differs between libraries.
+    uint32_t hash = 2166136261u;
+    for (size_t j = 0; j < strTarget.size(); j++) {
+        hash = (hash ^ (unsigned char)strTarget[j]) * 16777619u;
+    }
+    return (int)(hash % (uint32_t)nShards);
+}
+
+// Record a problem in ProblemStore, stamped with the event's timestamp.
+static void AddProblem(int64_t usWall, uint32_t kind, uint32_t code, int64_t usRtt, const std::string& strDetail,
+    const std::string& strTarget)
+{
+    STAGE_SCOPE(STAGE_PROBLEM_ADD);
+    StructProblem problem;
+    MakeProblem(problem, usWall / 1000, kind, code, usRtt, strTarget, strDetail);
+    ProblemStore.Add(problem);
+}
+
+// The timeout and slow threshold for a type of probe.  Pings take them
+// from their target.
+static void GetProbeLimits(const struct_settings& settings, const StructTargetSettings& target, EnumProbeType type,
+    int& msTimeout, int& msBad)
+{
+    switch (type) {
+    case PROBE_TYPE_TCP:
+        msTimeout = settings.msTcpTimeout;
+        msBad = settings.msBadTcp;
+        break;
+    case PROBE_TYPE_UDP:
+        msTimeout = settings.msUdpTimeout;
+        msBad = settings.msBadUdp;
+        break;
+    case PROBE_TYPE_DNS:
+        msTimeout = settings.msDnsTimeout;
+        msBad = settings.msBadDns;
+        break;
+    default:
+        msTimeout = target.msPingTimeout;
+        msBad = target.msBadPing;
+        break;
+    }
+}
+
+// The backend, with its ICMP handle and reply buffers, and the session
+// for our target live as long as the prober.  If the configured backend
+// is refused, the ICMP engine stands in and Open reports why.
+static CProbeBackend* CreateConfiguredBackend(std::string& strError)
+{
+    CProbeBackend* pBackend = CreateProbeBackend(GetSettings()->settings.strProbeBackend, strError);
+    return pBackend ? pBackend : new CProbeEngine();
+}
+
+CProber::CProber(CProbeBackend* pBackend, const std::string& strTarget, CSocketProbeEngine* pSockets)
+    : m_pOwnBackend(pBackend ? NULL : CreateConfiguredBackend(m_strBackendError)),
+      m_pBackend(pBackend ? pBackend : m_pOwnBackend.get()), m_session(*m_pBackend),
+      m_strTarget(strTarget), m_pTarget(NULL), m_iStats(-1), m_iSeries(-1), m_msLastSummary(0),
+      m_msNextDue(0), m_msPeriod(0), m_bInBurst(false), m_rng(std::random_device()()), m_bPinging(false), m_bSessionDone(false),
+      m_usStart(0), m_usEnd(0), m_usWaited(0), m_usWallEvent(0), m_msDue(0), m_iContext(0), m_nContext(0), m_nPostContext(0),
+      m_pSockets(pSockets), m_nServicesPending(0), m_msLastTrace(-1), m_train(*m_pBackend),
+      m_pSet(NULL), m_idSetTimer(-1)
+{
+}
+
+CProber::~CProber()
+{
+    // A shared socket engine outlives us; take our targets out of it.
+    if (!m_pOwnSockets) {
+        for (size_t j = 0; j < m_vectServices.size(); j++) {
+            m_pSockets->RemoveTarget(m_vectServices[j].iTarget);
+        }
+    }
+    if (m_bInBurst) {
+        ProbeLoopStats.nInBurst.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+// Raise a maximum that several threads may raise at once.
+static void StoreMax(std::atomic<int64_t>& nMax, int64_t n)
+{
+    int64_t nOld = nMax.load(std::memory_order_relaxed);
+    while (n > nOld && !nMax.compare_exchange_weak(nOld, n, std::memory_order_relaxed)) {
+    }
+}
+
+// Take the latest settings snapshot, and our target in it.  A target
+// that has gone from the settings keeps the values it last had.
+// Exit:   Returns false if the target has never been in the settings.
+bool CProber::TakeSettings()
+{
+    if (m_pSnapshot && m_pSnapshot->version == GetSettingsVersion()) {
+        return true;
+    }
+    std::shared_ptr<const StructSettingsSnapshot> pSnapshot = GetSettings();
+    if (pSnapshot == m_pSnapshot) {
+        return true;
+    }
+    const StructTargetSettings* pTarget = m_strTarget.empty() ? &pSnapshot->vectTargets[0]
+        : pSnapshot->FindTarget(m_strTarget);
+    if (pTarget == NULL) {
+        return m_pTarget != NULL;
+    }
+    m_pSnapshot = pSnapshot;
+    m_pTarget = pTarget;
+    return true;
+}
+
+// Log a record about our target.
+void CProber::LogRecord(const std::string& action, const std::string& details)
+{
+    LogWriter.Write(FormatLogRecord(m_usWallEvent, action, m_pTarget->strAddress, details));
+}
+
+bool CProber::Open(std::string& strError)
+{
+    if (!TakeSettings()) {
+        strError = "no target " + m_strTarget + " in the settings";
+        LogToFile("error", strError);
+        return false;
+    }
+    if (!m_strBackendError.empty()) {
+        strError = m_strBackendError;
+        LogToFile("error", strError);
+        return false;
+    }
+    if (m_pOwnBackend && !m_pOwnBackend->Open(strError)) {
+        LogToFile("error", strError);
+        return false;
+    }
+    int64_t msNow = ProbeNowMicros() / 1000;
+    m_msLastSummary = msNow;
+    m_rollup.Clear(msNow);
+    m_msPeriod = m_pTarget->secsSleep * 1000;
+    m_msNextDue = msNow + m_rng() % (m_msPeriod > 0 ? m_msPeriod : 1);
+    return true;
+}
+
+int CProber::GetMsUntilDue() const
+{
+    int64_t msWait = m_msNextDue - ProbeNowMicros() / 1000;
+    int msTrace = m_tracer.GetMsUntilNext();
+    if (msTrace < msWait) {
+        msWait = msTrace;
+    }
+    int msTrain = m_train.GetMsUntilNext();
+    if (msTrain < msWait) {
+        msWait = msTrain;
+    }
+    return msWait < 0 ? 0 : msWait > INT32_MAX ? INT32_MAX : (int)msWait;
+}
+
+int CProber::GetMsUntilPoll() const
+{
+    int msWait = m_train.GetMsUntilNext();
+    return IsBusyAlongside() && msWait > 1 ? 1 : msWait;
+}
+
+// Start a path trace to the target, unless one is running or the last
+// was too recent.
+void CProber::StartTrace(int64_t msNow)
+{
+    const struct_settings& settings = m_pSnapshot->settings;
+    if (settings.secsTraceMin <= 0 || m_tracer.IsRunning() ||
+        (m_msLastTrace >= 0 && msNow - m_msLastTrace < settings.secsTraceMin * 1000LL)) {
+        return;
+    }
+    m_msLastTrace = msNow;
+    std::string strError;
+    if (!m_tracer.Start(settings.strProbeBackend, m_outcome.strAddress, settings.nTraceHops,
+            settings.nTraceRounds, m_pTarget->msPingTimeout, strError)) {
+        LogRecord("error", strError);
+    }
+}
+
+// Wait up to msWait ms on whichever of the service probes and the path
+// trace are out.  When both are, neither waits more than a millisecond,
+// so that each is read promptly.  A shared socket engine is left for its
+// owner to poll.
+void CProber::PollAlongside(int msWait)
+{
+    bool bServices = m_nServicesPending > 0 && m_pOwnSockets;
+    bool bTrace = m_tracer.IsRunning();
+    if (bServices && bTrace && msWait > 1) {
+        msWait = 1;
+    }
+    if (bServices) {
+        m_pSockets->Poll(bTrace ? 0 : msWait, OnServiceDone, NULL);
+    }
+    if (bTrace) {
+        PollTrace(msWait);
+    }
+}
+
+// Move a running path trace along, and log it and add it to the
+// problems once it finishes.
+void CProber::PollTrace(int msWait)
+{
+    if (!m_tracer.Poll(msWait)) {
+        return;
+    }
+    // Filed under the target as configured, like its pings, even if it
+    // is a name.
+    std::string strTrace = m_tracer.Format();
+    int64_t usWall = GetWallMicros();
+    LogWriter.Write(FormatLogRecord(usWall, "trace", m_pTarget->strAddress, strTrace));
+    AddProblem(usWall, PROBLEM_PATH_TRACE, 0, -1, strTrace, m_pTarget->strAddress);
+}
+
+// Work out the next deadline from the one just served, and switch burst
+// mode on or off.
+void CProber::ScheduleNext(int64_t msDue, bool bProblem)
+{
+    int msNormal = m_pTarget->secsSleep * 1000;
+    int msBurst = m_pSnapshot->settings.msBurstInterval;
+    bool bWasBurst = m_bInBurst;
+    if (bProblem && msBurst > 0 && msBurst < msNormal) {
+        m_msPeriod = msBurst;
+    } else if (!bProblem && bWasBurst) {
+        m_msPeriod = m_msPeriod * 2 < msNormal ? m_msPeriod * 2 : msNormal;
+    } else {
+        m_msPeriod = msNormal;
+    }
+    bool bBurst = m_msPeriod < msNormal;
+    if (bBurst != bWasBurst) {
+        LogRecord("burst", bBurst ? "start" : "end");
+        m_bInBurst = bBurst;
+        LatencyStats.SetBurst(m_iStats, bBurst);
+        ProbeLoopStats.nInBurst.fetch_add(bBurst ? 1 : -1, std::memory_order_relaxed);
+        if (bBurst) {
+            ProbeLoopStats.nBursts.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Stay on the grid of the old deadline, skipping any we've overrun.
+    int64_t msNext = msDue + m_msPeriod;
+    int64_t msNow = ProbeNowMicros() / 1000;
+    if (msNext <= msNow) {
+        int64_t nSkipped = (msNow - msNext) / m_msPeriod + 1;
+        msNext += nSkipped * m_msPeriod;
+        ProbeLoopStats.nSkipped.fetch_add(nSkipped, std::memory_order_relaxed);
+    }
+    m_msNextDue = msNext;
+}
+
+// Log the record of one ping, or hold it back as context for an episode,
+// as the logDetail setting says.
+void CProber::LogPing(const StructPingOutcome& outcome, const std::string& strRecord)
+{
+    const struct_settings& settings = m_pSnapshot->settings;
+    if (settings.logDetail != LOG_DETAIL_EPISODES) {
+        LogWriter.Write(strRecord);
+        return;
+    }
+
+    m_rollup.Add(outcome.usPing);
+    if (settings.secsRollup > 0 && outcome.msNow - m_rollup.msStart >= settings.secsRollup * 1000LL) {
+        char szRollup[160];
+        m_rollup.Format(outcome.msNow, szRollup, sizeof(szRollup));
+        LogRecord("rollup", szRollup);
+        m_rollup.Clear(outcome.msNow);
+    }
+
+    bool bWasEpisode = m_episodes.InEpisode();
+    bool bChanged = m_episodes.Update(outcome.msNow, outcome.usPing, outcome.bSlow, outcome.errorCode);
+    const char* pszState = CEpisodeTracker::GetStateName(m_episodes.GetState());
+    if (m_episodes.InEpisode()) {
+        if (!bWasEpisode) {
+            // Write out the pings that led up to it, oldest first.
+            size_t nSlots = m_vectContext.size();
+            for (size_t j = 0; j < m_nContext; j++) {
+                LogWriter.Write(m_vectContext[(m_iContext + nSlots - m_nContext + j) % nSlots]);
+            }
+            m_nContext = 0;
+            LogRecord("episode", std::string("start state=") + pszState);
+        } else if (bChanged) {
+            LogRecord("episode", std::string("state=") + pszState);
+        }
+        LogWriter.Write(strRecord);
+        m_nPostContext = settings.nEpisodeContext;
+        return;
+    }
+    if (bWasEpisode) {
+        char szEpisode[400];
+        CEpisodeTracker::FormatEpisode(m_episodes.GetEpisode(), szEpisode, sizeof(szEpisode));
+        LogWriter.Write(strRecord);
+        LogRecord("episode", szEpisode);
+        return;
+    }
+    if (m_nPostContext > 0) {
+        m_nPostContext--;
+        LogWriter.Write(strRecord);
+        return;
+    }
+
+    // Healthy: keep the record in case an episode follows.
+    size_t nSlots = settings.nEpisodeContext > 0 ? settings.nEpisodeContext : 0;
+    if (m_vectContext.size() != nSlots) {
+        m_vectContext.assign(nSlots, std::string());
+        m_iContext = 0;
+        m_nContext = 0;
+    }
+    if (nSlots > 0) {
+        m_vectContext[m_iContext] = strRecord;
+        m_iContext = (m_iContext + 1) % nSlots;
+        if (m_nContext < nSlots) {
+            m_nContext++;
+        }
+    }
+}
+
+// Bring m_vectServices into line with the target's probes, which may
+// have been reloaded.  Specs that are refused are logged and left out.
+void CProber::SetServiceProbes()
+{
+    if (m_pTarget->strProbes == m_strProbes) {
+        return;
+    }
+    m_strProbes = m_pTarget->strProbes;
+    for (size_t j = 0; j < m_vectServices.size(); j++) {
+        m_pSockets->RemoveTarget(m_vectServices[j].iTarget);
+    }
+    m_vectServices.clear();
+    if (m_strProbes.empty()) {
+        return;
+    }
+    std::string strError;
+    if (m_pSockets == NULL) {
+        m_pOwnSockets.reset(new CSocketProbeEngine());
+        if (!m_pOwnSockets->Open(strError)) {
+            m_pOwnSockets.reset();
+            LogRecord("error", strError);
+            return;
+        }
+        m_pSockets = m_pOwnSockets.get();
+    }
+
+    size_t iStart = 0;
+    while (iStart < m_strProbes.size()) {
+        size_t iEnd = m_strProbes.find(',', iStart);
+        if (iEnd == std::string::npos) {
+            iEnd = m_strProbes.size();
+        }
+        size_t iFirst = m_strProbes.find_first_not_of(' ', iStart);
+        size_t iLast = m_strProbes.find_last_not_of(' ', iEnd - 1);
+        iStart = iEnd + 1;
+        if (iFirst >= iEnd || iLast == std::string::npos || iLast < iFirst) {
+            continue;
+        }
+        StructServiceProbe probe;
+        probe.strSpec = m_strProbes.substr(iFirst, iLast + 1 - iFirst);
+        probe.type = GetProbeType(probe.strSpec);
+        probe.pProber = this;
+        probe.iTarget = m_pSockets->AddTarget(probe.strSpec.c_str(), strError);
+        if (probe.iTarget < 0) {
+            LogRecord("error", strError);
+            continue;
+        }
+        probe.iStats = LatencyStats.GetTarget(probe.strSpec);
+        probe.bDone = false;
+        probe.usRtt = -1;
+        probe.errorCode = 0;
+        probe.bSlow = false;
+        m_vectServices.push_back(probe);
+    }
+}
+
+void CProber::SendServiceProbes()
+{
+    m_nServicesPending = 0;
+    for (size_t j = 0; j < m_vectServices.size(); j++) {
+        StructServiceProbe& probe = m_vectServices[j];
+        int msTimeout, msBad;
+        GetProbeLimits(m_pSnapshot->settings, *m_pTarget, probe.type, msTimeout, msBad);
+        probe.bDone = false;
+        m_nServicesPending++;
+        if (!m_pSockets->Send(probe.iTarget, msTimeout, &probe)) {
+            StructProbeResult result;
+            result.iTarget = probe.iTarget;
+            result.seq = 0;
+            result.errorCode = PROBE_ERR_NO_RESOURCES;
+            result.usRoundTrip = 0;
+            result.addrFrom.Clear();
+            result.bDuplicate = false;
+            result.pUser = &probe;
+            OnServiceDone(result, NULL);
+        }
+    }
+}
+
+// Completion callback for the socket engine: account for and log the
+// outcome of a service probe, named by the pUser cookie.  m_vectServices
+// doesn't change while any probe is out, so the cookie stays good.
+void CProber::OnServiceDone(const StructProbeResult& result, void* pContext)
+{
+    (void)pContext;
+    StructServiceProbe& probe = *(StructServiceProbe*)result.pUser;
+    CProber* pProber = probe.pProber;
+    pProber->m_nServicesPending--;
+    int msTimeout, msBad;
+    GetProbeLimits(pProber->m_pSnapshot->settings, *pProber->m_pTarget, probe.type, msTimeout, msBad);
+    int64_t msNow = ProbeNowMicros() / 1000;
+    int64_t usWall = GetWallMicros();
+
+    probe.bDone = true;
+    probe.errorCode = result.errorCode;
+    probe.usRtt = result.errorCode == 0 ? result.usRoundTrip : -1;
+    probe.bSlow = probe.usRtt >= (int64_t)msBad * 1000;
+    LatencyStats.Record(probe.iStats, probe.usRtt, msNow, probe.errorCode);
+    if (ResultStream.IsRunning()) {
+        ResultStream.Send(probe.strSpec, usWall / 1000, probe.usRtt, probe.errorCode);
+    }
+
+    std::string strAction = GetProbeTypeName(probe.type);
+    std::string strRemote = probe.strSpec.substr(strAction.size() + 1);
+    char szDetail[32];
+    if (probe.usRtt >= 0) {
+        FormatMicrosAsMs(probe.usRtt, szDetail, sizeof(szDetail));
+        if (probe.bSlow) {
+            AddProblem(usWall, PROBLEM_SLOW_PING, 0, probe.usRtt, "", probe.strSpec);
+        }
+    } else {
+        FormatErrorCode(probe.errorCode, szDetail, sizeof(szDetail));
+        strAction += "-error";
+        AddProblem(usWall, PROBLEM_ERROR, probe.errorCode, -1, "", probe.strSpec);
+    }
+    if (pProber->m_pSnapshot->settings.logDetail != LOG_DETAIL_EPISODES || probe.usRtt < 0 || probe.bSlow) {
+        LogWriter.Write(FormatLogRecord(usWall, strAction, strRemote, szDetail));
+    }
+}
+
+bool CProber::Ping(StructPingOutcome& outcome)
+{
+    if (!StartPing()) {
+        return false;
+    }
+    while (!PollPing(m_pTarget->msPingTimeout)) {
+    }
+    FinishPing();
+    outcome = m_outcome;
+    return true;
+}
+
+bool CProber::StartPing()
+{
+    if (m_tracer.IsRunning()) {
+        PollTrace(0);
+    }
+    int64_t usStart = ProbeNowMicros();
+    if (usStart / 1000 < m_msNextDue) {
+        return false;
+    }
+    STAGE_SCOPE(STAGE_PING_START);
+    TakeSettings();
+
+    // A name is resolved in the background; until its first answer, look
+    // again shortly.
+    StructResolved resolved;
+    EnumResolveState resolveState = Resolver.Lookup(m_pTarget->strAddress, resolved);
+    if (resolveState == RESOLVE_PENDING) {
+        m_msNextDue = usStart / 1000 + PROBER_RESOLVE_RETRY_MS;
+        return false;
+    }
+    m_usStart = usStart;
+    m_usWallEvent = GetWallMicros();
+    m_msDue = m_msNextDue;
+    int64_t usLag = usStart - m_msDue * 1000;
+    ProbeLoopStats.usLagTotal.fetch_add(usLag, std::memory_order_relaxed);
+    ProbeLoopStats.usLagLast.store(usLag, std::memory_order_relaxed);
+    StoreMax(ProbeLoopStats.usLagMax, usLag);
+
+    StructPingOutcome& outcome = m_outcome;
+    outcome.strTarget = m_pTarget->strAddress;
+    outcome.strAddress = resolved.strAddress;
+    outcome.usPing = -1;
+    outcome.errorCode = 0;
+    outcome.strError.clear();
+    outcome.bSlow = false;
+    NoteResolved(resolveState, resolved);
+
+    if (m_strStatsTarget != m_pTarget->strAddress) {
+        m_strStatsTarget = m_pTarget->strAddress;
+        m_iStats = LatencyStats.GetTarget(m_strStatsTarget);
+        m_iSeries = RttSeries.GetTarget(m_strStatsTarget, m_pTarget->secsSleep);
+        // Pings still log; only statistics or history are lost.  Say so
+        // once, not for every target past the limit.
+        static std::atomic<bool> bUntrackedLogged(false);
+        if ((m_iStats < 0 || m_iSeries < 0) && !bUntrackedLogged.exchange(true)) {
+            LogToFile("error", std::string("no room to keep ") +
+                (m_iStats < 0 ? "statistics" : "RTT history (see SeriesMemoryMB)") + " for " + m_strStatsTarget +
+                " and later targets");
+        }
+    }
+    LatencyStats.RecordLag(m_iStats, usLag);
+    SetServiceProbes();
+    SendServiceProbes();
+    outcome.bTrain = false;
+    if (m_pTarget->nTrainPackets > 1 && resolveState == RESOLVE_OK) {
+        std::string strError;
+        outcome.bTrain = m_train.Start(outcome.strAddress, m_pTarget->nTrainPackets,
+            m_pSnapshot->settings.msTrainSpacing, m_pTarget->msPingTimeout, strError);
+        if (!outcome.bTrain && strError != m_strTrainError) {
+            LogRecord("error", strError);
+        }
+        m_strTrainError = strError;
+    }
+    m_bPinging = true;
+    if (resolveState == RESOLVE_OK) {
+        m_bSessionDone = !m_session.SetAddress(outcome.strAddress, outcome.strError);
+    } else {
+        outcome.strError = "Cannot resolve " + m_pTarget->strAddress + ": " + resolved.strError;
+        m_bSessionDone = true;
+    }
+    if (!m_bSessionDone) {
+        m_session.Send(m_pTarget->msPingTimeout);
+    } else {
+        m_usEnd = ProbeNowMicros();
+        m_usWaited = 0;
+        m_usWallEvent = GetWallMicros();
+    }
+    return true;
+}
+
+// Log the address a target's name resolved to when it is first learned
+// or changes, and a failure to resolve it when it first fails or fails
+// differently.
+void CProber::NoteResolved(EnumResolveState state, const StructResolved& resolved)
+{
+    if (resolved.bNumeric) {
+        return;
+    }
+    if (state != RESOLVE_OK) {
+        if (resolved.strError != m_strResolveError) {
+            m_strResolveError = resolved.strError;
+            LogRecord("resolve-error", resolved.strError);
+        }
+        return;
+    }
+    m_strResolveError.clear();
+    if (resolved.strAddress == m_strResolved) {
+        return;
+    }
+    std::string strDetails = "address=" + resolved.strAddress + " ttl=" + std::to_string(resolved.secsTtl);
+    if (!m_strResolved.empty()) {
+        strDetails += " was=" + m_strResolved;
+    }
+    m_strResolved = resolved.strAddress;
+    LogRecord("resolve", strDetails);
+}
+
+bool CProber::PollPing(int msWait)
+{
+    if (!m_bPinging) {
+        return true;
+    }
+    STAGE_SCOPE(STAGE_PING_WAIT);
+    // The train's requests go out as they fall due, and its replies come
+    // through the backend with the ping's, so no wait runs past the next.
+    m_train.SendDue();
+    int msTrain = m_train.GetMsUntilNext();
+    if (msTrain < msWait) {
+        msWait = msTrain;
+    }
+    if (!m_bSessionDone) {
+        // While service probes or a path trace are out, take turns
+        // waiting on the backends, a millisecond at a time.
+        bool bAlongside = IsBusyAlongside();
+        if (m_pOwnBackend) {
+            m_session.Poll(bAlongside ? 0 : msWait);
+        }
+        if (bAlongside && !m_session.IsDone()) {
+            PollAlongside(m_pOwnBackend && msWait > 0 ? 1 : 0);
+        }
+        if (!m_session.IsDone()) {
+            return false;
+        }
+        m_bSessionDone = true;
+        m_usEnd = ProbeNowMicros();
+        m_usWaited = m_session.GetWaited();
+        m_usWallEvent = GetWallMicros();
+        m_outcome.usPing = m_session.GetResult();
+        if (m_outcome.usPing < 0) {
+            m_outcome.errorCode = m_session.GetErrorCode();
+        }
+    }
+    if (m_train.IsRunning() && m_pOwnBackend) {
+        m_session.Poll(IsBusyAlongside() ? 0 : msWait);
+        msWait = msWait > 1 ? 1 : msWait;
+    }
+    if (IsBusyAlongside()) {
+        PollAlongside(msWait);
+    }
+    return m_nServicesPending == 0 && !m_train.IsRunning();
+}
+
+void CProber::FinishPing()
+{
+    if (!m_bPinging) {
+        return;
+    }
+    m_bPinging = false;
+    STAGE_SCOPE(STAGE_PING_FINISH);
+    const struct_settings& settings = m_pSnapshot->settings;
+    StructPingOutcome& outcome = m_outcome;
+    outcome.iStats = m_iStats;
+    outcome.iSeries = m_iSeries;
+    if (outcome.bTrain) {
+        outcome.train = m_train.GetResult();
+    }
+    outcome.msNow = m_usEnd / 1000;
+    outcome.usWall = m_usWallEvent;
+    {
+        STAGE_SCOPE(STAGE_STATS_RECORD);
+        LatencyStats.Record(m_iStats, outcome.usPing, outcome.msNow, outcome.errorCode);
+        RttSeries.Record(m_iSeries, outcome.usWall / 1000, outcome.usPing);
+    }
+    if (ResultStream.IsRunning()) {
+        ResultStream.Send(outcome.strTarget, outcome.usWall / 1000, outcome.usPing, outcome.errorCode);
+    }
+
+    // A failed ping measured no round trip; its wait for the error or
+    // timeout isn't the loop's overhead either.
+    int64_t usOverhead = m_usEnd - m_usStart - (outcome.usPing > 0 ? outcome.usPing : m_usWaited);
+    ProbeLoopStats.nPings.fetch_add(1, std::memory_order_relaxed);
+    ProbeLoopStats.usBusyTotal.fetch_add(m_usEnd - m_usStart, std::memory_order_relaxed);
+    if (usOverhead > 0) {
+        ProbeLoopStats.usOverheadTotal.fetch_add(usOverhead, std::memory_order_relaxed);
+        StoreMax(ProbeLoopStats.usOverheadMax, usOverhead);
+    }
+    if (settings.secsLogSummary > 0 && outcome.msNow - m_msLastSummary >= settings.secsLogSummary * 1000LL) {
+        m_msLastSummary = outcome.msNow;
+        LogRecord("summary", FormatLatencySummary(m_iStats, STATS_WINDOW_1HOUR, outcome.msNow));
+    }
+
+    // Records of a target given by name also say which address answered
+    // or failed, so that a change of address shows up against its pings.
+    const std::string& strTarget = m_pTarget->strAddress;
+    std::string strPinged;
+    if (!outcome.strAddress.empty() && outcome.strAddress != strTarget) {
+        strPinged = " address=" + outcome.strAddress;
+    }
+    if (outcome.usPing >= 0) {
+        char szMs[32];
+        FormatMicrosAsMs(outcome.usPing, szMs, sizeof(szMs));
+        if (outcome.usPing >= (int64_t)m_pTarget->msBadPing * 1000) {
+            outcome.bSlow = true;
+            AddProblem(outcome.usWall, PROBLEM_SLOW_PING, 0, outcome.usPing, "", strTarget);
+        }
+        LogPing(outcome, FormatLogRecord(outcome.usWall, "ping", strTarget, szMs + strPinged));
+    } else {
+        // The description is left for whoever displays the problem.
+        AddProblem(outcome.usWall, PROBLEM_ERROR, outcome.errorCode, -1, outcome.strError, strTarget);
+        if (outcome.errorCode) {
+            char szCode[32];
+            FormatErrorCode(outcome.errorCode, szCode, sizeof(szCode));
+            LogPing(outcome, FormatLogRecord(outcome.usWall, "error", strTarget, szCode + strPinged));
+        } else {
+            LogPing(outcome, FormatLogRecord(outcome.usWall, "error", strTarget, outcome.strError + strPinged));
+        }
+    }
+    if (outcome.bTrain && (settings.logDetail != LOG_DETAIL_EPISODES || outcome.train.nReceived < outcome.train.nSent)) {
+        LogRecord("train", CPacketTrain::Format(outcome.train));
+    }
+    if (outcome.bSlow || outcome.errorCode != 0) {
+        StartTrace(outcome.msNow);
+    }
+    ScheduleNext(m_msDue, outcome.usPing < 0 || outcome.bSlow);
+}
+
+CProberSet::CProberSet()
+    : m_bSocketsOpen(false), m_iShard(0), m_nShards(1), m_pStats(NULL), m_bScheduled(false), m_pPool(NULL),
+      m_iWorker(0), m_pfnPinged(NULL), m_pPingedContext(NULL), m_nFinishing(0), m_critFinished("ProberSet.Finished")
+{
+}
+
+CProberSet::~CProberSet()
+{
+    // The probers' sessions and service probes leave the backends
+    // before they close.
+    m_vectProbers.clear();
+    if (m_pBackend) {
+        m_pBackend->Close();
+    }
+    m_sockets.Close();
+}
+
+bool CProberSet::Open(std::string& strError)
+{
+    std::string strBackendError;
+    m_pBackend.reset(CreateConfiguredBackend(strBackendError));
+    if (!strBackendError.empty()) {
+        strError = strBackendError;
+        LogToFile("error", strError);
+        return false;
+    }
+    if (!m_pBackend->Open(strError)) {
+        LogToFile("error", strError);
+        return false;
+    }
+    // Without a shared socket engine, service probes still work, each
+    // prober opening its own.
+    m_bSocketsOpen = m_sockets.Open(strBackendError);
+    if (!m_bSocketsOpen) {
+        LogToFile("error", strBackendError);
+    }
+    Sync();
+    return true;
+}
+
+void CProberSet::Sync()
+{
+    if (m_pSnapshot && m_pSnapshot->version == GetSettingsVersion()) {
+        return;
+    }
+    m_pSnapshot = GetSettings();
+
+    // Keep the probers of targets that stay, in the order of the targets.
+    std::unordered_map<std::string, std::unique_ptr<CProber>> mapOld;
+    for (size_t j = 0; j < m_vectProbers.size(); j++) {
+        std::string strTarget = m_vectProbers[j]->GetTarget();
+        mapOld[strTarget] = std::move(m_vectProbers[j]);
+    }
+    m_vectProbers.clear();
+    m_bScheduled = false;
+    for (size_t j = 0; j < m_pSnapshot->vectTargets.size(); j++) {
+        const std::string& strTarget = m_pSnapshot->vectTargets[j].strAddress;
+        if (m_nShards > 1 && GetShardOfTarget(strTarget, m_nShards) != m_iShard) {
+            continue;
+        }
+        std::unordered_map<std::string, std::unique_ptr<CProber>>::iterator it = mapOld.find(strTarget);
+        if (it != mapOld.end()) {
+            m_vectProbers.push_back(std::move(it->second));
+            mapOld.erase(it);
+            continue;
+        }
+        std::unique_ptr<CProber> pProber(new CProber(m_pBackend.get(), strTarget,
+            m_bSocketsOpen ? &m_sockets : NULL));
+        pProber->m_pSet = this;
+        std::string strError;
+        if (pProber->Open(strError)) {
+            m_vectProbers.push_back(std::move(pProber));
+        }
+    }
+    if (m_pStats) {
+        m_pStats->nTargets.store((int)m_vectProbers.size(), std::memory_order_relaxed);
+    }
+}
+
+int CProberSet::GetMsUntilDue() const
+{
+    if (m_bScheduled) {
+        int64_t msWait = m_wheelDue.GetNextDue() - ProbeNowMicros() / 1000;
+        return msWait < 0 ? 0 : msWait > INT32_MAX ? INT32_MAX : (int)msWait;
+    }
+    int msWait = INT32_MAX;
+    for (size_t j = 0; j < m_vectProbers.size(); j++) {
+        int msProber = m_vectProbers[j]->GetMsUntilDue();
+        if (msProber < msWait) {
+            msWait = msProber;
+        }
+    }
+    return msWait;
+}
+
+void CProberSet::SetShard(int iShard, int nShards, StructShardStats* pStats)
+{
+    m_iShard = iShard;
+    m_nShards = nShards;
+    m_pStats = pStats;
+}
+
+void CProberSet::SetFinisher(CWorkPool* pPool, int iWorker, PFN_PINGED pfnPinged, void* pContext)
+{
+    m_pPool = pPool;
+    m_iWorker = iWorker;
+    m_pfnPinged = pfnPinged;
+    m_pPingedContext = pContext;
+}
+
+// Put a prober with no ping out in m_wheelDue, at least a millisecond
+// ahead, so one that is due but can't ping yet doesn't spin the loop.
+void CProberSet::Schedule(CProber* pProber, int64_t msNow)
+{
+    int msUntil = pProber->GetMsUntilDue();
+    int64_t msDue = msNow + (msUntil < 1 ? 1 : msUntil);
+    if (pProber->m_idSetTimer >= 0) {
+        m_wheelDue.Reschedule(pProber->m_idSetTimer, msDue);
+        return;
+    }
+    int id = m_wheelDue.Add(msDue);
+    if ((size_t)id >= m_vectProberOfTimer.size()) {
+        m_vectProberOfTimer.resize(id + 1, NULL);
+    }
+    m_vectProberOfTimer[id] = pProber;
+    pProber->m_idSetTimer = id;
+}
+
+// Start m_wheelDue afresh with every prober, after a Sync.  Nothing is
+// out then.
+void CProberSet::ScheduleAll(int64_t msNow)
+{
+    m_wheelDue = CTimerWheel();
+    m_vectProberOfTimer.clear();
+    for (size_t j = 0; j < m_vectProbers.size(); j++) {
+        m_vectProbers[j]->m_idSetTimer = -1;
+        Schedule(m_vectProbers[j].get(), msNow);
+    }
+    m_bScheduled = true;
+}
+
+// Finish a ping that is done, here or on the pool.
+void CProberSet::StepFinish(CProber* pProber)
+{
+    if (m_pPool) {
+        m_nFinishing++;
+        m_pPool->Submit(m_iWorker, FinishTask, pProber);
+        return;
+    }
+    pProber->FinishPing();
+    if (m_pfnPinged) {
+        m_pfnPinged(*pProber, m_pPingedContext);
+    }
+    Schedule(pProber, ProbeNowMicros() / 1000);
+}
+
+// Runs on a worker of the pool.  Handing the prober back under
+// m_critFinished publishes what FinishPing changed to the set's thread.
+// The first prober handed back since Step last looked wakes the set's
+// wait on the backend; a wake that comes before the wait ends the wait
+// at once, so none is lost.
+void CProberSet::FinishTask(void* pArg, int iWorker)
+{
+    (void)iWorker;
+    CProber* pProber = (CProber*)pArg;
+    CProberSet* pSet = pProber->m_pSet;
+    pProber->FinishPing();
+    if (pSet->m_pfnPinged) {
+        pSet->m_pfnPinged(*pProber, pSet->m_pPingedContext);
+    }
+    bool bFirst;
+    {
+        CCritSecInScope lock(pSet->m_critFinished);
+        bFirst = pSet->m_vectFinished.empty();
+        pSet->m_vectFinished.push_back(pProber);
+    }
+    if (bFirst) {
+        pSet->m_pBackend->Wake();
+    }
+}
+
+int CProberSet::Step(int msWait)
+{
+    int64_t usStepStart = ProbeNowMicros();
+    int64_t msNow = usStepStart / 1000;
+
+    // Probers the pool has finished with are due again.
+    {
+        CCritSecInScope lock(m_critFinished);
+        m_vectReturned.swap(m_vectFinished);
+    }
+    for (size_t j = 0; j < m_vectReturned.size(); j++) {
+        m_nFinishing--;
+        if (m_bScheduled) {
+            Schedule(m_vectReturned[j], msNow);
+        }
+    }
+    m_vectReturned.clear();
+
+    // No prober may go away while it is out or on the pool.
+    bool bSyncDue = !m_pSnapshot || GetSettingsVersion() != m_pSnapshot->version;
+    if (bSyncDue && m_vectActive.empty() && m_nFinishing == 0) {
+        Sync();
+        bSyncDue = false;
+    }
+    if (!m_bScheduled && m_vectActive.empty() && m_nFinishing == 0) {
+        ScheduleAll(msNow);
+    }
+
+    int nStarted = 0;
+    if (!bSyncDue && m_bScheduled) {
+        m_vectDue.clear();
+        m_wheelDue.Expire(msNow, m_vectDue);
+        for (size_t j = 0; j < m_vectDue.size(); j++) {
+            CProber* pProber = m_vectProberOfTimer[m_vectDue[j]];
+            if (pProber->StartPing()) {
+                m_wheelDue.Remove(pProber->m_idSetTimer);
+                m_vectProberOfTimer[pProber->m_idSetTimer] = NULL;
+                pProber->m_idSetTimer = -1;
+                m_vectActive.push_back(pProber);
+                nStarted++;
+            } else {
+                Schedule(pProber, msNow);
+            }
+        }
+    }
+
+    // Finish what is done before and after one wait on the backend, which
+    // serves every prober's ping.  Pings that failed without sending, such
+    // as to a name that didn't resolve, are finished before the wait.
+    // While anything is out alongside, wait a millisecond at a time, so
+    // nothing waits long on the set; probers the pool hands back wake the
+    // wait themselves (see FinishTask).
+    int64_t usWait = 0;
+    for (int iPass = 0; iPass < 2; iPass++) {
+        size_t iKeep = 0;
+        for (size_t j = 0; j < m_vectActive.size(); j++) {
+            CProber* pProber = m_vectActive[j];
+            if (pProber->PollPing(0)) {
+                StepFinish(pProber);
+            } else {
+                m_vectActive[iKeep++] = pProber;
+            }
+        }
+        m_vectActive.resize(iKeep);
+        if (iPass == 1) {
+            break;
+        }
+
+        // Timers aren't expired while a sync waits, so don't wait on them.
+        int64_t msUntil = bSyncDue ? 1 : m_wheelDue.GetNextDue() - ProbeNowMicros() / 1000;
+        int msPoll = msUntil < 0 ? 0 : msUntil < msWait ? (int)msUntil : msWait;
+        for (size_t j = 0; j < m_vectActive.size() && msPoll > 0; j++) {
+            int msProber = m_vectActive[j]->GetMsUntilPoll();
+            if (msProber < msPoll) {
+                msPoll = msProber;
+            }
+        }
+        int64_t usPollStart = ProbeNowMicros();
+        {
+            STAGE_SCOPE(STAGE_BACKEND_POLL);
+            m_pBackend->Poll(msPoll, DispatchProbeDone, NULL);
+        }
+        usWait = ProbeNowMicros() - usPollStart;
+        if (m_sockets.GetInFlight() > 0) {
+            m_sockets.Poll(0, CProber::OnServiceDone, NULL);
+        }
+    }
+
+    if (m_pStats) {
+        m_pStats->nActive.store((int)m_vectActive.size(), std::memory_order_relaxed);
+        m_pStats->nFinishing.store(m_nFinishing, std::memory_order_relaxed);
+        m_pStats->nPings.fetch_add(nStarted, std::memory_order_relaxed);
+        m_pStats->nSteps.fetch_add(1, std::memory_order_relaxed);
+        m_pStats->usWait.fetch_add(usWait, std::memory_order_relaxed);
+        m_pStats->usBusy.fetch_add(ProbeNowMicros() - usStepStart - usWait, std::memory_order_relaxed);
+    }
+    return nStarted;
+}
@@ -0,0 +1,419 @@
+// Prober.h : The platform-neutral core shared by netavailw (the Windows
+// dialog) and netavaild (the headless daemon): pinging the configured
+// targets, logging records, and keeping latency statistics and problems.
+// Nothing here touches a window; front ends display the outcome of each
+// ping as they see fit.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CritSec.h"
+#include "Episodes.h"
+#include "ErrorCodes.h"
+#include "LatencyStats.h"
+#include "LocalIP.h"
+#include "LogWriter.h"
+#include "MetricsServer.h"
+#include "PacketTrain.h"
+#include "PathTrace.h"
+#include "ProbeBackend.h"
+#include "ProbeSession.h"
+#include "ProblemStore.h"
+#include "Resolver.h"
+#include "ResultStream.h"
+#include "RttSeries.h"
+#include "Settings.h"
+#include "SocketProbe.h"
+#include "StageTimer.h"
+#include "TimerWheel.h"
+#include "Timestamp.h"
+#include "WorkPool.h"
+
+#define PROBER_RESOLVE_RETRY_MS 100     // how soon to look again for a name still being resolved
+
+extern std::string strHostname;
+extern CProblemStore ProblemStore;  // recent problems; the prober never waits on readers
+extern CLogWriter LogWriter;        // writes netavailw.csv in the background
+extern CLocalIPCache LocalIPCache;  // local IP for the log, refreshed on address changes
+extern CLatencyStats LatencyStats;  // rolling RTT quantiles and loss per target
+extern CRttSeries RttSeries;        // RTT history per target, for the latency graph
+extern CMetricsServer MetricsServer; // Prometheus endpoint, if Settings.portMetrics is set
+extern CResultStream ResultStream;  // results to the fleet collector, if Settings.strCollector is set
+extern CResolver Resolver;          // addresses of targets given by name
+
+// Timing of CProber::Ping, for the metrics endpoint.  Overhead is the
+// time a ping took beyond the round trip it measured, or, if it failed,
+// beyond its wait for the error or timeout; lag is how late it started
+// compared with its deadline.  These are over all targets, which
+// may ping from several threads; the lag and burst mode of each target
+// are in LatencyStats.
+struct StructProbeLoopStats {
+    std::atomic<uint64_t> nPings{0};
+    std::atomic<uint64_t> usBusyTotal{0};
+    std::atomic<uint64_t> usOverheadTotal{0};
+    std::atomic<int64_t>  usOverheadMax{0};
+    std::atomic<uint64_t> usLagTotal{0};
+    std::atomic<int64_t>  usLagMax{0};
+    std::atomic<int64_t>  usLagLast{0};
+    std::atomic<uint64_t> nSkipped{0};      // deadlines missed because a ping overran
+    std::atomic<uint64_t> nBursts{0};       // times a target entered burst mode
+    std::atomic<int>      nInBurst{0};      // targets in burst mode
+};
+extern StructProbeLoopStats ProbeLoopStats;
+
+// The load of one CProberSet pinging by Step, such as a shard of a
+// CShardedProberSet (see ShardedProber.h).  Busy is the time spent
+// other than waiting on the backend.
+struct StructShardStats {
+    std::atomic<int>      nTargets{0};
+    std::atomic<int>      nActive{0};       // pings out
+    std::atomic<int>      nFinishing{0};    // pings handed to the pool and not yet back
+    std::atomic<uint64_t> nPings{0};
+    std::atomic<uint64_t> nSteps{0};
+    std::atomic<uint64_t> usBusy{0};
+    std::atomic<uint64_t> usWait{0};
+    std::atomic<int64_t>  usStarted{0};     // when the shard started, on ProbeNowMicros
+};
+
+// Record the host name, fill in RttSeries from the log, and start the
+// local IP cache, the resolver, the log writer, the metrics endpoint and
+// result streaming with the current Settings; logs "start", and
+// "history" if the log was read.  Call after Settings.Load() and
+// PublishSettings().
+void StartCore();
+
+// Log "stop", then write out any queued records and stop the
+// background threads.
+void StopCore();
+
+// Exit:   Returns the local computer's name, as log records carry it.
+std::string GetComputerHostname();
+
+// Exit:   Returns the current local time, or the time of a timestamp
+//         from GetWallMicros, as the log stamps it, e.g.
+//         "YYYY-MM-DD HH:MM:SS.fff"; see Timestamp.h.
+std::string GetTimeStr();
+std::string GetTimeStr(int64_t usWall);
+
+// Log a record to the log file.
+void LogToFile(std::string action, std::string details);
+
+// Exit:   Returns a log record stamped with the current time, or with
+//         usWall, without logging it.  The remote IP is the first target
+//         of the settings unless given.
+std::string FormatLogRecord(const std::string& action, const std::string& details);
+std::string FormatLogRecord(const std::string& action, const std::string& strRemote, const std::string& details);
+std::string FormatLogRecord(int64_t usWall, const std::string& action, const std::string& strRemote,
+    const std::string& details);
+
+// Format a time in microseconds as milliseconds with three decimals.
+void FormatMicrosAsMs(int64_t us, char* szBuf, size_t cbBuf);
+
+// Exit:   Returns the quantiles and loss of one window of a target as
+//         logged in "summary" records.
+std::string FormatLatencySummary(int iTarget, EnumStatsWindow window, int64_t msNow);
+
+// Exit:   Returns which of nShards shards a target belongs to, by a hash
+//         of its name that is the same on every run and platform.
+int GetShardOfTarget(const std::string& strTarget, int nShards);
+
+// What happened to one ping.
+struct StructPingOutcome {
+    std::string strTarget;      // the target as configured: a numeric address or a name
+    std::string strAddress;     // the address pinged, or "" if a name couldn't be resolved
+    int64_t     usPing;         // round trip time, or -1 if it failed
+    uint32_t    errorCode;      // IP_xxx code if the ping failed, else 0
+    std::string strError;       // description of a failure with no errorCode
+    bool        bSlow;          // succeeded, but took msBadPing or longer
+    int         iStats;         // LatencyStats target
+    int         iSeries;        // RttSeries target, or -1 if it didn't fit
+    int64_t     msNow;          // monotonic time the ping finished
+    int64_t     usWall;         // the same as a timestamp; its records and displays all carry it
+    bool        bTrain;         // a packet train went with the ping
+    StructTrainResult train;    // its outcome, if so
+
+    // Exit:   Returns the description of the failure, for display.
+    std::string GetErrorText() const { return errorCode ? ErrorCodeToText(errorCode) : strError; }
+};
+
+// One service probe of a target's Probes setting, and its latest outcome.
+class CProber;
+
+struct StructServiceProbe {
+    std::string strSpec;        // e.g. "tcp:192.0.2.1:443"
+    CProber*    pProber;        // that makes it; its results are routed there
+    EnumProbeType type;
+    int         iTarget;        // in the socket engine, or -1 if the spec was refused
+    int         iStats;         // LatencyStats target, named by strSpec
+    bool        bDone;
+    int64_t     usRtt;          // -1 if it failed
+    uint32_t    errorCode;
+    bool        bSlow;
+};
+
+class CProberSet;
+
+// Pings one target of the settings (see Settings.h) on a fixed schedule,
+// and logs and accounts for the results.  The settings are taken from
+// the latest snapshot as each ping starts, and hold for the whole ping.
+// Intervals and thresholds are the target's own.
+//
+// Pings are due on absolute deadlines every secsSleep seconds, from a
+// random phase chosen at Open, so the period doesn't stretch by the time
+// each ping takes and many probers don't ping in step.  A deadline
+// missed because a ping overran is skipped, not made up.
+//
+// When a ping fails or is slow, the prober goes into burst mode and pings
+// every msBurstInterval ms, so the start and end of an incident are seen
+// sooner.  Each healthy ping then doubles the interval until it is back
+// to secsSleep.  "burst" records log both transitions.
+//
+// With logDetail set to LOG_DETAIL_EPISODES, pings are logged only
+// around outage episodes (see Episodes.h): the nEpisodeContext pings
+// before an episode, every ping during it, and nEpisodeContext after.
+// "episode" records log its start, changes of state and end, and a
+// "rollup" every secsRollup seconds stands in for the other pings.
+//
+// The target's service probes (see SocketProbe.h) are made alongside
+// each ping, each with the timeout and slow threshold of its type.  They
+// are logged with their type as the action ("tcp", "udp", "dns", or
+// "tcp-error" and so on), with the spec less its type as the remote IP,
+// and counted in LatencyStats under their spec.  With
+// LOG_DETAIL_EPISODES only the ones that fail or are slow are logged.
+//
+// When a ping fails with an error from the network or is slow, the prober
+// starts a path trace to the target (see PathTrace.h), unless it made one
+// in the last secsTraceMin seconds.  The trace runs alongside the
+// following pings; when it finishes, it is logged as a "trace" record
+// and added to ProblemStore as a PROBLEM_PATH_TRACE, with each hop's
+// address, round trip and loss.
+//
+// A target may be given by name.  The name is resolved in the background
+// by Resolver, and pings go to the address it resolved to; until the
+// first answer, a due ping waits PROBER_RESOLVE_RETRY_MS at a time rather
+// than hold up the loop.  Records keep the name as the remote IP.  A
+// "resolve" record logs the address when it is first learned and each
+// time it changes, e.g. "address=2001:db8::5 ttl=300 was=192.0.2.7", and
+// a "resolve-error" record logs a failure to resolve; pings fail
+// meanwhile, with "Cannot resolve NAME: ..." as their error.
+//
+// With nTrainPackets of 2 or more, each ping also sends a packet train
+// (see PacketTrain.h) to the target through the prober's backend, and
+// waits for it as for the service probes.  Its loss, reordering,
+// duplicates and jitter are logged as a "train" record after the ping's,
+// and handed back in the outcome.  With LOG_DETAIL_EPISODES only trains
+// that lost packets are logged.
+class CProber
+{
+public:
+    // Ping the target with address strTarget, or, if it is empty, the
+    // first target of the settings.  With pBackend NULL, the prober has
+    // a backend of its own, named by strProbeBackend when the prober is
+    // created; otherwise it shares pBackend, which the caller opens and
+    // polls (see CProberSet).  Likewise, with pSockets NULL the prober
+    // opens a socket engine of its own for service probes, if it has
+    // any; otherwise it shares pSockets, which the caller opens and
+    // polls with OnServiceDone.
+    CProber(CProbeBackend* pBackend = NULL, const std::string& strTarget = std::string(),
+        CSocketProbeEngine* pSockets = NULL);
+    ~CProber();
+
+    // Open the prober's own backend, if it has one, and schedule the first
+    // ping.  On failure, the error is also logged.
+    bool Open(std::string& strError);
+
+    // Exit:   Returns how long until the next ping is due, in ms, or until
+    //         a running path trace or packet train next needs attention, if
+    //         that is sooner.
+    int GetMsUntilDue() const;
+
+    // Move a running path trace along.  If a ping is due, send it and wait
+    // for its outcome.  Logs it, records it in LatencyStats, adds a
+    // problem if it failed or was slow, logs a "summary" every
+    // secsLogSummary seconds, and schedules the next ping.
+    // Exit:   Returns false if no ping was due.
+    bool Ping(StructPingOutcome& outcome);
+
+    // Ping in steps, as Ping does, for a caller with other probers on a
+    // shared backend: StartPing, which sends the ping if it is due, then
+    // PollPing until it returns true, then FinishPing.  PollPing waits up
+    // to msWait ms for the ping and whatever went with it, but leaves a
+    // shared backend for the caller to poll.
+    bool StartPing();
+    bool PollPing(int msWait);
+    void FinishPing();
+
+    // Exit:   Returns true while service probes or a path trace are out,
+    //         and want to be polled often.
+    bool IsBusyAlongside() const { return m_nServicesPending > 0 || m_tracer.IsRunning(); }
+
+    // Exit:   Returns how long the ping under way may wait on the backend
+    //         before PollPing is next needed, in ms: at most 1 while
+    //         IsBusyAlongside, and no later than the packet train's next
+    //         request.
+    int GetMsUntilPoll() const;
+
+    // The address given when the prober was made.
+    const std::string& GetTarget() const { return m_strTarget; }
+
+    // The outcome of the last ping.
+    const StructPingOutcome& GetOutcome() const { return m_outcome; }
+
+    // The service probes, with the outcome of those made by the last Ping.
+    const std::vector<StructServiceProbe>& GetServiceProbes() const { return m_vectServices; }
+
+private:
+    bool TakeSettings();
+    void LogRecord(const std::string& action, const std::string& details);
+    void ScheduleNext(int64_t msDue, bool bProblem);
+    void SetServiceProbes();
+    void SendServiceProbes();
+    static void OnServiceDone(const StructProbeResult& result, void* pContext);
+    void LogPing(const StructPingOutcome& outcome, const std::string& strRecord);
+    void StartTrace(int64_t msNow);
+    void PollTrace(int msWait);
+    void PollAlongside(int msWait);
+    void NoteResolved(EnumResolveState state, const StructResolved& resolved);
+
+    std::string   m_strBackendError;  // why strProbeBackend was refused; before m_pOwnBackend
+    std::unique_ptr<CProbeBackend> m_pOwnBackend;  // NULL if the backend is shared
+    CProbeBackend* m_pBackend;
+    CProbeSession m_session;
+    std::string   m_strTarget;
+    std::shared_ptr<const StructSettingsSnapshot> m_pSnapshot;  // taken as the last ping started
+    const StructTargetSettings*   m_pTarget;    // our target in it
+    std::string   m_strStatsTarget;
+    int           m_iStats;
+    int           m_iSeries;
+    int64_t       m_msLastSummary;
+
+    int64_t       m_msNextDue;      // deadline of the next ping; a CProberSet keeps it in its wheel too
+    int           m_msPeriod;       // current interval; below secsSleep in burst mode
+    bool          m_bInBurst;       // counted in ProbeLoopStats.nInBurst
+    std::minstd_rand m_rng;
+
+    // The ping under way, between StartPing and FinishPing.
+    bool          m_bPinging;
+    bool          m_bSessionDone;
+    int64_t       m_usStart;
+    int64_t       m_usEnd;          // when the echo request was answered or failed
+    int64_t       m_usWaited;       // how long it was out, less any time after its timeout
+    int64_t       m_usWallEvent;    // timestamp for records about the ping: when it was sent, then m_usEnd
+    int64_t       m_msDue;
+    StructPingOutcome m_outcome;
+
+    // For LOG_DETAIL_EPISODES.
+    CEpisodeTracker m_episodes;
+    StructRollup  m_rollup;
+    std::vector<std::string> m_vectContext; // ring of the latest unlogged ping records
+    size_t        m_iContext;       // next slot in m_vectContext
+    size_t        m_nContext;       // records in m_vectContext
+    int           m_nPostContext;   // pings still to log after an episode
+
+    // Service probes.  An engine of our own is opened when the first is set.
+    std::unique_ptr<CSocketProbeEngine> m_pOwnSockets;
+    CSocketProbeEngine* m_pSockets; // shared or m_pOwnSockets; NULL until there is one
+    std::string   m_strProbes;      // the Probes setting that m_vectServices was made from
+    std::vector<StructServiceProbe> m_vectServices;
+    int           m_nServicesPending;
+
+    CPathTracer   m_tracer;
+    int64_t       m_msLastTrace;    // monotonic start of the last path trace, or -1
+
+    CPacketTrain  m_train;
+    std::string   m_strTrainError;  // last failure to start a train, logged once
+
+    std::string   m_strResolved;    // address the target's name last resolved to
+    std::string   m_strResolveError; // last failure to resolve it, logged once
+
+    // Kept by the CProberSet that owns the prober, for Step.
+    friend class CProberSet;
+    CProberSet*   m_pSet;
+    int           m_idSetTimer;     // in the set's wheel, or -1 while a ping is out
+};
+
+// Called by CProberSet::Step after each ping it finishes, on the thread
+// that finished it.
+typedef void (*PFN_PINGED)(const CProber& prober, void* pContext);
+
+// Pings every target of the settings from one thread: a CProber for each,
+// all sharing one probe backend, so the pings of targets that fall due
+// together are in flight together and one wait serves them all.
+class CProberSet
+{
+public:
+    CProberSet();
+    ~CProberSet();
+
+    // Open the backend named by strProbeBackend, a socket engine for the
+    // probers' service probes, and a prober for each target.  On failure,
+    // the error is also logged.
+    bool Open(std::string& strError);
+
+    // Bring the probers into line with the targets of the latest
+    // settings.  Probers of targets that stay keep their schedules and
+    // state; call between pings, with nothing in flight.
+    void Sync();
+
+    // Exit:   Returns how long until the first prober is due, in ms; from
+    //         the set's wheel once Step has scheduled the probers.
+    int GetMsUntilDue() const;
+
+    size_t GetCount() const { return m_vectProbers.size(); }
+
+    // Take only the targets of shard iShard of nShards (see
+    // GetShardOfTarget), and keep Step's figures in *pStats, if not
+    // NULL.  Call before Open.
+    void SetShard(int iShard, int nShards, StructShardStats* pStats);
+
+    // Have Step hand each ping that is done to pPool, queued on worker
+    // iWorker, to be finished there, and then call pfnPinged, if not
+    // NULL.  Without a pool, Step finishes pings itself.
+    void SetFinisher(CWorkPool* pPool, int iWorker, PFN_PINGED pfnPinged, void* pContext);
+
+    // Ping continuously, rather than in rounds: start the pings that are
+    // due, wait on the backend until the next is due or up to msWait ms,
+    // and finish the pings that are done.  A slow ping
+    // holds up no other, and a prober isn't pinged again until its last
+    // ping is finished.  New settings are synced to once nothing is out.
+    // Exit:   Returns the number of pings started.
+    int Step(int msWait);
+
+private:
+    void ScheduleAll(int64_t msNow);
+    void Schedule(CProber* pProber, int64_t msNow);
+    void StepFinish(CProber* pProber);
+    static void FinishTask(void* pArg, int iWorker);
+
+    std::unique_ptr<CProbeBackend> m_pBackend;
+    CSocketProbeEngine m_sockets;   // shared by the probers' service probes
+    bool          m_bSocketsOpen;   // else each prober opens its own
+    std::vector<std::unique_ptr<CProber>> m_vectProbers;
+    std::vector<CProber*> m_vectActive;
+    std::shared_ptr<const StructSettingsSnapshot> m_pSnapshot;  // the targets were last synced to
+
+    int           m_iShard;
+    int           m_nShards;
+    StructShardStats* m_pStats;
+
+    // For Step: when each prober with no ping out is next due.
+    CTimerWheel   m_wheelDue;
+    bool          m_bScheduled;     // m_wheelDue holds the probers of the last Sync
+    std::vector<CProber*> m_vectProberOfTimer;
+    std::vector<int> m_vectDue;
+
+    // Finishing on the pool.  Probers come back through m_vectFinished.
+    CWorkPool*    m_pPool;
+    int           m_iWorker;
+    PFN_PINGED    m_pfnPinged;
+    void*         m_pPingedContext;
+    int           m_nFinishing;
+    CCritSec      m_critFinished;
+    std::vector<CProber*> m_vectFinished;
+    std::vector<CProber*> m_vectReturned;
+};
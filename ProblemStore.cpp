@@ -0,0 +1,119 @@
+// ProblemStore.cpp : Fixed-capacity store of recent problems.
+
+#include "ProblemStore.h"
+#include "ErrorCodes.h"
+#include "Timestamp.h"
+#include <stdio.h>
+#include <string.h>
+
+bool StructProblemFilter::Matches(const StructProblem& problem) const
+{
+    if (!(problem.kind & kindMask)) {
+        return false;
+    }
+    return strTarget.empty() || strTarget == problem.szTarget;
+}
+
+// Copy str into a fixed-size, always-terminated buffer.
+static void CopyTruncated(char* szDest, size_t cbDest, const std::string& str)
+{
+    size_t cb = str.size() < cbDest - 1 ? str.size() : cbDest - 1;
+    memcpy(szDest, str.data(), cb);
+    szDest[cb] = '\0';
+}
+
+void MakeProblem(StructProblem& problem, int64_t msTime, uint32_t kind, uint32_t code, int64_t usRtt,
+    const std::string& strTarget, const std::string& strDetail)
+{
+    problem.msTime = msTime;
+    problem.kind = kind;
+    problem.code = code;
+    problem.usRtt = usRtt;
+    CopyTruncated(problem.szTarget, sizeof(problem.szTarget), strTarget);
+    CopyTruncated(problem.szDetail, sizeof(problem.szDetail), strDetail);
+}
+
+CProblemStore::CProblemStore(size_t nCapacity)
+    : m_nCapacity(nCapacity ? nCapacity : 1), m_nAdded(0), m_critWrite("ProblemStore.Add")
+{
+    m_pSlots = new StructSlot[m_nCapacity];
+    for (size_t j = 0; j < m_nCapacity; j++) {
+        m_pSlots[j].version.store(0, std::memory_order_relaxed);
+    }
+}
+
+CProblemStore::~CProblemStore()
+{
+    delete[] m_pSlots;
+}
+
+uint64_t CProblemStore::Add(const StructProblem& problem)
+{
+    CCritSecInScope lock(m_critWrite);
+    uint64_t seq = m_nAdded.load(std::memory_order_relaxed);
+    StructSlot& slot = m_pSlots[seq % m_nCapacity];
+
+    // Odd version: readers that see it, or see it change, discard the copy.
+    slot.version.store(2 * seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.problem = problem;
+    slot.version.store(2 * seq + 2, std::memory_order_release);
+
+    m_nAdded.store(seq + 1, std::memory_order_release);
+    return seq;
+}
+
+// Copy out problem number seq.
+// Exit:   Returns false if the slot no longer (or doesn't yet) hold it.
+bool CProblemStore::ReadSlot(uint64_t seq, StructProblem& problem) const
+{
+    const StructSlot& slot = m_pSlots[seq % m_nCapacity];
+    uint64_t version = slot.version.load(std::memory_order_acquire);
+    if (version != 2 * seq + 2) {
+        return false;
+    }
+    problem = slot.problem;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.version.load(std::memory_order_relaxed) == version;
+}
+
+uint64_t CProblemStore::ReadSince(uint64_t& seqNext, const StructProblemFilter& filter,
+    std::vector<StructProblem>& vectOut) const
+{
+    uint64_t nAdded = GetCount();
+    uint64_t nLost = 0;
+    if (nAdded > m_nCapacity && seqNext < nAdded - m_nCapacity) {
+        nLost = nAdded - m_nCapacity - seqNext;
+        seqNext = nAdded - m_nCapacity;
+    }
+    StructProblem problem;
+    for (; seqNext < nAdded; seqNext++) {
+        if (!ReadSlot(seqNext, problem)) {
+            // The writer lapped us while we were reading.
+            nLost++;
+            continue;
+        }
+        if (filter.Matches(problem)) {
+            vectOut.push_back(problem);
+        }
+    }
+    return nLost;
+}
+
+std::string FormatProblem(const StructProblem& problem)
+{
+    char szTime[TIMESTAMP_MAX];
+    FormatTimestamp(problem.msTime * 1000, szTime, sizeof(szTime));
+
+    char szBuf[PROBLEM_DETAIL_MAX + 200];
+    if (problem.kind == PROBLEM_SLOW_PING) {
+        snprintf(szBuf, sizeof(szBuf), "%s  %s  Long ping time: %lld.%03lld ms", szTime, problem.szTarget,
+            (long long)(problem.usRtt / 1000), (long long)(problem.usRtt % 1000));
+    } else if (problem.kind == PROBLEM_PATH_TRACE) {
+        snprintf(szBuf, sizeof(szBuf), "%s  %s  Path: %s", szTime, problem.szTarget, problem.szDetail);
+    } else {
+        snprintf(szBuf, sizeof(szBuf), "%s  %s  %s", szTime, problem.szTarget,
+            problem.szDetail[0] || problem.code == 0 ? problem.szDetail : ErrorCodeToText(problem.code).c_str());
+    }
+    return szBuf;
+}
@@ -0,0 +1,86 @@
+// ProblemStore.h : Fixed-capacity store of recent problems (slow pings,
+// failed pings) for display.
+//
+// Entries are kept in a ring; once it is full, each new problem replaces
+// the oldest.  Every entry gets a sequence number, so a view can keep a
+// cursor and fetch only what was added since it last looked.
+//
+// Writers are serialized among themselves, but readers take no lock at
+// all: each slot carries a version that is odd while the slot is being
+// written, and a reader retries or skips a slot whose version changed
+// under it.  So the prober never waits on the UI.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "CritSec.h"
+
+// Kinds of problem; bit flags so filters can combine them.
+#define PROBLEM_SLOW_PING       0x1     // reply took longer than msBadPing
+#define PROBLEM_ERROR           0x2     // no reply; code says why
+#define PROBLEM_PATH_TRACE      0x4     // path trace made after one of the above; detail has the hops
+#define PROBLEM_ALL_KINDS       0x7
+
+#define PROBLEM_TARGET_MAX      64
+#define PROBLEM_DETAIL_MAX      512
+
+struct StructProblem {
+    int64_t  msTime;                        // ms since 1970 UTC
+    uint32_t kind;                          // PROBLEM_xxx
+    uint32_t code;                          // IP_xxx error code, or 0
+    int64_t  usRtt;                         // round trip time, or -1
+    char     szTarget[PROBLEM_TARGET_MAX];  // remote address
+    char     szDetail[PROBLEM_DETAIL_MAX];  // error text, if any
+};
+
+// Which problems a view wants.  An empty strTarget matches every target.
+struct StructProblemFilter {
+    uint32_t    kindMask = PROBLEM_ALL_KINDS;
+    std::string strTarget;
+
+    bool Matches(const StructProblem& problem) const;
+};
+
+// Fill in a problem; strings that are too long are truncated.
+void MakeProblem(StructProblem& problem, int64_t msTime, uint32_t kind, uint32_t code, int64_t usRtt,
+    const std::string& strTarget, const std::string& strDetail);
+
+class CProblemStore
+{
+public:
+    CProblemStore(size_t nCapacity = 1000);
+    ~CProblemStore();
+
+    // Exit:   Returns the sequence number given to the problem.
+    uint64_t Add(const StructProblem& problem);
+
+    // Copy the problems with sequence numbers from seqNext on that match
+    // filter to vectOut, and advance seqNext past what was examined.
+    // Exit:   Returns the number of problems that were overwritten before
+    //         they could be read (the view fell more than a ring behind).
+    uint64_t ReadSince(uint64_t& seqNext, const StructProblemFilter& filter, std::vector<StructProblem>& vectOut) const;
+
+    // Sequence number the next problem will get; also the total ever added.
+    uint64_t GetCount() const { return m_nAdded.load(std::memory_order_acquire); }
+    size_t GetCapacity() const { return m_nCapacity; }
+
+private:
+    struct StructSlot {
+        std::atomic<uint64_t> version;      // 2*seq+1 while writing, 2*seq+2 when done
+        StructProblem problem;
+    };
+
+    bool ReadSlot(uint64_t seq, StructProblem& problem) const;
+
+    size_t      m_nCapacity;
+    StructSlot* m_pSlots;
+    std::atomic<uint64_t> m_nAdded;
+    CCritSec    m_critWrite;                // serializes Add; readers never take it
+};
+
+// Format a problem as one line for display, with its time as the log
+// stamps it, e.g. "2024-05-14 10:00:00.084  8.8.8.8  Long ping time:
+// 512.123 ms".
+std::string FormatProblem(const StructProblem& problem);
@@ -0,0 +1,305 @@
+// Resolver.cpp : Asynchronous, caching name resolver.  See Resolver.h.
+
+#include "Resolver.h"
+#include "ProbeBackend.h"
+#include <string.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windns.h>
+
+#pragma comment(lib, "dnsapi.lib")
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#endif
+
+static int64_t ResolverNowMs()
+{
+    return ProbeNowMicros() / 1000;
+}
+
+// Ask DNS for the records of a name that getaddrinfo resolved to an
+// address of the given family, for their TTL.  getaddrinfo doesn't
+// report it.  The lowest TTL in the answer counts, CNAMEs included.
+// Exit:   Returns the TTL in seconds, or -1 if there was no answer, as
+//         for names from the hosts file.
+static int QueryTtl(const std::string& strName, int family)
+{
+    int64_t secsMin = -1;
+#ifdef _WIN32
+    PDNS_RECORD pRecords = NULL;
+    if (DnsQuery_A(strName.c_str(), family == AF_INET6 ? DNS_TYPE_AAAA : DNS_TYPE_A, DNS_QUERY_STANDARD, NULL,
+            &pRecords, NULL) != 0) {
+        return -1;
+    }
+    for (PDNS_RECORD pRecord = pRecords; pRecord; pRecord = pRecord->pNext) {
+        if (pRecord->Flags.S.Section == DnsSectionAnswer && (secsMin < 0 || pRecord->dwTtl < secsMin)) {
+            secsMin = pRecord->dwTtl;
+        }
+    }
+    DnsRecordListFree(pRecords, DnsFreeRecordList);
+#else
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+    if (res_ninit(&state) != 0) {
+        return -1;
+    }
+    unsigned char answer[4096];
+    int cb = res_nsearch(&state, strName.c_str(), ns_c_in, family == AF_INET6 ? ns_t_aaaa : ns_t_a,
+        answer, sizeof(answer));
+    res_nclose(&state);
+    ns_msg msg;
+    if (cb < 0 || ns_initparse(answer, cb, &msg) != 0) {
+        return -1;
+    }
+    for (int j = 0; j < ns_msg_count(msg, ns_s_an); j++) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, j, &rr) != 0) {
+            break;
+        }
+        int type = ns_rr_type(rr);
+        if ((type == ns_t_a || type == ns_t_aaaa || type == ns_t_cname) &&
+            (secsMin < 0 || ns_rr_ttl(rr) < secsMin)) {
+            secsMin = ns_rr_ttl(rr);
+        }
+    }
+#endif
+    return (int)secsMin;
+}
+
+CResolver::CResolver()
+    : m_crit("Resolver"), m_msLastSweep(0), m_nLookups(0), m_nFailures(0), m_nChanges(0)
+{
+    m_bStop = false;
+}
+
+CResolver::~CResolver()
+{
+    Stop();
+}
+
+void CResolver::Start()
+{
+    CCritSecInScope lock(m_crit);
+    if (m_vectThreads.empty()) {
+        StartThreads();
+    }
+}
+
+// Call with m_crit held.
+void CResolver::StartThreads()
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    m_bStop = false;
+    for (int j = 0; j < RESOLVE_THREADS; j++) {
+        m_vectThreads.push_back(std::thread(&CResolver::ThreadMain, this));
+    }
+}
+
+void CResolver::Stop()
+{
+    std::vector<std::thread> vectThreads;
+    {
+        CCritSecInScope lock(m_crit);
+        vectThreads.swap(m_vectThreads);
+        m_bStop = true;
+    }
+    for (size_t j = 0; j < vectThreads.size(); j++) {
+        vectThreads[j].join();
+    }
+
+    // Names left in the queue are queued again by the next Lookup.
+    CCritSecInScope lock(m_crit);
+    m_queue.clear();
+    for (auto& item : m_mapEntries) {
+        item.second.bQueued = false;
+    }
+}
+
+EnumResolveState CResolver::Lookup(const std::string& strName, StructResolved& resolved)
+{
+    StructProbeAddr addr;
+    uint32_t idScope;
+    resolved.strError.clear();
+    if (ParseNumericAddress(strName.c_str(), addr, idScope)) {
+        resolved.strAddress = strName;
+        resolved.secsTtl = 0;
+        resolved.bNumeric = true;
+        return RESOLVE_OK;
+    }
+    resolved.bNumeric = false;
+
+    int64_t msNow = ResolverNowMs();
+    CCritSecInScope lock(m_crit);
+    if (m_vectThreads.empty()) {
+        StartThreads();
+    }
+    std::pair<std::unordered_map<std::string, StructEntry>::iterator, bool> result =
+        m_mapEntries.emplace(strName, StructEntry());
+    StructEntry& entry = result.first->second;
+    if (result.second) {
+        entry.secsTtl = 0;
+        entry.msExpires = 0;
+        entry.msStaleLimit = 0;
+        entry.bQueued = false;
+    }
+    entry.msLastUsed = msNow;
+    if (!entry.bQueued && msNow >= entry.msExpires) {
+        // Resolve it afresh in the background, serving what we have
+        // meanwhile.
+        entry.bQueued = true;
+        m_queue.push_back(strName);
+    }
+    if (!entry.strAddress.empty()) {
+        resolved.strAddress = entry.strAddress;
+        resolved.secsTtl = entry.secsTtl;
+        return RESOLVE_OK;
+    }
+    resolved.strAddress.clear();
+    resolved.secsTtl = 0;
+    if (!entry.strError.empty()) {
+        resolved.strError = entry.strError;
+        return RESOLVE_FAILED;
+    }
+    return RESOLVE_PENDING;
+}
+
+std::string CResolver::Peek(const std::string& strName)
+{
+    CCritSecInScope lock(m_crit);
+    std::unordered_map<std::string, StructEntry>::const_iterator it = m_mapEntries.find(strName);
+    return it == m_mapEntries.end() ? std::string() : it->second.strAddress;
+}
+
+StructResolverStats CResolver::GetStats()
+{
+    CCritSecInScope lock(m_crit);
+    StructResolverStats stats;
+    stats.nLookups = m_nLookups;
+    stats.nFailures = m_nFailures;
+    stats.nChanges = m_nChanges;
+    stats.nNames = (int)m_mapEntries.size();
+    return stats;
+}
+
+// Forget idle names, and queue names still in use whose answers have run
+// out, so they are fresh by the time they are next looked up.  Call
+// with m_crit held.
+void CResolver::Sweep(int64_t msNow)
+{
+    m_msLastSweep = msNow;
+    for (std::unordered_map<std::string, StructEntry>::iterator it = m_mapEntries.begin(); it != m_mapEntries.end();) {
+        StructEntry& entry = it->second;
+        if (!entry.bQueued && msNow - entry.msLastUsed >= RESOLVE_IDLE_SECS * 1000LL) {
+            it = m_mapEntries.erase(it);
+            continue;
+        }
+        if (!entry.bQueued && msNow >= entry.msExpires) {
+            entry.bQueued = true;
+            m_queue.push_back(it->first);
+        }
+        ++it;
+    }
+}
+
+void CResolver::ThreadMain()
+{
+    while (!m_bStop) {
+        std::string strName;
+        {
+            CCritSecInScope lock(m_crit);
+            int64_t msNow = ResolverNowMs();
+            if (msNow - m_msLastSweep >= 1000) {
+                Sweep(msNow);
+            }
+            if (!m_queue.empty()) {
+                strName = m_queue.front();
+                m_queue.pop_front();
+            }
+        }
+        if (strName.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(RESOLVE_POLL_MS));
+            continue;
+        }
+
+        std::string strAddress;
+        std::string strError;
+        int secsTtl = 0;
+        bool bResolved = ResolveName(strName, strAddress, secsTtl, strError);
+
+        CCritSecInScope lock(m_crit);
+        m_nLookups++;
+        std::unordered_map<std::string, StructEntry>::iterator it = m_mapEntries.find(strName);
+        if (it == m_mapEntries.end()) {
+            continue;
+        }
+        StructEntry& entry = it->second;
+        int64_t msNow = ResolverNowMs();
+        entry.bQueued = false;
+        if (bResolved) {
+            if (!entry.strAddress.empty() && entry.strAddress != strAddress) {
+                m_nChanges++;
+            }
+            entry.strAddress = strAddress;
+            entry.strError.clear();
+            entry.secsTtl = secsTtl;
+            entry.msExpires = msNow + secsTtl * 1000LL;
+            entry.msStaleLimit = entry.msExpires + RESOLVE_STALE_SECS * 1000LL;
+        } else {
+            m_nFailures++;
+            entry.strError = strError;
+            entry.msExpires = msNow + RESOLVE_NEGATIVE_SECS * 1000LL;
+            if (msNow >= entry.msStaleLimit) {
+                entry.strAddress.clear();
+            }
+        }
+    }
+}
+
+bool CResolver::ResolveName(const std::string& strName, std::string& strAddress, int& secsTtl,
+    std::string& strError)
+{
+    // Only look for address families this host has addresses in, and
+    // take the first answer, in the order the system prefers.
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    addrinfo* pResult = NULL;
+    int err = getaddrinfo(strName.c_str(), NULL, &hints, &pResult);
+    if (err != 0 || pResult == NULL) {
+        strError = err != 0 ? gai_strerror(err) : "no address";
+        return false;
+    }
+    char szAddress[NI_MAXHOST];
+    err = getnameinfo(pResult->ai_addr, (socklen_t)pResult->ai_addrlen, szAddress, sizeof(szAddress), NULL, 0,
+        NI_NUMERICHOST);
+    int family = pResult->ai_family;
+    freeaddrinfo(pResult);
+    if (err != 0) {
+        strError = gai_strerror(err);
+        return false;
+    }
+    strAddress = szAddress;
+
+    secsTtl = QueryTtl(strName, family);
+    if (secsTtl < 0) {
+        secsTtl = RESOLVE_DEFAULT_TTL_SECS;
+    } else if (secsTtl < RESOLVE_MIN_TTL_SECS) {
+        secsTtl = RESOLVE_MIN_TTL_SECS;
+    } else if (secsTtl > RESOLVE_MAX_TTL_SECS) {
+        secsTtl = RESOLVE_MAX_TTL_SECS;
+    }
+    return true;
+}
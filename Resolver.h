@@ -0,0 +1,110 @@
+// Resolver.h : Asynchronous, caching name resolver for targets given by
+// name rather than by numeric address.  The probe loop never waits on
+// DNS: Lookup answers from the cache at once, and names it hasn't seen,
+// or whose answers have run out, are resolved by a small pool of
+// threads in the background.
+//
+// An answer is kept for the TTL of its DNS records (RESOLVE_MIN_TTL_SECS
+// to RESOLVE_MAX_TTL_SECS), or RESOLVE_DEFAULT_TTL_SECS where the TTL
+// can't be had, e.g. for names from the hosts file.  When it runs out,
+// the old address is still served while the name is resolved again, and
+// for up to RESOLVE_STALE_SECS more if that fails, so a DNS hiccup
+// doesn't show up as an outage of the target.  Failures are cached for
+// RESOLVE_NEGATIVE_SECS.  Names not looked up for RESOLVE_IDLE_SECS are
+// forgotten.
+//
+// Numeric IPv4 and IPv6 addresses are answered as they are, without
+// touching the cache.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "CritSec.h"
+
+#define RESOLVE_THREADS             4
+#define RESOLVE_DEFAULT_TTL_SECS    300
+#define RESOLVE_MIN_TTL_SECS        5
+#define RESOLVE_MAX_TTL_SECS        3600
+#define RESOLVE_NEGATIVE_SECS       30
+#define RESOLVE_STALE_SECS          300
+#define RESOLVE_IDLE_SECS           600
+#define RESOLVE_POLL_MS             50      // how often idle threads look for work
+
+enum EnumResolveState {
+    RESOLVE_PENDING,            // not resolved yet; ask again shortly
+    RESOLVE_OK,
+    RESOLVE_FAILED,
+};
+
+struct StructResolved {
+    std::string strAddress;     // numeric address, if RESOLVE_OK
+    std::string strError;       // why not, if RESOLVE_FAILED
+    int         secsTtl;        // how long the answer was given for; 0 for a numeric address
+    bool        bNumeric;       // the name was already a numeric address
+};
+
+struct StructResolverStats {
+    uint64_t nLookups;          // names resolved by the threads
+    uint64_t nFailures;         // of which failed
+    uint64_t nChanges;          // resolutions that gave a different address from the last
+    int      nNames;            // names in the cache
+};
+
+class CResolver
+{
+public:
+    CResolver();
+    ~CResolver();
+
+    // Start the resolving threads.  Lookup starts them too, if need be.
+    void Start();
+    void Stop();
+
+    // Look a name up in the cache.  Never blocks on DNS.
+    // Exit:   Returns RESOLVE_OK with the address, RESOLVE_FAILED with the
+    //         error, or RESOLVE_PENDING if the name is being resolved for
+    //         the first time.
+    EnumResolveState Lookup(const std::string& strName, StructResolved& resolved);
+
+    // Exit:   Returns the cached address of a name, or "" if there is
+    //         none, without counting as a use.
+    std::string Peek(const std::string& strName);
+
+    StructResolverStats GetStats();
+
+private:
+    struct StructEntry {
+        std::string strAddress;     // last address resolved, or ""
+        std::string strError;       // error of the last resolution, if it failed
+        int         secsTtl;
+        int64_t     msExpires;      // when to resolve again
+        int64_t     msStaleLimit;   // when to stop serving strAddress if resolving keeps failing
+        int64_t     msLastUsed;
+        bool        bQueued;        // waiting for or being resolved by a thread
+    };
+
+    void StartThreads();
+    void ThreadMain();
+    void Sweep(int64_t msNow);
+
+    // Resolve a name, blocking.
+    // Exit:   Returns false with strError set if it couldn't be.
+    static bool ResolveName(const std::string& strName, std::string& strAddress, int& secsTtl,
+        std::string& strError);
+
+    CCritSec m_crit;
+    std::unordered_map<std::string, StructEntry> m_mapEntries;
+    std::deque<std::string> m_queue;
+    int64_t  m_msLastSweep;
+    uint64_t m_nLookups;
+    uint64_t m_nFailures;
+    uint64_t m_nChanges;
+
+    std::vector<std::thread> m_vectThreads;
+    std::atomic<bool> m_bStop;
+};
@@ -0,0 +1,425 @@
+// ResultStream.cpp : Streaming of ping results to a fleet collector.
+// See ResultStream.h.
+
+#include "ResultStream.h"
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define poll WSAPoll
+#define SEND_FLAGS 0
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#define closesocket close
+#define INVALID_SOCKET (-1)
+#define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+#define STREAM_CONNECT_MS       1000    // longest a TCP connect may take
+#define STREAM_BACKOFF_MIN_MS   1000
+#define STREAM_BACKOFF_MAX_MS   60000
+
+static int64_t StreamNowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Append a name of at most STREAM_NAME_MAX bytes.
+// Exit:   Returns its length as written.
+static uint8_t AppendName(char* p, const char* pszName, size_t cbName)
+{
+    if (cbName > STREAM_NAME_MAX) {
+        cbName = STREAM_NAME_MAX;
+    }
+    memcpy(p, pszName, cbName);
+    return (uint8_t)cbName;
+}
+
+void CStreamBatchBuilder::Begin(const std::string& strHost, const std::string& strLocalIP, uint32_t idSender,
+    uint32_t seq)
+{
+    StructStreamHdr hdr;
+    hdr.magic = STREAM_MAGIC;
+    hdr.cbBatch = 0;
+    hdr.nRecords = 0;
+    hdr.idSender = idSender;
+    hdr.seq = seq;
+    char* p = m_buf + sizeof(hdr);
+    hdr.cbHost = AppendName(p, strHost.c_str(), strHost.size());
+    p += hdr.cbHost;
+    hdr.cbLocalIP = AppendName(p, strLocalIP.c_str(), strLocalIP.size());
+    p += hdr.cbLocalIP;
+    m_cb = p - m_buf;
+    m_nRecords = 0;
+    hdr.cbBatch = (uint16_t)m_cb;
+    memcpy(m_buf, &hdr, sizeof(hdr));
+}
+
+bool CStreamBatchBuilder::Add(const char* pszTarget, int64_t msTime, int64_t usRtt, uint32_t errorCode)
+{
+    size_t cbTarget = strlen(pszTarget);
+    if (cbTarget > STREAM_NAME_MAX) {
+        cbTarget = STREAM_NAME_MAX;
+    }
+    if (m_cb + sizeof(StructStreamRecord) + cbTarget > STREAM_BATCH_MAX) {
+        return false;
+    }
+    StructStreamRecord rec;
+    rec.msTime = msTime;
+    rec.usRtt = usRtt < 0 ? -1 : (usRtt > INT32_MAX ? INT32_MAX : (int32_t)usRtt);
+    rec.errorCode = errorCode;
+    rec.cbTarget = (uint8_t)cbTarget;
+    memcpy(m_buf + m_cb, &rec, sizeof(rec));
+    memcpy(m_buf + m_cb + sizeof(rec), pszTarget, cbTarget);
+    m_cb += sizeof(rec) + cbTarget;
+    m_nRecords++;
+
+    // Keep the header current, so the batch can be sent at any point.
+    StructStreamHdr* pHdr = (StructStreamHdr*)m_buf;
+    pHdr->cbBatch = (uint16_t)m_cb;
+    pHdr->nRecords = (uint16_t)m_nRecords;
+    return true;
+}
+
+size_t GetStreamBatchSize(const char* p, size_t cb)
+{
+    if (cb < sizeof(StructStreamHdr)) {
+        return 0;
+    }
+    StructStreamHdr hdr;
+    memcpy(&hdr, p, sizeof(hdr));
+    if (hdr.magic != STREAM_MAGIC || hdr.cbBatch < sizeof(hdr) || hdr.cbBatch > STREAM_BATCH_MAX) {
+        return 0;
+    }
+    return hdr.cbBatch;
+}
+
+bool DecodeStreamBatch(const char* p, size_t cb, StructStreamBatch& batch, std::vector<StructStreamResult>& vectResults)
+{
+    vectResults.clear();
+    if (GetStreamBatchSize(p, cb) != cb) {
+        return false;
+    }
+    StructStreamHdr hdr;
+    memcpy(&hdr, p, sizeof(hdr));
+    const char* pEnd = p + cb;
+    const char* pNext = p + sizeof(hdr);
+    if ((size_t)(pEnd - pNext) < (size_t)hdr.cbHost + hdr.cbLocalIP) {
+        return false;
+    }
+    batch.idSender = hdr.idSender;
+    batch.seq = hdr.seq;
+    batch.host.p = pNext;
+    batch.host.cb = hdr.cbHost;
+    pNext += hdr.cbHost;
+    batch.localIP.p = pNext;
+    batch.localIP.cb = hdr.cbLocalIP;
+    pNext += hdr.cbLocalIP;
+
+    for (int j = 0; j < hdr.nRecords; j++) {
+        StructStreamRecord rec;
+        if ((size_t)(pEnd - pNext) < sizeof(rec)) {
+            return false;
+        }
+        memcpy(&rec, pNext, sizeof(rec));
+        pNext += sizeof(rec);
+        if ((size_t)(pEnd - pNext) < rec.cbTarget) {
+            return false;
+        }
+        StructStreamResult result;
+        result.target.p = pNext;
+        result.target.cb = rec.cbTarget;
+        result.msTime = rec.msTime;
+        result.usRtt = rec.usRtt < 0 ? -1 : rec.usRtt;
+        result.errorCode = rec.errorCode;
+        vectResults.push_back(result);
+        pNext += rec.cbTarget;
+    }
+    return pNext == pEnd;
+}
+
+CResultStream::CResultStream()
+{
+    m_pfnLocalIP = NULL;
+    m_bTcp = false;
+    memset(&m_addr, 0, sizeof(m_addr));
+    m_sock = (intptr_t)INVALID_SOCKET;
+    m_msNextConnect = 0;
+    m_msBackoff = STREAM_BACKOFF_MIN_MS;
+    m_idSender = 0;
+    m_seq = 0;
+    m_pQueue = NULL;
+    m_bStop = false;
+    m_nQueued = 0;
+    m_nSent = 0;
+    m_nDropped = 0;
+    m_nBatches = 0;
+    m_nSendErrors = 0;
+    m_nConnects = 0;
+    m_bConnected = false;
+}
+
+CResultStream::~CResultStream()
+{
+    Stop();
+    delete m_pQueue;
+}
+
+bool CResultStream::Start(const std::string& strSpec, const std::string& strHost, const char* (*pfnLocalIP)(),
+    std::string& strError)
+{
+    if (m_thread.joinable()) {
+        return true;
+    }
+    std::string strHostPort;
+    if (strSpec.compare(0, 4, "udp:") == 0) {
+        m_bTcp = false;
+    } else if (strSpec.compare(0, 4, "tcp:") == 0) {
+        m_bTcp = true;
+    } else {
+        strError = "Collector must be udp:HOST[:PORT] or tcp:HOST[:PORT]: " + strSpec;
+        return false;
+    }
+    strHostPort = strSpec.substr(4);
+    std::string strAddress = strHostPort;
+    long port = STREAM_PORT_DEFAULT;
+    size_t iColon = strHostPort.find(':');
+    if (iColon != std::string::npos) {
+        strAddress = strHostPort.substr(0, iColon);
+        char* pEnd = NULL;
+        port = strtol(strHostPort.c_str() + iColon + 1, &pEnd, 10);
+        if (*pEnd != '\0') {
+            port = 0;
+        }
+    }
+    memset(&m_addr, 0, sizeof(m_addr));
+    m_addr.sin_family = AF_INET;
+    m_addr.sin_port = htons((uint16_t)port);
+    if (port <= 0 || port >= 65536 || inet_pton(AF_INET, strAddress.c_str(), &m_addr.sin_addr) != 1) {
+        strError = "Bad collector address: " + strSpec;
+        return false;
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    if (!m_bTcp) {
+        auto sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (sock == INVALID_SOCKET) {
+            strError = "Cannot create collector socket";
+            return false;
+        }
+        m_sock = (intptr_t)sock;
+        m_bConnected = true;
+    }
+    m_strHost = strHost;
+    m_pfnLocalIP = pfnLocalIP;
+    m_idSender = std::random_device()();
+    m_seq = 0;
+    m_msNextConnect = 0;
+    m_msBackoff = STREAM_BACKOFF_MIN_MS;
+    delete m_pQueue;
+    m_pQueue = new CMpscQueue<StructItem>(STREAM_QUEUE_CAPACITY);
+    m_bStop = false;
+    m_thread = std::thread(&CResultStream::ThreadMain, this);
+    return true;
+}
+
+void CResultStream::Stop()
+{
+    if (m_thread.joinable()) {
+        m_bStop = true;
+        m_thread.join();
+    }
+    CloseSocket();
+}
+
+bool CResultStream::Send(const std::string& strTarget, int64_t msTime, int64_t usRtt, uint32_t errorCode)
+{
+    if (m_pQueue == NULL) {
+        return false;
+    }
+    size_t pos;
+    StructItem* pItem = m_pQueue->BeginPush(pos);
+    if (pItem == NULL) {
+        m_nDropped++;
+        return false;
+    }
+    pItem->msTime = msTime;
+    pItem->usRtt = usRtt;
+    pItem->errorCode = errorCode;
+    size_t cbTarget = strTarget.size() > STREAM_NAME_MAX ? STREAM_NAME_MAX : strTarget.size();
+    memcpy(pItem->szTarget, strTarget.c_str(), cbTarget);
+    pItem->szTarget[cbTarget] = '\0';
+    pItem->cbTarget = (uint8_t)cbTarget;
+    m_pQueue->EndPush(pos);
+    m_nQueued++;
+    return true;
+}
+
+StructResultStreamStats CResultStream::GetStats() const
+{
+    StructResultStreamStats stats;
+    stats.nQueued = m_nQueued;
+    stats.nSent = m_nSent;
+    stats.nDropped = m_nDropped;
+    stats.nBatches = m_nBatches;
+    stats.nSendErrors = m_nSendErrors;
+    stats.nConnects = m_nConnects;
+    stats.bConnected = m_bConnected;
+    return stats;
+}
+
+void CResultStream::CloseSocket()
+{
+    if (m_sock != (intptr_t)INVALID_SOCKET) {
+        closesocket(m_sock);
+    }
+    m_sock = (intptr_t)INVALID_SOCKET;
+    m_bConnected = false;
+}
+
+// Connect to the collector over TCP, waiting no more than
+// STREAM_CONNECT_MS, so that Stop is never held up for long.
+bool CResultStream::Connect()
+{
+    auto sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) {
+        return false;
+    }
+#ifdef _WIN32
+    u_long on = 1;
+    ioctlsocket(sock, FIONBIO, &on);
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+#endif
+    bool bConnected = connect(sock, (const sockaddr*)&m_addr, sizeof(m_addr)) == 0;
+    if (!bConnected) {
+        pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        int err = 0;
+        socklen_t cbErr = sizeof(err);
+        bConnected = poll(&pfd, 1, STREAM_CONNECT_MS) == 1 &&
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&err, &cbErr) == 0 && err == 0;
+    }
+    if (!bConnected) {
+        closesocket(sock);
+        return false;
+    }
+    // Back to blocking for the writes, but never for long.
+#ifdef _WIN32
+    on = 0;
+    ioctlsocket(sock, FIONBIO, &on);
+    DWORD msTimeout = STREAM_CONNECT_MS;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&msTimeout, sizeof(msTimeout));
+#else
+    fcntl(sock, F_SETFL, flags);
+    timeval tv = { STREAM_CONNECT_MS / 1000, (STREAM_CONNECT_MS % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+    m_sock = (intptr_t)sock;
+    m_bConnected = true;
+    m_nConnects++;
+    m_msBackoff = STREAM_BACKOFF_MIN_MS;
+    return true;
+}
+
+// Send the batch being built, and start the next.
+void CResultStream::SendBatch()
+{
+    int nRecords = m_batch.GetCount();
+    if (nRecords == 0) {
+        return;
+    }
+    if (m_bTcp && !m_bConnected) {
+        int64_t msNow = StreamNowMs();
+        if (msNow < m_msNextConnect || !Connect()) {
+            if (msNow >= m_msNextConnect) {
+                m_msNextConnect = msNow + m_msBackoff;
+                m_msBackoff = m_msBackoff * 2 > STREAM_BACKOFF_MAX_MS ? STREAM_BACKOFF_MAX_MS : m_msBackoff * 2;
+            }
+            m_nDropped += nRecords;
+            m_batch.Begin(m_strHost, m_pfnLocalIP ? m_pfnLocalIP() : "", m_idSender, m_seq);
+            return;
+        }
+    }
+
+    bool bOk = true;
+    if (m_bTcp) {
+        const char* p = m_batch.GetData();
+        size_t cbLeft = m_batch.GetSize();
+        while (cbLeft > 0) {
+            int cb = send(m_sock, p, (int)cbLeft, SEND_FLAGS);
+            if (cb <= 0) {
+                bOk = false;
+                break;
+            }
+            p += cb;
+            cbLeft -= cb;
+        }
+        if (!bOk) {
+            CloseSocket();
+        }
+    } else {
+        bOk = sendto(m_sock, m_batch.GetData(), (int)m_batch.GetSize(), 0, (const sockaddr*)&m_addr,
+            sizeof(m_addr)) == (int)m_batch.GetSize();
+    }
+    if (bOk) {
+        m_nSent += nRecords;
+        m_nBatches++;
+    } else {
+        m_nSendErrors++;
+        m_nDropped += nRecords;
+    }
+    // A batch lost on the way counts as lost at the collector too.
+    m_seq++;
+    m_batch.Begin(m_strHost, m_pfnLocalIP ? m_pfnLocalIP() : "", m_idSender, m_seq);
+}
+
+void CResultStream::ThreadMain()
+{
+    m_batch.Begin(m_strHost, m_pfnLocalIP ? m_pfnLocalIP() : "", m_idSender, m_seq);
+    int64_t msFirst = 0;        // when the first result of the batch was taken
+    for (;;) {
+        // Stop is checked before draining so that results queued before
+        // the request are all sent.
+        bool bStopping = m_bStop;
+        size_t nGathered = 0;
+        StructItem* pItem;
+        while ((pItem = m_pQueue->Front()) != NULL) {
+            if (m_batch.GetCount() == 0) {
+                msFirst = StreamNowMs();
+            }
+            if (!m_batch.Add(pItem->szTarget, pItem->msTime, pItem->usRtt, pItem->errorCode)) {
+                SendBatch();
+                msFirst = StreamNowMs();
+                m_batch.Add(pItem->szTarget, pItem->msTime, pItem->usRtt, pItem->errorCode);
+            }
+            m_pQueue->Pop();
+            nGathered++;
+        }
+        if (m_batch.GetCount() > 0 && (bStopping || StreamNowMs() - msFirst >= STREAM_FLUSH_MS)) {
+            SendBatch();
+        }
+        if (bStopping) {
+            break;
+        }
+        if (nGathered == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(STREAM_FLUSH_MS / 5));
+        }
+    }
+}
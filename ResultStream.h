@@ -0,0 +1,181 @@
+// ResultStream.h : Streaming of ping results to a fleet collector (see
+// Collector.h and nalcollect.cpp), so that an outage many machines see at
+// once shows up in one place within seconds.
+//
+// Results go out in batches, each a StructStreamHdr followed by the
+// sending host's name and local IP, and then up to a datagram's worth of
+// StructStreamRecord, each followed by its target's name.  The fields are
+// little-endian, as on every platform netavailw runs on; BinLog.h makes
+// the same assumption.  Over UDP a batch is one datagram.  Over TCP
+// batches are written back to back; cbBatch in each header says where
+// the next begins.
+//
+// Each sender numbers its batches from 0, under an id chosen at random
+// when it starts, so the collector can count batches lost on the way
+// without mistaking a restart for a loss.
+//
+// CResultStream is the sending side.  Like CLogWriter, any thread can
+// queue a result without blocking: results go into a bounded lock-free
+// queue and are dropped (and counted) if it is full.  One thread gathers
+// them into batches and sends them, at most STREAM_FLUSH_MS after the
+// first of a batch was queued.  Over TCP it reconnects, backing off, if the
+// connection drops; results queued meanwhile are dropped, not kept.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BinLog.h"
+#include "MpscQueue.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#define STREAM_MAGIC            0x3152414Eu     // "NAR1"
+#define STREAM_PORT_DEFAULT     9479
+#define STREAM_BATCH_MAX        1400    // bytes; fits an Ethernet frame with room for tunnels
+#define STREAM_NAME_MAX         255     // longest host, local IP or target name; longer are cut
+#define STREAM_FLUSH_MS         100     // most a result waits for its batch to fill
+#define STREAM_QUEUE_CAPACITY   4096    // results
+
+#pragma pack(push, 1)
+struct StructStreamHdr {
+    uint32_t magic;             // STREAM_MAGIC
+    uint16_t cbBatch;           // the whole batch, this header included
+    uint16_t nRecords;
+    uint32_t idSender;          // random per sender start
+    uint32_t seq;               // batch number from that start
+    uint8_t  cbHost;            // the names that follow
+    uint8_t  cbLocalIP;
+};
+
+struct StructStreamRecord {
+    int64_t  msTime;            // when the ping finished, ms since 1970 UTC
+    int32_t  usRtt;             // round trip time, or -1 if the ping failed
+    uint32_t errorCode;         // IP_xxx code if it failed, else 0
+    uint8_t  cbTarget;          // the name that follows
+};
+#pragma pack(pop)
+
+// One result of a decoded batch; the names point into the batch.
+struct StructStreamResult {
+    StructField target;
+    int64_t     msTime;
+    int64_t     usRtt;
+    uint32_t    errorCode;
+};
+
+// The header of a decoded batch.
+struct StructStreamBatch {
+    StructField host;
+    StructField localIP;
+    uint32_t    idSender;
+    uint32_t    seq;
+};
+
+// Builds one batch in place.
+class CStreamBatchBuilder
+{
+public:
+    CStreamBatchBuilder() : m_cb(0), m_nRecords(0) {}
+
+    void Begin(const std::string& strHost, const std::string& strLocalIP, uint32_t idSender, uint32_t seq);
+
+    // Exit:   Returns false, adding nothing, if the batch is full.
+    bool Add(const char* pszTarget, int64_t msTime, int64_t usRtt, uint32_t errorCode);
+
+    const char* GetData() const { return m_buf; }
+    size_t GetSize() const { return m_cb; }
+    int GetCount() const { return m_nRecords; }
+
+private:
+    char   m_buf[STREAM_BATCH_MAX];
+    size_t m_cb;
+    int    m_nRecords;
+};
+
+// Exit:   Returns the size of the batch at the start of p, or 0 if it is
+//         not a batch, and so not worth reading on from, or if cb is too
+//         short to tell.  Check cb against the result before decoding.
+size_t GetStreamBatchSize(const char* p, size_t cb);
+
+// Decode one batch of cb bytes.
+// Exit:   Returns false if the batch is malformed; vectResults may then
+//         hold some of its results.
+bool DecodeStreamBatch(const char* p, size_t cb, StructStreamBatch& batch, std::vector<StructStreamResult>& vectResults);
+
+struct StructResultStreamStats {
+    uint64_t nQueued;           // results accepted
+    uint64_t nSent;             // results sent
+    uint64_t nDropped;          // results dropped: queue full, or not connected
+    uint64_t nBatches;          // batches sent
+    uint64_t nSendErrors;
+    uint64_t nConnects;         // TCP connections made
+    bool     bConnected;        // always true for UDP
+};
+
+class CResultStream
+{
+public:
+    CResultStream();
+    ~CResultStream();
+
+    // Start streaming to strSpec, "udp:HOST[:PORT]" or "tcp:HOST[:PORT]",
+    // with HOST a dotted IPv4 address and PORT by default
+    // STREAM_PORT_DEFAULT.  Batches name strHost as their sender, and the
+    // local IP pfnLocalIP returns as each batch is started.
+    bool Start(const std::string& strSpec, const std::string& strHost, const char* (*pfnLocalIP)(),
+        std::string& strError);
+
+    // Send what is queued, then stop the sending thread.
+    void Stop();
+
+    bool IsRunning() const { return m_thread.joinable(); }
+
+    // Queue a result.  Never blocks.
+    // Exit:   Returns false if it was dropped.
+    bool Send(const std::string& strTarget, int64_t msTime, int64_t usRtt, uint32_t errorCode);
+
+    StructResultStreamStats GetStats() const;
+
+private:
+    struct StructItem {
+        int64_t  msTime;
+        int64_t  usRtt;
+        uint32_t errorCode;
+        uint8_t  cbTarget;
+        char     szTarget[STREAM_NAME_MAX + 1];
+    };
+
+    void ThreadMain();
+    bool Connect();
+    void CloseSocket();
+    void SendBatch();
+
+    std::string m_strHost;
+    const char* (*m_pfnLocalIP)();
+    bool        m_bTcp;
+    sockaddr_in m_addr;             // of the collector
+    intptr_t    m_sock;
+    int64_t     m_msNextConnect;
+    int         m_msBackoff;
+    uint32_t    m_idSender;
+    uint32_t    m_seq;
+    CStreamBatchBuilder m_batch;
+    CMpscQueue<StructItem>* m_pQueue;
+    std::thread m_thread;
+    std::atomic<bool> m_bStop;
+
+    std::atomic<uint64_t> m_nQueued;
+    std::atomic<uint64_t> m_nSent;
+    std::atomic<uint64_t> m_nDropped;
+    std::atomic<uint64_t> m_nBatches;
+    std::atomic<uint64_t> m_nSendErrors;
+    std::atomic<uint64_t> m_nConnects;
+    std::atomic<bool>     m_bConnected;
+};
@@ -0,0 +1,448 @@
+// RttSeries.cpp : Round-trip time series per target.  See RttSeries.h.
+
+#include "RttSeries.h"
+#include "BinLog.h"
+#include "MappedFile.h"
+#include <string.h>
+#include <unordered_map>
+
+// Bucket lengths, in ms, indexed by EnumSeriesTier; raw samples have none.
+static const int64_t AryBucketMs[SERIES_NUM_TIERS] = {
+    0,
+    60 * 1000LL,
+    3600 * 1000LL
+};
+
+// How far back each tier reaches, in ms.
+static const int64_t AryTierSpanMs[SERIES_NUM_TIERS] = {
+    SERIES_RAW_MS,
+    SERIES_MINUTES * 60 * 1000LL,
+    SERIES_HOURS * 3600 * 1000LL
+};
+
+static const char* AryTierNames[SERIES_NUM_TIERS] = { "raw", "1m", "1h" };
+
+void StructRttBucket::Clear(int64_t msStartNew)
+{
+    msStart = msStartNew;
+    nProbes = 0;
+    nLost = 0;
+    usMin = 0;
+    usMax = 0;
+    usSum = 0;
+}
+
+void StructRttBucket::Add(int64_t usRtt)
+{
+    nProbes++;
+    if (usRtt < 0) {
+        nLost++;
+        return;
+    }
+    if (nProbes - nLost == 1 || usRtt < usMin) {
+        usMin = usRtt;
+    }
+    if (usRtt > usMax) {
+        usMax = usRtt;
+    }
+    usSum += usRtt;
+}
+
+void StructRttBucket::Merge(const StructRttBucket& other)
+{
+    if (other.nProbes > other.nLost) {
+        if (nProbes == nLost || other.usMin < usMin) {
+            usMin = other.usMin;
+        }
+        if (other.usMax > usMax) {
+            usMax = other.usMax;
+        }
+    }
+    nProbes += other.nProbes;
+    nLost += other.nLost;
+    usSum += other.usSum;
+}
+
+CRttSeries::CRttSeries()
+    : m_cbBudget(SERIES_DEFAULT_BUDGET), m_cbUsed(0), m_critAdd("RttSeries.GetTarget")
+{
+}
+
+CRttSeries::~CRttSeries()
+{
+    int nTargets = m_tableTargets.GetCount();
+    for (int j = 0; j < nTargets; j++) {
+        delete[] m_tableTargets.Get(j)->pRaw;
+        delete m_tableTargets.Get(j);
+    }
+}
+
+void CRttSeries::SetBudget(size_t cbBudget)
+{
+    m_cbBudget.store(cbBudget, std::memory_order_relaxed);
+}
+
+int CRttSeries::GetTarget(const std::string& strName, int secsInterval)
+{
+    CCritSecInScope lock(m_critAdd);
+    std::unordered_map<std::string, int>::const_iterator it = m_mapTargets.find(strName);
+    if (it != m_mapTargets.end()) {
+        return it->second;
+    }
+
+    // Room for two results per interval, so burst mode still fits an
+    // hour; then as much of that as the budget allows.
+    size_t nRaw = (size_t)(2 * SERIES_RAW_MS / 1000 / (secsInterval > 0 ? secsInterval : 1));
+    nRaw = nRaw < SERIES_RAW_MIN ? SERIES_RAW_MIN : nRaw > SERIES_RAW_MAX ? SERIES_RAW_MAX : nRaw;
+    size_t cbUsed = m_cbUsed.load(std::memory_order_relaxed);
+    size_t cbBudget = m_cbBudget.load(std::memory_order_relaxed);
+    size_t cbFixed = sizeof(StructTargetSeries);
+    size_t cbLeft = cbBudget > cbUsed + cbFixed ? cbBudget - cbUsed - cbFixed : 0;
+    if (cbLeft / sizeof(StructSampleSlot) < nRaw) {
+        nRaw = cbLeft / sizeof(StructSampleSlot);
+    }
+    if (nRaw < SERIES_RAW_MIN) {
+        return -1;
+    }
+
+    StructTargetSeries* pTarget = new StructTargetSeries;
+    pTarget->strName = strName;
+    pTarget->nRaw = nRaw;
+    pTarget->pRaw = new StructSampleSlot[nRaw];
+    for (size_t j = 0; j < nRaw; j++) {
+        pTarget->pRaw[j].msTime.store(-1, std::memory_order_relaxed);
+        pTarget->pRaw[j].usRtt.store(-1, std::memory_order_relaxed);
+    }
+    pTarget->nRawWritten.store(0, std::memory_order_relaxed);
+    StructBucketSlot* aryTiers[] = { pTarget->aryMinutes, pTarget->aryHours };
+    int aryCounts[] = { SERIES_MINUTES, SERIES_HOURS };
+    for (int t = 0; t < 2; t++) {
+        for (int j = 0; j < aryCounts[t]; j++) {
+            StructBucketSlot& slot = aryTiers[t][j];
+            slot.msStart.store(-1, std::memory_order_relaxed);
+            slot.nProbes.store(0, std::memory_order_relaxed);
+            slot.nLost.store(0, std::memory_order_relaxed);
+            slot.usMin.store(0, std::memory_order_relaxed);
+            slot.usMax.store(0, std::memory_order_relaxed);
+            slot.usSum.store(0, std::memory_order_relaxed);
+        }
+    }
+    int iTarget = m_tableTargets.Add(pTarget);
+    if (iTarget < 0) {
+        delete[] pTarget->pRaw;
+        delete pTarget;
+        return -1;
+    }
+    m_cbUsed.store(cbUsed + cbFixed + nRaw * sizeof(StructSampleSlot), std::memory_order_relaxed);
+    m_mapTargets[strName] = iTarget;
+    return iTarget;
+}
+
+// Add a result to the bucket of one tier that holds msTime, recycling the
+// slot if it holds an older period.
+void CRttSeries::RecordBucket(StructBucketSlot* pSlots, int nSlots, int64_t msBucket, int64_t msTime, int64_t usRtt)
+{
+    int64_t period = msTime / msBucket;
+    StructBucketSlot& slot = pSlots[period % nSlots];
+    int64_t msStart = period * msBucket;
+    int64_t msSlot = slot.msStart.load(std::memory_order_relaxed);
+    if (msSlot > msStart) {
+        return;
+    }
+    // Only this thread writes the slot, so plain load/store suffices for
+    // everything but keeps readers free of torn values.
+    uint32_t nProbes = 0;
+    uint32_t nLost = 0;
+    int64_t usSum = 0;
+    int64_t usMin = 0;
+    int64_t usMax = 0;
+    if (msSlot == msStart) {
+        nProbes = slot.nProbes.load(std::memory_order_relaxed);
+        nLost = slot.nLost.load(std::memory_order_relaxed);
+        usSum = slot.usSum.load(std::memory_order_relaxed);
+        usMin = slot.usMin.load(std::memory_order_relaxed);
+        usMax = slot.usMax.load(std::memory_order_relaxed);
+    } else {
+        // Mark the slot as belonging to no period while it's recycled, so
+        // a reader skips it rather than taking half-cleared figures.
+        slot.msStart.store(-1, std::memory_order_release);
+    }
+    nProbes++;
+    if (usRtt < 0) {
+        nLost++;
+    } else {
+        if (nProbes - nLost == 1 || usRtt < usMin) {
+            usMin = usRtt;
+        }
+        if (usRtt > usMax) {
+            usMax = usRtt;
+        }
+        usSum += usRtt;
+    }
+    slot.nProbes.store(nProbes, std::memory_order_relaxed);
+    slot.nLost.store(nLost, std::memory_order_relaxed);
+    slot.usSum.store(usSum, std::memory_order_relaxed);
+    slot.usMin.store(usMin, std::memory_order_relaxed);
+    slot.usMax.store(usMax, std::memory_order_relaxed);
+    slot.msStart.store(msStart, std::memory_order_release);
+}
+
+void CRttSeries::Record(int iTarget, int64_t msTime, int64_t usRtt)
+{
+    if (iTarget < 0 || iTarget >= m_tableTargets.GetCount()) {
+        return;
+    }
+    StructTargetSeries& target = *m_tableTargets.Get(iTarget);
+    uint64_t iSample = target.nRawWritten.load(std::memory_order_relaxed);
+    StructSampleSlot& sample = target.pRaw[iSample % target.nRaw];
+    sample.msTime.store(msTime, std::memory_order_relaxed);
+    sample.usRtt.store(usRtt, std::memory_order_relaxed);
+    target.nRawWritten.store(iSample + 1, std::memory_order_release);
+    RecordBucket(target.aryMinutes, SERIES_MINUTES, AryBucketMs[SERIES_TIER_1MIN], msTime, usRtt);
+    RecordBucket(target.aryHours, SERIES_HOURS, AryBucketMs[SERIES_TIER_1HOUR], msTime, usRtt);
+}
+
+void CRttSeries::GetSamples(int iTarget, int64_t msFrom, std::vector<StructRttSample>& vectOut) const
+{
+    if (iTarget < 0 || iTarget >= m_tableTargets.GetCount()) {
+        return;
+    }
+    const StructTargetSeries& target = *m_tableTargets.Get(iTarget);
+    uint64_t nWritten = target.nRawWritten.load(std::memory_order_acquire);
+    uint64_t iFirst = nWritten > target.nRaw ? nWritten - target.nRaw : 0;
+    for (uint64_t j = iFirst; j < nWritten; j++) {
+        const StructSampleSlot& slot = target.pRaw[j % target.nRaw];
+        StructRttSample sample;
+        sample.msTime = slot.msTime.load(std::memory_order_relaxed);
+        sample.usRtt = slot.usRtt.load(std::memory_order_relaxed);
+        if (sample.msTime >= msFrom) {
+            vectOut.push_back(sample);
+        }
+    }
+}
+
+// Exit:   Returns the time of the oldest raw sample a target keeps, or
+//         INT64_MIN if none has been overwritten yet.
+int64_t CRttSeries::GetOldestSampleMs(int iTarget) const
+{
+    if (iTarget < 0 || iTarget >= m_tableTargets.GetCount()) {
+        return INT64_MIN;
+    }
+    const StructTargetSeries& target = *m_tableTargets.Get(iTarget);
+    uint64_t nWritten = target.nRawWritten.load(std::memory_order_acquire);
+    if (nWritten <= target.nRaw) {
+        return INT64_MIN;
+    }
+    return target.pRaw[(nWritten - target.nRaw) % target.nRaw].msTime.load(std::memory_order_relaxed);
+}
+
+// Copy out a bucket.
+// Exit:   Returns false if the slot holds no period, or was recycled
+//         while it was being read.
+bool CRttSeries::ReadBucket(const StructBucketSlot& slot, StructRttBucket& bucket)
+{
+    bucket.msStart = slot.msStart.load(std::memory_order_acquire);
+    if (bucket.msStart < 0) {
+        return false;
+    }
+    bucket.nProbes = slot.nProbes.load(std::memory_order_relaxed);
+    bucket.nLost = slot.nLost.load(std::memory_order_relaxed);
+    bucket.usMin = slot.usMin.load(std::memory_order_relaxed);
+    bucket.usMax = slot.usMax.load(std::memory_order_relaxed);
+    bucket.usSum = slot.usSum.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.msStart.load(std::memory_order_relaxed) == bucket.msStart;
+}
+
+void CRttSeries::GetBuckets(int iTarget, EnumSeriesTier tier, int64_t msFrom, std::vector<StructRttBucket>& vectOut) const
+{
+    if (tier == SERIES_TIER_RAW || iTarget < 0 || iTarget >= m_tableTargets.GetCount()) {
+        return;
+    }
+    const StructTargetSeries& target = *m_tableTargets.Get(iTarget);
+    const StructBucketSlot* pSlots = tier == SERIES_TIER_1MIN ? target.aryMinutes : target.aryHours;
+    int nSlots = tier == SERIES_TIER_1MIN ? SERIES_MINUTES : SERIES_HOURS;
+    int64_t msBucket = AryBucketMs[tier];
+
+    // Walk the ring from the slot after the newest, which holds the oldest.
+    int64_t msNewest = -1;
+    for (int j = 0; j < nSlots; j++) {
+        int64_t msStart = pSlots[j].msStart.load(std::memory_order_relaxed);
+        if (msStart > msNewest) {
+            msNewest = msStart;
+        }
+    }
+    if (msNewest < 0) {
+        return;
+    }
+    int64_t msFirst = msFrom / msBucket * msBucket;
+    int64_t msOldest = msNewest - (nSlots - 1) * msBucket;
+    for (int64_t msStart = msFirst > msOldest ? msFirst : msOldest; msStart <= msNewest; msStart += msBucket) {
+        StructRttBucket bucket;
+        if (ReadBucket(pSlots[(msStart / msBucket) % nSlots], bucket) && bucket.msStart == msStart &&
+            bucket.nProbes > 0) {
+            vectOut.push_back(bucket);
+        }
+    }
+}
+
+void CRttSeries::GetColumns(int iTarget, int64_t msFrom, int64_t msPerColumn, int nColumns,
+    std::vector<StructRttBucket>& vectColumns) const
+{
+    vectColumns.resize(nColumns > 0 ? nColumns : 0);
+    for (int j = 0; j < nColumns; j++) {
+        vectColumns[j].Clear(msFrom + j * msPerColumn);
+    }
+    if (nColumns <= 0 || msPerColumn <= 0) {
+        return;
+    }
+
+    // The coarsest tier with buckets no longer than a column, or a
+    // coarser one if that doesn't reach back to msFrom.
+    int64_t msEnd = msFrom + nColumns * msPerColumn;
+    int tier = SERIES_TIER_RAW;
+    while (tier + 1 < SERIES_NUM_TIERS && AryBucketMs[tier + 1] <= msPerColumn) {
+        tier++;
+    }
+    // The raw ring reaches back as far as its oldest sample; a bucket
+    // tier may be a bucket short at the left edge.
+    while (tier + 1 < SERIES_NUM_TIERS) {
+        int64_t msOldest = tier == SERIES_TIER_RAW ? GetOldestSampleMs(iTarget)
+            : msEnd - AryTierSpanMs[tier] - AryBucketMs[tier];
+        if (msFrom >= msOldest) {
+            break;
+        }
+        tier++;
+    }
+
+    if (tier == SERIES_TIER_RAW) {
+        std::vector<StructRttSample> vectSamples;
+        GetSamples(iTarget, msFrom, vectSamples);
+        for (size_t j = 0; j < vectSamples.size(); j++) {
+            int64_t iColumn = (vectSamples[j].msTime - msFrom) / msPerColumn;
+            if (iColumn < nColumns) {
+                vectColumns[(size_t)iColumn].Add(vectSamples[j].usRtt);
+            }
+        }
+        return;
+    }
+
+    // A bucket counts in every column it overlaps, so columns narrower
+    // than the tier's buckets show it as a band rather than gaps.
+    int64_t msBucket = AryBucketMs[tier];
+    std::vector<StructRttBucket> vectBuckets;
+    GetBuckets(iTarget, (EnumSeriesTier)tier, msFrom, vectBuckets);
+    for (size_t j = 0; j < vectBuckets.size(); j++) {
+        const StructRttBucket& bucket = vectBuckets[j];
+        int64_t iFirst = bucket.msStart > msFrom ? (bucket.msStart - msFrom) / msPerColumn : 0;
+        int64_t iLast = (bucket.msStart + msBucket - 1 - msFrom) / msPerColumn;
+        for (int64_t i = iFirst; i <= iLast && i < nColumns; i++) {
+            vectColumns[(size_t)i].Merge(bucket);
+        }
+    }
+}
+
+// Exit:   Returns the start of the first line at or after p.
+static const char* SkipToLineStart(const char* pBase, const char* p, const char* pEnd)
+{
+    if (p == pBase) {
+        return p;
+    }
+    const char* pNewline = (const char*)memchr(p - 1, '\n', pEnd - (p - 1));
+    return pNewline ? pNewline + 1 : pEnd;
+}
+
+// Exit:   Returns the time of the first well-formed line at or after p,
+//         or -1 if there is none within a few lines.
+static int64_t GetLineTime(const char* p, const char* pEnd, StructTimeCache& cache)
+{
+    StructCsvSplit split;
+    StructLogLine line;
+    for (int j = 0; j < 8 && p < pEnd; j++) {
+        SplitCsvLine(p, pEnd, split);
+        if (ParseCsvLogSplit(split, cache, line)) {
+            return line.msTime;
+        }
+        p = split.pNext;
+    }
+    return -1;
+}
+
+int64_t CRttSeries::LoadFromLog(const std::string& strPath, int64_t msNow)
+{
+    CMappedFile file;
+    if (!file.Open(strPath)) {
+        return -1;
+    }
+    const char* pBase = file.GetData();
+    const char* pEnd = pBase + file.GetSize();
+    int64_t msFrom = msNow - AryTierSpanMs[SERIES_TIER_1HOUR];
+    StructTimeCache cache;
+
+    // Records are written in time order, so bisect for the first line of
+    // the period rather than parse the years before it.
+    size_t ibLow = 0;
+    size_t ibHigh = file.GetSize();
+    while (ibHigh - ibLow > 64 * 1024) {
+        size_t ibMid = ibLow + (ibHigh - ibLow) / 2;
+        int64_t msMid = GetLineTime(SkipToLineStart(pBase, pBase + ibMid, pEnd), pEnd, cache);
+        if (msMid >= 0 && msMid < msFrom) {
+            ibLow = ibMid;
+        } else {
+            ibHigh = ibMid;
+        }
+    }
+
+    int nTargets = GetTargetCount();
+    std::unordered_map<std::string, int> mapTargets;
+    for (int j = 0; j < nTargets; j++) {
+        mapTargets[m_tableTargets.Get(j)->strName] = j;
+    }
+    int64_t nRecorded = 0;
+    StructCsvSplit split;
+    StructLogLine line;
+    std::string strRemote;
+    StructField remotePrev = { NULL, 0 };
+    int iTarget = -1;
+    for (const char* p = SkipToLineStart(pBase, pBase + ibLow, pEnd); p < pEnd; p = split.pNext) {
+        SplitCsvLine(p, pEnd, split);
+        if (!ParseCsvLogSplit(split, cache, line) || line.msTime < msFrom) {
+            continue;
+        }
+        int64_t usRtt;
+        if (line.action.cb == 4 && memcmp(line.action.p, "ping", 4) == 0) {
+            usRtt = ParseRoundTripMicros(line.details.p, line.details.cb);
+            if (usRtt < 0) {
+                continue;
+            }
+        } else if (line.action.cb == 5 && memcmp(line.action.p, "error", 5) == 0) {
+            usRtt = -1;
+        } else {
+            continue;
+        }
+        // Consecutive lines are mostly of the same target, so only look
+        // it up when it changes.
+        if (remotePrev.p == NULL || line.remoteIP.cb != remotePrev.cb ||
+            memcmp(line.remoteIP.p, remotePrev.p, remotePrev.cb) != 0) {
+            strRemote.assign(line.remoteIP.p, line.remoteIP.cb);
+            std::unordered_map<std::string, int>::const_iterator it = mapTargets.find(strRemote);
+            iTarget = it != mapTargets.end() ? it->second : -1;
+            remotePrev = line.remoteIP;
+        }
+        if (iTarget >= 0) {
+            Record(iTarget, line.msTime, usRtt);
+            nRecorded++;
+        }
+    }
+    return nRecorded;
+}
+
+const char* CRttSeries::GetTierName(EnumSeriesTier tier)
+{
+    return AryTierNames[tier];
+}
+
+int64_t CRttSeries::GetBucketMs(EnumSeriesTier tier)
+{
+    return AryBucketMs[tier];
+}
@@ -0,0 +1,157 @@
+// RttSeries.h : Round-trip time series per target, in fixed memory, for
+// graphs of latency history.  Each target keeps three rings, from fine to
+// coarse:
+//   raw     every result of the last hour: time and RTT, or a loss
+//   1min    min/avg/max RTT and loss per minute, for a day
+//   1hour   the same per hour, for 30 days
+// Every result goes into all three, so the coarse tiers need no
+// down-sampling pass.  The raw ring is sized from the target's interval,
+// with room for burst mode; if results come faster still, it holds less
+// than an hour.
+//
+// Memory is reserved when a target is added, against a budget set with
+// SetBudget (the SeriesMemoryMB setting).  A target that won't fit with a
+// full raw ring gets a smaller one, down to SERIES_RAW_MIN samples; past
+// that, it isn't added.  The budget never grows the memory of targets
+// already added.
+//
+// As in CLatencyStats, recording is O(1) and allocation-free, each target
+// is recorded by one thread at a time, and readers take no lock; a read
+// racing with a write may see the old or new value of a slot being
+// written.
+//
+// LoadFromLog rebuilds the rings from netavailw.csv at startup: it maps
+// the file, skips straight to the first line of the last 30 days, and
+// records each ping and error line of a known target, with nothing else
+// of the probe pipeline.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CritSec.h"
+#include "TargetTable.h"
+
+enum EnumSeriesTier {
+    SERIES_TIER_RAW,
+    SERIES_TIER_1MIN,
+    SERIES_TIER_1HOUR,
+    SERIES_NUM_TIERS
+};
+
+#define SERIES_RAW_MS           (3600 * 1000LL)
+#define SERIES_RAW_MIN          64          // samples; the least a target gets
+#define SERIES_RAW_MAX          (2 * 3600)  // samples; enough for 2 per second
+#define SERIES_MINUTES          1440        // 1-minute buckets: a day
+#define SERIES_HOURS            720         // 1-hour buckets: 30 days
+#define SERIES_DEFAULT_BUDGET   (64 * 1024 * 1024)
+
+// A result: ms since 1970 UTC, and the RTT in us, or -1 if it was lost.
+struct StructRttSample {
+    int64_t msTime;
+    int64_t usRtt;
+};
+
+// The results of one period.  A bucket with no results has nProbes 0.
+struct StructRttBucket {
+    int64_t  msStart;
+    uint32_t nProbes;       // replies plus losses
+    uint32_t nLost;
+    int64_t  usMin;         // of replies; 0 if none
+    int64_t  usMax;
+    int64_t  usSum;
+
+    void Clear(int64_t msStartNew);
+    void Add(int64_t usRtt);
+    void Merge(const StructRttBucket& other);
+
+    // Exit:   Returns the mean RTT of the replies, or -1 if none.
+    int64_t GetMean() const { return nProbes > nLost ? usSum / (nProbes - nLost) : -1; }
+};
+
+class CRttSeries
+{
+public:
+    // The table of targets grows without moving (see TargetTable.h), so
+    // adding a target never moves data a reader may be looking at.
+    CRttSeries();
+    ~CRttSeries();
+
+    // The memory targets added from now on may use in all, in bytes.
+    void SetBudget(size_t cbBudget);
+
+    // Find a target by name, adding it if it's new, with a raw ring for
+    // results secsInterval apart.  Allocates; call it when targets are
+    // configured, not per result.
+    // Exit:   Returns the target index, or -1 if it doesn't fit in the
+    //         budget or the table.
+    int GetTarget(const std::string& strName, int secsInterval);
+    int GetTargetCount() const { return m_tableTargets.GetCount(); }
+    const std::string& GetTargetName(int iTarget) const { return m_tableTargets.Get(iTarget)->strName; }
+
+    // Record a result at msTime, ms since 1970 UTC.  Results of a target
+    // should come in time order; one older than a bucket already recycled
+    // is left out of that tier.
+    void Record(int iTarget, int64_t msTime, int64_t usRtt);
+
+    // Copy the raw samples of a target from msFrom on, oldest first.
+    void GetSamples(int iTarget, int64_t msFrom, std::vector<StructRttSample>& vectOut) const;
+
+    // Copy the buckets of a tier (SERIES_TIER_1MIN or SERIES_TIER_1HOUR)
+    // that have results, from the one holding msFrom on, oldest first.
+    void GetBuckets(int iTarget, EnumSeriesTier tier, int64_t msFrom, std::vector<StructRttBucket>& vectOut) const;
+
+    // Fill nColumns buckets of msPerColumn each, the first starting at
+    // msFrom, from the coarsest tier no coarser than a column that still
+    // covers msFrom; a graph draws one column from each.
+    void GetColumns(int iTarget, int64_t msFrom, int64_t msPerColumn, int nColumns,
+        std::vector<StructRttBucket>& vectColumns) const;
+
+    // Rebuild from a netavailw.csv log: record its ping and error lines
+    // of targets already added, from the last 30 days before msNow.
+    // Exit:   Returns the number of results recorded, or -1 if the file
+    //         can't be read.
+    int64_t LoadFromLog(const std::string& strPath, int64_t msNow);
+
+    // Memory reserved for targets, in bytes.
+    size_t GetMemoryUsed() const { return m_cbUsed.load(std::memory_order_relaxed); }
+
+    static const char* GetTierName(EnumSeriesTier tier);
+    static int64_t GetBucketMs(EnumSeriesTier tier);
+
+private:
+    struct StructSampleSlot {
+        std::atomic<int64_t> msTime;
+        std::atomic<int64_t> usRtt;
+    };
+
+    struct StructBucketSlot {
+        std::atomic<int64_t>  msStart;      // -1 while the slot is being recycled
+        std::atomic<uint32_t> nProbes;
+        std::atomic<uint32_t> nLost;
+        std::atomic<int64_t>  usMin;
+        std::atomic<int64_t>  usMax;
+        std::atomic<int64_t>  usSum;
+    };
+
+    struct StructTargetSeries {
+        std::string strName;
+        size_t nRaw;                        // capacity of the raw ring
+        StructSampleSlot* pRaw;
+        std::atomic<uint64_t> nRawWritten;  // samples ever recorded
+        StructBucketSlot aryMinutes[SERIES_MINUTES];
+        StructBucketSlot aryHours[SERIES_HOURS];
+    };
+
+    static void RecordBucket(StructBucketSlot* pSlots, int nSlots, int64_t msBucket, int64_t msTime, int64_t usRtt);
+    static bool ReadBucket(const StructBucketSlot& slot, StructRttBucket& bucket);
+    int64_t GetOldestSampleMs(int iTarget) const;
+
+    CTargetTable<StructTargetSeries> m_tableTargets;
+    std::unordered_map<std::string, int> m_mapTargets;  // guarded by m_critAdd
+    std::atomic<size_t> m_cbBudget;
+    std::atomic<size_t> m_cbUsed;
+    CCritSec    m_critAdd;          // serializes GetTarget; Record and readers never take it
+};
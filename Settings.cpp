@@ -0,0 +1,496 @@
+// Settings.cpp : User settings for the prober, GUI and daemon.
+
+#include "Settings.h"
+#include <atomic>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unordered_set>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+struct_settings Settings;
+
+// The integer settings, by the name they are stored under.
+static const struct StructIntSetting {
+    const char* pszName;
+    int struct_settings::* pMember;
+} AryIntSettings[] = {
+    {"msBadPing", &struct_settings::msBadPing},
+    {"msPingTimeout", &struct_settings::msPingTimeout},
+    {"secsSleep", &struct_settings::secsSleep},
+    {"msLogFsync", &struct_settings::msLogFsync},
+    {"mbLogRotate", &struct_settings::mbLogRotate},
+    {"hoursLogRotate", &struct_settings::hoursLogRotate},
+    {"LogFormat", &struct_settings::logFormat},
+    {"secsLogSummary", &struct_settings::secsLogSummary},
+    {"MetricsPort", &struct_settings::portMetrics},
+    {"msBurstInterval", &struct_settings::msBurstInterval},
+    {"LogDetail", &struct_settings::logDetail},
+    {"nEpisodeContext", &struct_settings::nEpisodeContext},
+    {"secsRollup", &struct_settings::secsRollup},
+    {"msTcpTimeout", &struct_settings::msTcpTimeout},
+    {"msBadTcp", &struct_settings::msBadTcp},
+    {"msUdpTimeout", &struct_settings::msUdpTimeout},
+    {"msBadUdp", &struct_settings::msBadUdp},
+    {"msDnsTimeout", &struct_settings::msDnsTimeout},
+    {"msBadDns", &struct_settings::msBadDns},
+    {"secsTraceMin", &struct_settings::secsTraceMin},
+    {"nTraceHops", &struct_settings::nTraceHops},
+    {"nTraceRounds", &struct_settings::nTraceRounds},
+    {"nTrainPackets", &struct_settings::nTrainPackets},
+    {"msTrainSpacing", &struct_settings::msTrainSpacing},
+    {"LockStats", &struct_settings::lockStats},
+    {"LogTimeDigits", &struct_settings::logTimeDigits},
+    {"LogTimeIso", &struct_settings::logTimeIso},
+    {"SeriesMemoryMB", &struct_settings::seriesMemoryMB},
+    {"ProbeShards", &struct_settings::probeShards},
+    {"ProbeWorkers", &struct_settings::probeWorkers},
+    {NULL, NULL}
+};
+
+#ifdef _WIN32
+void struct_settings::Load()
+{
+    HKEY hKey;
+    if (RegOpenKeyEx(HKEY_CURRENT_USER, "Software\\netavailw", 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
+        char buffer[256];
+        DWORD bufferSize = sizeof(buffer);
+        if (RegGetValue(hKey, NULL, "RemoteIP", RRF_RT_REG_SZ, NULL, buffer, &bufferSize) == ERROR_SUCCESS) {
+            strRemoteIP = buffer;
+        }
+        bufferSize = sizeof(buffer);
+        if (RegGetValue(hKey, NULL, "ProbeBackend", RRF_RT_REG_SZ, NULL, buffer, &bufferSize) == ERROR_SUCCESS) {
+            strProbeBackend = buffer;
+        }
+        bufferSize = sizeof(buffer);
+        if (RegGetValue(hKey, NULL, "TargetsFile", RRF_RT_REG_SZ, NULL, buffer, &bufferSize) == ERROR_SUCCESS) {
+            strTargetsFile = buffer;
+        }
+        bufferSize = sizeof(buffer);
+        if (RegGetValue(hKey, NULL, "Collector", RRF_RT_REG_SZ, NULL, buffer, &bufferSize) == ERROR_SUCCESS) {
+            strCollector = buffer;
+        }
+        char bufferProbes[2048];
+        bufferSize = sizeof(bufferProbes);
+        if (RegGetValue(hKey, NULL, "Probes", RRF_RT_REG_SZ, NULL, bufferProbes, &bufferSize) == ERROR_SUCCESS) {
+            strProbes = bufferProbes;
+        }
+        bufferSize = sizeof(msBadPing);
+        RegGetValue(hKey, NULL, "msBadPing", RRF_RT_REG_DWORD, NULL, &msBadPing, &bufferSize);
+        bufferSize = sizeof(msPingTimeout);
+        RegGetValue(hKey, NULL, "msPingTimeout", RRF_RT_REG_DWORD, NULL, &msPingTimeout, &bufferSize);
+        bufferSize = sizeof(secsSleep);
+        RegGetValue(hKey, NULL, "secsSleep", RRF_RT_REG_DWORD, NULL, &secsSleep, &bufferSize);
+        bufferSize = sizeof(msLogFsync);
+        RegGetValue(hKey, NULL, "msLogFsync", RRF_RT_REG_DWORD, NULL, &msLogFsync, &bufferSize);
+        bufferSize = sizeof(mbLogRotate);
+        RegGetValue(hKey, NULL, "mbLogRotate", RRF_RT_REG_DWORD, NULL, &mbLogRotate, &bufferSize);
+        bufferSize = sizeof(hoursLogRotate);
+        RegGetValue(hKey, NULL, "hoursLogRotate", RRF_RT_REG_DWORD, NULL, &hoursLogRotate, &bufferSize);
+        bufferSize = sizeof(logFormat);
+        RegGetValue(hKey, NULL, "LogFormat", RRF_RT_REG_DWORD, NULL, &logFormat, &bufferSize);
+        bufferSize = sizeof(secsLogSummary);
+        RegGetValue(hKey, NULL, "secsLogSummary", RRF_RT_REG_DWORD, NULL, &secsLogSummary, &bufferSize);
+        bufferSize = sizeof(portMetrics);
+        RegGetValue(hKey, NULL, "MetricsPort", RRF_RT_REG_DWORD, NULL, &portMetrics, &bufferSize);
+        bufferSize = sizeof(msBurstInterval);
+        RegGetValue(hKey, NULL, "msBurstInterval", RRF_RT_REG_DWORD, NULL, &msBurstInterval, &bufferSize);
+        bufferSize = sizeof(logDetail);
+        RegGetValue(hKey, NULL, "LogDetail", RRF_RT_REG_DWORD, NULL, &logDetail, &bufferSize);
+        bufferSize = sizeof(nEpisodeContext);
+        RegGetValue(hKey, NULL, "nEpisodeContext", RRF_RT_REG_DWORD, NULL, &nEpisodeContext, &bufferSize);
+        bufferSize = sizeof(secsRollup);
+        RegGetValue(hKey, NULL, "secsRollup", RRF_RT_REG_DWORD, NULL, &secsRollup, &bufferSize);
+        bufferSize = sizeof(msTcpTimeout);
+        RegGetValue(hKey, NULL, "msTcpTimeout", RRF_RT_REG_DWORD, NULL, &msTcpTimeout, &bufferSize);
+        bufferSize = sizeof(msBadTcp);
+        RegGetValue(hKey, NULL, "msBadTcp", RRF_RT_REG_DWORD, NULL, &msBadTcp, &bufferSize);
+        bufferSize = sizeof(msUdpTimeout);
+        RegGetValue(hKey, NULL, "msUdpTimeout", RRF_RT_REG_DWORD, NULL, &msUdpTimeout, &bufferSize);
+        bufferSize = sizeof(msBadUdp);
+        RegGetValue(hKey, NULL, "msBadUdp", RRF_RT_REG_DWORD, NULL, &msBadUdp, &bufferSize);
+        bufferSize = sizeof(msDnsTimeout);
+        RegGetValue(hKey, NULL, "msDnsTimeout", RRF_RT_REG_DWORD, NULL, &msDnsTimeout, &bufferSize);
+        bufferSize = sizeof(msBadDns);
+        RegGetValue(hKey, NULL, "msBadDns", RRF_RT_REG_DWORD, NULL, &msBadDns, &bufferSize);
+        bufferSize = sizeof(secsTraceMin);
+        RegGetValue(hKey, NULL, "secsTraceMin", RRF_RT_REG_DWORD, NULL, &secsTraceMin, &bufferSize);
+        bufferSize = sizeof(nTraceHops);
+        RegGetValue(hKey, NULL, "nTraceHops", RRF_RT_REG_DWORD, NULL, &nTraceHops, &bufferSize);
+        bufferSize = sizeof(nTraceRounds);
+        RegGetValue(hKey, NULL, "nTraceRounds", RRF_RT_REG_DWORD, NULL, &nTraceRounds, &bufferSize);
+        bufferSize = sizeof(nTrainPackets);
+        RegGetValue(hKey, NULL, "nTrainPackets", RRF_RT_REG_DWORD, NULL, &nTrainPackets, &bufferSize);
+        bufferSize = sizeof(msTrainSpacing);
+        RegGetValue(hKey, NULL, "msTrainSpacing", RRF_RT_REG_DWORD, NULL, &msTrainSpacing, &bufferSize);
+        bufferSize = sizeof(lockStats);
+        RegGetValue(hKey, NULL, "LockStats", RRF_RT_REG_DWORD, NULL, &lockStats, &bufferSize);
+        bufferSize = sizeof(logTimeDigits);
+        RegGetValue(hKey, NULL, "LogTimeDigits", RRF_RT_REG_DWORD, NULL, &logTimeDigits, &bufferSize);
+        bufferSize = sizeof(logTimeIso);
+        RegGetValue(hKey, NULL, "LogTimeIso", RRF_RT_REG_DWORD, NULL, &logTimeIso, &bufferSize);
+        bufferSize = sizeof(seriesMemoryMB);
+        RegGetValue(hKey, NULL, "SeriesMemoryMB", RRF_RT_REG_DWORD, NULL, &seriesMemoryMB, &bufferSize);
+        bufferSize = sizeof(probeShards);
+        RegGetValue(hKey, NULL, "ProbeShards", RRF_RT_REG_DWORD, NULL, &probeShards, &bufferSize);
+        bufferSize = sizeof(probeWorkers);
+        RegGetValue(hKey, NULL, "ProbeWorkers", RRF_RT_REG_DWORD, NULL, &probeWorkers, &bufferSize);
+
+        RegCloseKey(hKey);
+    }
+    LoadTargetsFile();
+}
+
+void struct_settings::Save()
+{
+    HKEY hKey;
+    DWORD dwDisposition;
+    if (RegCreateKeyEx(HKEY_CURRENT_USER, "Software\\netavailw", 0, NULL, 0, KEY_WRITE, NULL, &hKey, &dwDisposition) == ERROR_SUCCESS) {
+        RegSetValueEx(hKey, "RemoteIP", 0, REG_SZ, (BYTE*)strRemoteIP.c_str(), strRemoteIP.size() + 1);
+        RegSetValueEx(hKey, "ProbeBackend", 0, REG_SZ, (BYTE*)strProbeBackend.c_str(), strProbeBackend.size() + 1);
+        RegSetValueEx(hKey, "Probes", 0, REG_SZ, (BYTE*)strProbes.c_str(), strProbes.size() + 1);
+        RegSetValueEx(hKey, "TargetsFile", 0, REG_SZ, (BYTE*)strTargetsFile.c_str(), strTargetsFile.size() + 1);
+        RegSetValueEx(hKey, "Collector", 0, REG_SZ, (BYTE*)strCollector.c_str(), strCollector.size() + 1);
+        RegSetValueEx(hKey, "msBadPing", 0, REG_DWORD, (BYTE*)&msBadPing, sizeof(msBadPing));
+        RegSetValueEx(hKey, "msPingTimeout", 0, REG_DWORD, (BYTE*)&msPingTimeout, sizeof(msPingTimeout));
+        RegSetValueEx(hKey, "secsSleep", 0, REG_DWORD, (BYTE*)&secsSleep, sizeof(secsSleep));
+        RegSetValueEx(hKey, "msLogFsync", 0, REG_DWORD, (BYTE*)&msLogFsync, sizeof(msLogFsync));
+        RegSetValueEx(hKey, "mbLogRotate", 0, REG_DWORD, (BYTE*)&mbLogRotate, sizeof(mbLogRotate));
+        RegSetValueEx(hKey, "hoursLogRotate", 0, REG_DWORD, (BYTE*)&hoursLogRotate, sizeof(hoursLogRotate));
+        RegSetValueEx(hKey, "LogFormat", 0, REG_DWORD, (BYTE*)&logFormat, sizeof(logFormat));
+        RegSetValueEx(hKey, "secsLogSummary", 0, REG_DWORD, (BYTE*)&secsLogSummary, sizeof(secsLogSummary));
+        RegSetValueEx(hKey, "MetricsPort", 0, REG_DWORD, (BYTE*)&portMetrics, sizeof(portMetrics));
+        RegSetValueEx(hKey, "msBurstInterval", 0, REG_DWORD, (BYTE*)&msBurstInterval, sizeof(msBurstInterval));
+        RegSetValueEx(hKey, "LogDetail", 0, REG_DWORD, (BYTE*)&logDetail, sizeof(logDetail));
+        RegSetValueEx(hKey, "nEpisodeContext", 0, REG_DWORD, (BYTE*)&nEpisodeContext, sizeof(nEpisodeContext));
+        RegSetValueEx(hKey, "secsRollup", 0, REG_DWORD, (BYTE*)&secsRollup, sizeof(secsRollup));
+        RegSetValueEx(hKey, "msTcpTimeout", 0, REG_DWORD, (BYTE*)&msTcpTimeout, sizeof(msTcpTimeout));
+        RegSetValueEx(hKey, "msBadTcp", 0, REG_DWORD, (BYTE*)&msBadTcp, sizeof(msBadTcp));
+        RegSetValueEx(hKey, "msUdpTimeout", 0, REG_DWORD, (BYTE*)&msUdpTimeout, sizeof(msUdpTimeout));
+        RegSetValueEx(hKey, "msBadUdp", 0, REG_DWORD, (BYTE*)&msBadUdp, sizeof(msBadUdp));
+        RegSetValueEx(hKey, "msDnsTimeout", 0, REG_DWORD, (BYTE*)&msDnsTimeout, sizeof(msDnsTimeout));
+        RegSetValueEx(hKey, "msBadDns", 0, REG_DWORD, (BYTE*)&msBadDns, sizeof(msBadDns));
+        RegSetValueEx(hKey, "secsTraceMin", 0, REG_DWORD, (BYTE*)&secsTraceMin, sizeof(secsTraceMin));
+        RegSetValueEx(hKey, "nTraceHops", 0, REG_DWORD, (BYTE*)&nTraceHops, sizeof(nTraceHops));
+        RegSetValueEx(hKey, "nTraceRounds", 0, REG_DWORD, (BYTE*)&nTraceRounds, sizeof(nTraceRounds));
+        RegSetValueEx(hKey, "nTrainPackets", 0, REG_DWORD, (BYTE*)&nTrainPackets, sizeof(nTrainPackets));
+        RegSetValueEx(hKey, "msTrainSpacing", 0, REG_DWORD, (BYTE*)&msTrainSpacing, sizeof(msTrainSpacing));
+        RegSetValueEx(hKey, "LockStats", 0, REG_DWORD, (BYTE*)&lockStats, sizeof(lockStats));
+        RegSetValueEx(hKey, "LogTimeDigits", 0, REG_DWORD, (BYTE*)&logTimeDigits, sizeof(logTimeDigits));
+        RegSetValueEx(hKey, "LogTimeIso", 0, REG_DWORD, (BYTE*)&logTimeIso, sizeof(logTimeIso));
+        RegSetValueEx(hKey, "SeriesMemoryMB", 0, REG_DWORD, (BYTE*)&seriesMemoryMB, sizeof(seriesMemoryMB));
+        RegSetValueEx(hKey, "ProbeShards", 0, REG_DWORD, (BYTE*)&probeShards, sizeof(probeShards));
+        RegSetValueEx(hKey, "ProbeWorkers", 0, REG_DWORD, (BYTE*)&probeWorkers, sizeof(probeWorkers));
+        
+        RegCloseKey(hKey);
+    }
+}
+#else
+void struct_settings::Load()
+{
+    LoadFromFile(strFile);
+    LoadTargetsFile();
+}
+
+void struct_settings::Save()
+{
+    SaveToFile(strFile);
+}
+#endif
+
+// Trim leading and trailing blanks in place.
+static char* TrimBlanks(char* psz)
+{
+    while (*psz == ' ' || *psz == '\t') {
+        psz++;
+    }
+    size_t cb = strlen(psz);
+    while (cb > 0 && strchr(" \t\r\n", psz[cb - 1])) {
+        psz[--cb] = '\0';
+    }
+    return psz;
+}
+
+// Exit:   Returns true if a name read from a file is that of a setting,
+//         ignoring case as the registry does, so "SecsSleep" is secsSleep.
+static bool IsSettingName(const char* pszName, const char* pszSetting)
+{
+    for (; *pszName && *pszSetting; pszName++, pszSetting++) {
+        if (tolower((unsigned char)*pszName) != tolower((unsigned char)*pszSetting)) {
+            return false;
+        }
+    }
+    return *pszName == *pszSetting;
+}
+
+bool struct_settings::LoadFromFile(const std::string& strPath)
+{
+    FILE* fp = fopen(strPath.c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+    char szLine[2048];
+    while (fgets(szLine, sizeof(szLine), fp)) {
+        char* pszName = TrimBlanks(szLine);
+        char* pEquals = strchr(pszName, '=');
+        if (*pszName == '#' || pEquals == NULL) {
+            continue;
+        }
+        *pEquals = '\0';
+        pszName = TrimBlanks(pszName);
+        char* pszValue = TrimBlanks(pEquals + 1);
+        if (IsSettingName(pszName, "RemoteIP")) {
+            strRemoteIP = pszValue;
+            continue;
+        }
+        if (IsSettingName(pszName, "ProbeBackend")) {
+            strProbeBackend = pszValue;
+            continue;
+        }
+        if (IsSettingName(pszName, "Probes")) {
+            strProbes = pszValue;
+            continue;
+        }
+        if (IsSettingName(pszName, "TargetsFile")) {
+            strTargetsFile = pszValue;
+            continue;
+        }
+        if (IsSettingName(pszName, "Collector")) {
+            strCollector = pszValue;
+            continue;
+        }
+        for (int j = 0; AryIntSettings[j].pszName; j++) {
+            if (IsSettingName(pszName, AryIntSettings[j].pszName)) {
+                this->*AryIntSettings[j].pMember = atoi(pszValue);
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+bool struct_settings::SaveToFile(const std::string& strPath) const
+{
+    FILE* fp = fopen(strPath.c_str(), "w");
+    if (fp == NULL) {
+        return false;
+    }
+    fprintf(fp, "# netavailw settings\n");
+    fprintf(fp, "RemoteIP=%s\n", strRemoteIP.c_str());
+    fprintf(fp, "ProbeBackend=%s\n", strProbeBackend.c_str());
+    fprintf(fp, "Probes=%s\n", strProbes.c_str());
+    fprintf(fp, "TargetsFile=%s\n", strTargetsFile.c_str());
+    fprintf(fp, "Collector=%s\n", strCollector.c_str());
+    for (int j = 0; AryIntSettings[j].pszName; j++) {
+        fprintf(fp, "%s=%d\n", AryIntSettings[j].pszName, this->*AryIntSettings[j].pMember);
+    }
+    fclose(fp);
+    return true;
+}
+
+// The integer settings a target may have of its own.
+static const struct StructTargetIntSetting {
+    const char* pszName;
+    int StructTargetSettings::* pMember;
+    int struct_settings::* pDefault;
+} AryTargetIntSettings[] = {
+    {"secsSleep", &StructTargetSettings::secsSleep, &struct_settings::secsSleep},
+    {"msBadPing", &StructTargetSettings::msBadPing, &struct_settings::msBadPing},
+    {"msPingTimeout", &StructTargetSettings::msPingTimeout, &struct_settings::msPingTimeout},
+    {"nTrainPackets", &StructTargetSettings::nTrainPackets, &struct_settings::nTrainPackets},
+    {NULL, NULL, NULL}
+};
+
+// Get the modification time and size of a file.
+// Exit:   Returns false if it doesn't exist.
+static bool GetFileStamp(const std::string& strPath, int64_t& time, int64_t& cb)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(strPath.c_str(), &st) != 0) {
+#else
+    struct stat st;
+    if (stat(strPath.c_str(), &st) != 0) {
+#endif
+        time = 0;
+        cb = -1;
+        return false;
+    }
+    time = (int64_t)st.st_mtime;
+    cb = (int64_t)st.st_size;
+    return true;
+}
+
+bool struct_settings::LoadTargetsFile()
+{
+    vectTargets.clear();
+    if (strTargetsFile.empty()) {
+        return false;
+    }
+    GetFileStamp(strTargetsFile, timeTargetsFile, cbTargetsFile);
+    FILE* fp = fopen(strTargetsFile.c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+    std::unordered_map<std::string, size_t> mapSeen;
+    StructTargetSettings* pTarget = NULL;
+    char szLine[2048];
+    while (fgets(szLine, sizeof(szLine), fp)) {
+        char* pszName = TrimBlanks(szLine);
+        if (*pszName == '[') {
+            char* pClose = strchr(pszName, ']');
+            if (pClose == NULL) {
+                continue;
+            }
+            *pClose = '\0';
+            std::string strAddress = TrimBlanks(pszName + 1);
+            pTarget = NULL;
+            if (strAddress.empty()) {
+                continue;
+            }
+            std::unordered_map<std::string, size_t>::iterator it = mapSeen.find(strAddress);
+            if (it != mapSeen.end()) {
+                vectTargets[it->second] = StructTargetSettings();
+                vectTargets[it->second].strAddress = strAddress;
+                pTarget = &vectTargets[it->second];
+            } else {
+                mapSeen[strAddress] = vectTargets.size();
+                vectTargets.push_back(StructTargetSettings());
+                pTarget = &vectTargets.back();
+                pTarget->strAddress = strAddress;
+            }
+            continue;
+        }
+        char* pEquals = strchr(pszName, '=');
+        if (*pszName == '#' || *pszName == ';' || pEquals == NULL || pTarget == NULL) {
+            continue;
+        }
+        *pEquals = '\0';
+        pszName = TrimBlanks(pszName);
+        char* pszValue = TrimBlanks(pEquals + 1);
+        if (IsSettingName(pszName, "Probes")) {
+            pTarget->strProbes = pszValue;
+            continue;
+        }
+        for (int j = 0; AryTargetIntSettings[j].pszName; j++) {
+            if (IsSettingName(pszName, AryTargetIntSettings[j].pszName)) {
+                pTarget->*AryTargetIntSettings[j].pMember = atoi(pszValue);
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+bool struct_settings::TargetsFileChanged() const
+{
+    if (strTargetsFile.empty()) {
+        return false;
+    }
+    int64_t time, cb;
+    GetFileStamp(strTargetsFile, time, cb);
+    return time != timeTargetsFile || cb != cbTargetsFile;
+}
+
+const StructTargetSettings* StructSettingsSnapshot::FindTarget(const std::string& strAddress) const
+{
+    std::unordered_map<std::string, size_t>::const_iterator it = mapTargets.find(strAddress);
+    return it != mapTargets.end() ? &vectTargets[it->second] : NULL;
+}
+
+// Append to strOwned the specs of strProbes, a comma-separated list,
+// that no target has claimed yet, and claim them.
+static void ClaimProbes(const std::string& strProbes, std::unordered_set<std::string>& setClaimed,
+    std::string& strOwned)
+{
+    size_t iStart = 0;
+    while (iStart < strProbes.size()) {
+        size_t iEnd = strProbes.find(',', iStart);
+        if (iEnd == std::string::npos) {
+            iEnd = strProbes.size();
+        }
+        size_t iFirst = strProbes.find_first_not_of(' ', iStart);
+        size_t iLast = strProbes.find_last_not_of(' ', iEnd - 1);
+        iStart = iEnd + 1;
+        if (iFirst >= iEnd || iLast == std::string::npos || iLast < iFirst) {
+            continue;
+        }
+        std::string strSpec = strProbes.substr(iFirst, iLast + 1 - iFirst);
+        if (setClaimed.insert(strSpec).second) {
+            strOwned += strOwned.empty() ? strSpec : "," + strSpec;
+        }
+    }
+}
+
+// Make a snapshot of settings, with the targets resolved.  Each service
+// probe goes to one target, which makes it alongside its pings: those of
+// the settings to the first target, and those of a target to the first
+// that lists them.
+static StructSettingsSnapshot* MakeSnapshot(const struct_settings& settings, uint64_t version)
+{
+    StructSettingsSnapshot* pSnapshot = new StructSettingsSnapshot();
+    pSnapshot->version = version;
+    pSnapshot->settings = settings;
+    pSnapshot->vectTargets.swap(pSnapshot->settings.vectTargets);
+    if (pSnapshot->vectTargets.empty()) {
+        StructTargetSettings target;
+        target.strAddress = settings.strRemoteIP;
+        pSnapshot->vectTargets.push_back(target);
+    }
+    std::unordered_set<std::string> setClaimed;
+    for (size_t j = 0; j < pSnapshot->vectTargets.size(); j++) {
+        StructTargetSettings& target = pSnapshot->vectTargets[j];
+        for (int k = 0; AryTargetIntSettings[k].pszName; k++) {
+            if (target.*AryTargetIntSettings[k].pMember < 0) {
+                target.*AryTargetIntSettings[k].pMember = settings.*AryTargetIntSettings[k].pDefault;
+            }
+        }
+        if (target.secsSleep < 1) {
+            target.secsSleep = 1;
+        }
+        std::string strOwned;
+        if (j == 0) {
+            ClaimProbes(settings.strProbes, setClaimed, strOwned);
+        }
+        ClaimProbes(target.strProbes, setClaimed, strOwned);
+        target.strProbes = strOwned;
+        pSnapshot->mapTargets[target.strAddress] = j;
+    }
+    return pSnapshot;
+}
+
+// The latest snapshot.  The pointer to it is never destroyed, so threads
+// still running as the program exits can read it.
+static std::shared_ptr<const StructSettingsSnapshot>& LatestSettings()
+{
+    static std::shared_ptr<const StructSettingsSnapshot>* pLatest =
+        new std::shared_ptr<const StructSettingsSnapshot>(MakeSnapshot(struct_settings(), 0));
+    return *pLatest;
+}
+
+static std::atomic<uint64_t> versionSettingsLatest(0);
+static uint64_t versionSettingsLast = 0;    // touched only by the owner of Settings
+
+void PublishSettings()
+{
+    std::shared_ptr<const StructSettingsSnapshot> pSnapshot(MakeSnapshot(Settings, ++versionSettingsLast));
+    std::atomic_store_explicit(&LatestSettings(), pSnapshot, std::memory_order_release);
+    // After the snapshot, so whoever sees the version gets it or a later one.
+    versionSettingsLatest.store(versionSettingsLast, std::memory_order_release);
+}
+
+std::shared_ptr<const StructSettingsSnapshot> GetSettings()
+{
+    return std::atomic_load_explicit(&LatestSettings(), std::memory_order_acquire);
+}
+
+uint64_t GetSettingsVersion()
+{
+    return versionSettingsLatest.load(std::memory_order_acquire);
+}
@@ -0,0 +1,173 @@
+// Settings.h : User settings for the prober, GUI and daemon.
+// On Windows they are kept in the registry under
+// HKEY_CURRENT_USER\Software\netavailw; elsewhere in a text file of
+// Name=value lines using the same names as the registry values.
+//
+// Settings is the editable copy, owned by the thread that loads and
+// edits it (the dialog's, or netavaild's main thread).  The probe path
+// never reads it: after changing Settings, the owner calls
+// PublishSettings.  Probers look at GetSettingsVersion, a single atomic
+// load, before each ping, and take the latest immutable snapshot from
+// GetSettings only when it has changed, so a ping never waits on a lock
+// or sees a half-made change.
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#define SETTINGS_FILE_DEFAULT   "/etc/netavaild.conf"
+#endif
+
+// Values for struct_settings::logFormat; may be combined.
+#define LOG_FORMAT_CSV      1   // netavailw.csv
+#define LOG_FORMAT_BINARY   2   // netavailw-*.nab segments; see BinLog.h and nalquery
+
+// Values for struct_settings::logDetail.
+#define LOG_DETAIL_PINGS    0   // a "ping" or "error" record for every ping
+#define LOG_DETAIL_EPISODES 1   // "episode" and "rollup" records, and pings only around episodes
+
+// One target of a targets file.  Values of -1 take the setting of the
+// same name for all targets.  Probes are the target's own; in a settings
+// snapshot, the first target also makes the Probes of the settings, and
+// each spec is made by the first target that lists it, so that no
+// service is probed more than once.
+struct StructTargetSettings {
+    std::string strAddress;
+    int         secsSleep = -1;
+    int         msBadPing = -1;
+    int         msPingTimeout = -1;
+    int         nTrainPackets = -1;
+    std::string strProbes;
+};
+
+struct struct_settings {
+    std::string strRemoteIP = "8.8.8.8";
+    int         msBadPing = 400;
+    int         msPingTimeout = 3000;
+    int         secsSleep = 10;
+    // Log writer settings.  These have no UI; set them in the registry
+    // or settings file.
+    int         msLogFsync = 1000;  // fsync cadence; 0 for never
+    int         mbLogRotate = 0;    // rotate netavailw.csv at this size; 0 for never
+    int         hoursLogRotate = 0; // rotate netavailw.csv at this age; 0 for never
+    int         logFormat = LOG_FORMAT_CSV; // LOG_FORMAT_xxx bits
+    int         secsLogSummary = 3600; // log a latency "summary" this often; 0 for never
+    int         portMetrics = 9478; // serve Prometheus metrics on 127.0.0.1:port; 0 for off
+    int         msBurstInterval = 1000; // ping this often while a target has problems; 0 for off
+    int         logDetail = LOG_DETAIL_PINGS; // LOG_DETAIL_xxx
+    int         nEpisodeContext = 5; // pings logged before and after each episode
+    int         secsRollup = 300;   // log a "rollup" this often with LOG_DETAIL_EPISODES
+    std::string strProbeBackend = "icmp"; // or "sim:RULES" for a simulated network; see SimBackend.h
+    // Service probes made alongside each ping, separated by commas, e.g.
+    // "tcp:192.0.2.1:443,dns:192.0.2.53/example.com"; see SocketProbe.h.
+    // Each type has its own timeout and slow threshold.
+    std::string strProbes;
+    int         msTcpTimeout = 3000;
+    int         msBadTcp = 400;
+    int         msUdpTimeout = 3000;
+    int         msBadUdp = 400;
+    int         msDnsTimeout = 3000;
+    int         msBadDns = 400;
+    // Path traces (see PathTrace.h), made when a ping fails or is slow,
+    // at most once every secsTraceMin seconds; 0 for never.
+    int         secsTraceMin = 300;
+    int         nTraceHops = 30;
+    int         nTraceRounds = 3;
+    // Packet trains (see PacketTrain.h): with nTrainPackets of 2 or more,
+    // each ping also sends that many echo requests msTrainSpacing apart,
+    // for loss percentage and jitter.
+    int         nTrainPackets = 0;
+    int         msTrainSpacing = 20;
+    // Lock instrumentation (see CritSec.h): 1 to count contention and
+    // time waits and holds of the named locks.
+    int         lockStats = 0;
+    // Log timestamps: 0, 3 or 6 digits of fractional seconds, and 1 for
+    // ISO 8601 with the UTC offset; see Timestamp.h.
+    int         logTimeDigits = 3;
+    int         logTimeIso = 0;
+    // Memory for the RTT history behind the latency graph, in MB; see
+    // RttSeries.h.  Only read at startup.
+    int         seriesMemoryMB = 64;
+    // Threads that ping for netavaild (see ShardedProber.h): 1 for its
+    // main thread alone, 0 for one per processor.  probeWorkers threads
+    // finish their pings; 0 for one per shard.  Only read at startup.
+    int         probeShards = 1;
+    int         probeWorkers = 0;
+    // Stream every result to a fleet collector (see ResultStream.h and
+    // nalcollect), e.g. "udp:192.0.2.10:9479" or "tcp:192.0.2.10"; "" for
+    // off.  Only read at startup.
+    std::string strCollector;
+
+    // Targets file: an INI file with a [HOST] section for each target,
+    // HOST being an IPv4 or IPv6 address or a name, holding any of
+    // secsSleep, msBadPing, msPingTimeout, nTrainPackets and Probes for
+    // that target.  netavaild pings every target in it instead of
+    // strRemoteIP, and reloads it when it changes.
+    std::string strTargetsFile;
+    std::vector<StructTargetSettings> vectTargets;  // from strTargetsFile; not saved
+    int64_t     timeTargetsFile = 0;    // its modification time and size when loaded
+    int64_t     cbTargetsFile = 0;
+
+#ifndef _WIN32
+    std::string strFile = SETTINGS_FILE_DEFAULT;   // where Load and Save keep the settings
+#endif
+
+    // Load settings from the registry (user-specific) or settings file.
+    // If the values are not present, the settings are not changed.
+    void Load();
+
+    // Save the settings to the registry (user-specific) or settings file.
+    void Save();
+
+    // Read or write a settings file of Name=value lines.  Lines starting
+    // with # are comments; names match ignoring case, and unknown names
+    // are ignored.
+    // Exit:   Returns false if the file can't be opened.
+    bool LoadFromFile(const std::string& strPath);
+    bool SaveToFile(const std::string& strPath) const;
+
+    // Read vectTargets from strTargetsFile; Load does so too.  Lines
+    // starting with # or ; are comments; names match ignoring case, and
+    // unknown names are ignored; a target named twice takes its last
+    // section.
+    // Exit:   Returns false, leaving vectTargets empty, if the file can't
+    //         be opened.
+    bool LoadTargetsFile();
+
+    // Exit:   Returns true if strTargetsFile has been modified, created or
+    //         removed since it was last loaded.
+    bool TargetsFileChanged() const;
+};
+
+extern struct_settings Settings;
+
+// The settings as published to the probe path.  Every target is
+// resolved, with each value filled in, and there is always at least one:
+// strRemoteIP, if the targets file names none.
+struct StructSettingsSnapshot {
+    uint64_t        version;        // 1 for the first published, and so on; 0 for the defaults
+    struct_settings settings;       // without its vectTargets, which are resolved below
+    std::vector<StructTargetSettings> vectTargets;
+    std::unordered_map<std::string, size_t> mapTargets;    // address to index in vectTargets
+
+    // Exit:   Returns the target with this address, or NULL.
+    const StructTargetSettings* FindTarget(const std::string& strAddress) const;
+};
+
+// Publish a snapshot of Settings as it now stands.  A snapshot is freed
+// once the last holder lets go of it, so a prober may hold on to one as
+// long as it likes.
+void PublishSettings();
+
+// Exit:   Returns the latest published snapshot, or one of the default
+//         settings if none has been published yet.  May wait briefly on
+//         the lock that guards the shared pointer.
+std::shared_ptr<const StructSettingsSnapshot> GetSettings();
+
+// Exit:   Returns the version of the latest published snapshot.  Never
+//         blocks, so it can be checked before every ping.
+uint64_t GetSettingsVersion();
@@ -0,0 +1,126 @@
+// ShardedProber.cpp : Pings a large set of targets from several threads.
+// See ShardedProber.h.
+
+#include "ShardedProber.h"
+#include <stdio.h>
+
+StructShardStats ShardStats[PROBE_SHARDS_MAX];
+std::atomic<int> ShardCount(0);
+CWorkPool FinishPool;
+
+// Thread names for the stage timings, which keep the pointer.  Room for
+// "shard " and any int, so that compilers can see it won't truncate.
+static char AryShardNames[PROBE_SHARDS_MAX][24];
+
+CShardedProberSet::CShardedProberSet()
+    : m_bStop(false)
+{
+}
+
+CShardedProberSet::~CShardedProberSet()
+{
+    Close();
+}
+
+bool CShardedProberSet::Open(int nShards, int nWorkers, PFN_PINGED pfnPinged, void* pContext, std::string& strError)
+{
+    Close();
+    if (nShards <= 0) {
+        nShards = (int)std::thread::hardware_concurrency();
+    }
+    if (nShards < 1) {
+        nShards = 1;
+    } else if (nShards > PROBE_SHARDS_MAX) {
+        nShards = PROBE_SHARDS_MAX;
+    }
+    if (nWorkers <= 0) {
+        nWorkers = nShards;
+    }
+
+    // Each shard opens its own backend, so its own socket and identifier.
+    int64_t usNow = ProbeNowMicros();
+    for (int j = 0; j < nShards; j++) {
+        StructShardStats& stats = ShardStats[j];
+        stats.nTargets = 0;
+        stats.nActive = 0;
+        stats.nFinishing = 0;
+        stats.nPings = 0;
+        stats.nSteps = 0;
+        stats.usBusy = 0;
+        stats.usWait = 0;
+        stats.usStarted = usNow;
+        std::unique_ptr<StructShard> pShard(new StructShard);
+        pShard->set.SetShard(j, nShards, &stats);
+        pShard->set.SetFinisher(&FinishPool, j, pfnPinged, pContext);
+        if (!pShard->set.Open(strError)) {
+            m_vectShards.clear();
+            return false;
+        }
+        m_vectShards.push_back(std::move(pShard));
+    }
+
+    FinishPool.Start(nWorkers, "finish");
+    m_bStop = false;
+    for (int j = 0; j < nShards; j++) {
+        snprintf(AryShardNames[j], sizeof(AryShardNames[j]), "shard %d", j);
+        m_vectShards[j]->thread = std::thread(&CShardedProberSet::ThreadMain, this, j);
+    }
+    ShardCount = nShards;
+    return true;
+}
+
+void CShardedProberSet::Close()
+{
+    if (m_vectShards.empty()) {
+        return;
+    }
+    m_bStop = true;
+    for (size_t j = 0; j < m_vectShards.size(); j++) {
+        m_vectShards[j]->thread.join();
+    }
+    // The pool hands probers back to their sets, so it stops first.
+    FinishPool.Stop();
+    ShardCount = 0;
+    m_vectShards.clear();
+}
+
+void CShardedProberSet::ThreadMain(int iShard)
+{
+    SetStageThreadName(AryShardNames[iShard]);
+    CProberSet& set = m_vectShards[iShard]->set;
+    while (!m_bStop) {
+        set.Step(SHARD_POLL_MS);
+    }
+}
+
+std::string FormatShardStats()
+{
+    int nShards = ShardCount.load();
+    if (nShards == 0) {
+        return std::string();
+    }
+    std::string strStats;
+    char szLine[200];
+    int64_t usRun = ProbeNowMicros() - ShardStats[0].usStarted.load(std::memory_order_relaxed);
+    if (usRun < 1) {
+        usRun = 1;
+    }
+    for (int j = 0; j < nShards; j++) {
+        const StructShardStats& stats = ShardStats[j];
+        snprintf(szLine, sizeof(szLine), "shard %d targets=%d pings=%llu active=%d finishing=%d busy=%.1f%%\n", j,
+            stats.nTargets.load(std::memory_order_relaxed),
+            (unsigned long long)stats.nPings.load(std::memory_order_relaxed),
+            stats.nActive.load(std::memory_order_relaxed), stats.nFinishing.load(std::memory_order_relaxed),
+            100.0 * stats.usBusy.load(std::memory_order_relaxed) / usRun);
+        strStats += szLine;
+    }
+    int nWorkers = FinishPool.GetWorkerCount();
+    for (int j = 0; j < nWorkers; j++) {
+        StructWorkerStats stats = FinishPool.GetStats(j);
+        snprintf(szLine, sizeof(szLine), "worker %d tasks=%llu stolen=%llu queued=%d busy=%.1f%%\n", j,
+            (unsigned long long)stats.nTasks, (unsigned long long)stats.nStolen, stats.nQueued,
+            100.0 * stats.usBusy / usRun);
+        strStats += szLine;
+    }
+    return strStats;
+}
@@ -0,0 +1,64 @@
+// ShardedProber.h : Pings a large set of targets from several threads.
+// The targets are split into shards by a hash of their names (see
+// GetShardOfTarget), and each shard is a CProberSet on a thread of its
+// own with a probe backend of its own: its own ICMP socket or handle, so
+// its own echo identifier and sequence numbers, and replies reach the
+// shard that sent the requests without any state shared between shards.
+//
+// Shards ping continuously (see CProberSet::Step) and hand each ping that
+// is done to FinishPool (see WorkPool.h) to be logged and accounted for,
+// so a shard's thread only sends and receives, and workers steal from
+// each other when some shards are busier than others.
+//
+// netavaild runs one when ProbeShards is other than 1; with 1 it steps a
+// single CProberSet from its main thread.  The load of each shard and worker
+// is in ShardStats and FinishPool, for the metrics endpoint and
+// netavaild's SIGUSR1 dump.
+#pragma once
+
+#include "Prober.h"
+#include <thread>
+
+#define PROBE_SHARDS_MAX    64
+#define SHARD_POLL_MS       100     // longest wait of a shard on its backend, so it notices Close
+
+extern StructShardStats ShardStats[PROBE_SHARDS_MAX];
+extern std::atomic<int> ShardCount;     // shards running; 0 if none
+extern CWorkPool FinishPool;            // finishes the shards' pings
+
+class CShardedProberSet
+{
+public:
+    CShardedProberSet();
+    ~CShardedProberSet();
+
+    // Open nShards shards (0 for one per processor, and at most
+    // PROBE_SHARDS_MAX), and start FinishPool with nWorkers workers (0
+    // for one per shard).  pfnPinged, if not NULL, is called with
+    // pContext on a worker after each ping.  Shards sync to new settings
+    // by themselves.  On failure, the error is also logged.
+    bool Open(int nShards, int nWorkers, PFN_PINGED pfnPinged, void* pContext, std::string& strError);
+
+    // Stop the shards, then finish what they handed to the pool.
+    void Close();
+
+    // Exit:   Returns the number of shards, or 0 if not open.
+    int GetShardCount() const { return (int)m_vectShards.size(); }
+
+private:
+    struct StructShard {
+        CProberSet  set;
+        std::thread thread;
+    };
+
+    void ThreadMain(int iShard);
+
+    std::vector<std::unique_ptr<StructShard>> m_vectShards;
+    std::atomic<bool> m_bStop;
+};
+
+// Exit:   Returns a line for each shard and worker, e.g. "shard 0
+//         targets=2500 pings=91230 active=12 finishing=0 busy=3.1%" and
+//         "worker 0 tasks=45012 stolen=310 queued=0 busy=1.2%", or "" if
+//         no shards are running.
+std::string FormatShardStats();
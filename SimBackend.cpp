@@ -0,0 +1,361 @@
+// SimBackend.cpp : Simulated network, as a probe backend.  See SimBackend.h.
+
+#include "SimBackend.h"
+#include "ErrorCodes.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+// FNV-1a hash of an address, to give each target its own generator.
+static uint64_t HashAddress(const char* address)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* p = address; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// splitmix64: small, fast, and the same on every platform, unlike the
+// distributions in <random>.
+static uint64_t NextRandom(uint64_t& rng)
+{
+    uint64_t z = (rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Exit:   Returns a number in [0, 1).
+double CSimProbeBackend::NextUniform(uint64_t& rng)
+{
+    return (NextRandom(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+CSimProbeBackend::CSimProbeBackend()
+{
+    m_seed = 1;
+    m_nOrder = 0;
+    m_seqNext = 1;
+    m_bReportDuplicates = false;
+    m_bWake = false;
+    for (int j = 0; AryErrorCodes[j].ec_num != 0; j++) {
+        m_vectCodes.push_back(AryErrorCodes[j].ec_num);
+    }
+}
+
+// Apply one rule's key=value list to a profile.
+bool CSimProbeBackend::ApplySettings(const std::string& strSettings, StructSimProfile& profile,
+    uint64_t& seed, std::string& strError)
+{
+    size_t iStart = 0;
+    while (iStart < strSettings.size()) {
+        size_t iEnd = strSettings.find(',', iStart);
+        if (iEnd == std::string::npos) {
+            iEnd = strSettings.size();
+        }
+        std::string strItem = strSettings.substr(iStart, iEnd - iStart);
+        iStart = iEnd + 1;
+        if (strItem.empty()) {
+            continue;
+        }
+        size_t iEquals = strItem.find('=');
+        if (iEquals == std::string::npos) {
+            strError = "simulation setting without a value: " + strItem;
+            return false;
+        }
+        std::string strKey = strItem.substr(0, iEquals);
+        const char* pszValue = strItem.c_str() + iEquals + 1;
+        char* pEnd = NULL;
+        double value = strtod(pszValue, &pEnd);
+        bool bNumber = pEnd != pszValue && *pEnd == '\0';
+        bool bProbability = bNumber && value >= 0 && value <= 1;
+
+        if (strKey == "code") {
+            const StructErrorCodes* pEntry = NULL;
+            for (int j = 0; AryErrorCodes[j].ec_num != 0 && pEntry == NULL; j++) {
+                if (strcmp(AryErrorCodes[j].ec_ident, pszValue) == 0) {
+                    pEntry = &AryErrorCodes[j];
+                }
+            }
+            if (pEntry) {
+                profile.errorCode = pEntry->ec_num;
+            } else if (bNumber && value >= 0) {
+                profile.errorCode = (uint32_t)value;
+            } else {
+                strError = std::string("unknown error code: ") + pszValue;
+                return false;
+            }
+        } else if (strKey == "rtt" && bNumber && value >= 0) {
+            profile.msMedian = value;
+        } else if (strKey == "spread" && bNumber && value >= 0) {
+            profile.spread = value;
+        } else if (strKey == "vary" && bNumber && value >= 0) {
+            profile.vary = value;
+        } else if (strKey == "loss" && bProbability) {
+            profile.pLoss = value;
+        } else if (strKey == "error" && bProbability) {
+            profile.pError = value;
+        } else if (strKey == "burst" && bProbability) {
+            profile.pBurst = value;
+        } else if (strKey == "burstlen" && bNumber && value >= 1) {
+            profile.nBurstLen = (int)value;
+        } else if (strKey == "hops" && bNumber && value >= 1 && value <= 255) {
+            profile.nHops = (int)value;
+        } else if (strKey == "dup" && bProbability) {
+            profile.pDup = value;
+        } else if (strKey == "lossfrom" && bNumber && value >= 1) {
+            profile.nLossFrom = (int)value;
+        } else if (strKey == "seed" && bNumber) {
+            seed = (uint64_t)value;
+        } else {
+            strError = "bad simulation setting: " + strItem;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CSimProbeBackend::Configure(const std::string& strRules, std::string& strError)
+{
+    std::vector<StructRule> vectRules;
+    uint64_t seed = m_seed;
+    size_t iStart = 0;
+    while (iStart < strRules.size()) {
+        size_t iEnd = strRules.find(';', iStart);
+        if (iEnd == std::string::npos) {
+            iEnd = strRules.size();
+        }
+        std::string strRule = strRules.substr(iStart, iEnd - iStart);
+        iStart = iEnd + 1;
+        if (strRule.empty()) {
+            continue;
+        }
+        StructRule rule;
+        size_t iColon = strRule.find(':');
+        if (iColon != std::string::npos) {
+            rule.strPrefix = strRule.substr(0, iColon);
+            rule.strSettings = strRule.substr(iColon + 1);
+        } else {
+            rule.strSettings = strRule;
+        }
+        // Check the rule now, so that AddTarget can't fail on it.
+        StructSimProfile profile;
+        if (!ApplySettings(rule.strSettings, profile, seed, strError)) {
+            return false;
+        }
+        vectRules.push_back(rule);
+    }
+    m_vectRules.swap(vectRules);
+    m_seed = seed;
+    return true;
+}
+
+bool CSimProbeBackend::Open(std::string& strError)
+{
+    (void)strError;
+    return true;
+}
+
+void CSimProbeBackend::Close()
+{
+    m_heapPending.clear();
+}
+
+int CSimProbeBackend::AddTarget(const char* address, std::string& strError)
+{
+    if (address == NULL || *address == '\0') {
+        strError = "no address for simulated target";
+        return -1;
+    }
+    StructTarget target;
+    target.bInUse = true;
+    target.nBurstLeft = 0;
+    target.nGeneration = 0;
+    uint32_t idScope;
+    if (!ParseNumericAddress(address, target.addr, idScope)) {
+        target.addr.Clear();
+    }
+    uint64_t seed = m_seed;
+    for (size_t j = 0; j < m_vectRules.size(); j++) {
+        if (strncmp(address, m_vectRules[j].strPrefix.c_str(), m_vectRules[j].strPrefix.size()) == 0) {
+            ApplySettings(m_vectRules[j].strSettings, target.profile, seed, strError);
+        }
+    }
+    target.rng = HashAddress(address) ^ (m_seed * 0x9E3779B97F4A7C15ULL);
+    if (target.profile.vary > 0) {
+        // Log-uniform, so that fast and slow targets are equally likely.
+        double factor = exp((2 * NextUniform(target.rng) - 1) * log(1 + target.profile.vary));
+        target.profile.msMedian *= factor;
+    }
+
+    // Reuse an index freed by RemoveTarget, if there is one.  A prober
+    // set shares one backend among all its targets, each added on its
+    // first ping and again after reloads and re-resolved addresses, so
+    // neither this nor RemoveTarget may search all of them.
+    if (!m_vectFreeTargets.empty()) {
+        int iTarget = m_vectFreeTargets.back();
+        m_vectFreeTargets.pop_back();
+        target.nGeneration = m_vectTargets[iTarget].nGeneration + 1;
+        m_vectTargets[iTarget] = target;
+        return iTarget;
+    }
+    m_vectTargets.push_back(target);
+    return (int)m_vectTargets.size() - 1;
+}
+
+void CSimProbeBackend::RemoveTarget(int iTarget)
+{
+    if (iTarget >= 0 && iTarget < (int)m_vectTargets.size() && m_vectTargets[iTarget].bInUse) {
+        m_vectTargets[iTarget].bInUse = false;
+        m_vectFreeTargets.push_back(iTarget);
+    }
+}
+
+bool CSimProbeBackend::Send(int iTarget, int msTimeout, void* pUser)
+{
+    return SendTtl(iTarget, 0, msTimeout, pUser);
+}
+
+bool CSimProbeBackend::SendTtl(int iTarget, int ttl, int msTimeout, void* pUser)
+{
+    if (m_heapPending.size() >= SIM_MAX_IN_FLIGHT) {
+        return false;
+    }
+    StructTarget& target = m_vectTargets[iTarget];
+    const StructSimProfile& profile = target.profile;
+
+    // Always draw the same numbers, so that a target's outcomes don't
+    // shift when its profile changes which of them are looked at.
+    double uBurst = NextUniform(target.rng);
+    double uLoss = NextUniform(target.rng);
+    double uError = NextUniform(target.rng);
+    double uCode = NextUniform(target.rng);
+    double u1 = NextUniform(target.rng);
+    double u2 = NextUniform(target.rng);
+    double uDup = NextUniform(target.rng);
+
+    // Box-Muller, for the normal deviate behind the log-normal round trip.
+    double z = sqrt(-2 * log(1 - u1)) * cos(6.283185307179586 * u2);
+    int64_t usRtt = (int64_t)(profile.msMedian * 1000 * exp(profile.spread * z));
+    int64_t usTimeout = (int64_t)msTimeout * 1000;
+
+    // The hop where the request ends, and whether it gets as far as the
+    // trouble.
+    int nHop = ttl > 0 && ttl < profile.nHops ? ttl : profile.nHops;
+    bool bReachesTrouble = nHop >= profile.nLossFrom;
+    usRtt = usRtt * nHop / profile.nHops;
+
+    StructPending pending;
+    pending.nOrder = m_nOrder++;
+    pending.nGeneration = target.nGeneration;
+    pending.result.iTarget = iTarget;
+    pending.result.seq = m_seqNext++;
+    pending.result.errorCode = 0;
+    pending.result.usRoundTrip = 0;
+    pending.result.addrFrom.Clear();
+    pending.result.bDuplicate = false;
+    pending.result.pUser = pUser;
+
+    bool bLost = false;
+    if (!bReachesTrouble) {
+        bLost = usRtt >= usTimeout;
+        pending.result.usRoundTrip = usRtt;
+    } else if (target.nBurstLeft > 0) {
+        target.nBurstLeft--;
+        bLost = true;
+    } else if (uBurst < profile.pBurst) {
+        target.nBurstLeft = profile.nBurstLen - 1;
+        bLost = true;
+    } else if (uLoss < profile.pLoss) {
+        bLost = true;
+    } else if (uError < profile.pError && nHop == profile.nHops) {
+        pending.result.errorCode = profile.errorCode ? profile.errorCode
+            : m_vectCodes[(size_t)(uCode * m_vectCodes.size())];
+        bLost = pending.result.errorCode == PROBE_ERR_TIMED_OUT;
+    } else if (usRtt >= usTimeout) {
+        bLost = true;
+    } else {
+        pending.result.usRoundTrip = usRtt;
+    }
+    if (bLost) {
+        pending.result.errorCode = PROBE_ERR_TIMED_OUT;
+        usRtt = usTimeout;
+    } else if (pending.result.errorCode == 0 && nHop < profile.nHops) {
+        pending.result.errorCode = PROBE_ERR_TTL_EXPIRED;
+        if (target.addr.ver == 6) {
+            // 2001:2::HOP, from the IPv6 benchmarking range.
+            uint8_t abHop[16] = { 0x20, 0x01, 0x00, 0x02 };
+            abHop[15] = (uint8_t)nHop;
+            pending.result.addrFrom.SetV6(abHop);
+        } else {
+            pending.result.addrFrom.SetV4(htonl(0xC6120000 | (uint32_t)nHop));
+        }
+    } else if (pending.result.errorCode == 0) {
+        pending.result.addrFrom = target.addr;
+    }
+    pending.usDue = ProbeNowMicros() + usRtt;
+
+    m_heapPending.push_back(pending);
+    std::push_heap(m_heapPending.begin(), m_heapPending.end(), std::greater<StructPending>());
+    if (m_bReportDuplicates && uDup < profile.pDup && pending.result.errorCode == 0) {
+        // The copy trails the original by an eighth of the round trip.
+        pending.nOrder = m_nOrder++;
+        pending.usDue += usRtt / 8;
+        pending.result.usRoundTrip += usRtt / 8;
+        pending.result.bDuplicate = true;
+        m_heapPending.push_back(pending);
+        std::push_heap(m_heapPending.begin(), m_heapPending.end(), std::greater<StructPending>());
+    }
+    return true;
+}
+
+int CSimProbeBackend::Poll(int msWait, PFN_PROBE_DONE pfnDone, void* pContext)
+{
+    int64_t usNow = ProbeNowMicros();
+    if (msWait > 0 && (m_heapPending.empty() || m_heapPending.front().usDue > usNow)) {
+        int64_t usUntil = usNow + (int64_t)msWait * 1000;
+        if (!m_heapPending.empty() && m_heapPending.front().usDue < usUntil) {
+            usUntil = m_heapPending.front().usDue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutexWake);
+        m_condWake.wait_for(lock, std::chrono::microseconds(usUntil - usNow), [this] { return m_bWake; });
+        m_bWake = false;
+        lock.unlock();
+        usNow = ProbeNowMicros();
+    }
+
+    int nDone = 0;
+    while (!m_heapPending.empty() && m_heapPending.front().usDue <= usNow) {
+        std::pop_heap(m_heapPending.begin(), m_heapPending.end(), std::greater<StructPending>());
+        StructProbeResult result = m_heapPending.back().result;
+        uint32_t nGeneration = m_heapPending.back().nGeneration;
+        m_heapPending.pop_back();
+        // Duplicates still to come when their target was removed are
+        // dropped, as the engine drops them.
+        const StructTarget& target = m_vectTargets[result.iTarget];
+        if (result.bDuplicate && (!target.bInUse || target.nGeneration != nGeneration)) {
+            continue;
+        }
+        // The callback may Send again, so the result is off the heap first.
+        pfnDone(result, pContext);
+        nDone++;
+    }
+    return nDone;
+}
+
+void CSimProbeBackend::Wake()
+{
+    std::lock_guard<std::mutex> lock(m_mutexWake);
+    m_bWake = true;
+    m_condWake.notify_one();
+}
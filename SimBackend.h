@@ -0,0 +1,139 @@
+// SimBackend.h : Simulated network, as a probe backend.
+// Stands in for CProbeEngine in load tests and benchmarks (see nalbench),
+// and for trying out logging and alerting without waiting for a real
+// outage.  Each target answers after a round trip drawn from a log-normal
+// distribution, and can lose probes, answer with ICMP errors, or go
+// through outages in which every probe is lost.
+//
+// Outcomes come from a random generator per target, seeded from the
+// backend's seed and the target's address, so a target goes through the
+// same sequence of outcomes on every run, however its probes interleave
+// with those to other targets.  Timing is real: a result is delivered by
+// the first Poll after its round trip, or its timeout, has passed.
+//
+// Behaviour is set by rules of the form [PREFIX:]key=value,key=value...
+// separated by ';'.  A rule applies to targets whose address starts with
+// PREFIX, or to all targets if it has none; later rules override earlier
+// ones.  Keys:
+//   rtt=MS        median round trip (default 20)
+//   spread=S      sigma of the log-normal round trip (default 0.25)
+//   vary=F        scale each target's median by a fixed factor between
+//                 1/(1+F) and 1+F, so that targets differ (default 0)
+//   loss=P        probability a probe gets no answer (default 0)
+//   error=P       probability a probe ends in an ICMP error (default 0)
+//   code=CODE     that error, as an IP_xxx name or number; by default each
+//                 error is drawn from all of AryErrorCodes
+//   burst=P       probability per probe that an outage starts (default 0)
+//   burstlen=N    probes lost in each outage (default 10)
+//   hops=N        routers on the path, counting the target (default 8)
+//   dup=P         probability a reply comes twice; the copy is delivered
+//                 only if ReportDuplicates is on (default 0)
+//   lossfrom=N    first hop where loss, errors and outages happen, for
+//                 path traces; hops before it always answer (default 1)
+//   seed=N        seed of the whole backend, whatever the prefix (default 1)
+// For example "rtt=30,loss=0.01;10.0.2.:rtt=250,spread=0.6,burst=0.001".
+//
+// A request sent with SendTtl whose TTL runs out before the target is
+// answered by hop TTL, from address 198.18.0.TTL (2001:2::TTL for IPv6
+// targets), with IP_TTL_EXPIRED_TRANSIT after a round trip of TTL/hops of
+// the target's.
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ProbeBackend.h"
+
+// Requests that can be outstanding at once.  Far above what the ICMP
+// engine allows, so that load tests are limited by the pipeline rather
+// than the backend.
+#define SIM_MAX_IN_FLIGHT   65536
+
+struct StructSimProfile {
+    double   msMedian = 20;
+    double   spread = 0.25;
+    double   vary = 0;
+    double   pLoss = 0;
+    double   pError = 0;
+    uint32_t errorCode = 0;     // 0 to draw from AryErrorCodes
+    double   pBurst = 0;
+    int      nBurstLen = 10;
+    int      nHops = 8;
+    int      nLossFrom = 1;
+    double   pDup = 0;
+};
+
+class CSimProbeBackend : public CProbeBackend
+{
+public:
+    CSimProbeBackend();
+
+    // Set the rules; see above.  Targets already added keep their
+    // behaviour.
+    // Exit:   Returns false with strError set if the rules don't parse.
+    bool Configure(const std::string& strRules, std::string& strError);
+
+    bool Open(std::string& strError) override;
+    void Close() override;
+
+    // Any non-empty address is accepted.
+    int  AddTarget(const char* address, std::string& strError) override;
+    void RemoveTarget(int iTarget) override;
+
+    // The outcome is decided here; Poll delivers it when it is due.
+    bool Send(int iTarget, int msTimeout, void* pUser) override;
+    bool SendTtl(int iTarget, int ttl, int msTimeout, void* pUser) override;
+    int  Poll(int msWait, PFN_PROBE_DONE pfnDone, void* pContext) override;
+    void Wake() override;
+
+    int  GetInFlight() const override { return (int)m_heapPending.size(); }
+    void ReportDuplicates(bool bReport) override { m_bReportDuplicates = bReport; }
+
+private:
+    struct StructRule {
+        std::string strPrefix;
+        std::string strSettings;
+    };
+
+    struct StructTarget {
+        bool     bInUse;
+        StructSimProfile profile;
+        StructProbeAddr addr;   // unset if the address isn't numeric
+        uint64_t rng;           // splitmix64 state
+        int      nBurstLeft;    // probes still to lose in the current outage
+        uint32_t nGeneration;   // bumped each time the index is reused
+    };
+
+    // A request waiting to be delivered.
+    struct StructPending {
+        int64_t  usDue;
+        uint64_t nOrder;        // breaks ties, so delivery order is stable
+        uint32_t nGeneration;   // of the target when sent
+        StructProbeResult result;
+
+        bool operator>(const StructPending& other) const {
+            return usDue != other.usDue ? usDue > other.usDue : nOrder > other.nOrder;
+        }
+    };
+
+    static bool ApplySettings(const std::string& strSettings, StructSimProfile& profile,
+        uint64_t& seed, std::string& strError);
+    static double NextUniform(uint64_t& rng);
+
+    std::vector<StructRule>   m_vectRules;
+    std::vector<StructTarget> m_vectTargets;
+    std::vector<int>          m_vectFreeTargets;    // indexes freed by RemoveTarget
+    std::vector<StructPending> m_heapPending;   // min-heap by due time
+    std::vector<uint32_t>     m_vectCodes;      // error codes drawn from when code isn't set
+    uint64_t m_seed;
+    uint64_t m_nOrder;
+    uint16_t m_seqNext;
+    bool     m_bReportDuplicates;
+
+    // Poll waits on m_condWake rather than sleeping, so Wake can end it.
+    std::mutex m_mutexWake;
+    std::condition_variable m_condWake;
+    bool     m_bWake;           // guarded by m_mutexWake
+};
@@ -0,0 +1,572 @@
+// SocketProbe.cpp : TCP connect, UDP and DNS probes.  See SocketProbe.h.
+
+#include "SocketProbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+
+#define IP_DEST_NET_UNREACHABLE     11002
+#define IP_DEST_HOST_UNREACHABLE    11003
+#define IP_DEST_PORT_UNREACHABLE    11005
+#define IP_NO_RESOURCES             11006
+#define IP_REQ_TIMED_OUT            11010
+#define IP_GENERAL_FAILURE          11050
+
+#define SOCKET_PROBE_BAD_FD         INVALID_SOCKET
+#define CloseProbeSocket            closesocket
+#define GetProbeSocketError()       WSAGetLastError()
+#define PROBE_EINPROGRESS           WSAEWOULDBLOCK
+#define PROBE_EAGAIN                WSAEWOULDBLOCK
+#define PROBE_ECONNREFUSED          WSAECONNREFUSED
+#define PROBE_ECONNRESET            WSAECONNRESET
+#define PROBE_EHOSTUNREACH          WSAEHOSTUNREACH
+#define PROBE_ENETUNREACH           WSAENETUNREACH
+#define PROBE_ETIMEDOUT             WSAETIMEDOUT
+#define PROBE_EMFILE                WSAEMFILE
+#define PROBE_ENOBUFS               WSAENOBUFS
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+// The Windows IP_xxx status codes; see ProbeEngine.cpp.
+#define IP_DEST_NET_UNREACHABLE     11002
+#define IP_DEST_HOST_UNREACHABLE    11003
+#define IP_DEST_PORT_UNREACHABLE    11005
+#define IP_NO_RESOURCES             11006
+#define IP_REQ_TIMED_OUT            11010
+#define IP_GENERAL_FAILURE          11050
+
+#define SOCKET_PROBE_BAD_FD         (-1)
+#define CloseProbeSocket            close
+#define GetProbeSocketError()       errno
+#define PROBE_EINPROGRESS           EINPROGRESS
+#define PROBE_EAGAIN                EAGAIN
+#define PROBE_ECONNREFUSED          ECONNREFUSED
+#define PROBE_ECONNRESET            ECONNRESET
+#define PROBE_EHOSTUNREACH          EHOSTUNREACH
+#define PROBE_ENETUNREACH           ENETUNREACH
+#define PROBE_ETIMEDOUT             ETIMEDOUT
+#define PROBE_EMFILE                EMFILE
+#define PROBE_ENOBUFS               ENOBUFS
+
+// Events gathered by one epoll_wait.
+#define SOCKET_PROBE_EVENTS         256
+#endif
+
+// Largest datagram read back; anything longer is truncated, which is
+// fine since only the DNS header and question are looked at.
+#define SOCKET_PROBE_RECV_SIZE      1500
+
+static const char* const AryProbeTypeNames[PROBE_NUM_TYPES] = { "icmp", "tcp", "udp", "dns" };
+
+// DNS record types that may be given by name.
+static const struct StructDnsType {
+    const char* pszName;
+    uint16_t    type;
+} AryDnsTypes[] = {
+    {"A", 1}, {"NS", 2}, {"CNAME", 5}, {"SOA", 6}, {"PTR", 12}, {"MX", 15},
+    {"TXT", 16}, {"AAAA", 28}, {NULL, 0}
+};
+
+EnumProbeType GetProbeType(const std::string& strSpec)
+{
+    for (int type = PROBE_TYPE_TCP; type < PROBE_NUM_TYPES; type++) {
+        size_t cb = strlen(AryProbeTypeNames[type]);
+        if (strSpec.compare(0, cb, AryProbeTypeNames[type]) == 0 && strSpec.size() > cb && strSpec[cb] == ':') {
+            return (EnumProbeType)type;
+        }
+    }
+    return PROBE_TYPE_ICMP;
+}
+
+const char* GetProbeTypeName(EnumProbeType type)
+{
+    return type >= 0 && type < PROBE_NUM_TYPES ? AryProbeTypeNames[type] : "?";
+}
+
+// Map a socket error to the nearest IP_xxx code.
+static uint32_t SocketErrorToCode(int err)
+{
+    switch (err) {
+    case PROBE_ECONNREFUSED:
+    case PROBE_ECONNRESET:  return IP_DEST_PORT_UNREACHABLE;
+    case PROBE_EHOSTUNREACH: return IP_DEST_HOST_UNREACHABLE;
+    case PROBE_ENETUNREACH: return IP_DEST_NET_UNREACHABLE;
+    case PROBE_ETIMEDOUT:   return IP_REQ_TIMED_OUT;
+    case PROBE_EMFILE:
+    case PROBE_ENOBUFS:     return IP_NO_RESOURCES;
+    }
+    return IP_GENERAL_FAILURE;
+}
+
+// Build the question of a DNS query for a name and type: the 12-byte
+// header with a zero ID, then the question section.
+// Exit:   Returns false if the name isn't a valid domain name.
+static bool BuildDnsQuery(const std::string& strName, uint16_t type, std::string& strQuery)
+{
+    static const unsigned char AryHeader[12] = { 0, 0, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };  // RD, QDCOUNT=1
+    strQuery.assign((const char*)AryHeader, sizeof(AryHeader));
+    size_t iStart = 0;
+    while (iStart < strName.size()) {
+        size_t iDot = strName.find('.', iStart);
+        if (iDot == std::string::npos) {
+            iDot = strName.size();
+        }
+        size_t cbLabel = iDot - iStart;
+        if (cbLabel == 0 || cbLabel > 63) {
+            return false;
+        }
+        strQuery += (char)cbLabel;
+        strQuery.append(strName, iStart, cbLabel);
+        iStart = iDot + 1;
+    }
+    strQuery += '\0';
+    if (strQuery.size() - sizeof(AryHeader) > 255) {
+        return false;
+    }
+    strQuery += (char)(type >> 8);
+    strQuery += (char)(type & 0xFF);
+    strQuery += '\0';
+    strQuery += '\1';       // class IN
+    return true;
+}
+
+// Parse "HOST:PORT" into addr.  The port may be left out if portDefault
+// isn't 0.
+static bool ParseHostPort(const std::string& strHostPort, uint16_t portDefault, sockaddr_in& addr)
+{
+    std::string strHost = strHostPort;
+    long port = portDefault;
+    size_t iColon = strHostPort.find(':');
+    if (iColon != std::string::npos) {
+        strHost = strHostPort.substr(0, iColon);
+        char* pEnd = NULL;
+        port = strtol(strHostPort.c_str() + iColon + 1, &pEnd, 10);
+        if (*pEnd != '\0') {
+            return false;
+        }
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    return port > 0 && port < 65536 && inet_pton(AF_INET, strHost.c_str(), &addr.sin_addr) == 1;
+}
+
+bool CSocketProbeEngine::ParseTarget(const char* spec, StructTarget& target, std::string& strError)
+{
+    std::string strSpec = spec;
+    target.bInUse = true;
+    target.type = GetProbeType(strSpec);
+    if (target.type == PROBE_TYPE_ICMP) {
+        strError = std::string("not a tcp:, udp: or dns: probe: ") + spec;
+        return false;
+    }
+    std::string strRest = strSpec.substr(strlen(AryProbeTypeNames[target.type]) + 1);
+    std::string strHostPort = strRest.substr(0, strRest.find('/'));
+    std::string strRequest = strRest.size() > strHostPort.size() ? strRest.substr(strHostPort.size() + 1) : "";
+    uint16_t portDefault = target.type == PROBE_TYPE_DNS ? 53 : 0;
+    if (!ParseHostPort(strHostPort, portDefault, target.addr)) {
+        strError = std::string("bad address in probe: ") + spec;
+        return false;
+    }
+
+    switch (target.type) {
+    case PROBE_TYPE_TCP:
+        if (!strRequest.empty()) {
+            strError = std::string("tcp probes take no payload: ") + spec;
+            return false;
+        }
+        break;
+    case PROBE_TYPE_UDP:
+        target.strRequest = strRequest.empty() ? "netavail" : strRequest;
+        break;
+    case PROBE_TYPE_DNS: {
+        std::string strName = strRequest.substr(0, strRequest.find('/'));
+        std::string strType = strRequest.size() > strName.size() ? strRequest.substr(strName.size() + 1) : "A";
+        uint16_t type = (uint16_t)atoi(strType.c_str());
+        for (int j = 0; AryDnsTypes[j].pszName && type == 0; j++) {
+            if (strType == AryDnsTypes[j].pszName) {
+                type = AryDnsTypes[j].type;
+            }
+        }
+        if (type == 0 || !BuildDnsQuery(strName, type, target.strRequest)) {
+            strError = std::string("bad DNS query in probe: ") + spec;
+            return false;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return true;
+}
+
+CSocketProbeEngine::CSocketProbeEngine()
+{
+    m_seqNext = 1;
+    m_idSalt = 0;
+    m_nInFlight = 0;
+    m_bOpen = false;
+#ifndef _WIN32
+    m_epfd = -1;
+#endif
+}
+
+CSocketProbeEngine::~CSocketProbeEngine()
+{
+    Close();
+}
+
+bool CSocketProbeEngine::Open(std::string& strError)
+{
+    if (m_bOpen) {
+        return true;
+    }
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        strError = "WSAStartup failed.";
+        return false;
+    }
+#else
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0) {
+        strError = std::string("epoll_create1: ") + strerror(errno);
+        return false;
+    }
+    // Every request in flight holds a descriptor.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < SOCKET_PROBE_MAX_IN_FLIGHT + 256) {
+        limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, SOCKET_PROBE_MAX_IN_FLIGHT + 256);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+    m_vectSlots.assign(SOCKET_PROBE_MAX_IN_FLIGHT, StructSlot());
+    for (size_t j = 0; j < m_vectSlots.size(); j++) {
+        m_vectSlots[j].bInUse = false;
+        m_vectSlots[j].sock = SOCKET_PROBE_BAD_FD;
+    }
+    m_idSalt = (uint16_t)std::random_device()();
+    m_bOpen = true;
+    return true;
+}
+
+void CSocketProbeEngine::Close()
+{
+    if (!m_bOpen) {
+        return;
+    }
+    for (size_t j = 0; j < m_vectSlots.size(); j++) {
+        if (m_vectSlots[j].bInUse) {
+            CloseProbeSocket(m_vectSlots[j].sock);
+        }
+    }
+    m_vectSlots.clear();
+    m_vectDone.clear();
+    m_heapDeadlines.clear();
+    m_nInFlight = 0;
+#ifdef _WIN32
+    WSACleanup();
+#else
+    close(m_epfd);
+    m_epfd = -1;
+#endif
+    m_bOpen = false;
+}
+
+int CSocketProbeEngine::AddTarget(const char* address, std::string& strError)
+{
+    StructTarget target;
+    if (!ParseTarget(address, target, strError)) {
+        return -1;
+    }
+
+    // Reuse an index freed by RemoveTarget, if there is one.
+    if (!m_vectFreeTargets.empty()) {
+        int iTarget = m_vectFreeTargets.back();
+        m_vectFreeTargets.pop_back();
+        m_vectTargets[iTarget] = target;
+        return iTarget;
+    }
+    m_vectTargets.push_back(target);
+    return (int)m_vectTargets.size() - 1;
+}
+
+void CSocketProbeEngine::RemoveTarget(int iTarget)
+{
+    if (iTarget >= 0 && iTarget < (int)m_vectTargets.size() && m_vectTargets[iTarget].bInUse) {
+        m_vectTargets[iTarget].bInUse = false;
+        m_vectFreeTargets.push_back(iTarget);
+    }
+}
+
+// Find a free slot and assign it the next sequence number.
+// Exit:   Returns the slot, or NULL if all slots are busy.
+CSocketProbeEngine::StructSlot* CSocketProbeEngine::AllocSlot()
+{
+    if (m_nInFlight >= SOCKET_PROBE_MAX_IN_FLIGHT) {
+        return NULL;
+    }
+    for (int j = 0; j < SOCKET_PROBE_MAX_IN_FLIGHT; j++) {
+        uint16_t seq = m_seqNext++;
+        StructSlot* pSlot = &m_vectSlots[seq & (SOCKET_PROBE_MAX_IN_FLIGHT - 1)];
+        if (!pSlot->bInUse) {
+            pSlot->bInUse = true;
+            pSlot->seq = seq;
+            pSlot->sock = SOCKET_PROBE_BAD_FD;
+            m_nInFlight++;
+            return pSlot;
+        }
+    }
+    return NULL;
+}
+
+// Record the completion of a request, close its socket and free its
+// slot.  The result is handed to the caller's callback by the next
+// DispatchDone.
+void CSocketProbeEngine::Complete(StructSlot* pSlot, uint32_t errorCode, int64_t usRoundTrip)
+{
+    StructProbeResult result;
+    result.iTarget = pSlot->iTarget;
+    result.seq = pSlot->seq;
+    result.errorCode = errorCode;
+    result.usRoundTrip = usRoundTrip;
+    result.addrFrom.SetV4(errorCode == 0 ? m_vectTargets[pSlot->iTarget].addr.sin_addr.s_addr : 0);
+    result.bDuplicate = false;
+    result.pUser = pSlot->pUser;
+    m_vectDone.push_back(result);
+
+    // Closing also takes the socket out of the epoll set.
+    if (pSlot->sock != SOCKET_PROBE_BAD_FD) {
+        CloseProbeSocket(pSlot->sock);
+        pSlot->sock = SOCKET_PROBE_BAD_FD;
+    }
+    pSlot->bInUse = false;
+    m_nInFlight--;
+}
+
+int CSocketProbeEngine::DispatchDone(PFN_PROBE_DONE pfnDone, void* pContext)
+{
+    int nDone = (int)m_vectDone.size();
+    for (int j = 0; j < nDone; j++) {
+        pfnDone(m_vectDone[j], pContext);
+    }
+    m_vectDone.clear();
+    return nDone;
+}
+
+bool CSocketProbeEngine::Send(int iTarget, int msTimeout, void* pUser)
+{
+    StructSlot* pSlot = AllocSlot();
+    if (pSlot == NULL) {
+        return false;
+    }
+    const StructTarget& target = m_vectTargets[iTarget];
+    pSlot->iTarget = iTarget;
+    pSlot->pUser = pUser;
+    pSlot->usSent = ProbeNowMicros();
+    pSlot->usDeadline = pSlot->usSent + (int64_t)msTimeout * 1000;
+    pSlot->idDns = pSlot->seq ^ m_idSalt;
+
+    bool bTcp = target.type == PROBE_TYPE_TCP;
+#ifdef _WIN32
+    pSlot->sock = socket(AF_INET, bTcp ? SOCK_STREAM : SOCK_DGRAM, bTcp ? IPPROTO_TCP : IPPROTO_UDP);
+    if (pSlot->sock != SOCKET_PROBE_BAD_FD) {
+        u_long bNonBlocking = 1;
+        ioctlsocket(pSlot->sock, FIONBIO, &bNonBlocking);
+    }
+#else
+    pSlot->sock = socket(AF_INET, (bTcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#endif
+    if (pSlot->sock == SOCKET_PROBE_BAD_FD) {
+        Complete(pSlot, SocketErrorToCode(GetProbeSocketError()), 0);
+        return true;
+    }
+    if (bTcp) {
+        // Reset rather than close the connection once it's made, so that
+        // probing doesn't leave sockets in TIME_WAIT on either side.
+        linger lingerReset;
+        lingerReset.l_onoff = 1;
+        lingerReset.l_linger = 0;
+        setsockopt(pSlot->sock, SOL_SOCKET, SO_LINGER, (const char*)&lingerReset, sizeof(lingerReset));
+    }
+
+    // A connected UDP socket hears about ICMP port unreachable replies.
+    if (connect(pSlot->sock, (const sockaddr*)&target.addr, sizeof(target.addr)) != 0) {
+        int err = GetProbeSocketError();
+        if (!bTcp || err != PROBE_EINPROGRESS) {
+            Complete(pSlot, SocketErrorToCode(err), 0);
+            return true;
+        }
+    } else if (bTcp) {
+        // Connected at once, as can happen on loopback.
+        Complete(pSlot, 0, ProbeNowMicros() - pSlot->usSent);
+        return true;
+    }
+
+    if (!bTcp) {
+        std::string strRequest = target.strRequest;
+        if (target.type == PROBE_TYPE_DNS) {
+            strRequest[0] = (char)(pSlot->idDns >> 8);
+            strRequest[1] = (char)(pSlot->idDns & 0xFF);
+        }
+        if (send(pSlot->sock, strRequest.data(), (int)strRequest.size(), 0) < 0) {
+            Complete(pSlot, SocketErrorToCode(GetProbeSocketError()), 0);
+            return true;
+        }
+    }
+
+#ifndef _WIN32
+    epoll_event event;
+    event.events = bTcp ? EPOLLOUT : EPOLLIN;
+    event.data.u32 = pSlot->seq;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, pSlot->sock, &event) != 0) {
+        Complete(pSlot, IP_NO_RESOURCES, 0);
+        return true;
+    }
+#endif
+    m_heapDeadlines.push_back(std::make_pair(-pSlot->usDeadline, pSlot->seq));
+    std::push_heap(m_heapDeadlines.begin(), m_heapDeadlines.end());
+    return true;
+}
+
+// A request's socket is writable (TCP) or readable (UDP and DNS): see
+// whether it has finished.
+void CSocketProbeEngine::HandleReady(StructSlot* pSlot, int64_t usNow)
+{
+    const StructTarget& target = m_vectTargets[pSlot->iTarget];
+    if (target.type == PROBE_TYPE_TCP) {
+        int err = 0;
+        socklen_t cbErr = sizeof(err);
+        getsockopt(pSlot->sock, SOL_SOCKET, SO_ERROR, (char*)&err, &cbErr);
+        Complete(pSlot, err ? SocketErrorToCode(err) : 0, usNow - pSlot->usSent);
+        return;
+    }
+
+    unsigned char buf[SOCKET_PROBE_RECV_SIZE];
+    for (;;) {
+        int cb = (int)recv(pSlot->sock, (char*)buf, sizeof(buf), 0);
+        if (cb < 0) {
+            int err = GetProbeSocketError();
+            if (err != PROBE_EAGAIN) {
+                Complete(pSlot, SocketErrorToCode(err), 0);
+            }
+            return;
+        }
+        if (target.type == PROBE_TYPE_UDP) {
+            Complete(pSlot, 0, usNow - pSlot->usSent);
+            return;
+        }
+
+        // A DNS reply must match our ID and echo our question; anything
+        // else is ignored.
+        size_t cbQuestion = target.strRequest.size() - 12;
+        if ((size_t)cb < 12 + cbQuestion || (buf[2] & 0x80) == 0 ||
+            ((buf[0] << 8) | buf[1]) != pSlot->idDns ||
+            memcmp(buf + 12, target.strRequest.data() + 12, cbQuestion) != 0) {
+            continue;
+        }
+        uint32_t errorCode = 0;
+        switch (buf[3] & 0x0F) {
+        case 0:                 // NOERROR
+        case 3:                 // NXDOMAIN: the server answered
+            break;
+        case 2:
+            errorCode = PROBE_ERR_DNS_SERVFAIL;
+            break;
+        case 5:
+            errorCode = PROBE_ERR_DNS_REFUSED;
+            break;
+        default:
+            errorCode = PROBE_ERR_DNS_ERROR;
+            break;
+        }
+        Complete(pSlot, errorCode, errorCode ? 0 : usNow - pSlot->usSent);
+        return;
+    }
+}
+
+void CSocketProbeEngine::ExpireTimeouts(int64_t usNow)
+{
+    while (!m_heapDeadlines.empty() && -m_heapDeadlines.front().first <= usNow) {
+        int64_t usDeadline = -m_heapDeadlines.front().first;
+        uint16_t seq = m_heapDeadlines.front().second;
+        std::pop_heap(m_heapDeadlines.begin(), m_heapDeadlines.end());
+        m_heapDeadlines.pop_back();
+
+        StructSlot* pSlot = &m_vectSlots[seq & (SOCKET_PROBE_MAX_IN_FLIGHT - 1)];
+        if (pSlot->bInUse && pSlot->seq == seq && pSlot->usDeadline == usDeadline) {
+            Complete(pSlot, IP_REQ_TIMED_OUT, 0);
+        }
+    }
+}
+
+int CSocketProbeEngine::Poll(int msWait, PFN_PROBE_DONE pfnDone, void* pContext)
+{
+    ExpireTimeouts(ProbeNowMicros());
+
+    if (m_vectDone.empty() && m_bOpen) {
+        // Don't sleep past the earliest deadline.
+        int msTimeout = msWait;
+        if (!m_heapDeadlines.empty()) {
+            int64_t usUntil = -m_heapDeadlines.front().first - ProbeNowMicros();
+            int msUntil = usUntil <= 0 ? 0 : (int)((usUntil + 999) / 1000);
+            msTimeout = std::min(msTimeout, msUntil);
+        }
+#ifdef _WIN32
+        // WSAPoll takes the whole set each time; fine for the hundreds of
+        // requests a Windows desktop would have in flight.
+        std::vector<WSAPOLLFD> vectFds;
+        std::vector<uint16_t> vectSeqs;
+        for (size_t j = 0; j < m_vectSlots.size(); j++) {
+            const StructSlot& slot = m_vectSlots[j];
+            if (slot.bInUse) {
+                WSAPOLLFD fd;
+                fd.fd = slot.sock;
+                fd.events = m_vectTargets[slot.iTarget].type == PROBE_TYPE_TCP ? POLLWRNORM : POLLRDNORM;
+                fd.revents = 0;
+                vectFds.push_back(fd);
+                vectSeqs.push_back(slot.seq);
+            }
+        }
+        int nEvents = 0;
+        if (vectFds.empty()) {
+            Sleep(msTimeout);
+        } else {
+            nEvents = WSAPoll(&vectFds[0], (ULONG)vectFds.size(), msTimeout);
+        }
+        int64_t usNow = ProbeNowMicros();
+        for (size_t j = 0; j < vectFds.size() && nEvents > 0; j++) {
+            if (vectFds[j].revents != 0) {
+                StructSlot* pSlot = &m_vectSlots[vectSeqs[j] & (SOCKET_PROBE_MAX_IN_FLIGHT - 1)];
+                if (pSlot->bInUse && pSlot->seq == vectSeqs[j]) {
+                    HandleReady(pSlot, usNow);
+                }
+            }
+        }
+#else
+        epoll_event events[SOCKET_PROBE_EVENTS];
+        int nEvents = epoll_wait(m_epfd, events, SOCKET_PROBE_EVENTS, msTimeout);
+        int64_t usNow = ProbeNowMicros();
+        for (int j = 0; j < nEvents; j++) {
+            uint16_t seq = (uint16_t)events[j].data.u32;
+            StructSlot* pSlot = &m_vectSlots[seq & (SOCKET_PROBE_MAX_IN_FLIGHT - 1)];
+            if (pSlot->bInUse && pSlot->seq == seq) {
+                HandleReady(pSlot, usNow);
+            }
+        }
+#endif
+        ExpireTimeouts(ProbeNowMicros());
+    }
+    return DispatchDone(pfnDone, pContext);
+}
@@ -0,0 +1,126 @@
+// SocketProbe.h : TCP connect, UDP and DNS probes, as a probe backend.
+// ICMP is often rate-limited or deprioritized by routers and upstreams,
+// and says nothing about whether a service answers.  These probes time
+// what a client would see instead:
+//   tcp:HOST:PORT              connect time (SYN to SYN-ACK, plus our
+//                              scheduling); the connection is then reset
+//   udp:HOST:PORT[/PAYLOAD]    time from sending PAYLOAD (default
+//                              "netavail") to the first datagram back
+//   dns:HOST[:PORT]/NAME[/TYPE] time to answer a recursive query for NAME
+//                              (TYPE A by default; AAAA, NS, MX, TXT,
+//                              SOA, CNAME, PTR or a number)
+// HOST is a dotted IPv4 address.  Every request gets its own non-blocking
+// socket; on Linux they are watched with epoll, on Windows with WSAPoll,
+// so thousands of requests can be in flight from one thread.
+//
+// Failures are reported with the IP_xxx codes of the ICMP engine where
+// one fits: a refused connection or an ICMP port unreachable is
+// IP_DEST_PORT_UNREACHABLE, and no answer in time is IP_REQ_TIMED_OUT.
+// A DNS answer of SERVFAIL or REFUSED is DNS_SERVFAIL or DNS_REFUSED, and
+// other errors but NXDOMAIN are DNS_ERROR; NXDOMAIN is an answer.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ProbeBackend.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET SOCKET_PROBE_FD;
+#else
+#include <netinet/in.h>
+typedef int SOCKET_PROBE_FD;
+#endif
+
+// Maximum number of requests outstanding at once; each holds a socket.
+// Must be a power of 2 that divides 65536, so that sequence numbers map
+// onto slots without collisions.  Open raises the open file limit to
+// make room for them if it can.
+#define SOCKET_PROBE_MAX_IN_FLIGHT  4096
+
+// DNS answers with these RCODEs (RFC 1035 4.1.1) are failures.
+#define PROBE_ERR_DNS_SERVFAIL      11060
+#define PROBE_ERR_DNS_REFUSED       11061
+#define PROBE_ERR_DNS_ERROR         11062
+
+enum EnumProbeType {
+    PROBE_TYPE_ICMP,
+    PROBE_TYPE_TCP,
+    PROBE_TYPE_UDP,
+    PROBE_TYPE_DNS,
+    PROBE_NUM_TYPES
+};
+
+// Exit:   Returns the type of probe a target spec asks for, from its
+//         prefix; PROBE_TYPE_ICMP if it has none.
+EnumProbeType GetProbeType(const std::string& strSpec);
+
+// Exit:   Returns the short name of a probe type, "icmp", "tcp", "udp" or
+//         "dns", as used in target specs.
+const char* GetProbeTypeName(EnumProbeType type);
+
+class CSocketProbeEngine : public CProbeBackend
+{
+public:
+    CSocketProbeEngine();
+    ~CSocketProbeEngine();
+
+    bool Open(std::string& strError) override;
+    void Close() override;
+
+    // Register a target given as a tcp:, udp: or dns: spec; see above.
+    int  AddTarget(const char* address, std::string& strError) override;
+    void RemoveTarget(int iTarget) override;
+
+    bool Send(int iTarget, int msTimeout, void* pUser) override;
+    int  Poll(int msWait, PFN_PROBE_DONE pfnDone, void* pContext) override;
+
+    int  GetInFlight() const override { return m_nInFlight; }
+
+private:
+    struct StructTarget {
+        bool        bInUse;
+        EnumProbeType type;
+        sockaddr_in addr;
+        std::string strRequest;     // UDP payload, or DNS query without its ID
+    };
+
+    // One outstanding request.  Slots are indexed by seq modulo
+    // SOCKET_PROBE_MAX_IN_FLIGHT.
+    struct StructSlot {
+        bool      bInUse;
+        uint16_t  seq;
+        int       iTarget;
+        void*     pUser;
+        SOCKET_PROBE_FD sock;
+        uint16_t  idDns;        // ID of the DNS query
+        int64_t   usSent;       // monotonic send time
+        int64_t   usDeadline;   // monotonic time at which the request times out
+    };
+
+    StructSlot* AllocSlot();
+    void Complete(StructSlot* pSlot, uint32_t errorCode, int64_t usRoundTrip);
+    int  DispatchDone(PFN_PROBE_DONE pfnDone, void* pContext);
+    void HandleReady(StructSlot* pSlot, int64_t usNow);
+    void ExpireTimeouts(int64_t usNow);
+    static bool ParseTarget(const char* spec, StructTarget& target, std::string& strError);
+
+    std::vector<StructTarget> m_vectTargets;
+    std::vector<int>          m_vectFreeTargets;    // indexes freed by RemoveTarget
+    std::vector<StructSlot>   m_vectSlots;
+    std::vector<StructProbeResult> m_vectDone;  // completed, not yet dispatched
+    uint16_t m_seqNext;
+    uint16_t m_idSalt;          // mixed into DNS IDs, so they aren't guessable from seq
+    int      m_nInFlight;
+    bool     m_bOpen;
+
+    // Min-heap of (deadline, seq), used to time out requests.  Entries
+    // whose request already completed are discarded when they surface.
+    std::vector<std::pair<int64_t, uint16_t> > m_heapDeadlines;
+
+#ifndef _WIN32
+    int      m_epfd;
+#endif
+};
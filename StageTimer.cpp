@@ -0,0 +1,261 @@
+// StageTimer.cpp : Timing of the stages of the probe loop.  See StageTimer.h.
+
+#include "StageTimer.h"
+#include "CritSec.h"
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+
+#define STAGE_THREADS_MAX   64      // threads with a ring at one time
+
+static const char* AryStageNames[STAGE_COUNT] = {
+    "ping.start",
+    "ping.wait",
+    "ping.finish",
+    "backend.poll",
+    "stats.record",
+    "problem.add",
+    "log.format",
+    "log.localip",
+    "log.write",
+    "log.fsync",
+    "ui.update",
+    "ui.problems",
+};
+
+// One span, as two words so that a reader racing with the owner sees
+// each whole: the start, and the duration shifted past the stage.
+struct StructStageSpan {
+    std::atomic<int64_t> usStart{0};
+    std::atomic<int64_t> durStage{0};
+};
+
+// A thread's spans.  Only the owner writes; nWritten counts every span
+// ever written, so a reader can tell which it copied were overwritten.
+struct StructStageRing {
+    std::atomic<bool> bInUse{false};
+    std::atomic<const char*> pszName{NULL};
+    std::atomic<uint64_t> nWritten{0};
+    StructStageSpan arySpans[STAGE_RING_SIZE];
+};
+
+static StructStageStats AryStageStats[STAGE_COUNT];
+
+// Rings are taken under the registry lock and never go away; a ring a
+// thread leaves behind is taken by the next new thread.
+static StructStageRing* AryStageRings[STAGE_THREADS_MAX];
+static std::atomic<int> nStageRings(0);
+
+// Gives the calling thread's ring back when the thread ends.
+class CStageRingHolder
+{
+public:
+    CStageRingHolder() : m_pRing(NULL), m_bTried(false) {}
+    ~CStageRingHolder() {
+        if (m_pRing) {
+            m_pRing->pszName.store(NULL, std::memory_order_relaxed);
+            m_pRing->bInUse.store(false, std::memory_order_release);
+        }
+    }
+
+    // Exit:   Returns the thread's ring, taking one on first use, or NULL
+    //         if every ring is taken.
+    StructStageRing* Get() {
+        if (!m_bTried) {
+            m_bTried = true;
+            m_pRing = TakeRing();
+        }
+        return m_pRing;
+    }
+
+private:
+    static StructStageRing* TakeRing();
+
+    StructStageRing* m_pRing;
+    bool m_bTried;
+};
+
+StructStageRing* CStageRingHolder::TakeRing()
+{
+    static CCritSec critRegistry;
+    CCritSecInScope lock(critRegistry);
+    int nRings = nStageRings.load(std::memory_order_relaxed);
+    for (int j = 0; j < nRings; j++) {
+        bool bFree = false;
+        if (AryStageRings[j]->bInUse.compare_exchange_strong(bFree, true, std::memory_order_acquire)) {
+            return AryStageRings[j];
+        }
+    }
+    if (nRings == STAGE_THREADS_MAX) {
+        return NULL;
+    }
+    StructStageRing* pRing = new StructStageRing;
+    pRing->bInUse.store(true, std::memory_order_relaxed);
+    AryStageRings[nRings] = pRing;
+    nStageRings.store(nRings + 1, std::memory_order_release);
+    return pRing;
+}
+
+static thread_local CStageRingHolder StageRingHolder;
+
+const char* GetStageName(int stage)
+{
+    return stage >= 0 && stage < STAGE_COUNT ? AryStageNames[stage] : "unknown";
+}
+
+int64_t StageNowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Exit:   Returns the histogram bucket for a time in us.
+static int GetStageBucket(int64_t us)
+{
+    int iBucket = 0;
+    while (iBucket < STAGE_HIST_BUCKETS - 1 && us >= ((int64_t)1 << iBucket)) {
+        iBucket++;
+    }
+    return iBucket;
+}
+
+void RecordStage(int stage, int64_t usStart, int64_t usDuration)
+{
+    StructStageStats& stats = AryStageStats[stage];
+    stats.nSpans.fetch_add(1, std::memory_order_relaxed);
+    stats.usTotal.fetch_add(usDuration, std::memory_order_relaxed);
+    stats.aryBuckets[GetStageBucket(usDuration)].fetch_add(1, std::memory_order_relaxed);
+    if (usDuration > stats.usMax.load(std::memory_order_relaxed)) {
+        stats.usMax.store(usDuration, std::memory_order_relaxed);
+    }
+
+    StructStageRing* pRing = StageRingHolder.Get();
+    if (pRing == NULL) {
+        return;
+    }
+    uint64_t iSpan = pRing->nWritten.load(std::memory_order_relaxed);
+    StructStageSpan& span = pRing->arySpans[iSpan & (STAGE_RING_SIZE - 1)];
+    // A reader that sees the new words also sees the count from before
+    // them, and so knows the slot was being written over.
+    std::atomic_thread_fence(std::memory_order_release);
+    span.usStart.store(usStart, std::memory_order_relaxed);
+    span.durStage.store((usDuration << 8) | stage, std::memory_order_relaxed);
+    pRing->nWritten.store(iSpan + 1, std::memory_order_release);
+}
+
+void SetStageThreadName(const char* pszName)
+{
+    StructStageRing* pRing = StageRingHolder.Get();
+    if (pRing) {
+        pRing->pszName.store(pszName, std::memory_order_relaxed);
+    }
+}
+
+const StructStageStats& GetStageStats(int stage)
+{
+    return AryStageStats[stage];
+}
+
+// Format the upper bound of the bucket where a share q of the spans is
+// reached, in ms.
+static void FormatStageQuantile(const StructStageStats& stats, uint64_t nSpans, double q, char* szBuf, size_t cbBuf)
+{
+    uint64_t nWanted = (uint64_t)(q * nSpans);
+    uint64_t nCumulative = 0;
+    int iBucket = 0;
+    for (; iBucket < STAGE_HIST_BUCKETS - 1; iBucket++) {
+        nCumulative += stats.aryBuckets[iBucket].load(std::memory_order_relaxed);
+        if (nCumulative > nWanted) {
+            break;
+        }
+    }
+    int64_t usLimit = GetStageBucketLimit(iBucket);
+    if (usLimit < 0) {
+        snprintf(szBuf, cbBuf, ">=%.3f", (double)((int64_t)1 << (STAGE_HIST_BUCKETS - 2)) / 1000);
+    } else {
+        snprintf(szBuf, cbBuf, "<%.3f", (double)usLimit / 1000);
+    }
+}
+
+std::string FormatStageStats()
+{
+    std::string strOut;
+#if !NAL_STAGE_TIMERS
+    strOut = "stage timers are compiled out; build with NAL_STAGE_TIMERS=ON\n";
+#endif
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const StructStageStats& stats = AryStageStats[stage];
+        uint64_t nSpans = stats.nSpans.load(std::memory_order_relaxed);
+        if (nSpans == 0) {
+            continue;
+        }
+        double msAvg = stats.usTotal.load(std::memory_order_relaxed) / 1000.0 / nSpans;
+        char szP50[32], szP99[32];
+        FormatStageQuantile(stats, nSpans, 0.5, szP50, sizeof(szP50));
+        FormatStageQuantile(stats, nSpans, 0.99, szP99, sizeof(szP99));
+        char szLine[200];
+        snprintf(szLine, sizeof(szLine), "%s n=%llu avg=%.3f p50%s p99%s max=%.3f\n", AryStageNames[stage],
+            (unsigned long long)nSpans, msAvg, szP50, szP99, stats.usMax.load(std::memory_order_relaxed) / 1000.0);
+        strOut += szLine;
+    }
+    return strOut;
+}
+
+bool WriteStageTrace(const std::string& strPath, std::string& strError)
+{
+    FILE* fp = fopen(strPath.c_str(), "w");
+    if (fp == NULL) {
+        strError = "Cannot write " + strPath;
+        return false;
+    }
+    fputs("{\"traceEvents\":[", fp);
+    bool bFirst = true;
+    std::vector<int64_t> vectStart, vectDurStage;
+    int nRings = nStageRings.load(std::memory_order_acquire);
+    for (int j = 0; j < nRings; j++) {
+        StructStageRing* pRing = AryStageRings[j];
+        int tid = j + 1;
+        const char* pszName = pRing->pszName.load(std::memory_order_relaxed);
+        char szName[32];
+        if (pszName == NULL) {
+            snprintf(szName, sizeof(szName), "thread %d", tid);
+            pszName = szName;
+        }
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            bFirst ? "" : ",", tid, pszName);
+        bFirst = false;
+
+        // Copy, then keep only the spans the owner can't have overwritten
+        // since the count was read, nor be overwriting now.
+        uint64_t nEnd = pRing->nWritten.load(std::memory_order_acquire);
+        uint64_t nBegin = nEnd > STAGE_RING_SIZE ? nEnd - STAGE_RING_SIZE : 0;
+        vectStart.clear();
+        vectDurStage.clear();
+        for (uint64_t i = nBegin; i < nEnd; i++) {
+            const StructStageSpan& span = pRing->arySpans[i & (STAGE_RING_SIZE - 1)];
+            vectStart.push_back(span.usStart.load(std::memory_order_relaxed));
+            vectDurStage.push_back(span.durStage.load(std::memory_order_relaxed));
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t nNow = pRing->nWritten.load(std::memory_order_relaxed);
+        uint64_t nValid = nNow + 1 > STAGE_RING_SIZE ? nNow + 1 - STAGE_RING_SIZE : 0;
+        for (uint64_t i = nBegin; i < nEnd; i++) {
+            if (i < nValid) {
+                continue;
+            }
+            int64_t durStage = vectDurStage[(size_t)(i - nBegin)];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"netavail\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d}",
+                GetStageName((int)(durStage & 0xFF)), (long long)vectStart[(size_t)(i - nBegin)],
+                (long long)(durStage >> 8), tid);
+        }
+    }
+    fputs("\n]}\n", fp);
+    bool bOk = !ferror(fp);
+    if (fclose(fp) != 0) {
+        bOk = false;
+    }
+    if (!bOk) {
+        strError = "Cannot write " + strPath;
+    }
+    return bOk;
+}
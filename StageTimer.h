@@ -0,0 +1,106 @@
+// StageTimer.h : Timing of the stages of the probe loop, to tell where an
+// iteration spends its time.  STAGE_SCOPE(stage) times the rest of the
+// enclosing scope.  Each thread records its spans into a ring of its own,
+// the latest STAGE_RING_SIZE of them, with no locking; each stage also
+// keeps a histogram of its durations.  FormatStageStats gives the figures
+// for the diagnostics view and the stats dumps, the metrics endpoint
+// reports them, and WriteStageTrace exports the rings as Chrome trace
+// events, to be opened in chrome://tracing or Perfetto, so a slow
+// iteration can be seen on a timeline.
+//
+// Built with NAL_STAGE_TIMERS=0 (cmake -DNAL_STAGE_TIMERS=OFF),
+// STAGE_SCOPE expands to nothing, so the probe loop carries no cost, and
+// the figures are empty.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#ifndef NAL_STAGE_TIMERS
+#define NAL_STAGE_TIMERS    1
+#endif
+
+#define STAGE_RING_SIZE     4096    // spans kept per thread; a power of two
+#define STAGE_HIST_BUCKETS  24      // bucket k: under 2^k us; the last takes the rest
+
+enum EnumStage {
+    STAGE_PING_START,       // CProber::StartPing: settings, service probes, train, send
+    STAGE_PING_WAIT,        // CProber::PollPing: waiting for the reply
+    STAGE_PING_FINISH,      // CProber::FinishPing: statistics, problems, log records
+    STAGE_BACKEND_POLL,     // CProberSet::Ping: one wait on the shared backend
+    STAGE_STATS_RECORD,     // LatencyStats.Record
+    STAGE_PROBLEM_ADD,      // ProblemStore.Add
+    STAGE_LOG_FORMAT,       // FormatLogRecord
+    STAGE_LOCAL_IP,         // the local IP lookup inside FormatLogRecord
+    STAGE_LOG_WRITE,        // the log writer's write of a batch
+    STAGE_LOG_FSYNC,        // the log writer's fsync
+    STAGE_UI_UPDATE,        // netavailw: status and statistics controls
+    STAGE_UI_PROBLEMS,      // netavailw: filling the problems list
+    STAGE_COUNT
+};
+
+// The figures for one stage.  Times are in microseconds.
+struct StructStageStats {
+    std::atomic<uint64_t> nSpans{0};
+    std::atomic<uint64_t> usTotal{0};
+    std::atomic<int64_t>  usMax{0};
+    std::atomic<uint64_t> aryBuckets[STAGE_HIST_BUCKETS] = {};
+};
+
+// Exit:   Returns a stage's name, e.g. "ping.wait".
+const char* GetStageName(int stage);
+
+// Exit:   Returns the upper bound of a histogram bucket, in us, or -1 for
+//         the last.
+inline int64_t GetStageBucketLimit(int iBucket)
+{
+    return iBucket < STAGE_HIST_BUCKETS - 1 ? (int64_t)1 << iBucket : -1;
+}
+
+// Exit:   Returns the steady clock in microseconds.
+int64_t StageNowMicros();
+
+// Record a span of a stage from the calling thread.
+void RecordStage(int stage, int64_t usStart, int64_t usDuration);
+
+// Name the calling thread in trace exports, e.g. "probe".  Threads not
+// named show as "thread N".
+void SetStageThreadName(const char* pszName);
+
+// The figures of a stage.  Safe from any thread; read without locking.
+const StructStageStats& GetStageStats(int stage);
+
+// Exit:   Returns one line per stage that has run, e.g. "ping.wait
+//         n=120 avg=11.204 p50<16.384 p99<32.768 max=23.117", times in ms,
+//         quantiles as histogram buckets; or a note if timers are
+//         compiled out.
+std::string FormatStageStats();
+
+// Write the spans in every thread's ring to a file as Chrome trace-event
+// JSON.  Spans overwritten while they are being copied are left out.
+// Exit:   Returns false with strError set if the file can't be written.
+bool WriteStageTrace(const std::string& strPath, std::string& strError);
+
+// Times from its creation until the end of its scope.
+class CStageScope
+{
+public:
+    explicit CStageScope(int stage) : m_stage(stage), m_usStart(StageNowMicros()) {}
+    ~CStageScope() { RecordStage(m_stage, m_usStart, StageNowMicros() - m_usStart); }
+
+private:
+    CStageScope(const CStageScope&) = delete;
+    CStageScope& operator=(const CStageScope&) = delete;
+
+    int     m_stage;
+    int64_t m_usStart;
+};
+
+#define STAGE_CONCAT2(a, b)     a##b
+#define STAGE_CONCAT(a, b)      STAGE_CONCAT2(a, b)
+#if NAL_STAGE_TIMERS
+#define STAGE_SCOPE(stage)      CStageScope STAGE_CONCAT(stageScope, __LINE__)(stage)
+#else
+#define STAGE_SCOPE(stage)
+#endif
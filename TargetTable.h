@@ -0,0 +1,65 @@
+// TargetTable.h : Table of per-target records that grows without moving.
+// Records are reached through a fixed directory of chunks, each of
+// TARGET_TABLE_CHUNK pointers.  A chunk is allocated when the first
+// record that needs it is added, and neither chunks nor records ever
+// move, so readers index the table without a lock while a writer adds
+// to it.
+//
+// Add is for one thread at a time (the owner's lock); the record must be
+// fully built before it is added, and Add publishes it.  Readers look no
+// further than GetCount.  The table doesn't own the records.
+#pragma once
+
+#include <atomic>
+
+#define TARGET_TABLE_CHUNK      1024
+#define TARGET_TABLE_CHUNKS     1024    // so up to about a million records
+
+template <typename T>
+class CTargetTable
+{
+public:
+    CTargetTable()
+        : m_nCount(0)
+    {
+        for (int j = 0; j < TARGET_TABLE_CHUNKS; j++) {
+            m_aryChunks[j] = NULL;
+        }
+    }
+
+    ~CTargetTable()
+    {
+        for (int j = 0; j < TARGET_TABLE_CHUNKS; j++) {
+            delete[] m_aryChunks[j];
+        }
+    }
+
+    // Exit:   Returns the number of records.  Safe from any thread.
+    int GetCount() const { return m_nCount.load(std::memory_order_acquire); }
+
+    // The record at index i, which must be below GetCount.
+    T* Get(int i) const { return m_aryChunks[i / TARGET_TABLE_CHUNK][i % TARGET_TABLE_CHUNK]; }
+
+    // Exit:   Returns the index of the record, or -1 if the table is full.
+    int Add(T* pRecord)
+    {
+        int n = m_nCount.load(std::memory_order_relaxed);
+        if (n == TARGET_TABLE_CHUNK * TARGET_TABLE_CHUNKS) {
+            return -1;
+        }
+        T**& pChunk = m_aryChunks[n / TARGET_TABLE_CHUNK];
+        if (pChunk == NULL) {
+            pChunk = new T*[TARGET_TABLE_CHUNK];
+        }
+        pChunk[n % TARGET_TABLE_CHUNK] = pRecord;
+        m_nCount.store(n + 1, std::memory_order_release);
+        return n;
+    }
+
+private:
+    CTargetTable(const CTargetTable&) = delete;
+    CTargetTable& operator=(const CTargetTable&) = delete;
+
+    T** m_aryChunks[TARGET_TABLE_CHUNKS];
+    std::atomic<int> m_nCount;
+};
@@ -0,0 +1,133 @@
+// TimerWheel.cpp : Hashed timer wheel for scheduling probes.
+
+#include "TimerWheel.h"
+
+CTimerWheel::CTimerWheel(int msTick, int nSlots)
+    : m_msTick(msTick > 0 ? msTick : 1), m_nSlots(nSlots > 0 ? nSlots : 1), m_tickNext(INT64_MIN),
+      m_vectHeads(m_nSlots, -1), m_iFree(-1), m_nTimers(0)
+{
+}
+
+// Put a timer in the slot for its deadline.  A deadline already passed
+// goes in the slot Expire will look at next.
+void CTimerWheel::Link(int id)
+{
+    StructTimer& timer = m_vectTimers[id];
+    int64_t tick = timer.msDue / m_msTick;
+    if (m_tickNext != INT64_MIN && tick < m_tickNext) {
+        tick = m_tickNext;
+    }
+    timer.iSlot = (int)(tick % m_nSlots);
+    timer.prev = -1;
+    timer.next = m_vectHeads[timer.iSlot];
+    if (timer.next >= 0) {
+        m_vectTimers[timer.next].prev = id;
+    }
+    m_vectHeads[timer.iSlot] = id;
+}
+
+void CTimerWheel::Unlink(int id)
+{
+    StructTimer& timer = m_vectTimers[id];
+    if (timer.prev >= 0) {
+        m_vectTimers[timer.prev].next = timer.next;
+    } else {
+        m_vectHeads[timer.iSlot] = timer.next;
+    }
+    if (timer.next >= 0) {
+        m_vectTimers[timer.next].prev = timer.prev;
+    }
+}
+
+int CTimerWheel::Add(int64_t msDue)
+{
+    int id;
+    if (m_iFree >= 0) {
+        id = m_iFree;
+        m_iFree = m_vectTimers[id].next;
+    } else {
+        id = (int)m_vectTimers.size();
+        m_vectTimers.push_back(StructTimer());
+    }
+    m_vectTimers[id].msDue = msDue < 0 ? 0 : msDue;
+    Link(id);
+    m_nTimers++;
+    return id;
+}
+
+void CTimerWheel::Remove(int id)
+{
+    if (id < 0 || id >= (int)m_vectTimers.size() || m_vectTimers[id].iSlot < 0) {
+        return;
+    }
+    Unlink(id);
+    m_vectTimers[id].iSlot = -1;
+    m_vectTimers[id].next = m_iFree;
+    m_iFree = id;
+    m_nTimers--;
+}
+
+void CTimerWheel::Reschedule(int id, int64_t msDue)
+{
+    Unlink(id);
+    m_vectTimers[id].msDue = msDue < 0 ? 0 : msDue;
+    Link(id);
+}
+
+int64_t CTimerWheel::GetNextDue() const
+{
+    if (m_nTimers == 0) {
+        return INT64_MAX;
+    }
+    // Walk the slots from the current tick; the first slot holding a
+    // timer due within this revolution holds the earliest deadline.
+    int64_t tickStart = m_tickNext;
+    if (tickStart == INT64_MIN) {
+        int64_t msMin = INT64_MAX;
+        for (int id = 0; id < (int)m_vectTimers.size(); id++) {
+            if (m_vectTimers[id].iSlot >= 0 && m_vectTimers[id].msDue < msMin) {
+                msMin = m_vectTimers[id].msDue;
+            }
+        }
+        return msMin;
+    }
+    int64_t msMin = INT64_MAX;
+    for (int k = 0; k < m_nSlots; k++) {
+        int64_t msSlotEnd = (tickStart + k + 1) * m_msTick;
+        for (int id = m_vectHeads[(tickStart + k) % m_nSlots]; id >= 0; id = m_vectTimers[id].next) {
+            if (m_vectTimers[id].msDue < msMin) {
+                msMin = m_vectTimers[id].msDue;
+            }
+        }
+        if (msMin < msSlotEnd) {
+            return msMin;
+        }
+    }
+    // Everything is more than a revolution away; msMin is the earliest.
+    return msMin;
+}
+
+void CTimerWheel::Expire(int64_t msNow, std::vector<int>& vectDue)
+{
+    int64_t tickNow = msNow / m_msTick;
+    int64_t tickFirst = m_tickNext;
+    if (tickFirst == INT64_MIN || tickNow - tickFirst >= m_nSlots) {
+        tickFirst = tickNow - m_nSlots + 1;
+    }
+    if (tickFirst < 0) {
+        tickFirst = 0;
+    }
+    for (int64_t tick = tickFirst; tick <= tickNow; tick++) {
+        int id = m_vectHeads[tick % m_nSlots];
+        while (id >= 0) {
+            int idNext = m_vectTimers[id].next;
+            if (m_vectTimers[id].msDue <= msNow) {
+                vectDue.push_back(id);
+            }
+            id = idNext;
+        }
+    }
+    // The current tick may still hold timers due later within it, so
+    // Expire starts from it next time.
+    m_tickNext = tickNow;
+}
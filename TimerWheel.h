@@ -0,0 +1,59 @@
+// TimerWheel.h : Hashed timer wheel for scheduling probes on absolute
+// deadlines.
+//
+// Time is divided into ticks of msTick; the wheel has nSlots slots, and a
+// timer due at time t sits in slot (t / msTick) % nSlots, in a doubly
+// linked list threaded through the timer table.  Adding, moving and
+// removing a timer is O(1) and allocation-free once the table has grown
+// to the number of timers in use.  Expire visits only the slots for the
+// ticks that have passed; a timer more than one revolution away just
+// stays in its slot until its time comes round.
+//
+// Times are in ms on any monotonic clock.  Not thread-safe; each probe
+// loop owns its wheel.
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+class CTimerWheel
+{
+public:
+    CTimerWheel(int msTick = 10, int nSlots = 1024);
+
+    // Exit:   Returns the id of a new timer due at msDue.
+    int Add(int64_t msDue);
+    void Remove(int id);
+
+    // Move a timer to a new deadline.
+    void Reschedule(int id, int64_t msDue);
+
+    int64_t GetDue(int id) const { return m_vectTimers[id].msDue; }
+
+    // Exit:   Returns the earliest deadline of any timer, or INT64_MAX if
+    //         there are none.
+    int64_t GetNextDue() const;
+
+    // Append the ids of timers due at or before msNow to vectDue.  They
+    // stay scheduled; the caller reschedules or removes them.
+    void Expire(int64_t msNow, std::vector<int>& vectDue);
+
+private:
+    struct StructTimer {
+        int64_t msDue;
+        int     iSlot;          // -1 if free
+        int     next;           // links within the slot, or the free list
+        int     prev;
+    };
+
+    void Link(int id);
+    void Unlink(int id);
+
+    int64_t m_msTick;
+    int     m_nSlots;
+    int64_t m_tickNext;         // first tick Expire has not finished with
+    std::vector<int> m_vectHeads;
+    std::vector<StructTimer> m_vectTimers;
+    int     m_iFree;
+    int     m_nTimers;
+};
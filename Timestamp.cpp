@@ -0,0 +1,102 @@
+// Timestamp.cpp : Wall-clock timestamps.  See Timestamp.h.
+
+#include "Timestamp.h"
+#include "Settings.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+
+int64_t GetWallMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Howard Hinnant's days_from_civil.
+int64_t DaysFromCivil(int year, int month, int day)
+{
+    int64_t y = month <= 2 ? year - 1 : year;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+CTimeFormatter::CTimeFormatter(int nDigits, bool bIso8601)
+{
+    m_nDigits = -1;
+    m_bIso8601 = false;
+    m_secCached = INT64_MIN;
+    m_szPrefix[0] = '\0';
+    m_szOffset[0] = '\0';
+    SetFormat(nDigits, bIso8601);
+}
+
+void CTimeFormatter::SetFormat(int nDigits, bool bIso8601)
+{
+    nDigits = nDigits <= 0 ? 0 : nDigits <= 3 ? 3 : 6;
+    if (nDigits != m_nDigits || bIso8601 != m_bIso8601) {
+        m_nDigits = nDigits;
+        m_bIso8601 = bIso8601;
+        m_secCached = INT64_MIN;
+    }
+}
+
+size_t CTimeFormatter::Format(int64_t usWall, char* szBuf, size_t cbBuf)
+{
+    int64_t sec = usWall >= 0 ? usWall / 1000000 : -((-usWall + 999999) / 1000000);
+    int64_t usFrac = usWall - sec * 1000000;
+    if (sec != m_secCached) {
+        time_t t = (time_t)sec;
+        tm mytm;
+#ifdef _WIN32
+        localtime_s(&mytm, &t);
+#else
+        localtime_r(&t, &mytm);
+#endif
+        snprintf(m_szPrefix, sizeof(m_szPrefix), "%04d-%02d-%02d%c%02d:%02d:%02d", mytm.tm_year + 1900,
+            mytm.tm_mon + 1, mytm.tm_mday, m_bIso8601 ? 'T' : ' ', mytm.tm_hour, mytm.tm_min, mytm.tm_sec);
+        m_szOffset[0] = '\0';
+        if (m_bIso8601) {
+            // The offset is how far the local fields are from UTC.
+            int64_t secLocal = DaysFromCivil(mytm.tm_year + 1900, mytm.tm_mon + 1, mytm.tm_mday) * 86400 +
+                mytm.tm_hour * 3600 + mytm.tm_min * 60 + mytm.tm_sec;
+            int minOffset = (int)((secLocal - sec) / 60);
+            int minAbs = minOffset < 0 ? -minOffset : minOffset;
+            snprintf(m_szOffset, sizeof(m_szOffset), "%c%02d:%02d", minOffset < 0 ? '-' : '+', minAbs / 60,
+                minAbs % 60);
+        }
+        m_secCached = sec;
+    }
+
+    char szFrac[16] = "";
+    if (m_nDigits == 3) {
+        snprintf(szFrac, sizeof(szFrac), ".%03d", (int)(usFrac / 1000));
+    } else if (m_nDigits == 6) {
+        snprintf(szFrac, sizeof(szFrac), ".%06d", (int)usFrac);
+    }
+    int cb = snprintf(szBuf, cbBuf, "%s%s%s", m_szPrefix, szFrac, m_szOffset);
+    return cb < 0 ? 0 : (size_t)cb < cbBuf ? (size_t)cb : cbBuf - 1;
+}
+
+size_t FormatTimestamp(int64_t usWall, char* szBuf, size_t cbBuf)
+{
+    static thread_local CTimeFormatter formatter;
+    // Each thread holds on to a snapshot until a newer one is published.
+    static thread_local std::shared_ptr<const StructSettingsSnapshot> pSnapshot;
+    if (!pSnapshot || pSnapshot->version != GetSettingsVersion()) {
+        pSnapshot = GetSettings();
+    }
+    const struct_settings& settings = pSnapshot->settings;
+    formatter.SetFormat(settings.logTimeDigits, settings.logTimeIso != 0);
+    return formatter.Format(usWall, szBuf, cbBuf);
+}
+
+std::string FormatTimestamp(int64_t usWall)
+{
+    char szBuf[TIMESTAMP_MAX];
+    size_t cb = FormatTimestamp(usWall, szBuf, sizeof(szBuf));
+    return std::string(szBuf, cb);
+}
@@ -0,0 +1,52 @@
+// Timestamp.h : Wall-clock timestamps for log records and displays.
+// A probe event takes one timestamp, as microseconds since 1970 UTC,
+// and every record and line about it is stamped from that, so they all
+// agree even when they straddle a second boundary.
+//
+// CTimeFormatter turns timestamps into local time as
+// "YYYY-MM-DD HH:MM:SS.fff", with 0, 3 or 6 fractional digits, or as
+// ISO 8601 with the UTC offset, "YYYY-MM-DDTHH:MM:SS.fff+01:00".  The
+// date and time up to the second, and the offset, are worked out once
+// per second and cached, so most timestamps cost only the fraction.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#define TIMESTAMP_MAX   40      // longest formatted timestamp, with its '\0'
+
+// Exit:   Returns the wall-clock time in microseconds since 1970 UTC.
+int64_t GetWallMicros();
+
+// Exit:   Returns the days from 1970-01-01 to a date in the proleptic
+//         Gregorian calendar, negative before it.
+int64_t DaysFromCivil(int year, int month, int day);
+
+// Formats timestamps.  Not thread-safe; give each thread its own, or
+// use FormatTimestamp.
+class CTimeFormatter
+{
+public:
+    CTimeFormatter(int nDigits = 3, bool bIso8601 = false);
+
+    // nDigits is 0, 3 or 6; other values are taken to the next of those.
+    void SetFormat(int nDigits, bool bIso8601);
+
+    // Format a timestamp into szBuf, which should hold TIMESTAMP_MAX.
+    // Exit:   Returns the length, without the '\0'.
+    size_t Format(int64_t usWall, char* szBuf, size_t cbBuf);
+
+private:
+    int         m_nDigits;
+    bool        m_bIso8601;
+    int64_t     m_secCached;        // second that m_szPrefix is for, or INT64_MIN
+    char        m_szPrefix[64];     // "YYYY-MM-DD HH:MM:SS"
+    char        m_szOffset[16];     // "+HH:MM", or "" unless ISO 8601
+};
+
+// Format a timestamp in the log's format (the LogTimeDigits and
+// LogTimeIso settings), with a formatter kept per thread.
+// Exit:   Returns the length, without the '\0'.
+size_t FormatTimestamp(int64_t usWall, char* szBuf, size_t cbBuf);
+std::string FormatTimestamp(int64_t usWall);
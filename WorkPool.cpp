@@ -0,0 +1,223 @@
+// WorkPool.cpp : Pool of threads for short tasks, balanced by work
+// stealing.  See WorkPool.h.
+
+#include "WorkPool.h"
+#include "StageTimer.h"
+#include <stdio.h>
+
+CWorkPool::CWorkPool()
+    : m_nWorkers(0), m_nStarted(0), m_bStop(false), m_nParked(0)
+{
+}
+
+CWorkPool::~CWorkPool()
+{
+    Stop();
+}
+
+void CWorkPool::Start(int nWorkers, const char* pszName)
+{
+    Stop();
+    if (nWorkers < 1) {
+        nWorkers = 1;
+    } else if (nWorkers > WORKPOOL_MAX_WORKERS) {
+        nWorkers = WORKPOOL_MAX_WORKERS;
+    }
+    m_bStop = false;
+    for (int j = 0; j < nWorkers; j++) {
+        StructWorker& worker = m_aryWorkers[j];
+        worker.nTasks = 0;
+        worker.nStolen = 0;
+        worker.usBusy = 0;
+        snprintf(worker.szName, sizeof(worker.szName), "%s %d", pszName, j);
+    }
+    m_nStarted = nWorkers;
+    m_nWorkers.store(nWorkers, std::memory_order_release);
+    for (int j = 0; j < nWorkers; j++) {
+        m_aryWorkers[j].thread = std::thread(&CWorkPool::ThreadMain, this, j);
+    }
+}
+
+void CWorkPool::Stop()
+{
+    if (m_nStarted == 0) {
+        return;
+    }
+    // Workers only leave once every queue is empty.
+    m_bStop = true;
+    {
+        std::lock_guard<std::mutex> lock(m_mutexPark);
+        m_condWork.notify_all();
+    }
+    for (int j = 0; j < m_nStarted; j++) {
+        m_aryWorkers[j].thread.join();
+    }
+    m_nWorkers.store(0, std::memory_order_release);
+    m_nStarted = 0;
+}
+
+void CWorkPool::Submit(int iWorker, PFN_WORK pfn, void* pArg)
+{
+    int nWorkers = GetWorkerCount();
+    if (nWorkers == 0) {
+        pfn(pArg, 0);
+        return;
+    }
+    StructWorker& worker = m_aryWorkers[iWorker % nWorkers];
+    StructTask task = {pfn, pArg};
+    {
+        CCritSecInScope lock(worker.crit);
+        worker.queue.push_back(task);
+        worker.nQueued.store((int)worker.queue.size());
+    }
+    WakeParked();
+}
+
+StructWorkerStats CWorkPool::GetStats(int iWorker) const
+{
+    const StructWorker& worker = m_aryWorkers[iWorker];
+    StructWorkerStats stats;
+    stats.nTasks = worker.nTasks.load(std::memory_order_relaxed);
+    stats.nStolen = worker.nStolen.load(std::memory_order_relaxed);
+    stats.usBusy = worker.usBusy.load(std::memory_order_relaxed);
+    stats.nQueued = worker.nQueued.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// Take the oldest task of a worker's own queue, so that tasks submitted
+// together finish in about the order they came.
+bool CWorkPool::TakeOwn(int iWorker, StructTask& task)
+{
+    StructWorker& worker = m_aryWorkers[iWorker];
+    if (worker.nQueued.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    CCritSecInScope lock(worker.crit);
+    if (worker.queue.empty()) {
+        return false;
+    }
+    task = worker.queue.front();
+    worker.queue.pop_front();
+    worker.nQueued.store((int)worker.queue.size(), std::memory_order_relaxed);
+    return true;
+}
+
+// Steal the newer half of the fullest other queue: one task to run now,
+// the rest onto our own queue, so a thief needn't come back for each.
+bool CWorkPool::Steal(int iWorker, StructTask& task)
+{
+    int iVictim = -1;
+    int nMost = 0;
+    for (int j = 1; j < m_nStarted; j++) {
+        int k = (iWorker + j) % m_nStarted;
+        int nQueued = m_aryWorkers[k].nQueued.load(std::memory_order_relaxed);
+        if (nQueued > nMost) {
+            nMost = nQueued;
+            iVictim = k;
+        }
+    }
+    if (iVictim < 0) {
+        return false;
+    }
+
+    StructTask aryTaken[256];
+    int nTaken = 0;
+    {
+        StructWorker& victim = m_aryWorkers[iVictim];
+        CCritSecInScope lock(victim.crit);
+        size_t nTake = (victim.queue.size() + 1) / 2;
+        if (nTake > sizeof(aryTaken) / sizeof(aryTaken[0])) {
+            nTake = sizeof(aryTaken) / sizeof(aryTaken[0]);
+        }
+        while ((size_t)nTaken < nTake) {
+            aryTaken[nTaken++] = victim.queue.back();
+            victim.queue.pop_back();
+        }
+        victim.nQueued.store((int)victim.queue.size(), std::memory_order_relaxed);
+    }
+    if (nTaken == 0) {
+        return false;
+    }
+
+    // The oldest of those taken runs first; the others keep their order.
+    task = aryTaken[nTaken - 1];
+    StructWorker& worker = m_aryWorkers[iWorker];
+    if (nTaken > 1) {
+        CCritSecInScope lock(worker.crit);
+        for (int j = nTaken - 2; j >= 0; j--) {
+            worker.queue.push_back(aryTaken[j]);
+        }
+        worker.nQueued.store((int)worker.queue.size());
+    }
+    worker.nStolen.fetch_add(nTaken, std::memory_order_relaxed);
+    if (nTaken > 1) {
+        // The rest may in turn be stolen by a worker that is parked.
+        WakeParked();
+    }
+    return true;
+}
+
+// Exit:   Returns true if any queue has a task waiting.
+bool CWorkPool::HasWork() const
+{
+    for (int j = 0; j < m_nStarted; j++) {
+        if (m_aryWorkers[j].nQueued.load() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Wait until there may be work, or the pool stops.  The count of parked
+// workers goes up before the queues are looked at, and Submit counts
+// its task before it reads that count, so either we see the task or
+// Submit sees us and signals under the mutex, after we wait.
+void CWorkPool::Park()
+{
+    std::unique_lock<std::mutex> lock(m_mutexPark);
+    m_nParked.fetch_add(1);
+    while (!m_bStop && !HasWork()) {
+        m_condWork.wait(lock);
+    }
+    m_nParked.fetch_sub(1);
+}
+
+// Signal one parked worker, if there is one.
+void CWorkPool::WakeParked()
+{
+    if (m_nParked.load() == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutexPark);
+    m_condWork.notify_one();
+}
+
+void CWorkPool::ThreadMain(int iWorker)
+{
+    StructWorker& worker = m_aryWorkers[iWorker];
+    SetStageThreadName(worker.szName);
+    int nIdle = 0;
+    for (;;) {
+        // Read m_bStop before looking: submitters have stopped by the time
+        // it is set, so a look after that which finds nothing is final.
+        bool bStop = m_bStop;
+        StructTask task;
+        if (TakeOwn(iWorker, task) || Steal(iWorker, task)) {
+            nIdle = 0;
+            int64_t usStart = StageNowMicros();
+            task.pfn(task.pArg, iWorker);
+            worker.usBusy.fetch_add(StageNowMicros() - usStart, std::memory_order_relaxed);
+            worker.nTasks.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (bStop) {
+            break;
+        }
+        if (++nIdle <= WORKPOOL_SPIN) {
+            std::this_thread::yield();
+        } else {
+            Park();
+            nIdle = 0;
+        }
+    }
+}
@@ -0,0 +1,103 @@
+// WorkPool.h : Pool of threads for short tasks, balanced by work stealing.
+// Each worker has a queue of its own, which Submit feeds.  A worker runs
+// the oldest task of its own queue, and when that is empty, steals the
+// newer half of the fullest other queue, so a burst handed to one worker
+// spreads over the pool without every thread contending for one queue.
+//
+// Tasks should be short and must not block for long.  An idle worker
+// looks again WORKPOOL_SPIN times, yielding in between, and then parks on
+// a condition variable until Submit signals that there is work.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "CritSec.h"
+
+#define WORKPOOL_MAX_WORKERS    64
+#define WORKPOOL_SPIN           64      // looks an idle worker yields for before it parks
+
+// A task, run on worker iWorker (0 to the number of workers less one).
+typedef void (*PFN_WORK)(void* pArg, int iWorker);
+
+struct StructWorkerStats {
+    uint64_t nTasks;        // tasks run
+    uint64_t nStolen;       // of which taken from other workers' queues
+    uint64_t usBusy;        // time spent running tasks
+    int      nQueued;       // tasks waiting in the worker's queue
+};
+
+class CWorkPool
+{
+public:
+    CWorkPool();
+    ~CWorkPool();
+
+    // Start nWorkers threads, clamped to 1..WORKPOOL_MAX_WORKERS, named
+    // "pszName N" in the stage timings; pszName must outlive the pool.
+    // Figures start again from zero.
+    void Start(int nWorkers, const char* pszName);
+
+    // Run the tasks still queued, then stop the threads.  Call once
+    // nothing submits any more.
+    void Stop();
+
+    // Exit:   Returns the number of workers, or 0 if the pool isn't
+    //         running.  Safe from any thread.
+    int GetWorkerCount() const { return m_nWorkers.load(std::memory_order_acquire); }
+
+    // Queue a task on worker iWorker modulo the number of workers, e.g.
+    // the submitting thread's own, so that its tasks tend to stay
+    // together; any idle worker may steal them.  Safe from any thread.
+    // If the pool isn't running, the task runs at once on the caller's
+    // thread, as worker 0.
+    void Submit(int iWorker, PFN_WORK pfn, void* pArg);
+
+    // The figures of a worker.  Safe from any thread while the pool runs.
+    StructWorkerStats GetStats(int iWorker) const;
+
+private:
+    CWorkPool(const CWorkPool&) = delete;
+    CWorkPool& operator=(const CWorkPool&) = delete;
+
+    struct StructTask {
+        PFN_WORK pfn;
+        void*    pArg;
+    };
+
+    struct StructWorker {
+        StructWorker() : crit("WorkPool.Queue") {}
+
+        CCritSec crit;                  // guards queue
+        std::deque<StructTask> queue;
+        std::atomic<int> nQueued{0};    // queue.size(), for thieves and figures without the lock
+        std::atomic<uint64_t> nTasks{0};
+        std::atomic<uint64_t> nStolen{0};
+        std::atomic<uint64_t> usBusy{0};
+        char szName[48];
+        std::thread thread;
+    };
+
+    bool TakeOwn(int iWorker, StructTask& task);
+    bool Steal(int iWorker, StructTask& task);
+    bool HasWork() const;
+    void Park();
+    void WakeParked();
+    void ThreadMain(int iWorker);
+
+    // Workers are never freed while the pool lives, so figures may be
+    // read as it stops.
+    StructWorker m_aryWorkers[WORKPOOL_MAX_WORKERS];
+    std::atomic<int> m_nWorkers;
+    int m_nStarted;                     // threads started; m_nWorkers drops to 0 first on Stop
+    std::atomic<bool> m_bStop;
+
+    // Idle workers wait on m_condWork.  m_nParked lets Submit skip the
+    // mutex while every worker is busy.
+    std::mutex m_mutexPark;
+    std::condition_variable m_condWork;
+    std::atomic<int> m_nParked;
+};
@@ -0,0 +1,52 @@
+# icmp-errors.cmake - generate IcmpErrors.inc, the table of ICMP status
+# codes that ErrorCodes.cpp compiles in, from icmp-errors.txt.
+# See https://learn.microsoft.com/en-us/windows/win32/api/ipexport/ns-ipexport-icmp_echo_reply32
+# This is necessary because FormatMessage() does not work for ICMP errors.
+#
+# Input consists of groups of 3 lines like this:
+# IP_BUF_TOO_SMALL
+# 11001
+# The reply buffer was too small.
+#
+# Usage: cmake -DIN=icmp-errors.txt -DOUT=IcmpErrors.inc -P icmp-errors.cmake
+# The build runs this whenever icmp-errors.txt changes.
+
+cmake_policy(SET CMP0007 NEW)
+
+# Read the lines into a list.  Semicolons separate list items in CMake, so
+# stand them in with a placeholder until the lines are split.
+file(READ "${IN}" content)
+string(REPLACE "\r" "" content "${content}")
+string(REPLACE ";" "@SEMICOLON@" content "${content}")
+string(REPLACE "\n" ";" lines "${content}")
+list(REMOVE_ITEM lines "")
+list(LENGTH lines nLines)
+math(EXPR nRem "${nLines} % 3")
+if(NOT nRem EQUAL 0)
+    message(FATAL_ERROR "${IN}: expected groups of 3 lines, got ${nLines} lines")
+endif()
+
+set(out "// Generated from icmp-errors.txt by icmp-errors.cmake; do not edit.\n")
+math(EXPR iLast "${nLines} - 1")
+foreach(i RANGE 0 ${iLast} 3)
+    math(EXPR iNum "${i} + 1")
+    math(EXPR iText "${i} + 2")
+    list(GET lines ${i} errident)
+    list(GET lines ${iNum} errnum)
+    list(GET lines ${iText} errtext)
+    string(STRIP "${errident}" errident)
+    string(STRIP "${errnum}" errnum)
+    string(STRIP "${errtext}" errtext)
+    if(NOT errident MATCHES "^[A-Z_0-9]+$" OR NOT errnum MATCHES "^[0-9]+$")
+        message(FATAL_ERROR "${IN}: bad entry '${errident}' '${errnum}'")
+    endif()
+    string(REPLACE "\\" "\\\\" errtext "${errtext}")
+    string(REPLACE "\"" "\\\"" errtext "${errtext}")
+    string(REPLACE "@SEMICOLON@" ";" errtext "${errtext}")
+    string(APPEND out "{${errnum}, \"${errident}\", \"${errtext}\"},\n")
+endforeach()
+
+# Only touch the output if it changed, so dependents aren't rebuilt.
+file(WRITE "${OUT}.tmp" "${out}")
+configure_file("${OUT}.tmp" "${OUT}" COPYONLY)
+file(REMOVE "${OUT}.tmp")
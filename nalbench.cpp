@@ -0,0 +1,911 @@
+// nalbench.cpp : Load test and benchmark of the probe pipeline.
+//
+// Usage:
+//   nalbench [--targets N] [--interval MS] [--secs S] [--timeout MS]
+//            [--sim RULES] [--log FILE|-] [--binary] [--queue N]
+//            [--shards N] [--workers N]
+//   nalbench --suite [--secs S] [--log FILE|-] [--shards N] [--workers N]
+//   nalbench --collector [--hosts N] [--targets N] [--interval MS] [--secs S]
+//            [--senders N] [--tcp] [--port N]
+//   nalbench --loopback [--secs S] [--log FILE|-]
+//
+// Pings N virtual targets on the simulated network of SimBackend.h (RULES
+// as described there), each every MS milliseconds, for S seconds, with
+// netavaild's own probe loop: the targets are published as settings (see
+// Settings.h) and pinged by a CProberSet stepped from this thread, as
+// netavaild does with ProbeShards=1, or with --shards or --workers by a
+// CShardedProberSet (see ShardedProber.h) of N shards, finishing pings on
+// FinishPool with N workers (0 for one per shard).  Each ping is
+// accounted for, logged and turned into problems just as netavaild's
+// are, the records queued to LogWriter, which appends them to FILE with
+// --log and otherwise counts them without writing ("-" too).  MS must be
+// a whole number of seconds, as targets' secsSleep is; path traces are
+// off, so that the load is the pings alone.
+//
+// The figures come from the counters netavaild keeps for its metrics and
+// SIGUSR1 dump, taken before and after the run:
+//   pings/s    pings started per second of the run
+//   lag        how late pings were started, compared with their deadlines
+//   overhead   time the loop took over each ping beyond its round trip,
+//              or for a failed ping beyond its wait for the error or
+//              timeout
+//   stages     the stages of StageTimer.h that make up the loop, as
+//              avg and bucket bounds of p50/p99, in ms
+//   log        records written and dropped, the queue's high-water mark,
+//              and the time taken to write out what was queued at the end
+//   shard      per shard: targets, pings started, and the share of the
+//              run it was busy other than waiting on its backend
+//   worker     per worker of FinishPool: pings finished, of which stolen
+//              from another worker's queue, and the share of the run it
+//              was busy
+// Lag and overhead are avg/max in ms.
+//
+// The simulated outcomes are seeded per target; as in netavaild, each
+// target starts at a random point in its interval.  --suite runs a fixed
+// set of scenarios, one line each, for comparing builds on the same
+// machine.
+//
+// --collector benchmarks the fleet collector of Collector.h instead.  N
+// simulated hosts (default 1000), spread over the sender threads, each
+// stream a result for every one of their targets (default 20) every MS
+// milliseconds, over UDP or TCP, to a CCollector on 127.0.0.1 port N
+// (default 9479).  The first target is down for every host through the
+// middle third of the run.  Then it reports the results and batches
+// taken in per second, batches lost or malformed on the way, and how long
+// after the shared outage began and ended the collector reported it.
+//
+// --loopback checks the ICMP pings of ProbeEngine.h and the TCP, UDP and
+// DNS probes of SocketProbe.h end to end instead.  It answers on
+// 127.0.0.1 a TCP port, a UDP echo port and a DNS port, and publishes a
+// target for each, plus one for a TCP port nothing listens on: 127.0.0.1,
+// ::1, 127.0.0.2 and 127.0.0.3, each with its own Probes and pinged every
+// second.  After S seconds (default 3) it prints a line per ping target
+// and probe and exits 1 unless every ping and probe was answered, and
+// every probe to the closed port refused.
+
+#include "Collector.h"
+#include "Prober.h"
+#include "Settings.h"
+#include "ShardedProber.h"
+#include "StageTimer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#define SEND_FLAGS 0
+#else
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#define closesocket close
+#define INVALID_SOCKET (-1)
+#define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+// The Windows IP_xxx status code of a refused connection; see
+// SocketProbe.cpp.
+#define IP_DEST_PORT_UNREACHABLE    11005
+
+struct StructOptions {
+    int     nTargets = 10000;
+    int     msInterval = 1000;
+    int     secsRun = 10;
+    int     msTimeout = 1000;
+    int     msBadPing = 400;
+    std::string strRules = "rtt=20,spread=0.3,vary=1,loss=0.002,error=0.001,burst=0.0002,burstlen=20";
+    std::string strLog;             // "" for no log
+    bool    bBinary = false;
+    size_t  nQueue = 4096;
+    int     nShards = 1;            // netavaild's ProbeShards
+    int     nWorkers = 0;           // and ProbeWorkers
+    int     nHosts = 1000;          // --collector: simulated hosts
+    int     nSenders = 4;           // threads sending for them
+    bool    bTcp = false;
+    int     port = STREAM_PORT_DEFAULT;
+};
+
+struct StructScenario {
+    const char* pszName;
+    int         nTargets;
+    int         msInterval;
+    const char* pszRules;
+};
+
+// The --suite scenarios: steady healthy targets, a lossy network with
+// outages, every ping ending in one of the ICMP errors, and ten times the
+// targets of the others.
+static const StructScenario AryScenarios[] = {
+    {"clean",    10000, 1000, "rtt=20,spread=0.3,vary=1"},
+    {"lossy",    10000, 1000, "rtt=40,spread=0.5,vary=1,loss=0.02,error=0.01,burst=0.0005,burstlen=20"},
+    {"errors",   10000, 1000, "rtt=30,error=1"},
+    {"fast",    100000, 1000, "rtt=20,spread=0.3,vary=1,loss=0.002"},
+    {NULL, 0, 0, NULL}
+};
+
+// The stages of the loop the bench reports, in the order it does.
+static const int AryBenchStages[] = {
+    STAGE_PING_START, STAGE_BACKEND_POLL, STAGE_PING_FINISH, STAGE_STATS_RECORD, STAGE_PROBLEM_ADD,
+    STAGE_LOG_FORMAT
+};
+
+// A stage's figures, or their change over a run.
+struct StructStageFigures {
+    uint64_t nSpans = 0;
+    uint64_t usTotal = 0;
+    uint64_t aryBuckets[STAGE_HIST_BUCKETS] = {};
+};
+
+struct StructShardFigures {
+    int      nTargets;
+    uint64_t nPings;
+    uint64_t usBusy;
+};
+
+// What a run changed of the counters, and the load of each shard and
+// worker.
+struct StructBenchResults {
+    uint64_t nStarted = 0;      // pings started
+    uint64_t nPings = 0;        // pings finished
+    uint64_t nSkipped = 0;      // deadlines missed because a ping overran
+    uint64_t nBursts = 0;       // times a target entered burst mode
+    uint64_t usLagTotal = 0;
+    int64_t  usLagMax = 0;
+    uint64_t usOverheadTotal = 0;
+    int64_t  usOverheadMax = 0;
+    StructStageFigures aryStages[STAGE_COUNT];
+    double   secsRun = 0;
+    double   secsCpu = 0;
+    double   secsDrain = 0;
+    StructLogWriterStats log = {};
+    std::vector<StructShardFigures> vectShards;
+    std::vector<StructWorkerStats> vectWorkers;
+};
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: nalbench [--targets N] [--interval MS] [--secs S] [--timeout MS]\n"
+        "                [--sim RULES] [--log FILE|-] [--binary] [--queue N]\n"
+        "                [--shards N] [--workers N]\n"
+        "       nalbench --suite [--secs S] [--log FILE|-] [--shards N] [--workers N]\n"
+        "       nalbench --collector [--hosts N] [--targets N] [--interval MS] [--secs S]\n"
+        "                [--senders N] [--tcp] [--port N]\n"
+        "       nalbench --loopback [--secs S] [--log FILE|-]\n");
+    exit(2);
+}
+
+static void TakeStageFigures(StructStageFigures* aryStages)
+{
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const StructStageStats& stats = GetStageStats(stage);
+        aryStages[stage].nSpans = stats.nSpans.load(std::memory_order_relaxed);
+        aryStages[stage].usTotal = stats.usTotal.load(std::memory_order_relaxed);
+        for (int k = 0; k < STAGE_HIST_BUCKETS; k++) {
+            aryStages[stage].aryBuckets[k] = stats.aryBuckets[k].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Publish nTargets targets 10.x.y.z on the simulated network as the
+// settings, and ping them with netavaild's probe loop for the length of
+// the run.
+static bool RunBench(const StructOptions& options, StructBenchResults& results, std::string& strError)
+{
+    Settings.strProbeBackend = "sim:" + options.strRules;
+    Settings.secsSleep = options.msInterval / 1000;
+    Settings.msPingTimeout = options.msTimeout;
+    Settings.msBadPing = options.msBadPing;
+    Settings.secsTraceMin = 0;
+    Settings.vectTargets.clear();
+    for (int j = 0; j < options.nTargets; j++) {
+        char szAddress[32];
+        snprintf(szAddress, sizeof(szAddress), "10.%d.%d.%d", (j >> 16) & 255, (j >> 8) & 255, j & 255);
+        StructTargetSettings target;
+        target.strAddress = szAddress;
+        Settings.vectTargets.push_back(target);
+    }
+    PublishSettings();
+
+    StructLogWriterConfig config;
+    config.strPath = options.strLog;
+    config.bCsv = !options.strLog.empty();
+    config.bBinary = options.bBinary;
+    config.strBinPrefix = "nalbench";
+    config.nQueueCapacity = options.nQueue;
+    StructLogWriterStats logBefore = LogWriter.GetStats();
+    LogWriter.Start(config);
+
+    StructStageFigures aryStagesBefore[STAGE_COUNT];
+    TakeStageFigures(aryStagesBefore);
+    uint64_t nPingsBefore = ProbeLoopStats.nPings.load();
+    uint64_t nSkippedBefore = ProbeLoopStats.nSkipped.load();
+    uint64_t nBurstsBefore = ProbeLoopStats.nBursts.load();
+    uint64_t usLagBefore = ProbeLoopStats.usLagTotal.load();
+    uint64_t usOverheadBefore = ProbeLoopStats.usOverheadTotal.load();
+    ProbeLoopStats.usLagMax = 0;
+    ProbeLoopStats.usOverheadMax = 0;
+
+    clock_t clockStart = clock();
+    int64_t usRunStart = ProbeNowMicros();
+    int64_t msEnd = usRunStart / 1000 + (int64_t)options.secsRun * 1000;
+    results.vectShards.clear();
+    results.vectWorkers.clear();
+    bool bOpen;
+    if (options.nShards == 1 && options.nWorkers == 0) {
+        // As netavaild steps its set from its main thread.
+        StructShardStats stats;
+        CProberSet probers;
+        probers.SetShard(0, 1, &stats);
+        bOpen = probers.Open(strError);
+        int64_t msNow;
+        while (bOpen && (msNow = ProbeNowMicros() / 1000) < msEnd) {
+            probers.Step(msEnd - msNow < SHARD_POLL_MS ? (int)(msEnd - msNow) : SHARD_POLL_MS);
+        }
+        StructShardFigures shard = { stats.nTargets.load(), stats.nPings.load(), stats.usBusy.load() };
+        results.vectShards.push_back(shard);
+    } else {
+        CShardedProberSet shards;
+        bOpen = shards.Open(options.nShards, options.nWorkers, NULL, NULL, strError);
+        if (bOpen) {
+            std::this_thread::sleep_for(std::chrono::microseconds(msEnd * 1000 - ProbeNowMicros()));
+            for (int j = 0; j < shards.GetShardCount(); j++) {
+                const StructShardStats& stats = ShardStats[j];
+                StructShardFigures shard = { stats.nTargets.load(), stats.nPings.load(), stats.usBusy.load() };
+                results.vectShards.push_back(shard);
+            }
+            for (int j = 0; j < FinishPool.GetWorkerCount(); j++) {
+                results.vectWorkers.push_back(FinishPool.GetStats(j));
+            }
+            shards.Close();
+        }
+    }
+    results.secsRun = (msEnd * 1000 - usRunStart) / 1e6;
+
+    int64_t usDrainStart = ProbeNowMicros();
+    LogWriter.Stop();
+    results.secsDrain = (ProbeNowMicros() - usDrainStart) / 1e6;
+    results.secsCpu = (double)(clock() - clockStart) / CLOCKS_PER_SEC;
+    if (!bOpen) {
+        return false;
+    }
+
+    results.nStarted = 0;
+    for (size_t j = 0; j < results.vectShards.size(); j++) {
+        results.nStarted += results.vectShards[j].nPings;
+    }
+    results.nPings = ProbeLoopStats.nPings.load() - nPingsBefore;
+    results.nSkipped = ProbeLoopStats.nSkipped.load() - nSkippedBefore;
+    results.nBursts = ProbeLoopStats.nBursts.load() - nBurstsBefore;
+    results.usLagTotal = ProbeLoopStats.usLagTotal.load() - usLagBefore;
+    results.usLagMax = ProbeLoopStats.usLagMax.load();
+    results.usOverheadTotal = ProbeLoopStats.usOverheadTotal.load() - usOverheadBefore;
+    results.usOverheadMax = ProbeLoopStats.usOverheadMax.load();
+    TakeStageFigures(results.aryStages);
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        StructStageFigures& figures = results.aryStages[stage];
+        figures.nSpans -= aryStagesBefore[stage].nSpans;
+        figures.usTotal -= aryStagesBefore[stage].usTotal;
+        for (int k = 0; k < STAGE_HIST_BUCKETS; k++) {
+            figures.aryBuckets[k] -= aryStagesBefore[stage].aryBuckets[k];
+        }
+    }
+    results.log = LogWriter.GetStats();
+    results.log.nWritten -= logBefore.nWritten;
+    results.log.nDropped -= logBefore.nDropped;
+    return true;
+}
+
+// Format the avg and max of a total over n, in ms.
+static std::string FormatAvgMax(uint64_t usTotal, uint64_t n, int64_t usMax)
+{
+    if (n == 0) {
+        return "-";
+    }
+    char szBuf[64];
+    snprintf(szBuf, sizeof(szBuf), "%.3f/%.3f", (double)usTotal / n / 1000.0, usMax / 1000.0);
+    return szBuf;
+}
+
+// Exit:   Returns the upper bound of the bucket a quantile of a stage's
+//         spans falls in, in ms, e.g. "<0.016", or "-" if there were none.
+static std::string FormatStageQuantile(const StructStageFigures& figures, double q)
+{
+    uint64_t nRank = (uint64_t)(q * figures.nSpans);
+    uint64_t nSeen = 0;
+    for (int k = 0; k < STAGE_HIST_BUCKETS; k++) {
+        nSeen += figures.aryBuckets[k];
+        if (nSeen > nRank) {
+            int64_t usLimit = GetStageBucketLimit(k);
+            if (usLimit < 0) {
+                return "max";
+            }
+            char szBuf[32];
+            snprintf(szBuf, sizeof(szBuf), "<%.3f", usLimit / 1000.0);
+            return szBuf;
+        }
+    }
+    return "-";
+}
+
+static void PrintResults(const StructOptions& options, const StructBenchResults& results)
+{
+    printf("targets %d  interval %d ms  timeout %d ms  %.1f s\n", options.nTargets,
+        options.msInterval, options.msTimeout, results.secsRun);
+    printf("sim     %s\n", options.strRules.c_str());
+    printf("pings   %llu started  %llu finished  %llu skipped  %llu bursts\n",
+        (unsigned long long)results.nStarted, (unsigned long long)results.nPings,
+        (unsigned long long)results.nSkipped, (unsigned long long)results.nBursts);
+    printf("pings/s %.0f  (cpu %.2f s, %.0f pings per cpu second)\n", results.nStarted / results.secsRun,
+        results.secsCpu, results.secsCpu > 0 ? results.nPings / results.secsCpu : 0.0);
+    printf("lag     %s ms\n", FormatAvgMax(results.usLagTotal, results.nStarted, results.usLagMax).c_str());
+    printf("overhead %s ms\n",
+        FormatAvgMax(results.usOverheadTotal, results.nPings, results.usOverheadMax).c_str());
+    for (size_t j = 0; j < sizeof(AryBenchStages) / sizeof(AryBenchStages[0]); j++) {
+        const StructStageFigures& figures = results.aryStages[AryBenchStages[j]];
+        if (figures.nSpans > 0) {
+            printf("stage %-14s n=%llu avg=%.3f p50%s p99%s\n", GetStageName(AryBenchStages[j]),
+                (unsigned long long)figures.nSpans, (double)figures.usTotal / figures.nSpans / 1000.0,
+                FormatStageQuantile(figures, 0.5).c_str(), FormatStageQuantile(figures, 0.99).c_str());
+        }
+    }
+    printf("log     %llu written  %llu dropped  queue max %zu  drain %.3f s\n",
+        (unsigned long long)results.log.nWritten, (unsigned long long)results.log.nDropped,
+        results.log.nDepthMax, results.secsDrain);
+    if (results.vectShards.size() > 1 || !results.vectWorkers.empty()) {
+        for (size_t j = 0; j < results.vectShards.size(); j++) {
+            const StructShardFigures& shard = results.vectShards[j];
+            printf("shard %-2d %d targets  %llu started  busy %.1f%%\n", (int)j, shard.nTargets,
+                (unsigned long long)shard.nPings, 100.0 * shard.usBusy / 1e6 / results.secsRun);
+        }
+        for (size_t j = 0; j < results.vectWorkers.size(); j++) {
+            const StructWorkerStats& worker = results.vectWorkers[j];
+            printf("worker %-2d %llu finished  %llu stolen  busy %.1f%%\n", (int)j,
+                (unsigned long long)worker.nTasks, (unsigned long long)worker.nStolen,
+                100.0 * worker.usBusy / 1e6 / results.secsRun);
+        }
+    }
+}
+
+// Everything the --collector senders and the outage callback share.
+struct StructFleetBench {
+    const StructOptions* pOptions;
+    std::vector<std::string> vectTargets;
+    sockaddr_in addr;               // of the collector
+    int64_t  msStart;
+    int64_t  msEnd;
+    int64_t  msOutageStart;         // the first target is down for every host from here
+    int64_t  msOutageEnd;           // to here
+    std::atomic<int>  nReady{0};    // senders connected
+    std::atomic<bool> bGo{false};   // the times above are set
+    std::atomic<uint64_t> nSent{0};         // results
+    std::atomic<uint64_t> nBatchesSent{0};
+    std::atomic<uint64_t> nSendErrors{0};
+    std::atomic<uint64_t> nBehind{0};       // rounds of a host started 10 ms or more late
+    std::atomic<int64_t>  msDetected{0};    // the outage reported started
+    std::atomic<int64_t>  msRecovered{0};   // and ended
+    std::atomic<int>      nOtherOutages{0}; // of any other target
+};
+
+static void OnFleetOutage(const StructOutageEvent& event, void* pContext)
+{
+    StructFleetBench* pBench = (StructFleetBench*)pContext;
+    if (event.strTarget != pBench->vectTargets[0]) {
+        pBench->nOtherOutages++;
+        return;
+    }
+    int64_t msNone = 0;
+    (event.bStart ? pBench->msDetected : pBench->msRecovered).compare_exchange_strong(msNone, event.msDetected);
+}
+
+// Write a whole batch to a TCP connection.
+// Exit:   Returns false if the connection failed.
+static bool SendAllTcp(intptr_t sock, const char* p, size_t cb)
+{
+    while (cb > 0) {
+        int cbSent = send((int)sock, p, (int)cb, SEND_FLAGS);
+        if (cbSent <= 0) {
+            return false;
+        }
+        p += cbSent;
+        cb -= cbSent;
+    }
+    return true;
+}
+
+// Send for hosts iSender, iSender + nSenders, ...  Each host's results go
+// out every msInterval as one or more batches, its rounds offset from the
+// other hosts' so the load is spread evenly over the interval.
+static void RunFleetSender(StructFleetBench* pBench, int iSender)
+{
+    const StructOptions& options = *pBench->pOptions;
+    std::vector<int> vectHosts;
+    for (int h = iSender; h < options.nHosts; h += options.nSenders) {
+        vectHosts.push_back(h);
+    }
+    std::vector<intptr_t> vectSockets(options.bTcp ? vectHosts.size() : 1, (intptr_t)INVALID_SOCKET);
+    for (size_t j = 0; j < vectSockets.size(); j++) {
+        intptr_t sock = socket(AF_INET, options.bTcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+        if (sock != (intptr_t)INVALID_SOCKET && options.bTcp &&
+            connect((int)sock, (const sockaddr*)&pBench->addr, sizeof(pBench->addr)) != 0) {
+            closesocket((int)sock);
+            sock = INVALID_SOCKET;
+        }
+        vectSockets[j] = sock;
+    }
+    std::vector<uint32_t> vectSeq(vectHosts.size(), 0);
+    pBench->nReady++;
+    while (!pBench->bGo) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    CStreamBatchBuilder batch;
+    std::minstd_rand rng(iSender + 1);
+    for (int64_t iRound = 0; ; iRound++) {
+        for (size_t i = 0; i < vectHosts.size(); i++) {
+            int h = vectHosts[i];
+            int64_t msDue = pBench->msStart + iRound * options.msInterval +
+                (int64_t)h * options.msInterval / options.nHosts;
+            if (msDue >= pBench->msEnd) {
+                goto Done;
+            }
+            int64_t msNow = GetWallMicros() / 1000;
+            if (msDue > msNow) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(msDue - msNow));
+            } else if (msDue <= msNow - 10) {
+                pBench->nBehind++;
+            }
+
+            char szHost[32];
+            char szLocalIP[32];
+            snprintf(szHost, sizeof(szHost), "host%05d", h);
+            snprintf(szLocalIP, sizeof(szLocalIP), "172.16.%d.%d", (h >> 8) & 255, h & 255);
+            intptr_t sock = vectSockets[options.bTcp ? i : 0];
+            bool bOutage = msDue >= pBench->msOutageStart && msDue < pBench->msOutageEnd;
+            size_t iTarget = 0;
+            while (iTarget < pBench->vectTargets.size()) {
+                batch.Begin(szHost, szLocalIP, (uint32_t)h + 1, vectSeq[i]++);
+                for (; iTarget < pBench->vectTargets.size(); iTarget++) {
+                    // Replies of 20-30 ms, and one probe in 500 lost.
+                    bool bLost = (iTarget == 0 && bOutage) || rng() % 500 == 0;
+                    int64_t usRtt = bLost ? -1 : 20000 + rng() % 10000;
+                    if (!batch.Add(pBench->vectTargets[iTarget].c_str(), msDue, usRtt, bLost ? PROBE_ERR_TIMED_OUT : 0)) {
+                        break;
+                    }
+                }
+                bool bSent;
+                if (sock == (intptr_t)INVALID_SOCKET) {
+                    bSent = false;
+                } else if (options.bTcp) {
+                    bSent = SendAllTcp(sock, batch.GetData(), batch.GetSize());
+                } else {
+                    bSent = sendto((int)sock, batch.GetData(), (int)batch.GetSize(), 0,
+                        (const sockaddr*)&pBench->addr, sizeof(pBench->addr)) == (int)batch.GetSize();
+                }
+                if (bSent) {
+                    pBench->nSent += batch.GetCount();
+                    pBench->nBatchesSent++;
+                } else {
+                    pBench->nSendErrors++;
+                }
+            }
+        }
+    }
+Done:
+    for (size_t j = 0; j < vectSockets.size(); j++) {
+        if (vectSockets[j] != (intptr_t)INVALID_SOCKET) {
+            closesocket((int)vectSockets[j]);
+        }
+    }
+}
+
+static int RunCollectorBench(const StructOptions& options)
+{
+    StructFleetBench bench;
+    bench.pOptions = &options;
+    for (int j = 0; j < options.nTargets; j++) {
+        char szAddress[32];
+        snprintf(szAddress, sizeof(szAddress), "10.%d.%d.%d", (j >> 16) & 255, (j >> 8) & 255, j & 255);
+        bench.vectTargets.push_back(szAddress);
+    }
+    memset(&bench.addr, 0, sizeof(bench.addr));
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_port = htons((unsigned short)options.port);
+    inet_pton(AF_INET, "127.0.0.1", &bench.addr.sin_addr);
+
+    StructCollectorConfig config;
+    config.port = options.port;
+    config.strBindAddress = "127.0.0.1";
+    config.bTcp = options.bTcp;
+    CCollector collector;
+    std::string strError;
+    if (!collector.Start(config, OnFleetOutage, &bench, strError)) {
+        fprintf(stderr, "%s\n", strError.c_str());
+        return 1;
+    }
+
+    // Start once the senders are connected, so that connecting isn't
+    // counted.
+    std::vector<std::thread> vectThreads;
+    for (int j = 0; j < options.nSenders; j++) {
+        vectThreads.emplace_back(RunFleetSender, &bench, j);
+    }
+    while (bench.nReady < options.nSenders) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    int64_t msRun = (int64_t)options.secsRun * 1000;
+    bench.msStart = GetWallMicros() / 1000;
+    bench.msEnd = bench.msStart + msRun;
+    bench.msOutageStart = bench.msStart + msRun / 3;
+    bench.msOutageEnd = bench.msStart + msRun * 2 / 3;
+    clock_t clockStart = clock();
+    bench.bGo = true;
+    for (size_t j = 0; j < vectThreads.size(); j++) {
+        vectThreads[j].join();
+    }
+    // Give the receive threads time to take in what is still queued.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    StructCollectorStats stats = collector.GetStats();
+    collector.Stop();
+    double secsCpu = (double)(clock() - clockStart) / CLOCKS_PER_SEC;
+    double secsRun = msRun / 1000.0;
+
+    printf("fleet   %d hosts x %d targets  interval %d ms  %s  %d senders  %.1f s\n", options.nHosts,
+        options.nTargets, options.msInterval, options.bTcp ? "tcp" : "udp", options.nSenders, secsRun);
+    printf("sent    %llu results  %llu batches  %llu send errors  %llu behind\n",
+        (unsigned long long)bench.nSent.load(), (unsigned long long)bench.nBatchesSent.load(),
+        (unsigned long long)bench.nSendErrors.load(), (unsigned long long)bench.nBehind.load());
+    printf("ingest  %llu results  %llu batches  %llu lost  %llu bad  %d pairs\n",
+        (unsigned long long)stats.nResults, (unsigned long long)stats.nBatches,
+        (unsigned long long)stats.nLostBatches, (unsigned long long)stats.nBadBatches, stats.nPairs);
+    printf("results/s %.0f  batches/s %.0f  (cpu %.2f s, senders included)\n", stats.nResults / secsRun,
+        stats.nBatches / secsRun, secsCpu);
+    char szDetected[32] = "-";
+    char szRecovered[32] = "-";
+    if (bench.msDetected != 0) {
+        snprintf(szDetected, sizeof(szDetected), "%.3f s", (bench.msDetected - bench.msOutageStart) / 1000.0);
+    }
+    if (bench.msRecovered != 0) {
+        snprintf(szRecovered, sizeof(szRecovered), "%.3f s", (bench.msRecovered - bench.msOutageEnd) / 1000.0);
+    }
+    printf("outage  detected after %s  recovered after %s  %d other outages\n", szDetected, szRecovered,
+        bench.nOtherOutages.load());
+    return 0;
+}
+
+// --loopback: services on 127.0.0.1 for the targets' service probes to
+// find, each on a port of its own, answered from one thread.
+struct StructLoopback {
+    intptr_t sockTcp = INVALID_SOCKET;  // listening; connections are accepted and closed
+    intptr_t sockUdp = INVALID_SOCKET;  // echoes datagrams
+    intptr_t sockDns = INVALID_SOCKET;  // answers queries NOERROR, with no records
+    int      portTcp = 0;
+    int      portUdp = 0;
+    int      portDns = 0;
+    int      portClosed = 0;            // nothing listens here
+    std::atomic<bool> bStop{false};
+};
+
+// Open a socket on 127.0.0.1 at a port of the system's choosing.
+// Exit:   Returns the socket, listening if TCP, and sets port, or returns
+//         INVALID_SOCKET.
+static intptr_t OpenLoopbackSocket(int type, int& port)
+{
+    intptr_t sock = socket(AF_INET, type, 0);
+    if (sock == (intptr_t)INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    socklen_t cbAddr = sizeof(addr);
+    if (bind((int)sock, (const sockaddr*)&addr, sizeof(addr)) != 0 ||
+        (type == SOCK_STREAM && listen((int)sock, 64) != 0) ||
+        getsockname((int)sock, (sockaddr*)&addr, &cbAddr) != 0) {
+        closesocket((int)sock);
+        return INVALID_SOCKET;
+    }
+    port = ntohs(addr.sin_port);
+    return sock;
+}
+
+static void RunLoopbackServices(StructLoopback* pLoopback)
+{
+    while (!pLoopback->bStop) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(pLoopback->sockTcp, &fds);
+        FD_SET(pLoopback->sockUdp, &fds);
+        FD_SET(pLoopback->sockDns, &fds);
+        intptr_t sockMax = std::max(pLoopback->sockTcp, std::max(pLoopback->sockUdp, pLoopback->sockDns));
+        timeval tv = { 0, 100000 };
+        if (select((int)sockMax + 1, &fds, NULL, NULL, &tv) <= 0) {
+            continue;
+        }
+        if (FD_ISSET(pLoopback->sockTcp, &fds)) {
+            intptr_t sock = accept((int)pLoopback->sockTcp, NULL, NULL);
+            if (sock != (intptr_t)INVALID_SOCKET) {
+                closesocket((int)sock);
+            }
+        }
+        for (int j = 0; j < 2; j++) {
+            intptr_t sock = j == 0 ? pLoopback->sockUdp : pLoopback->sockDns;
+            if (!FD_ISSET(sock, &fds)) {
+                continue;
+            }
+            char buf[512];
+            sockaddr_in addrFrom;
+            socklen_t cbFrom = sizeof(addrFrom);
+            int cb = (int)recvfrom((int)sock, buf, sizeof(buf), 0, (sockaddr*)&addrFrom, &cbFrom);
+            if (cb <= 0) {
+                continue;
+            }
+            if (sock == pLoopback->sockDns) {
+                // The query back as its own answer: QR and RA set, RCODE
+                // NOERROR, the question echoed and no records.
+                if (cb < 12) {
+                    continue;
+                }
+                buf[2] |= 0x80;
+                buf[3] = (char)0x80;
+            }
+            sendto((int)sock, buf, cb, 0, (const sockaddr*)&addrFrom, cbFrom);
+        }
+    }
+}
+
+// One target's service probe in a --loopback run, and whether it should
+// be answered or refused.
+struct StructLoopbackProbe {
+    std::string strSpec;
+    bool        bRefused;
+};
+
+// Open the loopback services, publish a loopback address, IPv4 or IPv6,
+// for each with its own Probes, run netavaild's probe loop over them for
+// the length of the run, and check from LatencyStats that each ping was
+// answered, and each probe answered, or refused as the closed port should
+// be.
+// Exit:   Returns 0 if every probe behaved, 1 if not, 2 on an error.
+static int RunLoopback(const StructOptions& options)
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    StructLoopback loopback;
+    loopback.sockTcp = OpenLoopbackSocket(SOCK_STREAM, loopback.portTcp);
+    loopback.sockUdp = OpenLoopbackSocket(SOCK_DGRAM, loopback.portUdp);
+    loopback.sockDns = OpenLoopbackSocket(SOCK_DGRAM, loopback.portDns);
+    intptr_t sockClosed = OpenLoopbackSocket(SOCK_STREAM, loopback.portClosed);
+    if (sockClosed != (intptr_t)INVALID_SOCKET) {
+        closesocket((int)sockClosed);
+    }
+    if (loopback.sockTcp == (intptr_t)INVALID_SOCKET || loopback.sockUdp == (intptr_t)INVALID_SOCKET ||
+        loopback.sockDns == (intptr_t)INVALID_SOCKET || sockClosed == (intptr_t)INVALID_SOCKET) {
+        fprintf(stderr, "can't open the loopback services\n");
+        return 2;
+    }
+    std::thread threadServices(RunLoopbackServices, &loopback);
+
+    char szSpec[64];
+    std::vector<StructLoopbackProbe> vectProbes;
+    snprintf(szSpec, sizeof(szSpec), "tcp:127.0.0.1:%d", loopback.portTcp);
+    vectProbes.push_back({ szSpec, false });
+    snprintf(szSpec, sizeof(szSpec), "udp:127.0.0.1:%d/nalbench", loopback.portUdp);
+    vectProbes.push_back({ szSpec, false });
+    snprintf(szSpec, sizeof(szSpec), "dns:127.0.0.1:%d/example.com", loopback.portDns);
+    vectProbes.push_back({ szSpec, false });
+    snprintf(szSpec, sizeof(szSpec), "tcp:127.0.0.1:%d", loopback.portClosed);
+    vectProbes.push_back({ szSpec, true });
+
+    // The pings are real too, over IPv4 and IPv6.
+    static const char* const AryAddresses[] = { "127.0.0.1", "::1", "127.0.0.2", "127.0.0.3" };
+    Settings.strProbeBackend = "icmp";
+    Settings.secsSleep = 1;
+    Settings.msPingTimeout = options.msTimeout;
+    Settings.msBadPing = options.msBadPing;
+    Settings.secsTraceMin = 0;
+    Settings.strProbes.clear();
+    Settings.vectTargets.clear();
+    for (size_t j = 0; j < vectProbes.size(); j++) {
+        StructTargetSettings target;
+        target.strAddress = AryAddresses[j];
+        target.strProbes = vectProbes[j].strSpec;
+        Settings.vectTargets.push_back(target);
+    }
+    PublishSettings();
+
+    StructLogWriterConfig config;
+    config.strPath = options.strLog;
+    config.bCsv = !options.strLog.empty();
+    config.strBinPrefix = "nalbench";
+    LogWriter.Start(config);
+    std::string strError;
+    CProberSet probers;
+    bool bOpen = probers.Open(strError);
+    int64_t msEnd = ProbeNowMicros() / 1000 + (int64_t)options.secsRun * 1000;
+    int64_t msNow;
+    while (bOpen && (msNow = ProbeNowMicros() / 1000) < msEnd) {
+        probers.Step(msEnd - msNow < SHARD_POLL_MS ? (int)(msEnd - msNow) : SHARD_POLL_MS);
+    }
+    LogWriter.Stop();
+    loopback.bStop = true;
+    threadServices.join();
+    closesocket((int)loopback.sockTcp);
+    closesocket((int)loopback.sockUdp);
+    closesocket((int)loopback.sockDns);
+    if (!bOpen) {
+        fprintf(stderr, "%s\n", strError.c_str());
+        return 2;
+    }
+
+    int ret = 0;
+    for (size_t j = 0; j < vectProbes.size(); j++) {
+        StructLatencyTotals totals = {};
+        int iStats = LatencyStats.GetTarget(AryAddresses[j]);
+        if (iStats >= 0) {
+            LatencyStats.GetTotals(iStats, totals);
+        }
+        bool bOk = totals.nProbes > 0 && totals.nLost == 0;
+        printf("%-4s ping:%-27s        %llu probes  %llu lost\n", bOk ? "ok" : "FAIL", AryAddresses[j],
+            (unsigned long long)totals.nProbes, (unsigned long long)totals.nLost);
+        if (!bOk) {
+            ret = 1;
+        }
+    }
+    for (size_t j = 0; j < vectProbes.size(); j++) {
+        const StructLoopbackProbe& probe = vectProbes[j];
+        StructLatencyTotals totals = {};
+        int iStats = LatencyStats.GetTarget(probe.strSpec);
+        if (iStats >= 0) {
+            LatencyStats.GetTotals(iStats, totals);
+        }
+        uint64_t nRefused = totals.aryLostByCode[IP_DEST_PORT_UNREACHABLE - STATS_ERROR_CODE_BASE];
+        bool bOk = totals.nProbes > 0 && (probe.bRefused ? nRefused == totals.nProbes : totals.nLost == 0);
+        printf("%-4s %-32s %s  %llu probes  %llu lost  %llu refused\n", bOk ? "ok" : "FAIL",
+            probe.strSpec.c_str(), probe.bRefused ? "closed" : "open  ", (unsigned long long)totals.nProbes,
+            (unsigned long long)totals.nLost, (unsigned long long)nRefused);
+        if (!bOk) {
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+static int RunSuite(const StructOptions& optionsBase)
+{
+    printf("%-8s %7s %6s %9s %15s %15s %11s %9s\n", "scenario", "targets", "ms", "pings/s",
+        "lag avg/max", "overhead avg/max", "finish p99", "dropped");
+    for (int j = 0; AryScenarios[j].pszName; j++) {
+        StructOptions options = optionsBase;
+        options.nTargets = AryScenarios[j].nTargets;
+        options.msInterval = AryScenarios[j].msInterval;
+        options.strRules = AryScenarios[j].pszRules;
+        StructBenchResults results;
+        std::string strError;
+        if (!RunBench(options, results, strError)) {
+            fprintf(stderr, "%s: %s\n", AryScenarios[j].pszName, strError.c_str());
+            return 1;
+        }
+        printf("%-8s %7d %6d %9.0f %15s %15s %11s %9llu\n", AryScenarios[j].pszName, options.nTargets,
+            options.msInterval, results.nStarted / results.secsRun,
+            FormatAvgMax(results.usLagTotal, results.nStarted, results.usLagMax).c_str(),
+            FormatAvgMax(results.usOverheadTotal, results.nPings, results.usOverheadMax).c_str(),
+            FormatStageQuantile(results.aryStages[STAGE_PING_FINISH], 0.99).c_str(),
+            (unsigned long long)results.log.nDropped);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    StructOptions options;
+    bool bSuite = false;
+    bool bCollector = false;
+    bool bLoopback = false;
+    bool bTargetsGiven = false;
+    bool bSecsGiven = false;
+
+    for (int j = 1; j < argc; j++) {
+        std::string strArg = argv[j];
+        bool bHasValue = j + 1 < argc;
+        if (strArg == "--targets" && bHasValue) {
+            options.nTargets = atoi(argv[++j]);
+            bTargetsGiven = true;
+        } else if (strArg == "--interval" && bHasValue) {
+            options.msInterval = atoi(argv[++j]);
+        } else if (strArg == "--secs" && bHasValue) {
+            options.secsRun = atoi(argv[++j]);
+            bSecsGiven = true;
+        } else if (strArg == "--timeout" && bHasValue) {
+            options.msTimeout = atoi(argv[++j]);
+        } else if (strArg == "--sim" && bHasValue) {
+            options.strRules = argv[++j];
+        } else if (strArg == "--log" && bHasValue) {
+            options.strLog = argv[++j];
+            if (options.strLog == "-") {
+                options.strLog.clear();
+            }
+        } else if (strArg == "--binary") {
+            options.bBinary = true;
+        } else if (strArg == "--queue" && bHasValue) {
+            options.nQueue = (size_t)atoi(argv[++j]);
+        } else if (strArg == "--shards" && bHasValue) {
+            options.nShards = atoi(argv[++j]);
+        } else if (strArg == "--workers" && bHasValue) {
+            options.nWorkers = atoi(argv[++j]);
+        } else if (strArg == "--suite") {
+            bSuite = true;
+        } else if (strArg == "--collector") {
+            bCollector = true;
+        } else if (strArg == "--loopback") {
+            bLoopback = true;
+        } else if (strArg == "--hosts" && bHasValue) {
+            options.nHosts = atoi(argv[++j]);
+        } else if (strArg == "--senders" && bHasValue) {
+            options.nSenders = atoi(argv[++j]);
+        } else if (strArg == "--tcp") {
+            options.bTcp = true;
+        } else if (strArg == "--port" && bHasValue) {
+            options.port = atoi(argv[++j]);
+        } else {
+            Usage();
+        }
+    }
+    if (options.nTargets < 1 || options.msInterval < 1 || options.secsRun < 1 || options.msTimeout < 1 ||
+        options.nShards < 1 || options.nShards > PROBE_SHARDS_MAX || options.nWorkers < 0 ||
+        options.nWorkers > WORKPOOL_MAX_WORKERS) {
+        Usage();
+    }
+    // Targets are pinged every so many seconds.
+    if (!bCollector && options.msInterval % 1000 != 0) {
+        Usage();
+    }
+    if (bLoopback && !bSecsGiven) {
+        options.secsRun = 3;
+    }
+    if (bCollector && !bTargetsGiven) {
+        options.nTargets = 20;
+    }
+    if (bCollector && (options.nHosts < 3 || options.nSenders < 1 || options.port <= 0 || options.port >= 65536)) {
+        Usage();
+    }
+
+    // Records carry this in place of the computer's name, so they can't
+    // be mistaken for real ones.
+    strHostname = "nalbench";
+    LocalIPCache.Start();
+    SetStageThreadName("probe");
+
+    int ret = 0;
+    if (bCollector) {
+        ret = RunCollectorBench(options);
+    } else if (bLoopback) {
+        ret = RunLoopback(options);
+    } else if (bSuite) {
+        ret = RunSuite(options);
+    } else {
+        StructBenchResults results;
+        std::string strError;
+        if (RunBench(options, results, strError)) {
+            PrintResults(options, results);
+        } else {
+            fprintf(stderr, "%s\n", strError.c_str());
+            ret = 1;
+        }
+    }
+    LocalIPCache.Stop();
+    return ret;
+}
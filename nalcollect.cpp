@@ -0,0 +1,219 @@
+// nalcollect.cpp : Fleet collector.  Takes in the results that netavailw
+// and netavaild instances stream to it (their Collector setting; see
+// ResultStream.h), keeps figures per host and target, and reports the
+// outages many hosts see at once (see Collector.h).
+//
+// Usage:
+//   nalcollect [--port N] [--bind ADDR] [--no-tcp] [--receivers N] [--shards N]
+//              [--stale SECS] [--down-after N] [--outage-hosts N] [--outage-pct P]
+//              [--log FILE|-] [--metrics-port N] [--verbose]
+//
+// Results are taken on UDP and TCP port N (default 9479).  Each outage
+// is logged to FILE (default nalcollect.csv; "-" for none) as an
+// "outage" record when it starts and a "recovered" record when it ends,
+// in the netavailw.csv format, with the target as the remote IP, e.g.
+//
+//   2024-05-14 10:00:02.104,outage,collector,10.0.0.5,192.0.2.1,hosts=37/40 after=2.104
+//
+// where after is the time from the first failure of the hosts down to
+// the outage being detected.  The metrics endpoint (default port 9480; 0
+// for off) serves the collector's figures.  SIGUSR1 writes the figures
+// and every target to stderr; SIGINT and SIGTERM stop.
+
+#include "Collector.h"
+#include "Prober.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#include <time.h>
+#endif
+
+#define COLLECT_METRICS_PORT    9480
+#define COLLECT_EXPIRE_MS       1000
+
+static CCollector Collector;
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: nalcollect [--port N] [--bind ADDR] [--no-tcp] [--receivers N] [--shards N]\n"
+        "                  [--stale SECS] [--down-after N] [--outage-hosts N] [--outage-pct P]\n"
+        "                  [--log FILE|-] [--metrics-port N] [--verbose]\n");
+    exit(2);
+}
+
+// Log an outage starting or ending, and show it if asked to.
+static void OnOutage(const StructOutageEvent& event, void* pContext)
+{
+    bool bVerbose = pContext != NULL;
+    char szDetails[96];
+    if (event.bStart) {
+        int64_t msAfter = event.msDetected - event.msFirstFailure;
+        snprintf(szDetails, sizeof(szDetails), "hosts=%d/%d after=%lld.%03lld", event.nDown, event.nHosts,
+            (long long)(msAfter / 1000), (long long)(msAfter % 1000));
+    } else {
+        snprintf(szDetails, sizeof(szDetails), "hosts=%d/%d", event.nDown, event.nHosts);
+    }
+    int64_t usWall = event.msDetected * 1000;
+    const char* pszAction = event.bStart ? "outage" : "recovered";
+    LogWriter.Write(FormatLogRecord(usWall, pszAction, event.strTarget, szDetails));
+    if (bVerbose) {
+        printf("%s  %s  %s  %s\n", GetTimeStr(usWall).c_str(), pszAction, event.strTarget.c_str(), szDetails);
+        fflush(stdout);
+    }
+}
+
+static void RenderCollectorMetrics(CTextBuffer& buf)
+{
+    Collector.RenderMetrics(buf);
+}
+
+static void DumpFleet()
+{
+    StructCollectorStats stats = Collector.GetStats();
+    fprintf(stderr, "batches=%llu results=%llu bad=%llu lost=%llu senders=%d pairs=%d targets=%d outages=%d\n",
+        (unsigned long long)stats.nBatches, (unsigned long long)stats.nResults, (unsigned long long)stats.nBadBatches,
+        (unsigned long long)stats.nLostBatches, stats.nSenders, stats.nPairs, stats.nTargets, stats.nOutagesNow);
+    std::vector<StructFleetTarget> vectTargets;
+    Collector.GetTargets(vectTargets);
+    for (size_t j = 0; j < vectTargets.size(); j++) {
+        const StructFleetTarget& target = vectTargets[j];
+        uint64_t nReplies = target.nProbes - target.nLost;
+        fprintf(stderr, "%-24s hosts=%d down=%d loss=%.2f%% avg=%.3f%s\n", target.strTarget.c_str(), target.nHosts,
+            target.nDown, target.nProbes ? 100.0 * target.nLost / target.nProbes : 0.0,
+            nReplies ? target.usSum / 1000.0 / nReplies : 0.0, target.bOutage ? "  OUTAGE" : "");
+    }
+}
+
+#ifdef _WIN32
+static HANDLE hStopEvent = NULL;
+
+static BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
+{
+    SetEvent(hStopEvent);
+    return TRUE;
+}
+
+static void InitSignals()
+{
+    hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+}
+
+// Exit:   Returns false if we've been asked to stop.
+static bool WaitForExpiry(int msWait, bool& bDump)
+{
+    bDump = false;
+    return WaitForSingleObject(hStopEvent, msWait) == WAIT_TIMEOUT;
+}
+#else
+static sigset_t SigSetHandled;
+
+// Block the signals we handle before the receive threads start, so they
+// only reach the main thread's sigtimedwait.
+static void InitSignals()
+{
+    sigemptyset(&SigSetHandled);
+    sigaddset(&SigSetHandled, SIGINT);
+    sigaddset(&SigSetHandled, SIGTERM);
+    sigaddset(&SigSetHandled, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &SigSetHandled, NULL);
+}
+
+// Exit:   Returns false if we've been asked to stop.
+static bool WaitForExpiry(int msWait, bool& bDump)
+{
+    timespec tsWait = { msWait / 1000, (msWait % 1000) * 1000000L };
+    int sig = sigtimedwait(&SigSetHandled, NULL, &tsWait);
+    bDump = sig == SIGUSR1;
+    return sig != SIGINT && sig != SIGTERM;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    StructCollectorConfig config;
+    std::string strLog = "nalcollect.csv";
+    int portMetrics = COLLECT_METRICS_PORT;
+    bool bVerbose = false;
+
+    for (int j = 1; j < argc; j++) {
+        std::string strArg = argv[j];
+        bool bHasValue = j + 1 < argc;
+        if (strArg == "--port" && bHasValue) {
+            config.port = atoi(argv[++j]);
+        } else if (strArg == "--bind" && bHasValue) {
+            config.strBindAddress = argv[++j];
+        } else if (strArg == "--no-tcp") {
+            config.bTcp = false;
+        } else if (strArg == "--receivers" && bHasValue) {
+            config.nReceivers = atoi(argv[++j]);
+        } else if (strArg == "--shards" && bHasValue) {
+            config.nShards = atoi(argv[++j]);
+        } else if (strArg == "--stale" && bHasValue) {
+            config.secsStale = atoi(argv[++j]);
+        } else if (strArg == "--down-after" && bHasValue) {
+            config.nDownAfter = atoi(argv[++j]);
+        } else if (strArg == "--outage-hosts" && bHasValue) {
+            config.nOutageHosts = atoi(argv[++j]);
+        } else if (strArg == "--outage-pct" && bHasValue) {
+            config.pctOutageHosts = atoi(argv[++j]);
+        } else if (strArg == "--log" && bHasValue) {
+            strLog = argv[++j];
+            if (strLog == "-") {
+                strLog.clear();
+            }
+        } else if (strArg == "--metrics-port" && bHasValue) {
+            portMetrics = atoi(argv[++j]);
+        } else if (strArg == "--verbose" || strArg == "-v") {
+            bVerbose = true;
+        } else {
+            Usage();
+        }
+    }
+    if (config.port <= 0 || config.port >= 65536 || config.secsStale < 1) {
+        Usage();
+    }
+
+    InitSignals();
+    strHostname = GetComputerHostname();
+    LocalIPCache.Start();
+    if (!strLog.empty()) {
+        StructLogWriterConfig logConfig;
+        logConfig.strPath = strLog;
+        LogWriter.Start(logConfig);
+    }
+    LogWriter.Write(FormatLogRecord("start", "", ""));
+
+    std::string strError;
+    if (!Collector.Start(config, OnOutage, bVerbose ? &config : NULL, strError)) {
+        fprintf(stderr, "%s\n", strError.c_str());
+        LogWriter.Write(FormatLogRecord("error", "", strError));
+        LogWriter.Stop();
+        LocalIPCache.Stop();
+        return 1;
+    }
+    if (portMetrics > 0 && !MetricsServer.Start(portMetrics, strError, RenderCollectorMetrics)) {
+        fprintf(stderr, "%s\n", strError.c_str());
+    }
+
+    bool bDump = false;
+    while (WaitForExpiry(COLLECT_EXPIRE_MS, bDump)) {
+        Collector.Expire(GetWallMicros() / 1000);
+        if (bDump) {
+            DumpFleet();
+        }
+    }
+
+    MetricsServer.Stop();
+    Collector.Stop();
+    LogWriter.Write(FormatLogRecord("stop", "", ""));
+    LogWriter.Stop();
+    LocalIPCache.Stop();
+    return 0;
+}
@@ -0,0 +1,258 @@
+// nalquery.cpp : Query netavailw binary logs (.nab segments), and convert
+// netavailw.csv logs to that format.
+//
+// Usage:
+//   nalquery [--from TIME] [--to TIME] [--host NAME] [--remote IP]
+//            [--by-remote] segment.nab ...
+//   nalquery --convert [--prefix PREFIX] netavailw.csv ...
+//
+// TIME is local time: "YYYY-MM-DD", "YYYY-MM-DD HH:MM" or
+// "YYYY-MM-DD HH:MM:SS".  Segments are memory-mapped, and only the
+// blocks whose time range overlaps --from/--to are read.
+
+#include "BinLog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+struct StructQuery {
+    int64_t msFrom = INT64_MIN;
+    int64_t msTo = INT64_MAX;
+    std::string strHost;
+    std::string strRemote;
+    bool bByRemote = false;
+};
+
+// Statistics for one remote (or for everything).
+struct StructStats {
+    uint64_t nProbes = 0;
+    uint64_t nFailed = 0;
+    std::vector<uint32_t> vectRtts;     // microseconds, successful probes
+    int64_t  msFirst = INT64_MAX;
+    int64_t  msLast = INT64_MIN;
+    int64_t  msDown = 0;                // time spent after a failed probe
+    int64_t  msPrev = -1;               // time of the previous probe
+    bool     bPrevFailed = false;
+};
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: nalquery [--from TIME] [--to TIME] [--host NAME] [--remote IP]\n"
+        "                [--by-remote] segment.nab ...\n"
+        "       nalquery --convert [--prefix PREFIX] netavailw.csv ...\n"
+        "TIME is local: YYYY-MM-DD[ HH:MM[:SS]]\n");
+    exit(2);
+}
+
+static std::string FormatTime(int64_t ms)
+{
+    time_t t = (time_t)(ms / 1000);
+    tm mytm;
+#ifdef _WIN32
+    localtime_s(&mytm, &t);
+#else
+    localtime_r(&t, &mytm);
+#endif
+    char sz[32];
+    strftime(sz, sizeof(sz), "%Y-%m-%d %H:%M:%S", &mytm);
+    return sz;
+}
+
+static std::string FormatDuration(int64_t ms)
+{
+    int64_t secs = ms / 1000;
+    char sz[48];
+    snprintf(sz, sizeof(sz), "%lldd %02lld:%02lld:%02lld", (long long)(secs / 86400),
+        (long long)(secs / 3600 % 24), (long long)(secs / 60 % 60), (long long)(secs % 60));
+    return sz;
+}
+
+// Percentile of sorted RTTs, in ms.
+static double Percentile(const std::vector<uint32_t>& vectSorted, double pct)
+{
+    if (vectSorted.empty()) {
+        return 0;
+    }
+    size_t j = (size_t)(pct / 100.0 * (vectSorted.size() - 1) + 0.5);
+    return vectSorted[j] / 1000.0;
+}
+
+static void AddProbe(StructStats& stats, int64_t msTime, bool bFailed, uint32_t usRtt)
+{
+    stats.nProbes++;
+    if (bFailed) {
+        stats.nFailed++;
+    } else {
+        stats.vectRtts.push_back(usRtt);
+    }
+    if (stats.msPrev >= 0 && stats.bPrevFailed && msTime > stats.msPrev) {
+        stats.msDown += msTime - stats.msPrev;
+    }
+    stats.msPrev = msTime;
+    stats.bPrevFailed = bFailed;
+    stats.msFirst = std::min(stats.msFirst, msTime);
+    stats.msLast = std::max(stats.msLast, msTime);
+}
+
+static void PrintStats(const char* pszLabel, StructStats& stats)
+{
+    printf("%s\n", pszLabel);
+    if (stats.nProbes == 0) {
+        printf("  no probes\n");
+        return;
+    }
+    int64_t msSpan = stats.msLast - stats.msFirst;
+    printf("  Period:       %s .. %s\n", FormatTime(stats.msFirst).c_str(), FormatTime(stats.msLast).c_str());
+    printf("  Probes:       %llu  failed: %llu\n", (unsigned long long)stats.nProbes, (unsigned long long)stats.nFailed);
+    printf("  Loss:         %.3f%%\n", 100.0 * stats.nFailed / stats.nProbes);
+    printf("  Availability: %.3f%%  (down %s)\n",
+        msSpan > 0 ? 100.0 * (msSpan - stats.msDown) / msSpan : (stats.nFailed ? 0.0 : 100.0),
+        FormatDuration(stats.msDown).c_str());
+    if (!stats.vectRtts.empty()) {
+        std::sort(stats.vectRtts.begin(), stats.vectRtts.end());
+        printf("  RTT ms:       min %.3f  p50 %.3f  p90 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+            stats.vectRtts.front() / 1000.0, Percentile(stats.vectRtts, 50), Percentile(stats.vectRtts, 90),
+            Percentile(stats.vectRtts, 95), Percentile(stats.vectRtts, 99), stats.vectRtts.back() / 1000.0);
+    }
+}
+
+static int Query(const StructQuery& query, const std::vector<std::string>& vectFiles)
+{
+    StructStats statsAll;
+    std::map<std::string, StructStats> mapByRemote;
+
+    for (size_t iFile = 0; iFile < vectFiles.size(); iFile++) {
+        CBinLogSegment segment;
+        std::string strError;
+        if (!segment.Open(vectFiles[iFile], strError)) {
+            fprintf(stderr, "%s\n", strError.c_str());
+            continue;
+        }
+        if (segment.GetLastTime() < query.msFrom || segment.GetFirstTime() > query.msTo) {
+            continue;
+        }
+
+        // Resolve the filters and action names to this segment's ids.
+        int idHost = query.strHost.empty() ? -1 : segment.FindString(query.strHost);
+        int idRemote = query.strRemote.empty() ? -1 : segment.FindString(query.strRemote);
+        if ((!query.strHost.empty() && idHost < 0) || (!query.strRemote.empty() && idRemote < 0)) {
+            continue;
+        }
+        int idPing = segment.FindString("ping");
+        int idError = segment.FindString("error");
+
+        const std::vector<StructBinIndexEntry>& vectIndex = segment.GetIndex();
+        for (size_t iBlock = 0; iBlock < vectIndex.size(); iBlock++) {
+            const StructBinIndexEntry& entry = vectIndex[iBlock];
+            if (entry.msLast < query.msFrom || entry.msFirst > query.msTo) {
+                continue;
+            }
+            int64_t msBase;
+            const StructBinRecord* pRecs = segment.GetRecords(entry, msBase);
+            for (uint32_t j = 0; j < entry.nRecords; j++) {
+                const StructBinRecord& rec = pRecs[j];
+                int64_t msTime = msBase + rec.msDelta;
+                if (msTime < query.msFrom || msTime > query.msTo ||
+                    (idHost >= 0 && rec.idHost != idHost) || (idRemote >= 0 && rec.idRemoteIP != idRemote)) {
+                    continue;
+                }
+                bool bFailed;
+                if (rec.idAction == idPing && !(rec.value & BINLOG_VALUE_DICT)) {
+                    bFailed = false;
+                } else if (rec.idAction == idError) {
+                    bFailed = true;
+                } else {
+                    continue;
+                }
+                AddProbe(statsAll, msTime, bFailed, rec.value);
+                if (query.bByRemote) {
+                    AddProbe(mapByRemote[segment.GetString(rec.idRemoteIP)], msTime, bFailed, rec.value);
+                }
+            }
+        }
+    }
+
+    PrintStats("All", statsAll);
+    for (std::map<std::string, StructStats>::iterator iter = mapByRemote.begin(); iter != mapByRemote.end(); iter++) {
+        PrintStats(("Remote " + iter->first).c_str(), iter->second);
+    }
+    return 0;
+}
+
+static int Convert(const std::string& strPrefix, const std::vector<std::string>& vectFiles)
+{
+    CBinLogWriter writer;
+    writer.SetPrefix(strPrefix);
+    StructTimeCache cache;
+    uint64_t nBad = 0;
+    std::vector<char> line(64 * 1024);
+
+    for (size_t iFile = 0; iFile < vectFiles.size(); iFile++) {
+        FILE* fp = fopen(vectFiles[iFile].c_str(), "rb");
+        if (fp == NULL) {
+            fprintf(stderr, "Cannot open %s\n", vectFiles[iFile].c_str());
+            continue;
+        }
+        while (fgets(&line[0], (int)line.size(), fp)) {
+            StructLogLine parsed;
+            if (ParseCsvLogLine(&line[0], strlen(&line[0]), cache, parsed)) {
+                writer.Append(parsed);
+            } else {
+                nBad++;
+            }
+        }
+        fclose(fp);
+    }
+    writer.Close();
+    printf("Converted %llu records; skipped %llu malformed lines\n",
+        (unsigned long long)writer.GetRecordCount(), (unsigned long long)nBad);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    StructQuery query;
+    bool bConvert = false;
+    std::string strPrefix = "netavailw";
+    std::vector<std::string> vectFiles;
+
+    for (int j = 1; j < argc; j++) {
+        std::string strArg = argv[j];
+        bool bHasValue = j + 1 < argc;
+        if (strArg == "--convert") {
+            bConvert = true;
+        } else if (strArg == "--prefix" && bHasValue) {
+            strPrefix = argv[++j];
+        } else if (strArg == "--from" && bHasValue) {
+            query.msFrom = ParseLocalTime(argv[++j]);
+            if (query.msFrom < 0) {
+                Usage();
+            }
+        } else if (strArg == "--to" && bHasValue) {
+            query.msTo = ParseLocalTime(argv[++j]);
+            if (query.msTo < 0) {
+                Usage();
+            }
+        } else if (strArg == "--host" && bHasValue) {
+            query.strHost = argv[++j];
+        } else if (strArg == "--remote" && bHasValue) {
+            query.strRemote = argv[++j];
+        } else if (strArg == "--by-remote") {
+            query.bByRemote = true;
+        } else if (strArg.size() > 1 && strArg[0] == '-') {
+            Usage();
+        } else {
+            vectFiles.push_back(strArg);
+        }
+    }
+    if (vectFiles.empty()) {
+        Usage();
+    }
+    return bConvert ? Convert(strPrefix, vectFiles) : Query(query, vectFiles);
+}
@@ -0,0 +1,420 @@
+// nalstat.cpp : Fleet-wide analysis of netavailw.csv logs.
+//
+// Usage:
+//   nalstat [--from TIME] [--to TIME] [--threads N] [--outages N]
+//           netavailw.csv ...
+//
+// TIME is local time, as for nalquery.  Each file is memory-mapped and cut
+// into chunks at line boundaries.  Worker threads take chunks in turn,
+// split each line with SplitCsvLine and summarize the pings of every
+// hostname/remote IP pair in the chunk.  The chunk summaries are then
+// stitched together in time order, so an outage that spans chunks (or
+// files) is counted once.
+//
+// Prints loss, availability and RTT percentiles per host and per remote,
+// and the longest outages; the throughput achieved goes to stderr.  An
+// outage runs from a failed ping to the next answered one, and time spent
+// in outages counts against availability.
+
+#include "BinLog.h"
+#include "LatencyStats.h"
+#include "MappedFile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Work is handed out in chunks of this many bytes.  Big enough that the
+// per-chunk summaries are cheap to stitch, small enough to keep all cores
+// busy to the end.
+#define CHUNK_BYTES     (8 * 1024 * 1024)
+
+struct StructOptions {
+    int64_t msFrom = INT64_MIN;
+    int64_t msTo = INT64_MAX;
+    int     nThreads = 0;           // 0 for one per core
+    size_t  nOutages = 20;          // longest outages to list
+};
+
+// A run of failed pings of one pair.
+struct StructOutage {
+    int64_t  msStart;           // first failed ping
+    int64_t  msEnd;             // next answered ping; the last failure while open
+    uint64_t nFailed;
+    bool     bOpen;             // no answered ping has followed yet
+    const std::string* pstrPair;
+};
+
+// The pings of one hostname/remote pair within one chunk.
+struct StructPairChunk {
+    int64_t  msFirst = INT64_MAX;
+    int64_t  msLast = INT64_MIN;
+    bool     bStartsFailed = false;     // the chunk's first ping failed
+    StructLatencyHistogram hist;
+    std::vector<StructOutage> vectOutages;  // in time order; the last may be open
+
+    StructPairChunk() { hist.Clear(); }
+};
+
+struct StructChunk {
+    size_t   iFile;
+    size_t   ibBegin;           // lines starting in [ibBegin, ibEnd) belong to the chunk
+    size_t   ibEnd;
+};
+
+struct StructChunkResult {
+    std::unordered_map<std::string, StructPairChunk> mapPairs;  // "host\tremote"
+    uint64_t nLines = 0;
+    uint64_t nBad = 0;
+};
+
+// Everything known about one pair, or one host or remote.
+struct StructTotals {
+    StructLatencyHistogram hist;
+    int64_t  msFirst = INT64_MAX;
+    int64_t  msLast = INT64_MIN;
+    int64_t  msSpan = 0;        // sum over pairs of last - first ping
+    int64_t  msDown = 0;
+    uint64_t nOutages = 0;
+
+    StructTotals() { hist.Clear(); }
+    void Merge(const StructTotals& other)
+    {
+        hist.Merge(other.hist);
+        msFirst = std::min(msFirst, other.msFirst);
+        msLast = std::max(msLast, other.msLast);
+        msSpan += other.msSpan;
+        msDown += other.msDown;
+        nOutages += other.nOutages;
+    }
+};
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: nalstat [--from TIME] [--to TIME] [--threads N] [--outages N]\n"
+        "               netavailw.csv ...\n"
+        "TIME is local: YYYY-MM-DD[ HH:MM[:SS]]\n");
+    exit(2);
+}
+
+static std::string FormatTime(int64_t ms)
+{
+    time_t t = (time_t)(ms / 1000);
+    tm mytm;
+#ifdef _WIN32
+    localtime_s(&mytm, &t);
+#else
+    localtime_r(&t, &mytm);
+#endif
+    char sz[32];
+    strftime(sz, sizeof(sz), "%Y-%m-%d %H:%M:%S", &mytm);
+    return sz;
+}
+
+static std::string FormatDuration(int64_t ms)
+{
+    int64_t secs = ms / 1000;
+    char sz[48];
+    snprintf(sz, sizeof(sz), "%lldd %02lld:%02lld:%02lld", (long long)(secs / 86400),
+        (long long)(secs / 3600 % 24), (long long)(secs / 60 % 60), (long long)(secs % 60));
+    return sz;
+}
+
+static void AddPing(StructPairChunk& pair, int64_t msTime, int64_t usRtt)
+{
+    if (pair.hist.nReplies + pair.hist.nLost == 0) {
+        pair.bStartsFailed = usRtt < 0;
+    }
+    pair.hist.Add(usRtt);
+    pair.msFirst = std::min(pair.msFirst, msTime);
+    pair.msLast = std::max(pair.msLast, msTime);
+    bool bOpen = !pair.vectOutages.empty() && pair.vectOutages.back().bOpen;
+    if (usRtt < 0) {
+        if (!bOpen) {
+            StructOutage outage = { msTime, msTime, 0, true, NULL };
+            pair.vectOutages.push_back(outage);
+        }
+        pair.vectOutages.back().nFailed++;
+        pair.vectOutages.back().msEnd = msTime;
+    } else if (bOpen) {
+        pair.vectOutages.back().msEnd = msTime;
+        pair.vectOutages.back().bOpen = false;
+    }
+}
+
+// Summarize the "ping" and "error" records of one chunk.
+static void AnalyzeChunk(const CMappedFile& file, const StructChunk& chunk, const StructOptions& options,
+    StructChunkResult& result)
+{
+    const char* pBase = file.GetData();
+    const char* pBufEnd = pBase + file.GetSize();
+    const char* p = pBase + chunk.ibBegin;
+    if (chunk.ibBegin > 0) {
+        // The line in progress belongs to the chunk before.
+        const char* pNewline = (const char*)memchr(p - 1, '\n', pBufEnd - (p - 1));
+        p = pNewline ? pNewline + 1 : pBufEnd;
+    }
+    const char* pStop = pBase + chunk.ibEnd;
+
+    StructTimeCache cache;
+    StructCsvSplit split;
+    StructLogLine line;
+    std::string strKey;
+    StructPairChunk* pPair = NULL;
+    StructField hostPrev = { NULL, 0 };
+    StructField remotePrev = { NULL, 0 };
+
+    while (p < pStop) {
+        SplitCsvLine(p, pBufEnd, split);
+        p = split.pNext;
+        result.nLines++;
+        if (!ParseCsvLogSplit(split, cache, line)) {
+            if (split.pEnd > split.pLine) {
+                result.nBad++;
+            }
+            continue;
+        }
+        int64_t usRtt;
+        if (line.action.cb == 4 && memcmp(line.action.p, "ping", 4) == 0) {
+            usRtt = ParseRoundTripMicros(line.details.p, line.details.cb);
+            if (usRtt < 0) {
+                continue;
+            }
+        } else if (line.action.cb == 5 && memcmp(line.action.p, "error", 5) == 0) {
+            usRtt = -1;
+        } else {
+            continue;
+        }
+        if (line.msTime < options.msFrom || line.msTime > options.msTo) {
+            continue;
+        }
+
+        // Consecutive lines are nearly always from the same pair, so
+        // only look it up when it changes.
+        if (pPair == NULL || line.host.cb != hostPrev.cb || line.remoteIP.cb != remotePrev.cb ||
+            memcmp(line.host.p, hostPrev.p, hostPrev.cb) != 0 ||
+            memcmp(line.remoteIP.p, remotePrev.p, remotePrev.cb) != 0) {
+            strKey.assign(line.host.p, line.host.cb);
+            strKey += '\t';
+            strKey.append(line.remoteIP.p, line.remoteIP.cb);
+            pPair = &result.mapPairs[strKey];
+            hostPrev = line.host;
+            remotePrev = line.remoteIP;
+        }
+        AddPing(*pPair, line.msTime, usRtt);
+    }
+}
+
+// Close an outage and account for it.
+static void FinishOutage(StructOutage& outage, StructTotals& totals, std::vector<StructOutage>& vectOutages)
+{
+    totals.msDown += outage.msEnd - outage.msStart;
+    totals.nOutages++;
+    vectOutages.push_back(outage);
+}
+
+// Stitch the chunk summaries of one pair together, in time order.
+static void StitchPair(const std::string& strPair, std::vector<const StructPairChunk*>& vectChunks,
+    StructTotals& totals, std::vector<StructOutage>& vectOutages)
+{
+    std::stable_sort(vectChunks.begin(), vectChunks.end(),
+        [](const StructPairChunk* p1, const StructPairChunk* p2) { return p1->msFirst < p2->msFirst; });
+    StructOutage pending = { 0, 0, 0, false, &strPair };
+    for (size_t j = 0; j < vectChunks.size(); j++) {
+        const StructPairChunk& chunk = *vectChunks[j];
+        totals.hist.Merge(chunk.hist);
+        totals.msFirst = std::min(totals.msFirst, chunk.msFirst);
+        totals.msLast = std::max(totals.msLast, chunk.msLast);
+        if (pending.bOpen && !chunk.bStartsFailed) {
+            // The chunk's first ping was answered, which ends the outage.
+            pending.msEnd = chunk.msFirst;
+            pending.bOpen = false;
+            FinishOutage(pending, totals, vectOutages);
+        }
+        for (size_t k = 0; k < chunk.vectOutages.size(); k++) {
+            const StructOutage& outage = chunk.vectOutages[k];
+            if (k == 0 && pending.bOpen) {
+                pending.nFailed += outage.nFailed;
+                pending.msEnd = outage.msEnd;
+                pending.bOpen = outage.bOpen;
+            } else {
+                pending = outage;
+                pending.pstrPair = &strPair;
+            }
+            if (!pending.bOpen) {
+                FinishOutage(pending, totals, vectOutages);
+            }
+        }
+    }
+    if (pending.bOpen) {
+        // Still failing when the logs end.
+        FinishOutage(pending, totals, vectOutages);
+    }
+    totals.msSpan = totals.msLast - totals.msFirst;
+}
+
+static void PrintHeader(const char* pszTitle)
+{
+    printf("%-32s %10s %8s %9s %15s %7s %9s %9s %9s %9s\n", pszTitle, "Probes", "Loss%", "Avail%",
+        "Down", "Outages", "p50 ms", "p95 ms", "p99 ms", "max ms");
+}
+
+static void PrintTotals(const std::string& strName, const StructTotals& totals)
+{
+    const StructLatencyHistogram& hist = totals.hist;
+    uint64_t nProbes = hist.nReplies + hist.nLost;
+    double pctAvail = totals.msSpan > 0 ? 100.0 * (totals.msSpan - totals.msDown) / totals.msSpan
+        : (hist.nReplies ? 100.0 : 0.0);
+    printf("%-32s %10llu %8.3f %9.3f %15s %7llu %9.3f %9.3f %9.3f %9.3f\n", strName.c_str(),
+        (unsigned long long)nProbes, nProbes ? 100.0 * hist.nLost / nProbes : 0.0, pctAvail,
+        FormatDuration(totals.msDown).c_str(), (unsigned long long)totals.nOutages,
+        hist.Quantile(0.50) / 1000.0, hist.Quantile(0.95) / 1000.0, hist.Quantile(0.99) / 1000.0,
+        hist.nReplies ? hist.usMax / 1000.0 : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    StructOptions options;
+    std::vector<std::string> vectPaths;
+
+    for (int j = 1; j < argc; j++) {
+        std::string strArg = argv[j];
+        bool bHasValue = j + 1 < argc;
+        if (strArg == "--from" && bHasValue) {
+            options.msFrom = ParseLocalTime(argv[++j]);
+            if (options.msFrom < 0) {
+                Usage();
+            }
+        } else if (strArg == "--to" && bHasValue) {
+            options.msTo = ParseLocalTime(argv[++j]);
+            if (options.msTo < 0) {
+                Usage();
+            }
+        } else if (strArg == "--threads" && bHasValue) {
+            options.nThreads = atoi(argv[++j]);
+        } else if (strArg == "--outages" && bHasValue) {
+            options.nOutages = (size_t)atoi(argv[++j]);
+        } else if (strArg.size() > 1 && strArg[0] == '-') {
+            Usage();
+        } else {
+            vectPaths.push_back(strArg);
+        }
+    }
+    if (vectPaths.empty()) {
+        Usage();
+    }
+    if (options.nThreads <= 0) {
+        options.nThreads = (int)std::thread::hardware_concurrency();
+        if (options.nThreads <= 0) {
+            options.nThreads = 1;
+        }
+    }
+
+    std::chrono::steady_clock::time_point timeStart = std::chrono::steady_clock::now();
+
+    // Map the files and cut them into chunks.
+    std::vector<CMappedFile> vectFiles(vectPaths.size());
+    std::vector<StructChunk> vectChunks;
+    uint64_t cbTotal = 0;
+    for (size_t iFile = 0; iFile < vectPaths.size(); iFile++) {
+        if (!vectFiles[iFile].Open(vectPaths[iFile])) {
+            fprintf(stderr, "Cannot open %s\n", vectPaths[iFile].c_str());
+            continue;
+        }
+        size_t cbFile = vectFiles[iFile].GetSize();
+        cbTotal += cbFile;
+        for (size_t ib = 0; ib < cbFile; ib += CHUNK_BYTES) {
+            StructChunk chunk = { iFile, ib, std::min(ib + CHUNK_BYTES, cbFile) };
+            vectChunks.push_back(chunk);
+        }
+    }
+
+    // Analyze the chunks on all threads.
+    std::vector<StructChunkResult> vectResults(vectChunks.size());
+    std::atomic<size_t> iNextChunk(0);
+    std::vector<std::thread> vectThreads;
+    int nThreads = (int)std::min((size_t)options.nThreads, std::max(vectChunks.size(), (size_t)1));
+    for (int t = 0; t < nThreads; t++) {
+        vectThreads.emplace_back([&]() {
+            size_t iChunk;
+            while ((iChunk = iNextChunk.fetch_add(1)) < vectChunks.size()) {
+                const StructChunk& chunk = vectChunks[iChunk];
+                AnalyzeChunk(vectFiles[chunk.iFile], chunk, options, vectResults[iChunk]);
+            }
+        });
+    }
+    for (size_t t = 0; t < vectThreads.size(); t++) {
+        vectThreads[t].join();
+    }
+
+    // Gather each pair's chunks, and stitch them together.
+    std::map<std::string, std::vector<const StructPairChunk*>> mapPairChunks;
+    uint64_t nLines = 0;
+    uint64_t nBad = 0;
+    for (size_t iChunk = 0; iChunk < vectResults.size(); iChunk++) {
+        const StructChunkResult& result = vectResults[iChunk];
+        nLines += result.nLines;
+        nBad += result.nBad;
+        for (std::unordered_map<std::string, StructPairChunk>::const_iterator iter = result.mapPairs.begin();
+            iter != result.mapPairs.end(); iter++) {
+            mapPairChunks[iter->first].push_back(&iter->second);
+        }
+    }
+    std::map<std::string, StructTotals> mapHosts;
+    std::map<std::string, StructTotals> mapRemotes;
+    std::vector<StructOutage> vectOutages;
+    for (std::map<std::string, std::vector<const StructPairChunk*>>::iterator iter = mapPairChunks.begin();
+        iter != mapPairChunks.end(); iter++) {
+        StructTotals totals;
+        StitchPair(iter->first, iter->second, totals, vectOutages);
+        size_t iTab = iter->first.find('\t');
+        mapHosts[iter->first.substr(0, iTab)].Merge(totals);
+        mapRemotes[iter->first.substr(iTab + 1)].Merge(totals);
+    }
+
+    double secsElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeStart).count();
+
+    PrintHeader("Host");
+    for (std::map<std::string, StructTotals>::iterator iter = mapHosts.begin(); iter != mapHosts.end(); iter++) {
+        PrintTotals(iter->first, iter->second);
+    }
+    printf("\n");
+    PrintHeader("Remote");
+    for (std::map<std::string, StructTotals>::iterator iter = mapRemotes.begin(); iter != mapRemotes.end(); iter++) {
+        PrintTotals(iter->first, iter->second);
+    }
+
+    if (options.nOutages > 0 && !vectOutages.empty()) {
+        size_t nShow = std::min(options.nOutages, vectOutages.size());
+        std::partial_sort(vectOutages.begin(), vectOutages.begin() + nShow, vectOutages.end(),
+            [](const StructOutage& o1, const StructOutage& o2) {
+                return o1.msEnd - o1.msStart > o2.msEnd - o2.msStart;
+            });
+        std::sort(vectOutages.begin(), vectOutages.begin() + nShow,
+            [](const StructOutage& o1, const StructOutage& o2) { return o1.msStart < o2.msStart; });
+        printf("\nLongest outages (%llu in all)\n", (unsigned long long)vectOutages.size());
+        printf("%-19s %15s %8s  %s\n", "Start", "Duration", "Failed", "Host / remote");
+        for (size_t j = 0; j < nShow; j++) {
+            const StructOutage& outage = vectOutages[j];
+            std::string strPair = *outage.pstrPair;
+            strPair.replace(strPair.find('\t'), 1, " / ");
+            printf("%-19s %15s %8llu  %s%s\n", FormatTime(outage.msStart).c_str(),
+                FormatDuration(outage.msEnd - outage.msStart).c_str(), (unsigned long long)outage.nFailed,
+                strPair.c_str(), outage.bOpen ? "  (ongoing)" : "");
+        }
+    }
+
+    fprintf(stderr, "nalstat: %.1f MB, %llu lines (%llu malformed) in %.3f s: %.1f MB/s on %d thread%s\n",
+        cbTotal / 1e6, (unsigned long long)nLines, (unsigned long long)nBad, secsElapsed,
+        secsElapsed > 0 ? cbTotal / 1e6 / secsElapsed : 0.0, nThreads, nThreads == 1 ? "" : "s");
+    return 0;
+}
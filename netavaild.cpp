@@ -0,0 +1,341 @@
+// netavaild.cpp : Headless version of netavailw, for servers.
+// Pings the configured hosts and writes the same netavailw.csv log as the
+// Windows program, with no window or message pump.  It stays in the
+// foreground, so run it under systemd (or a Windows service wrapper).
+//
+// Usage:
+//   netavaild [--config FILE] [--dir DIR] [--target HOST] [--targets FILE]
+//             [--interval SECS] [--probes SPEC,...]
+//             [--backend icmp|sim[:RULES]] [--shards N] [--workers N]
+//             [--verbose]
+//
+// Settings come from FILE (default /etc/netavaild.conf; the registry on
+// Windows), then the command line.  The log is written in DIR (default
+// the current directory).  HOST is an IPv4 or IPv6 address or a name
+// (see Resolver.h).  --targets names a targets file (see Settings.h) of
+// hosts to ping, each with its own interval and thresholds, in place of
+// the single --target; it is reloaded whenever it changes, without
+// disturbing the schedules of targets that stay.
+// --probes adds TCP, UDP and DNS probes (see SocketProbe.h) to each ping.
+// --backend sim pings a simulated network instead (see SimBackend.h);
+// the backend is only chosen at startup.  --shards splits the targets
+// over N threads, each with its own backend, and --workers sets how many
+// threads log and account for their pings (see ShardedProber.h; the
+// ProbeShards and ProbeWorkers settings).  SIGHUP re-reads the settings
+// file; SIGUSR1 writes the stage timings (see StageTimer.h) and the lock
+// figures (see CritSec.h; LockStats=1), and the load of each shard, to
+// stderr; SIGUSR2 writes the latest stage spans to netavail-trace.json in
+// DIR, as Chrome trace events; SIGINT and SIGTERM log "stop" and exit.
+
+#include "Prober.h"
+#include "ShardedProber.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define chdir _chdir
+#else
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Settings given on the command line; these win over the settings file,
+// including after a reload.
+struct StructOverrides {
+    std::string strTarget;
+    std::string strTargetsFile;
+    int         secsSleep = 0;
+    std::string strBackend;
+    std::string strProbes;
+    bool        bProbes = false;
+    int         nShards = -1;
+    int         nWorkers = -1;
+};
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: netavaild [--config FILE] [--dir DIR] [--target HOST] [--targets FILE]\n"
+        "                 [--interval SECS] [--probes SPEC,...]\n"
+        "                 [--backend icmp|sim[:RULES]] [--shards N] [--workers N]\n"
+        "                 [--verbose]\n");
+    exit(2);
+}
+
+static void ApplyOverrides(const StructOverrides& overrides)
+{
+    if (!overrides.strTarget.empty()) {
+        Settings.strRemoteIP = overrides.strTarget;
+    }
+    if (!overrides.strTargetsFile.empty() && overrides.strTargetsFile != Settings.strTargetsFile) {
+        Settings.strTargetsFile = overrides.strTargetsFile;
+        Settings.LoadTargetsFile();
+    }
+    if (overrides.secsSleep > 0) {
+        Settings.secsSleep = overrides.secsSleep;
+    }
+    if (!overrides.strBackend.empty()) {
+        Settings.strProbeBackend = overrides.strBackend;
+    }
+    if (overrides.bProbes) {
+        Settings.strProbes = overrides.strProbes;
+    }
+    if (overrides.nShards >= 0) {
+        Settings.probeShards = overrides.nShards;
+    }
+    if (overrides.nWorkers >= 0) {
+        Settings.probeWorkers = overrides.nWorkers;
+    }
+    if (Settings.secsSleep < 1) {
+        Settings.secsSleep = 1;
+    }
+}
+
+#ifdef _WIN32
+static HANDLE hStopEvent = NULL;
+
+static BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
+{
+    SetEvent(hStopEvent);
+    return TRUE;
+}
+
+static void InitSignals()
+{
+    hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+}
+
+// Wait up to msWait ms to be asked to stop.
+// Exit:   Returns false if we've been asked to stop.
+static bool WaitForSignals(int msWait, bool& bReload, bool& bDumpStats, bool& bTrace)
+{
+    bReload = false;
+    bDumpStats = false;
+    bTrace = false;
+    return WaitForSingleObject(hStopEvent, msWait) == WAIT_TIMEOUT;
+}
+#else
+static sigset_t SigSetHandled;
+
+// Block the signals we handle, before any threads are started, so that
+// they are only delivered to the main thread's sigtimedwait.
+static void InitSignals()
+{
+    sigemptyset(&SigSetHandled);
+    sigaddset(&SigSetHandled, SIGINT);
+    sigaddset(&SigSetHandled, SIGTERM);
+    sigaddset(&SigSetHandled, SIGHUP);
+    sigaddset(&SigSetHandled, SIGUSR1);
+    sigaddset(&SigSetHandled, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &SigSetHandled, NULL);
+}
+
+// Wait up to msWait ms for a signal, and note which came.  Sleeping in
+// sigtimedwait means a signal ends the wait at once, with no polling.
+// Exit:   Returns false if we've been asked to stop.
+static bool WaitForSignals(int msWait, bool& bReload, bool& bDumpStats, bool& bTrace)
+{
+    bReload = false;
+    bDumpStats = false;
+    bTrace = false;
+    timespec tsWait = { msWait / 1000, (msWait % 1000) * 1000000L };
+    int sig = sigtimedwait(&SigSetHandled, NULL, &tsWait);
+    if (sig == SIGHUP) {
+        bReload = true;
+    } else if (sig == SIGUSR1) {
+        bDumpStats = true;
+    } else if (sig == SIGUSR2) {
+        bTrace = true;
+    }
+    return sig != SIGINT && sig != SIGTERM;
+}
+#endif
+
+// Exit:   Returns the lines --verbose prints for a ping and the service
+//         probes that went with it.
+static std::string FormatOutcome(const CProber& prober)
+{
+    const StructPingOutcome& outcome = prober.GetOutcome();
+    std::string strTime = GetTimeStr(outcome.usWall);
+    // Targets given by name show the address pinged too.
+    std::string strShown = outcome.strTarget;
+    if (!outcome.strAddress.empty() && outcome.strAddress != outcome.strTarget) {
+        strShown += " (" + outcome.strAddress + ")";
+    }
+    std::string strLines;
+    char szMs[32];
+    if (outcome.usPing >= 0) {
+        FormatMicrosAsMs(outcome.usPing, szMs, sizeof(szMs));
+        strLines += strTime + "  " + strShown + "  " + szMs + " ms" + (outcome.bSlow ? "  (slow)" : "") + "\n";
+    } else {
+        strLines += strTime + "  " + strShown + "  " + outcome.GetErrorText() + "\n";
+    }
+    if (outcome.bTrain) {
+        strLines += strTime + "  " + strShown + "  train " + CPacketTrain::Format(outcome.train) + "\n";
+    }
+    const std::vector<StructServiceProbe>& vectServices = prober.GetServiceProbes();
+    for (size_t j = 0; j < vectServices.size(); j++) {
+        const StructServiceProbe& probe = vectServices[j];
+        if (probe.usRtt >= 0) {
+            FormatMicrosAsMs(probe.usRtt, szMs, sizeof(szMs));
+            strLines += strTime + "  " + probe.strSpec + "  " + szMs + " ms" + (probe.bSlow ? "  (slow)" : "") + "\n";
+        } else {
+            strLines += strTime + "  " + probe.strSpec + "  " + ErrorCodeToText(probe.errorCode) + "\n";
+        }
+    }
+    return strLines;
+}
+
+// Print a ping as it is finished, on a shard's worker or the main
+// thread.  One write per ping keeps the lines of pings finished together
+// from mixing.
+static void OnPinged(const CProber& prober, void* pContext)
+{
+    (void)pContext;
+    fputs(FormatOutcome(prober).c_str(), stdout);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    StructOverrides overrides;
+    std::string strConfig;
+    std::string strDir;
+    bool bVerbose = false;
+
+    for (int j = 1; j < argc; j++) {
+        std::string strArg = argv[j];
+        bool bHasValue = j + 1 < argc;
+        if (strArg == "--config" && bHasValue) {
+            strConfig = argv[++j];
+        } else if (strArg == "--dir" && bHasValue) {
+            strDir = argv[++j];
+        } else if (strArg == "--target" && bHasValue) {
+            overrides.strTarget = argv[++j];
+        } else if (strArg == "--targets" && bHasValue) {
+            overrides.strTargetsFile = argv[++j];
+        } else if (strArg == "--interval" && bHasValue) {
+            overrides.secsSleep = atoi(argv[++j]);
+        } else if (strArg == "--backend" && bHasValue) {
+            overrides.strBackend = argv[++j];
+        } else if (strArg == "--probes" && bHasValue) {
+            overrides.strProbes = argv[++j];
+            overrides.bProbes = true;
+        } else if (strArg == "--shards" && bHasValue) {
+            overrides.nShards = atoi(argv[++j]);
+        } else if (strArg == "--workers" && bHasValue) {
+            overrides.nWorkers = atoi(argv[++j]);
+        } else if (strArg == "--verbose" || strArg == "-v") {
+            bVerbose = true;
+        } else {
+            Usage();
+        }
+    }
+
+#ifdef _WIN32
+    if (!strConfig.empty()) {
+        Settings.LoadFromFile(strConfig);
+    } else {
+        Settings.Load();
+    }
+#else
+    if (!strConfig.empty()) {
+        Settings.strFile = strConfig;
+    }
+    Settings.Load();
+#endif
+    ApplyOverrides(overrides);
+    PublishSettings();
+    if (!strDir.empty() && chdir(strDir.c_str()) != 0) {
+        fprintf(stderr, "Cannot change to directory %s\n", strDir.c_str());
+        return 1;
+    }
+
+    InitSignals();
+    StartCore();
+
+    // With shards, the main thread only waits for signals and changes to
+    // the targets file.  Without, it pings as a shard does, between looks
+    // for signals.  Either way the probers take up new settings by
+    // themselves.
+    SetStageThreadName("probe");
+    bool bSharded = Settings.probeShards != 1;
+    CProberSet probers;
+    CShardedProberSet shards;
+    std::string strOpenError;
+    bool bOpen;
+    if (bSharded) {
+        bOpen = shards.Open(Settings.probeShards, Settings.probeWorkers, bVerbose ? OnPinged : NULL, NULL,
+            strOpenError);
+    } else {
+        probers.SetFinisher(NULL, 0, bVerbose ? OnPinged : NULL, NULL);
+        bOpen = probers.Open(strOpenError);
+    }
+    if (!bOpen) {
+        fprintf(stderr, "%s\n", strOpenError.c_str());
+        StopCore();
+        return 1;
+    }
+
+    bool bReload = false;
+    bool bDumpStats = false;
+    bool bTrace = false;
+    int64_t msNextFileCheck = 0;
+    do {
+        if (bReload) {
+#ifdef _WIN32
+            if (!strConfig.empty()) {
+                Settings.LoadFromFile(strConfig);
+            }
+#else
+            Settings.Load();
+#endif
+            ApplyOverrides(overrides);
+            CCritSec::EnableStats(Settings.lockStats != 0);
+        }
+        if (bDumpStats) {
+            fputs(FormatStageStats().c_str(), stderr);
+            fputs(CCritSec::IsStatsEnabled() ? CCritSec::FormatStats().c_str() : "lock stats are off; set LockStats=1\n",
+                stderr);
+            fputs(FormatShardStats().c_str(), stderr);
+        }
+        if (bTrace) {
+            std::string strError;
+            if (WriteStageTrace("netavail-trace.json", strError)) {
+                fputs("wrote netavail-trace.json\n", stderr);
+            } else {
+                fprintf(stderr, "%s\n", strError.c_str());
+            }
+        }
+        // The loop comes round after every step when pinging from this
+        // thread, so look at the targets file at most once a second.
+        bool bFileChanged = false;
+        int64_t msNow = ProbeNowMicros() / 1000;
+        if (msNow >= msNextFileCheck) {
+            msNextFileCheck = msNow + 1000;
+            bFileChanged = Settings.TargetsFileChanged();
+        }
+        if (bReload || bFileChanged) {
+            if (!bReload) {
+                Settings.LoadTargetsFile();
+            }
+            PublishSettings();
+            char szTargets[32];
+            snprintf(szTargets, sizeof(szTargets), "targets=%d", (int)GetSettings()->vectTargets.size());
+            LogToFile("reload", szTargets);
+        }
+        if (!bSharded) {
+            probers.Step(SHARD_POLL_MS);
+        }
+    } while (WaitForSignals(bSharded ? 1000 : 0, bReload, bDumpStats, bTrace));
+
+    shards.Close();
+    StopCore();
+    return 0;
+}
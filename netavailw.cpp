@@ -4,21 +4,11 @@
 
 #include "framework.h"
 #include "netavailw.h"
-#include <iphlpapi.h>
-#include <icmpapi.h>
 #include <stdio.h>
-#include <fstream>
 #include <vector>
 #include <string>
-#include <sstream>
-#include <time.h>
-#include "CritSec.h"
-
-#define _WINSOCK_DEPRECATED_NO_WARNINGS 
-#include <winsock2.h>
-
-#pragma comment(lib, "iphlpapi.lib")
-#pragma comment(lib, "ws2_32.lib")
+#include "Prober.h"
+#include "LatencyGraph.h"
 
 #define MAX_LOADSTRING 100
 
@@ -29,82 +19,15 @@ WCHAR szWindowClass[MAX_LOADSTRING];            // the main window class name
 HWND hDlgGlobal = NULL; // Global variable to store the dialog handle
 HWND hDlgProblems = NULL;  // Dialog showing problems
 
-// Struct used to store the descriptions of certain error codes that
-// are not handled properly by FormatMessage.
-struct StructErrorCodes {
-    DWORD ec_num;
-    const char* ec_ident;
-    const char* ec_text;
-} AryErrorCodes[] = {
-    {11001 , "IP_BUF_TOO_SMALL", "The reply buffer was too small."},
-    {11002 , "IP_DEST_NET_UNREACHABLE", "The destination network was unreachable."},
-    {11003 , "IP_DEST_HOST_UNREACHABLE", "The destination host was unreachable."},
-    {11004 , "IP_DEST_PROT_UNREACHABLE", "The destination protocol was unreachable."},
-    {11005 , "IP_DEST_PORT_UNREACHABLE", "The destination port was unreachable."},
-    {11006 , "IP_NO_RESOURCES", "Insufficient IP resources were available."},
-    {11007 , "IP_BAD_OPTION", "A bad IP option was specified."},
-    {11008 , "IP_HW_ERROR", "A hardware error occurred."},
-    {11009 , "IP_PACKET_TOO_BIG", "The packet was too big."},
-    {11010 , "IP_REQ_TIMED_OUT", "The request timed out."},
-    {11011 , "IP_BAD_REQ", "A bad request."},
-    {11012 , "IP_BAD_ROUTE", "A bad route."},
-    {11013 , "IP_TTL_EXPIRED_TRANSIT", "The time to live (TTL) expired in transit."},
-    {11014 , "IP_TTL_EXPIRED_REASSEM", "The time to live expired during fragment reassembly."},
-    {11015 , "IP_PARAM_PROBLEM", "A parameter problem."},
-    {11016 , "IP_SOURCE_QUENCH", "Datagrams are arriving too fast to be processed and datagrams may have been discarded."},
-    {11017 , "IP_OPTION_TOO_BIG", "An IP option was too big."},
-    {11018 , "IP_BAD_DESTINATION", "A bad destination."},
-    {11050 , "IP_GENERAL_FAILURE", "A general failure. This error can be returned for some malformed ICMP packets."},
-    {0, "IP_SUCCESS", "No error."}
-};
-
-struct struct_settings {
-    std::string strRemoteIP = "8.8.8.8";
-    int         msBadPing = 400;
-    int         msPingTimeout = 3000;
-    int         secsSleep = 10;
-
-    // Load settings from the registry (user-specific).
-    // If the registry values are not present, the settings are not changed.
-    void Load() {
-        HKEY hKey;
-        if (RegOpenKeyEx(HKEY_CURRENT_USER, "Software\\netavailw", 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
-            char buffer[256];
-            DWORD bufferSize = sizeof(buffer);
-            if (RegGetValue(hKey, NULL, "RemoteIP", RRF_RT_REG_SZ, NULL, buffer, &bufferSize) == ERROR_SUCCESS) {
-                strRemoteIP = buffer;
-            }
-            bufferSize = sizeof(msBadPing);
-            RegGetValue(hKey, NULL, "msBadPing", RRF_RT_REG_DWORD, NULL, &msBadPing, &bufferSize);
-            bufferSize = sizeof(msPingTimeout);
-            RegGetValue(hKey, NULL, "msPingTimeout", RRF_RT_REG_DWORD, NULL, &msPingTimeout, &bufferSize);
-            bufferSize = sizeof(secsSleep);
-            RegGetValue(hKey, NULL, "secsSleep", RRF_RT_REG_DWORD, NULL, &secsSleep, &bufferSize);
-
-            RegCloseKey(hKey);
-        }
-    }
-
-    // Save the settings to the registry (user-specific).
-    void Save() {
-        HKEY hKey;
-        DWORD dwDisposition;
-        if (RegCreateKeyEx(HKEY_CURRENT_USER, "Software\\netavailw", 0, NULL, 0, KEY_WRITE, NULL, &hKey, &dwDisposition) == ERROR_SUCCESS) {
-            RegSetValueEx(hKey, "RemoteIP", 0, REG_SZ, (BYTE*)strRemoteIP.c_str(), strRemoteIP.size() + 1);
-            RegSetValueEx(hKey, "msBadPing", 0, REG_DWORD, (BYTE*)&msBadPing, sizeof(msBadPing));
-            RegSetValueEx(hKey, "msPingTimeout", 0, REG_DWORD, (BYTE*)&msPingTimeout, sizeof(msPingTimeout));
-            RegSetValueEx(hKey, "secsSleep", 0, REG_DWORD, (BYTE*)&secsSleep, sizeof(secsSleep));
-            
-            RegCloseKey(hKey);
-        }
-    }
-} Settings;
+// Posted to hDlgProblems when problems are added, so the dialog can fetch
+// them on its own thread.
+#define WM_APP_PROBLEMS_ADDED   (WM_APP + 1)
 
-std::string strHostname;
-typedef std::vector<std::string> TypVectStrings;
-TypVectStrings VectProblems;
-CCritSec CritSecProblems;  // controls access to VectProblems
+// Posted to hDlgGlobal after each ping, with the series index of the
+// ping's target in wParam, so the graph is drawn on the dialog's thread.
+#define WM_APP_GRAPH_UPDATE     (WM_APP + 2)
 
+CLatencyGraph LatencyGraph;
 
 // Message handler for about box.
 INT_PTR CALLBACK About(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
@@ -126,61 +49,6 @@ INT_PTR CALLBACK About(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
     return (INT_PTR)FALSE;
 }
 
-std::string GetTimeStr() 
-{
-    time_t mytime = time(NULL);
-    tm mytm;
-    localtime_s(&mytm, &mytime);
-    char sztime[32];
-    strftime(sztime, sizeof(sztime), "%Y-%m-%d %H:%M:%S", &mytm);
-    return std::string(sztime);
-}
-
-// Map an ICMP error code to a textual description.
-// Exit:   Returns the description, or "" if the code wasn't recognized.
-std::string ErrorCodeToTextSpecial(DWORD errorCode)
-{
-    std::string result;
-    for (int j = 0; AryErrorCodes[j].ec_num > 0; j++) {
-        if (AryErrorCodes[j].ec_num == errorCode) {
-            result = AryErrorCodes[j].ec_text;
-            break;
-        }
-    }
-    return result;
-}
-
-std::string ErrorCodeToText(DWORD errorCode) {
-    char szNum[20];
-    _itoa_s(errorCode, szNum, 10);
-    std::string strPrefix = "Error ";
-    strPrefix += szNum;
-    strPrefix += ": ";
-
-    std::string strResult = ErrorCodeToTextSpecial(errorCode);
-    if (strResult.length() == 0) {
-        // It's not an ICMP error code, so use the general Windows function
-        // to translate the error code.
-        char szMsg[256];
-        szMsg[0] = '\0';
-
-        DWORD nChars = FormatMessage(
-            FORMAT_MESSAGE_FROM_SYSTEM |
-            FORMAT_MESSAGE_IGNORE_INSERTS,
-            NULL,
-            errorCode,
-            MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-            szMsg,
-            sizeof(szMsg), NULL);
-
-        if (0 == nChars) {
-            sprintf_s(szMsg, "Cannot convert error code %u (%x)", errorCode, errorCode);
-        }
-        strResult = szMsg;
-    }
-    return strPrefix + strResult;
-}
-
 void SetErrorText(const char* msg)
 {
     //std::string strFull = GetTimeStr() + " ";
@@ -188,108 +56,19 @@ void SetErrorText(const char* msg)
     SetDlgItemText(hDlgGlobal, IDC_STATIC_ERROR, msg);
 }
 
-void AppendProblemString(std::string text)
+// Tell the problems dialog, if it's open, that problems were added.
+// Called from the ping thread; never blocks on the UI.
+void NotifyProblemsAdded()
 {
-    CCritSecInScope CritSec(CritSecProblems.GetCritSecPtr());
-    VectProblems.push_back(text);
-}
-
-TypVectStrings splitIP(const std::string& s) {
-    TypVectStrings result;
-    std::istringstream iss(s);
-
-    for (std::string token; std::getline(iss, token, '.'); ) {
-        result.push_back(std::move(token));
+    HWND hDlg = hDlgProblems;
+    if (hDlg != NULL) {
+        PostMessage(hDlg, WM_APP_PROBLEMS_ADDED, 0, 0);
     }
-
-    return result;
 }
 
-TypVectStrings EnumerateLocalIPs() {
-    TypVectStrings vectIPs;
-    IP_ADAPTER_INFO AdapterInfo[16];       // Allocate information for up to 16 NICs
-    DWORD dwBufLen = sizeof(AdapterInfo);  // Save memory size of buffer
-
-    do {
-        DWORD dwStatus = GetAdaptersInfo(      // Call GetAdapterInfo
-            AdapterInfo,                 // [out] buffer to receive data
-            &dwBufLen);                  // [in] size of receive data buffer
-        if (dwStatus != ERROR_SUCCESS) {    // Check for errors
-            //printf("GetAdaptersInfo failed with error: %d\n", dwStatus);
-            break;
-        }
-
-        PIP_ADAPTER_INFO pAdapterInfo = AdapterInfo;// Contains pointer to current adapter info
-        do {
-            //printf("\nAdapter name: %s\n", pAdapterInfo->AdapterName);
-            //printf("Adapter description: %s\n", pAdapterInfo->Description);
-            //printf("Adapter IP address: %s\n", pAdapterInfo->IpAddressList.IpAddress.String);
-            vectIPs.push_back(std::string(pAdapterInfo->IpAddressList.IpAddress.String));
-            // Process next adapter
-            pAdapterInfo = pAdapterInfo->Next;
-        } while (pAdapterInfo);  // Terminate if last adapter
-    } while (false);
-    return vectIPs;
-}
-
-// Return the machine's local IP address.  Use the IP address most likely
-// to be actually used for the pinging.  The result is a numeric dotted IP.
-std::string GetLikelyLocalIP()
-{
-    std::string strIP;
-    TypVectStrings vectIPs = EnumerateLocalIPs();
-    for (TypVectStrings::iterator iter = vectIPs.begin();
-        vectIPs.end() != iter; iter++) {
-        TypVectStrings vectOctets = splitIP(*iter);
-        // Check the octets to look for a pattern that is likely NOT one
-        // of the weird IP addresses assigned by software like VMware. 
-        if (vectOctets.size() == 4 && vectOctets[0] == "192" && vectOctets[1] == "168") {
-            if (strIP.length() == 0) {
-                strIP = *iter;
-            } else if (vectOctets[3] != "1") {
-                strIP = *iter;
-            }
-        }
-    }
-    return strIP;
-}
-
-// Log a record to the log file.
-// Records look like:
-// timestamp,action,hostname,localIP,remoteIP,details
-void LogToFile(std::string action, std::string details)
-{
-    std::string fullMsg = GetTimeStr() + "," + action;
-    fullMsg += "," + strHostname;
-    // We recompute the local IP address each time, because the user
-    // may have connected to a different network during program execution.
-    fullMsg += "," + GetLikelyLocalIP();
-    fullMsg += "," + Settings.strRemoteIP;
-    fullMsg += "," + details;
-    std::ofstream file;
-
-    // Open the file in append mode
-    file.open("netavailw.csv", std::ios_base::app);
-
-    if (file.is_open()) {
-        // Write the string to the file
-        file << fullMsg << std::endl;
-
-        // Close the file
-        file.close();
-    } else {
-        // error
-    }
-}
-
-void ClearProblemsControl(HWND hwnd, int id)
-{
-    // Get the handle of the edit control
-    HWND hwndEdit = GetDlgItem(hwnd, id);
-
-    // Set the text of the control to an empty string
-    SetWindowText(hwndEdit, "");
-}
+// State of the problems dialog's view.  Only touched on the UI thread.
+uint64_t seqProblemsNext = 0;           // first problem not yet shown
+StructProblemFilter ProblemsFilter;
 
 void AppendTextToEditCtrl(HWND hwnd, int id, LPCSTR pszText)
 {
@@ -311,106 +90,139 @@ void AppendTextToEditCtrl(HWND hwnd, int id, LPCSTR pszText)
     SendMessage(hwndEdit, EM_SETSEL, (WPARAM)dwStart, (LPARAM)dwEnd);
 }
 
-void PopulateProblemsControl(HWND hDlg)
+// Remove the oldest lines of an edit control so it holds no more than
+// nMaxLines lines (plus the empty one after the final newline).
+void TrimEditCtrlLines(HWND hwnd, int id, int nMaxLines)
 {
-    CCritSecInScope CritSec(CritSecProblems.GetCritSecPtr());
-    ClearProblemsControl(hDlg, IDC_EDIT_PROBLEMS);
-    for (TypVectStrings::iterator iter = VectProblems.begin(); iter != VectProblems.end(); iter++) {
-        std::string strProblem = *iter + "\r\n";
-        AppendTextToEditCtrl(hDlg, IDC_EDIT_PROBLEMS, strProblem.c_str());
+    HWND hwndEdit = GetDlgItem(hwnd, id);
+    int nLines = (int)SendMessage(hwndEdit, EM_GETLINECOUNT, 0, 0) - 1;
+    if (nLines <= nMaxLines) {
+        return;
     }
+    int ichEnd = (int)SendMessage(hwndEdit, EM_LINEINDEX, (WPARAM)(nLines - nMaxLines), 0);
+    SendMessage(hwndEdit, EM_SETSEL, 0, (LPARAM)ichEnd);
+    SendMessage(hwndEdit, EM_REPLACESEL, (WPARAM)FALSE, (LPARAM)"");
 }
 
-long Ping(const char* address, std::string &strError)
+// Append the problems added since the view was last updated.
+void AppendNewProblems(HWND hDlg)
 {
-    HANDLE hIcmp;
-    unsigned long ipaddr = INADDR_NONE;
-    DWORD dwRetVal = 0;
-    char SendData[32] = "Data Buffer";
-    LPVOID ReplyBuffer;
-    DWORD ReplySize = 0;
-
-    ipaddr = inet_addr(address);
-    if (ipaddr == INADDR_NONE) {
-        strError = "inet_addr failed; IP: ";
-        strError += address;
-        return -1;
+    STAGE_SCOPE(STAGE_UI_PROBLEMS);
+    std::vector<StructProblem> vectNew;
+    ProblemStore.ReadSince(seqProblemsNext, ProblemsFilter, vectNew);
+    if (vectNew.empty()) {
+        return;
     }
-
-    hIcmp = IcmpCreateFile();
-    if (hIcmp == INVALID_HANDLE_VALUE) {
-        strError = "Unable to open handle.";
-        return -1;
+    std::string strText;
+    for (size_t j = 0; j < vectNew.size(); j++) {
+        strText += FormatProblem(vectNew[j]) + "\r\n";
     }
+    AppendTextToEditCtrl(hDlg, IDC_EDIT_PROBLEMS, strText.c_str());
+    TrimEditCtrlLines(hDlg, IDC_EDIT_PROBLEMS, (int)ProblemStore.GetCapacity());
+}
 
-    ReplySize = sizeof(ICMP_ECHO_REPLY) + sizeof(SendData);
-    ReplyBuffer = (VOID*)malloc(ReplySize);
-    if (ReplyBuffer == NULL) {
-        strError = "Unable to allocate memory";
-        return -1;
+// Show all the stored problems that pass the current filter.  Only done
+// when the dialog opens or the filter changes.
+void PopulateProblemsControl(HWND hDlg)
+{
+    STAGE_SCOPE(STAGE_UI_PROBLEMS);
+    std::vector<StructProblem> vectAll;
+    seqProblemsNext = 0;
+    ProblemStore.ReadSince(seqProblemsNext, ProblemsFilter, vectAll);
+    std::string strText;
+    for (size_t j = 0; j < vectAll.size(); j++) {
+        strText += FormatProblem(vectAll[j]) + "\r\n";
     }
+    SetDlgItemText(hDlg, IDC_EDIT_PROBLEMS, strText.c_str());
+}
 
-    dwRetVal = IcmpSendEcho(hIcmp, ipaddr, SendData, sizeof(SendData),
-        NULL, ReplyBuffer, ReplySize, Settings.msPingTimeout);
-    if (dwRetVal != 0) {
-        PICMP_ECHO_REPLY pEchoReply = (PICMP_ECHO_REPLY)ReplyBuffer;
-        struct in_addr ReplyAddr;
-        ReplyAddr.S_un.S_addr = pEchoReply->Address;
-        //printf("\tSent icmp message to %s\n", address);
-        if (dwRetVal > 0) {
-            //printf("\tReceived %ld icmp message responses\n", dwRetVal);
-            //printf("\tInformation from the first response:\n");
-            //printf("\t  Received from %s\n", inet_ntoa(ReplyAddr));
-            //printf("\t  Roundtrip time = %ld milliseconds\n", pEchoReply->RoundTripTime);
-            long roundTripTime = pEchoReply->RoundTripTime;
-            free(ReplyBuffer);
-            IcmpCloseHandle(hIcmp);
-            return roundTripTime;
-        } else {
-            strError = ErrorCodeToText(GetLastError());
-            free(ReplyBuffer);
-            IcmpCloseHandle(hIcmp);
-            return -1;
-        }
-    } else {
-        free(ReplyBuffer);
-        strError = ErrorCodeToText(GetLastError());
-        IcmpCloseHandle(hIcmp);
-        return -1;
+// Read the filter controls of the problems dialog into ProblemsFilter.
+void ReadProblemsFilter(HWND hDlg)
+{
+    static const uint32_t AryKindMasks[] = { PROBLEM_ALL_KINDS, PROBLEM_SLOW_PING, PROBLEM_ERROR, PROBLEM_PATH_TRACE };
+    LRESULT iSel = SendDlgItemMessage(hDlg, IDC_COMBO_PROBLEM_KIND, CB_GETCURSEL, 0, 0);
+    ProblemsFilter.kindMask = iSel >= 0 && iSel < 4 ? AryKindMasks[iSel] : PROBLEM_ALL_KINDS;
+    char buffer[PROBLEM_TARGET_MAX];
+    GetDlgItemText(hDlg, IDC_EDIT_PROBLEM_TARGET, buffer, sizeof(buffer));
+    ProblemsFilter.strTarget = buffer;
+}
+
+// Show the short-term and hourly figures under the latest ping.
+void ShowLatencyStats(int iTarget, int64_t msNow)
+{
+    StructLatencySummary summary1m, summary1h;
+    LatencyStats.GetSummary(iTarget, STATS_WINDOW_1MIN, msNow, summary1m);
+    LatencyStats.GetSummary(iTarget, STATS_WINDOW_1HOUR, msNow, summary1h);
+    char szP50[32], szP95[32], szP99[32];
+    FormatMicrosAsMs(summary1h.usP50, szP50, sizeof(szP50));
+    FormatMicrosAsMs(summary1h.usP95, szP95, sizeof(szP95));
+    FormatMicrosAsMs(summary1h.usP99, szP99, sizeof(szP99));
+    char szBuf[200];
+    snprintf(szBuf, sizeof(szBuf), "1h  p50 %s  p95 %s  p99 %s ms  loss %.1f%%  (1m loss %.1f%%)",
+        szP50, szP95, szP99,
+        summary1h.nProbes ? 100.0 * summary1h.nLost / summary1h.nProbes : 0.0,
+        summary1m.nProbes ? 100.0 * summary1m.nLost / summary1m.nProbes : 0.0);
+    SetDlgItemText(hDlgGlobal, IDC_STATIC_STATS, szBuf);
+}
+
+// Show the outcome of the packet train that went with a ping, if any.
+void ShowTrain(const StructPingOutcome& outcome)
+{
+    if (!outcome.bTrain) {
+        SetDlgItemText(hDlgGlobal, IDC_STATIC_TRAIN, "");
+        return;
     }
+    const StructTrainResult& train = outcome.train;
+    char szJitter[32];
+    FormatMicrosAsMs(train.usJitter, szJitter, sizeof(szJitter));
+    char szBuf[200];
+    snprintf(szBuf, sizeof(szBuf), "Train of %d:  loss %.1f%%  jitter %s ms  reordered %d  duplicates %d",
+        train.nSent, train.GetLossPercent(), szJitter, train.nReordered, train.nDuplicates);
+    SetDlgItemText(hDlgGlobal, IDC_STATIC_TRAIN, szBuf);
 }
 
+// netavailw pings one target, the first of the settings, which its window
+// shows; many targets and reloading them are left to netavaild, which
+// drives a CProberSet.
 DWORD WINAPI PingThreadFunction(LPVOID lpParam)
 {
+    SetStageThreadName("probe");
+    CProber prober;
+    std::string strOpenError;
+    if (!prober.Open(strOpenError)) {
+        SetErrorText(strOpenError.c_str());
+        return 1;
+    }
+
     do {
-        std::string strError;
-        long msPing = Ping(Settings.strRemoteIP.c_str(), strError);
-        if (msPing >= 0) {
-            char szbuf[64];
-            sprintf_s(szbuf, "%ld ms", msPing);
-            std::string msg = GetTimeStr() + "  " + std::string(szbuf);
+        // Pings are due on a fixed schedule; see CProber.
+        Sleep((DWORD)prober.GetMsUntilDue());
+        StructPingOutcome outcome;
+        if (!prober.Ping(outcome)) {
+            continue;
+        }
+        STAGE_SCOPE(STAGE_UI_UPDATE);
+        ShowLatencyStats(outcome.iStats, outcome.msNow);
+        ShowTrain(outcome);
+        PostMessage(hDlgGlobal, WM_APP_GRAPH_UPDATE, (WPARAM)outcome.iSeries, 0);
+        if (outcome.usPing >= 0) {
+            char szMs[32];
+            FormatMicrosAsMs(outcome.usPing, szMs, sizeof(szMs));
+            std::string msg = GetTimeStr(outcome.usWall) + "  " + szMs + " ms";
             SetDlgItemText(hDlgGlobal, IDC_STATIC_PINGMS, msg.c_str());
 
-            sprintf_s(szbuf, "%ld", msPing);
-            LogToFile("ping", szbuf);
-            if (msPing >= Settings.msBadPing) {
-                msg = GetTimeStr() + "  Long ping time: ";
-                char szBuf[32];
-                _itoa_s(msPing, szBuf, 10);
-                msg += szBuf;
+            if (outcome.bSlow) {
+                msg = GetTimeStr(outcome.usWall) + "  Long ping time: ";
+                msg += szMs;
                 SetErrorText(msg.c_str());
-                AppendProblemString(msg);
-                PopulateProblemsControl(hDlgProblems);
+                NotifyProblemsAdded();
             }
         } else {
-            std::string msg = GetTimeStr() + "  " + strError;
+            std::string msg = GetTimeStr(outcome.usWall) + "  " + outcome.GetErrorText();
             SetDlgItemText(hDlgGlobal, IDC_STATIC_PINGMS, msg.c_str());
             SetErrorText(msg.c_str());
-            AppendProblemString(msg);
-            PopulateProblemsControl(hDlgProblems);
-            LogToFile("error", strError);
+            NotifyProblemsAdded();
         }
-        Sleep(Settings.secsSleep * 1000);
     } while (true);
 
     return 0;
@@ -476,6 +288,7 @@ BOOL CALLBACK DialogProcSettings(HWND hwnd, UINT Message, WPARAM wParam, LPARAM
                     }
 
                     Settings.Save();
+                    PublishSettings();
 
                     EndDialog(hwnd, IDOK);
                     return TRUE;
@@ -493,16 +306,83 @@ INT_PTR CALLBACK DialogProcProblems(HWND hDlg, UINT message, WPARAM wParam, LPAR
     switch (message)
     {
     case WM_INITDIALOG:
-        hDlgProblems = hDlg;
+        SendDlgItemMessage(hDlg, IDC_COMBO_PROBLEM_KIND, CB_ADDSTRING, 0, (LPARAM)"All problems");
+        SendDlgItemMessage(hDlg, IDC_COMBO_PROBLEM_KIND, CB_ADDSTRING, 0, (LPARAM)"Slow pings");
+        SendDlgItemMessage(hDlg, IDC_COMBO_PROBLEM_KIND, CB_ADDSTRING, 0, (LPARAM)"Errors");
+        SendDlgItemMessage(hDlg, IDC_COMBO_PROBLEM_KIND, CB_ADDSTRING, 0, (LPARAM)"Path traces");
+        SendDlgItemMessage(hDlg, IDC_COMBO_PROBLEM_KIND, CB_SETCURSEL, 0, 0);
+        ReadProblemsFilter(hDlg);
         PopulateProblemsControl(hDlg);
+        hDlgProblems = hDlg;
+        return TRUE;
+
+    case WM_APP_PROBLEMS_ADDED:
+        AppendNewProblems(hDlg);
         return TRUE;
 
     case WM_COMMAND:
         if (LOWORD(wParam) == IDOK || LOWORD(wParam) == IDCANCEL)
         {
+            if (hDlgProblems == hDlg) {
+                hDlgProblems = NULL;
+            }
             EndDialog(hDlg, LOWORD(wParam));
             return TRUE;
         }
+        if ((LOWORD(wParam) == IDC_COMBO_PROBLEM_KIND && HIWORD(wParam) == CBN_SELCHANGE) ||
+            (LOWORD(wParam) == IDC_EDIT_PROBLEM_TARGET && HIWORD(wParam) == EN_CHANGE)) {
+            ReadProblemsFilter(hDlg);
+            PopulateProblemsControl(hDlg);
+            return TRUE;
+        }
+        break;
+    }
+    return FALSE;
+}
+
+// Show the stage timings and lock figures, one per line.
+void PopulateDiagnosticsControl(HWND hDlg)
+{
+    std::string strText = "Stage timings (ms):\n" + FormatStageStats() + "\nLocks:\n" +
+        (CCritSec::IsStatsEnabled() ? CCritSec::FormatStats() : std::string("off; set LockStats=1\n"));
+    std::string strCrLf;
+    for (size_t j = 0; j < strText.size(); j++) {
+        if (strText[j] == '\n') {
+            strCrLf += '\r';
+        }
+        strCrLf += strText[j];
+    }
+    SetDlgItemText(hDlg, IDC_EDIT_DIAGNOSTICS, strCrLf.c_str());
+}
+
+INT_PTR CALLBACK DialogProcDiagnostics(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    switch (message)
+    {
+    case WM_INITDIALOG:
+        PopulateDiagnosticsControl(hDlg);
+        return TRUE;
+
+    case WM_COMMAND:
+        if (LOWORD(wParam) == IDOK || LOWORD(wParam) == IDCANCEL)
+        {
+            EndDialog(hDlg, LOWORD(wParam));
+            return TRUE;
+        }
+        if (LOWORD(wParam) == IDC_BUTTON_REFRESH_DIAGNOSTICS) {
+            PopulateDiagnosticsControl(hDlg);
+            return TRUE;
+        }
+        if (LOWORD(wParam) == IDC_BUTTON_EXPORT_TRACE) {
+            // Written beside the log, for chrome://tracing or Perfetto.
+            std::string strError;
+            if (WriteStageTrace("netavail-trace.json", strError)) {
+                MessageBox(hDlg, "Wrote netavail-trace.json", "Export Trace", MB_OK | MB_ICONINFORMATION);
+            } else {
+                MessageBox(hDlg, strError.c_str(), "Export Trace", MB_OK | MB_ICONHAND);
+            }
+            return TRUE;
+        }
         break;
     }
     return FALSE;
@@ -516,6 +396,12 @@ INT_PTR CALLBACK DialogProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lPara
     {
     case WM_INITDIALOG:
         hDlgGlobal = hDlg; // Store the dialog handle
+        LatencyGraph.Attach(GetDlgItem(hDlg, IDC_STATIC_GRAPH));
+        for (int range = 0; range < GRAPH_NUM_RANGES; range++) {
+            SendDlgItemMessage(hDlg, IDC_COMBO_GRAPH_RANGE, CB_ADDSTRING, 0,
+                (LPARAM)CLatencyGraph::GetRangeName((EnumGraphRange)range));
+        }
+        SendDlgItemMessage(hDlg, IDC_COMBO_GRAPH_RANGE, CB_SETCURSEL, GRAPH_RANGE_HOUR, 0);
         if (!LaunchPingThread()) {
             MessageBox(NULL, "Cannot launch ping thread", "Error", MB_OK | MB_ICONHAND);
         }
@@ -537,8 +423,29 @@ INT_PTR CALLBACK DialogProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lPara
         break;
     } 
 
+    case WM_APP_GRAPH_UPDATE:
+        LatencyGraph.SetTarget((int)wParam, GetSettings()->vectTargets[0].msBadPing);
+        LatencyGraph.Update(GetWallMicros() / 1000);
+        return (INT_PTR)TRUE;
+
+    case WM_DRAWITEM:
+    {
+        const DRAWITEMSTRUCT* pdis = (const DRAWITEMSTRUCT*)lParam;
+        if (pdis->CtlID == IDC_STATIC_GRAPH) {
+            LatencyGraph.Paint(pdis->hDC, pdis->rcItem);
+            return (INT_PTR)TRUE;
+        }
+        break;
+    }
+
     case WM_COMMAND:
-        if (LOWORD(wParam) == IDOK || LOWORD(wParam) == IDCANCEL) {
+        if (LOWORD(wParam) == IDC_COMBO_GRAPH_RANGE && HIWORD(wParam) == CBN_SELCHANGE) {
+            LRESULT iSel = SendDlgItemMessage(hDlg, IDC_COMBO_GRAPH_RANGE, CB_GETCURSEL, 0, 0);
+            if (iSel >= 0 && iSel < GRAPH_NUM_RANGES) {
+                LatencyGraph.SetRange((EnumGraphRange)iSel);
+                LatencyGraph.Update(GetWallMicros() / 1000);
+            }
+        } else if (LOWORD(wParam) == IDOK || LOWORD(wParam) == IDCANCEL) {
             EndDialog(hDlg, LOWORD(wParam));
             PostQuitMessage(0);
             return (INT_PTR)TRUE;
@@ -548,13 +455,18 @@ INT_PTR CALLBACK DialogProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lPara
         } else if (LOWORD(wParam) == IDC_BUTTON_SETTINGS) {
             // Create and show the non-modal dialog box
             DialogBox(hInst, MAKEINTRESOURCE(IDD_SETTINGS), hDlg, DialogProcSettings);
+        } else if (LOWORD(wParam) == IDC_BUTTON_DIAGNOSTICS) {
+            DialogBox(hInst, MAKEINTRESOURCE(IDD_DIAGNOSTICS), hDlg, DialogProcDiagnostics);
         }
         break;
 
     case WM_CLOSE:
-        LogToFile("stop", "");
         EndDialog(hDlg, 0);
         return TRUE;
+
+    case WM_DESTROY:
+        LatencyGraph.Detach();
+        break;
     }
     return (INT_PTR)FALSE;
 }
@@ -572,14 +484,9 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
 {
    hInst = hInstance; // Store instance handle in our global variable
 
-   // Record the local computer's name.  This will help log analysis.
-   char szComputerName[64];
-   DWORD size = sizeof(szComputerName);
-   GetComputerName(szComputerName, &size);
-   strHostname = szComputerName;
-
-   LogToFile("start", "");
    Settings.Load();
+   PublishSettings();
+   StartCore();
 
    // Create a modal dialog box
    INT_PTR success = DialogBox(hInstance, MAKEINTRESOURCE(IDD_MAIN), NULL, DialogProc);
@@ -605,7 +512,11 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
     LoadStringW(hInstance, IDC_NETAVAILW, szWindowClass, MAX_LOADSTRING);
 
     // Perform application initialization:
-    if (!InitInstance (hInstance, nCmdShow))
+    BOOL bOK = InitInstance(hInstance, nCmdShow);
+
+    // Log "stop" and write out any queued log records.
+    StopCore();
+    if (!bOK)
     {
         return FALSE;
     }
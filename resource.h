@@ -16,6 +16,7 @@
 #define IDD_PROBLEMS                    130
 #define IDD_DIALOG_SETTINGS             131
 #define IDD_SETTINGS                    131
+#define IDD_DIAGNOSTICS                 132
 #define IDC_STATIC_PINGMS               1001
 #define IDC_STATIC_ERROR                1002
 #define IDC_BUTTON_PROBLEMS             1003
@@ -33,6 +34,16 @@
 #define IDC_STATIC_INTERVAL             1012
 #define IDC_EDIT5                       1013
 #define IDC_EDIT_SECS_BETWEEN           1013
+#define IDC_STATIC_STATS                1014
+#define IDC_COMBO_PROBLEM_KIND          1015
+#define IDC_EDIT_PROBLEM_TARGET         1016
+#define IDC_STATIC_TRAIN                1017
+#define IDC_BUTTON_DIAGNOSTICS          1018
+#define IDC_EDIT_DIAGNOSTICS            1019
+#define IDC_BUTTON_EXPORT_TRACE         1020
+#define IDC_BUTTON_REFRESH_DIAGNOSTICS  1021
+#define IDC_STATIC_GRAPH                1022
+#define IDC_COMBO_GRAPH_RANGE           1023
 #define IDC_STATIC                      -1
 
 // Next default values for new objects
@@ -40,9 +51,9 @@
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NO_MFC                     1
-#define _APS_NEXT_RESOURCE_VALUE        132
+#define _APS_NEXT_RESOURCE_VALUE        133
 #define _APS_NEXT_COMMAND_VALUE         32771
-#define _APS_NEXT_CONTROL_VALUE         1012
+#define _APS_NEXT_CONTROL_VALUE         1024
 #define _APS_NEXT_SYMED_VALUE           110
 #endif
 #endif